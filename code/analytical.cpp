@@ -4,6 +4,9 @@
  */
 
 #include <set>
+#include <cmath>
+#include <map>
+#include <typeinfo>
 #include <boost/optional.hpp>
 #include <boost/foreach.hpp>
 #include <boost/archive/binary_iarchive.hpp>
@@ -13,10 +16,24 @@
 #include <boost/assign/list_of.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/type_traits/is_integral.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
 #include "xplat/counters_stats.hpp"
-#include "common/perfect_hash_map.hpp"
+#include "common/perfect_hash.hpp"
 #include "common/prop_tree.hpp"
+#include "common/interval_index.hpp"
+#include "common/flat_table.hpp"
+#include "common/compact_table.hpp"
+#include "common/quantized_table.hpp"
+#include "common/direct_table.hpp"
+#include "common/tree_ensemble.hpp"
+#include "common/business_calendar.hpp"
+#include "common/shared_table_store.hpp"
+#include "common/sample_ring.hpp"
 #include "macro/macro_includes.hpp"
 #include "query_plugin/base_types_wrappers.hpp"
 #include "query_plugin/allocator_types.hpp"
@@ -37,6 +54,25 @@ static ebay::xplat::counters_stats::counter_registration
 static ebay::xplat::counters_stats::counter_registration
     model_result_counter("macro.shipping.fnf.analytical.model_has_result",
                          &ebay::xplat::counters_add_merger, true);
+static ebay::xplat::counters_stats::counter_registration
+    feature_probe_counter("macro.shipping.fnf.analytical.feature_probes",
+                          &ebay::xplat::counters_add_merger, true);
+static ebay::xplat::counters_stats::counter_registration
+    feature_probe_avoided_counter("macro.shipping.fnf.analytical.feature_probes_avoided",
+                                  &ebay::xplat::counters_add_merger, true);
+static ebay::xplat::counters_stats::counter_registration
+    shadow_scored_counter("macro.shipping.fnf.analytical.shadow.scored",
+                          &ebay::xplat::counters_add_merger, true);
+static ebay::xplat::counters_stats::counter_registration
+    shadow_dropped_counter("macro.shipping.fnf.analytical.shadow.dropped",
+                           &ebay::xplat::counters_add_merger, true);
+static ebay::xplat::counters_stats::counter_registration
+    shadow_bucket_differs_counter("macro.shipping.fnf.analytical.shadow.bucket_differs",
+                                  &ebay::xplat::counters_add_merger, true);
+/* Sum of the absolute score differences, in thousandths. */
+static ebay::xplat::counters_stats::counter_registration
+    shadow_score_difference_counter("macro.shipping.fnf.analytical.shadow.score_difference",
+                                    &ebay::xplat::counters_add_merger, true);
 static ebay::xplat::counters_stats::counter_registration
     au_model_result_counter("macro.shipping.fnf.au.model_has_result",
                             &ebay::xplat::counters_add_merger, true);
@@ -195,10 +231,19 @@ struct analytical_info
      *  @param day_of_week The day of the week to get from the array.
      */
     int16_t get_day(int64_t day_of_week) const
+    {
+        return data[day_column(day_of_week)];
+    }
+
+    /** @brief Gets the index of the field for the day of week.
+     *
+     *  @param day_of_week The day of the week.
+     */
+    static std::size_t day_column(int64_t day_of_week)
     {
         if (XPLAT_UNLIKELY(day_of_week < 1 || day_of_week > 7))
             day_of_week = 1;
-        return data[day_of_week];
+        return (std::size_t) day_of_week;
     }
 
     /** @brief Serialization function used by Boost serialization.
@@ -588,23 +633,153 @@ struct int64_hasher
     }
 };
 
+/* Perfect hash maps the feature archives are written as, converted on load. */
+typedef ebay::common::perfect_hash_table<int64_t, analytical_info> seller_archive_map;
+typedef ebay::common::perfect_hash_table<shipping_zip_key, analytical_info>
+    shipping_zip_archive_map;
+typedef ebay::common::perfect_hash_table<zip_key, analytical_info> zip_archive_map;
 /* Map <Service ID> to Analytical Info. */
-typedef ebay::common::perfect_hash_map<int64_t, analytical_info, int64_hasher> seller_map;
+typedef ebay::common::flat_table<int64_t, analytical_info> seller_map;
 /* Map <Category ID> to Analytical Info. */
-typedef boost::unordered_map<int64_t, analytical_info> category_map;
+typedef ebay::common::flat_table<int64_t, analytical_info> category_map;
 /* Map <Shipping Method ID> to Analytical Info. */
-typedef boost::unordered_map<int32_t, analytical_info> shipping_map;
+typedef ebay::common::flat_table<int32_t, analytical_info> shipping_map;
 /* Map <Shipping Method, Zip, Zip> to Analytical Info. */
-typedef ebay::common::perfect_hash_map<shipping_zip_key, analytical_info,
-                                       shipping_zip_key> shipping_zip_map;
+typedef ebay::common::flat_table<shipping_zip_key, analytical_info> shipping_zip_map;
 /* Map <Zip, Zip> to Analytical Info. */
-typedef ebay::common::perfect_hash_map<zip_key, analytical_info, zip_key> zip_map;
+typedef ebay::common::flat_table<zip_key, analytical_info> zip_map;
 /* Map Zip to Zip Range. */
-typedef boost::unordered_map<zip_range_key, int16_t> zip_range_map;
+typedef ebay::common::flat_table<zip_range_key, int16_t> zip_range_map;
+/* Map Country, Zip to the first Zip of its Zip Range, one entry per range. */
+typedef ebay::common::interval_index<int16_t> zip_range_index;
 /* Map Service, Country to Base Service. */
-typedef boost::unordered_map<service_country_key, int32_t> base_service_map;
+typedef ebay::common::flat_table<service_country_key, int32_t> base_service_map;
 /* Map Zip to Delivery Estimate. */
-typedef boost::unordered_map<shipping_zip_key, shipping_service_est> zip_estimate_map;
+typedef ebay::common::flat_table<shipping_zip_key, shipping_service_est> zip_estimate_map;
+
+/** @brief The @a feature_table struct holds one historical feature map. The
+ *    map is loaded either with full values, as an array over small integer
+ *    keys, quantized to 8 bits, or without its keys.
+ */
+template <typename K>
+struct feature_table
+{
+    typedef ebay::common::flat_table<K, analytical_info> full_map;
+    typedef ebay::common::quantized_table<K, analytical_info::analytical_info_data_size>
+        quantized_map;
+    typedef ebay::common::compact_table<K, analytical_info> compact_map;
+    typedef ebay::common::direct_table<analytical_info> direct_map;
+
+    /** @brief Maps a direct, a compact or a quantized table file. A
+     *    compact table file accepts about one in 65536 unknown keys with the
+     *    features of another key.
+     *
+     *  @param[in] path The path of the table file.
+     *  @return Returns @a false if the file is in none of the formats.
+     */
+    bool open_mapped(const char* path)
+    {
+        if (boost::is_integral<K>::value && direct_map::is_direct_file(path))
+        {
+            direct.reset(direct_map::open(path));
+            return true;
+        }
+        if (compact_map::is_compact_file(path))
+        {
+            compact.reset(compact_map::open(path));
+            return true;
+        }
+        if (!quantized_map::is_quantized_file(path))
+            return false;
+        quantized.reset(quantized_map::open(path));
+        return true;
+    }
+
+    /** @brief Gets the total and the day of week features of a key.
+     *
+     *  @param[in] key The key.
+     *  @param[in] day_of_week The day of the week.
+     *  @param[out] total Receives the total feature.
+     *  @param[out] day Receives the day of week feature.
+     *  @return Returns @a false, and leaves the features alone, if the key is
+     *    not in the map.
+     */
+    bool find(const K& key, int64_t day_of_week, int32_t& total, int32_t& day) const
+    {
+        if (XPLAT_LIKELY(full != NULL))
+        {
+            typename full_map::const_iterator it = full->find(key);
+
+            if (it == full->end())
+                return false;
+            total = it->second.get_total();
+            day = it->second.get_day(day_of_week);
+            return true;
+        }
+        if (direct != NULL)
+        {
+            const analytical_info* info = find_direct(key, boost::is_integral<K>());
+
+            if (info == NULL)
+                return false;
+            total = info->get_total();
+            day = info->get_day(day_of_week);
+            return true;
+        }
+        if (quantized != NULL)
+        {
+            std::size_t row = quantized->row(key);
+
+            if (row == quantized_map::npos)
+                return false;
+            total = quantized->value(row, 0);
+            day = quantized->value(row, analytical_info::day_column(day_of_week));
+            return true;
+        }
+        if (compact != NULL)
+        {
+            const analytical_info* info = compact->find(key);
+
+            if (info == NULL)
+                return false;
+            total = info->get_total();
+            day = info->get_day(day_of_week);
+            return true;
+        }
+        return false;
+    }
+
+    void reset()
+    {
+        full.reset();
+        segment.reset();
+        direct.reset();
+        quantized.reset();
+        compact.reset();
+    }
+
+    /** @brief Looks up an integer key in the direct table. Other keys are
+     *    never stored in one.
+     */
+    const analytical_info* find_direct(const K& key, boost::true_type) const
+    {
+        return direct->find(key);
+    }
+
+    const analytical_info* find_direct(const K& key, boost::false_type) const
+    {
+        return NULL;
+    }
+
+    /* The maps are immutable once loaded, and shared by the models loading the same file. */
+    boost::shared_ptr<full_map> full;
+    /* The shared feature store file the full map is mapped from, if any. */
+    boost::shared_ptr<ebay::common::shared_table_segment> segment;
+    boost::shared_ptr<direct_map> direct;
+    boost::shared_ptr<quantized_map> quantized;
+    boost::shared_ptr<compact_map> compact;
+};
+
 /*
  * Set to hold the category level opt outs. It will likely never hold > 3 items, so a
  * std::set gives better performance than an unordered_set.
@@ -613,11 +788,286 @@ typedef std::pair<int64_t, int64_t> seller_category;
 typedef std::set<seller_category> category_optout_set;
 
 static boost::scoped_ptr<zip_range_map> zip_ranges;
+static boost::scoped_ptr<zip_range_index> zip_ranges_index;
 static boost::scoped_ptr<base_service_map> base_services;
 static boost::scoped_ptr<zip_estimate_map> zip_estimates;
 static boost::scoped_ptr<MACRO_NS::holiday_map> holiday_info_map;
+static boost::scoped_ptr<ebay::common::business_calendar_index> business_calendars;
 static ebay::search::macro::eligibility_ptr eligibility;
 static category_optout_set category_optouts;
+/*
+ * Bumped by init() and cleanup(), invalidating the cached destinations and
+ * start dates. Bumped after the tables are replaced, and read before the
+ * caches, so a thread that sees the new generation also sees the new tables.
+ */
+static boost::atomic<uint32_t> tables_generation(1);
+
+/* Weekly non working days the calendars are built for when the config lists none. */
+static const int8_t default_calendar_working_days[] = { 0x00, 0x01, 0x40, 0x41 };
+
+/** @brief The @a holiday_day_test struct tells whether a day is a holiday in
+ *    a country, for building its calendars.
+ */
+struct holiday_day_test
+{
+    explicit holiday_day_test(const MACRO_NS::holiday_info& holidays) :
+        holidays(holidays)
+    {
+    }
+
+    bool operator()(int64_t day) const
+    {
+        return holidays.is_holiday(day);
+    }
+
+    const MACRO_NS::holiday_info& holidays;
+};
+
+/** @brief The @a non_working_day_test struct tells whether a day is a non
+ *    working day of a country for a set of weekly non working days.
+ */
+struct non_working_day_test
+{
+    non_working_day_test(const MACRO_NS::holiday_info& holidays, int8_t working_days_flags) :
+        holidays(holidays),
+        working_days_flags(working_days_flags)
+    {
+    }
+
+    bool operator()(int64_t day) const
+    {
+        return MACRO_NS::holiday_info::is_non_working_day(day, &holidays, working_days_flags);
+    }
+
+    const MACRO_NS::holiday_info& holidays;
+    int8_t working_days_flags;
+};
+
+/** @brief Builds the business day calendars of every country of the holiday
+ *    map, for every set of weekly non working days.
+ *
+ *  @param[in] holidays The holiday map.
+ *  @param[in] working_days The sets of weekly non working days.
+ *  @return Returns the calendars, owned by the caller.
+ */
+static ebay::common::business_calendar_index* build_business_calendars(
+    const MACRO_NS::holiday_map& holidays, const std::vector<int8_t>& working_days)
+{
+    ebay::common::business_calendar_index* index = new ebay::common::business_calendar_index();
+
+    for (MACRO_NS::holiday_map::const_iterator it = holidays.begin(); it != holidays.end(); ++it)
+    {
+        for (std::size_t i = 0; i < working_days.size(); i++)
+            index->add(it->first, working_days[i],
+                       ebay::common::business_calendar(
+                           it->second.start_date, MACRO_NS::max_holiday_bits,
+                           holiday_day_test(it->second),
+                           non_working_day_test(it->second, working_days[i])));
+    }
+    return index;
+}
+
+/** @brief Loads a lookup table. Flat table files are memory mapped and queried
+ *    in place, Boost archives of an unordered_map are read and converted.
+ *
+ *  @param[in] path The path of the table file.
+ *  @param[in] is_binary Do we expect binary or text archives.
+ *  @return Returns the table, owned by the caller.
+ */
+template <typename T>
+static T* load_table_data(const char* path, bool is_binary)
+{
+    typedef boost::unordered_map<typename T::key_type, typename T::mapped_type> archive_map;
+
+    if (T::is_flat_file(path))
+        return T::open(path);
+
+    boost::scoped_ptr<archive_map> map(
+        ebay::search::macro::load_map_data<archive_map>(path, is_binary));
+
+    return map ? T::create(*map) : NULL;
+}
+
+/** @brief Loads a feature table. Flat table files are memory mapped and
+ *    queried in place, Boost archives of a perfect_hash_table are read and
+ *    converted.
+ *
+ *  @param[in] path The path of the table file.
+ *  @param[in] is_binary Do we expect binary or text archives.
+ *  @return Returns the table, owned by the caller.
+ */
+template <typename T, typename M>
+static T* load_table_serialized(const char* path, bool is_binary)
+{
+    if (T::is_flat_file(path))
+        return T::open(path);
+
+    boost::scoped_ptr<M> map(MACRO_NS::load_serialized_data<M>(path, is_binary));
+
+    return map ? T::create(*map) : NULL;
+}
+
+/* Per host store of the feature tables built from archives, if configured. */
+static boost::scoped_ptr<ebay::common::shared_table_store> feature_store;
+
+/** @brief The @a shared_table_writer struct writes the flat table file of a
+ *    table archive, for the shared feature store.
+ */
+template <typename T>
+struct shared_table_writer
+{
+    typedef T* (*loader)(const char*, bool);
+
+    shared_table_writer(loader load, const char* source, bool is_binary) :
+        load(load),
+        source(source),
+        is_binary(is_binary)
+    {
+    }
+
+    void operator()(const char* path) const
+    {
+        boost::scoped_ptr<T> table(load(source, is_binary));
+
+        if (!table)
+            throw std::runtime_error(std::string("cannot load ") + source);
+        T::save(path, table->begin(), table->end());
+    }
+
+    loader load;
+    const char* source;
+    bool is_binary;
+};
+
+/** @brief Loads the full map of a feature table. With a shared feature
+ *    store, an archive is converted once per host and every process maps
+ *    the same flat table file; flat table files are mapped in place, and
+ *    are shared already.
+ *
+ *  @param[in,out] table The feature table.
+ *  @param[in] load The function loading the map in memory.
+ *  @param[in] path The path of the table file.
+ *  @param[in] is_binary Do we expect binary or text archives.
+ */
+template <typename K>
+static void load_feature_table(feature_table<K>& table,
+                               typename feature_table<K>::full_map* (*load)(const char*, bool),
+                               const char* path, bool is_binary)
+{
+    typedef typename feature_table<K>::full_map full_map;
+
+    if (feature_store == NULL || full_map::is_flat_file(path))
+    {
+        table.full.reset(load(path, is_binary));
+        return;
+    }
+    table.segment.reset(feature_store->attach(path, full_map::layout(),
+                                              shared_table_writer<full_map>(load, path, is_binary)));
+    table.full.reset(full_map::open(table.segment->path()));
+}
+
+/** @brief The @a feature_table_registry class shares the feature tables of
+ *    the experiment models loaded together. Tables are keyed by the content
+ *    of their files, so models whose paths name the same files, or copies
+ *    of them, load them once and share the immutable maps.
+ */
+class feature_table_registry : private boost::noncopyable
+{
+public:
+    /** @brief Gets the key of a feature table file.
+     *
+     *  @param[in] path The path of the table file.
+     *  @param[in] is_binary Do we expect binary or text archives.
+     *  @param[in] variant How the table is built from the file, if not as is.
+     */
+    template <typename K>
+    std::string key(const char* path, bool is_binary, const char* variant = "")
+    {
+        std::map<std::string, std::string>::const_iterator it = content_keys.find(path);
+
+        if (it == content_keys.end())
+            it = content_keys.insert(std::make_pair(std::string(path), content_key(path))).first;
+        return it->second + (is_binary ? " binary " : " text ") + typeid(K).name() + " " + variant;
+    }
+
+    /** @brief Finds a table loaded before.
+     *
+     *  @param[in] key The key of the table.
+     *  @param[out] table Receives the table, sharing its maps.
+     *  @return Returns @a false if no table has the key.
+     */
+    template <typename K>
+    bool find(const std::string& key, feature_table<K>& table) const
+    {
+        std::map<std::string, boost::shared_ptr<void> >::const_iterator it = tables.find(key);
+
+        if (it == tables.end())
+            return false;
+        table = *boost::static_pointer_cast<feature_table<K> >(it->second);
+        return true;
+    }
+
+    /** @brief Adds a loaded table.
+     */
+    template <typename K>
+    void add(const std::string& key, const feature_table<K>& table)
+    {
+        tables[key] = boost::make_shared<feature_table<K> >(table);
+    }
+
+private:
+    /** @brief Hashes the content of a file.
+     */
+    static std::string content_key(const char* path)
+    {
+        ebay::common::flat_table_file file(path);
+        const char* data = file.data();
+        uint64_t hash = 0x2545f4914f6cdd1dULL;
+        std::size_t i = 0;
+        char text[40];
+
+        for (; i + sizeof(uint64_t) <= file.size(); i += sizeof(uint64_t))
+        {
+            uint64_t word;
+
+            std::memcpy(&word, data + i, sizeof(word));
+            hash = ebay::common::flat_table_mix(hash, word);
+        }
+        for (; i < file.size(); i++)
+            hash = ebay::common::flat_table_mix(hash, (uint8_t) data[i]);
+        std::snprintf(text, sizeof(text), "%016llx:%llu", (unsigned long long) hash,
+                      (unsigned long long) file.size());
+        return text;
+    }
+
+    /* Content keys of the files read so far, by path. */
+    std::map<std::string, std::string> content_keys;
+    std::map<std::string, boost::shared_ptr<void> > tables;
+};
+
+/** @brief Loads a feature table, or shares the one loaded before from the
+ *    same content.
+ *
+ *  @param[in,out] registry The tables loaded before.
+ *  @param[out] table The feature table.
+ *  @param[in] load The function loading the full map in memory.
+ *  @param[in] path The path of the table file.
+ *  @param[in] is_binary Do we expect binary or text archives.
+ */
+template <typename K>
+static void load_registered_table(feature_table_registry& registry, feature_table<K>& table,
+                                  typename feature_table<K>::full_map* (*load)(const char*, bool),
+                                  const char* path, bool is_binary)
+{
+    std::string key = registry.template key<K>(path, is_binary);
+
+    table.reset();
+    if (registry.find(key, table))
+        return;
+    if (!table.open_mapped(path))
+        load_feature_table(table, load, path, is_binary);
+    registry.add(key, table);
+}
 
 /** @brief The @a experiment_model struct holds data for the experimentable
  *    analytical delivery estimate model.
@@ -631,6 +1081,7 @@ struct experiment_model
         shipping_zip_features(),
         zip_features(),
         thresholds(),
+        trees(),
         min_days_predicted(2),
         max_days_predicted(7)
     {
@@ -656,42 +1107,45 @@ struct experiment_model
      *  @param[in] is_binary Do we expect binary or text archives.
      */
     void load(const ebay::common::prop_tree& ptree, const char* prefix,
-              bool is_binary)
+              bool is_binary, feature_table_registry& registry)
     {
         /* Load seller historical data files. */
         std::string seller_map_path =
             ptree.get<std::string>(config_entry(prefix, "seller_history_path").c_str());
 
-        seller_features.reset(MACRO_NS::load_serialized_data<seller_map>(
-            seller_map_path.c_str(), is_binary));
+        load_registered_table(registry, seller_features,
+                              &load_table_serialized<seller_map, seller_archive_map>,
+                              seller_map_path.c_str(), is_binary);
 
         /* Load category historical data files. */
         std::string category_map_path =
             ptree.get<std::string>(config_entry(prefix, "category_history_path").c_str());
 
-        category_features.reset(ebay::search::macro::load_map_data<category_map>(
-            category_map_path.c_str(), is_binary));
+        load_registered_table(registry, category_features, &load_table_data<category_map>,
+                              category_map_path.c_str(), is_binary);
 
         /* Load shipment historical data files. */
         std::string shipment_map_path =
             ptree.get<std::string>(config_entry(prefix, "shipment_history_path").c_str());
 
-        shipping_features.reset(ebay::search::macro::load_map_data<shipping_map>(
-            shipment_map_path.c_str(), is_binary));
+        load_registered_table(registry, shipping_features, &load_table_data<shipping_map>,
+                              shipment_map_path.c_str(), is_binary);
 
         /* Load Zip historical data files. */
         std::string zip_map_path =
             ptree.get<std::string>(config_entry(prefix, "zip_history_path").c_str());
 
-        zip_features.reset(MACRO_NS::load_serialized_data<zip_map>(
-            zip_map_path.c_str(), is_binary));
+        load_registered_table(registry, zip_features,
+                              &load_table_serialized<zip_map, zip_archive_map>,
+                              zip_map_path.c_str(), is_binary);
 
         /* Load Shipment Zip historical data files. */
         std::string shipment_zip_map_path =
             ptree.get<std::string>(config_entry(prefix, "shipment_zip_history_path").c_str());
 
-        shipping_zip_features.reset(MACRO_NS::load_serialized_data<shipping_zip_map>(
-            shipment_zip_map_path.c_str(), is_binary));
+        load_registered_table(registry, shipping_zip_features,
+                              &load_table_serialized<shipping_zip_map, shipping_zip_archive_map>,
+                              shipment_zip_map_path.c_str(), is_binary);
 
         std::string macro_config_path = ptree.get<std::string>("macro_config_path");
 
@@ -720,7 +1174,51 @@ struct experiment_model
                 boost::lexical_cast<size_t>(opt_model_params->get<std::string>("min_days_predicted"));
             max_days_predicted =
                 boost::lexical_cast<size_t>(opt_model_params->get<std::string>("max_days_predicted"));
+
+            /* Without a model file, the model compiled into shipping_tree_model is used. */
+            boost::optional<std::string> model_path =
+                opt_model_params->get_optional<std::string>("model_path");
+
+            if (model_path)
+            {
+                /* The base score is read from the model file, as the table builder does. */
+                double base_score = 0;
+                ebay::common::tree_ensemble_trees model =
+                    ebay::common::read_tree_ensemble(model_path->c_str(),
+                                                     MACRO_NS::ship_model::MAX_VALUE, &base_score);
+
+                trees.reset(new ebay::common::tree_ensemble(model, base_score));
+            }
+            else
+                trees.reset();
+        }
+    }
+
+    /** @brief Scores the features of an item.
+     *
+     *  @param[in] features The model feature array.
+     */
+    double evaluate(const int32_t features[MACRO_NS::ship_model::MAX_VALUE]) const
+    {
+        if (trees != NULL)
+            return trees->evaluate(features);
+        return MACRO_NS::shipping_tree_model::evaluate(features);
+    }
+
+    /** @brief Gets the number of days the score of an item falls in.
+     *
+     *  @param[in] score The score of the item.
+     *  @param[in] max_days The last number of days to consider.
+     *  @return Returns the days, or -1 if the score is above every threshold.
+     */
+    int32_t predicted_days(double score, std::size_t max_days) const
+    {
+        for (std::size_t i = min_days_predicted; i <= max_days && i < thresholds.size(); i++)
+        {
+            if (score <= thresholds[i])
+                return (int32_t) i;
         }
+        return -1;
     }
 
     /** @brief Releases memory used by this model.
@@ -733,20 +1231,44 @@ struct experiment_model
         shipping_zip_features.reset();
         zip_features.reset();
         thresholds.clear();
+        trees.reset();
     }
 
-    boost::scoped_ptr<seller_map> seller_features;
-    boost::scoped_ptr<category_map> category_features;
-    boost::scoped_ptr<shipping_map> shipping_features;
-    boost::scoped_ptr<shipping_zip_map> shipping_zip_features;
-    boost::scoped_ptr<zip_map> zip_features;
+    feature_table<int64_t> seller_features;
+    feature_table<int64_t> category_features;
+    feature_table<int32_t> shipping_features;
+    feature_table<shipping_zip_key> shipping_zip_features;
+    feature_table<zip_key> zip_features;
     std::vector<double> thresholds;
+    /* The tree model read from model_params.model_path, if any. */
+    boost::scoped_ptr<ebay::common::tree_ensemble> trees;
     std::size_t min_days_predicted;
     std::size_t max_days_predicted;
 };
 
+/* Experiment models by sde_model name, such as "b" for the ep_ test model. */
+typedef std::vector<std::pair<std::string, boost::shared_ptr<experiment_model> > >
+    experiment_model_list;
+
 static experiment_model default_model;
-static experiment_model test_model;
+static experiment_model_list experiment_models;
+
+/** @brief Finds the experiment model an sde_model parameter selects.
+ *
+ *  @param[in] sde_model The sde_model parameter.
+ *  @return Returns the model, or NULL if no model has that name.
+ */
+static experiment_model* find_experiment_model(const QPL_NS::qpl_blob& sde_model)
+{
+    for (experiment_model_list::const_iterator it = experiment_models.begin();
+         it != experiment_models.end(); ++it)
+    {
+        if (it->first.size() == sde_model.size &&
+            std::memcmp(it->first.data(), sde_model.data, sde_model.size) == 0)
+            return it->second.get();
+    }
+    return NULL;
+}
 
 /** @brief Translate the to_zip into the format we use.
  *
@@ -835,18 +1357,9 @@ static void set_seller_features(int32_t features[MACRO_NS::ship_model::MAX_VALUE
     features[MACRO_NS::ship_model::SELLER_TOTAL_AVERAGE] = -1;
     features[MACRO_NS::ship_model::SELLER_DAY_AVERAGE] = -1;
     /* Read seller historical data. */
-    if (XPLAT_LIKELY(model.seller_features != NULL))
-    {
-        seller_map::const_iterator it = model.seller_features->find(seller_id);
-
-        if (XPLAT_LIKELY(it != model.seller_features->end()))
-        {
-            features[MACRO_NS::ship_model::SELLER_TOTAL_AVERAGE] =
-                it->second.get_total();
-            features[MACRO_NS::ship_model::SELLER_DAY_AVERAGE] =
-                it->second.get_day(day_of_week);
-        }
-    }
+    model.seller_features.find(seller_id, day_of_week,
+                               features[MACRO_NS::ship_model::SELLER_TOTAL_AVERAGE],
+                               features[MACRO_NS::ship_model::SELLER_DAY_AVERAGE]);
 }
 
 /** @brief Set the category map features.
@@ -863,19 +1376,48 @@ static void set_category_features(int32_t features[MACRO_NS::ship_model::MAX_VAL
     features[MACRO_NS::ship_model::CATEGORY_TOTAL_AVERAGE] = -1;
     features[MACRO_NS::ship_model::CATEGORY_DAY_AVERAGE] = -1;
     /* Read leaf category historical data. */
-    if (XPLAT_LIKELY(model.category_features != NULL))
-    {
-        category_map::const_iterator it =
-            model.category_features->find(leaf_category_id);
+    model.category_features.find(leaf_category_id, day_of_week,
+                                 features[MACRO_NS::ship_model::CATEGORY_TOTAL_AVERAGE],
+                                 features[MACRO_NS::ship_model::CATEGORY_DAY_AVERAGE]);
+}
 
-        if (XPLAT_LIKELY(it != model.category_features->end()))
-        {
-            features[MACRO_NS::ship_model::CATEGORY_TOTAL_AVERAGE] =
-                it->second.get_total();
-            features[MACRO_NS::ship_model::CATEGORY_DAY_AVERAGE] =
-                it->second.get_day(day_of_week);
-        }
-    }
+/** @brief Set the shipping service map features.
+ *
+ *  @param[in,out] features The model feature array.
+ *  @param[in] day_of_week The day of the week.
+ *  @param[in] shipping_service The shipping service.
+ *  @param[in] model The model to use.
+ */
+static void set_shipment_features(int32_t features[MACRO_NS::ship_model::MAX_VALUE],
+                                  int64_t day_of_week, int32_t shipping_service,
+                                  experiment_model& model)
+{
+    features[MACRO_NS::ship_model::SHIPPING_METHOD_TOTAL_AVERAGE] = -1;
+    features[MACRO_NS::ship_model::SHIPPING_METHOD_DAY_AVERAGE] = -1;
+    /* Read shipment method historical data. */
+    model.shipping_features.find(shipping_service, day_of_week,
+                                 features[MACRO_NS::ship_model::SHIPPING_METHOD_TOTAL_AVERAGE],
+                                 features[MACRO_NS::ship_model::SHIPPING_METHOD_DAY_AVERAGE]);
+}
+
+/** @brief Set the zip map features.
+ *
+ *  @param[in,out] features The model feature array.
+ *  @param[in] day_of_week The day of the week.
+ *  @param[in] to_zip The buyers zip location.
+ *  @param[in] from_zip The item/seller zip location.
+ *  @param[in] model The model to use.
+ */
+static void set_zip_features(int32_t features[MACRO_NS::ship_model::MAX_VALUE],
+                             int64_t day_of_week, int16_t to_zip, int16_t from_zip,
+                             experiment_model& model)
+{
+    features[MACRO_NS::ship_model::ZIP_TOTAL_AVERAGE] = -1;
+    features[MACRO_NS::ship_model::ZIP_DAY_AVERAGE] = -1;
+    /* Read zip historical data. */
+    model.zip_features.find(zip_key(from_zip, to_zip), day_of_week,
+                            features[MACRO_NS::ship_model::ZIP_TOTAL_AVERAGE],
+                            features[MACRO_NS::ship_model::ZIP_DAY_AVERAGE]);
 }
 
 /** @brief Set the shipping service and zip map features.
@@ -892,56 +1434,402 @@ static void set_shipment_zip_features(int32_t features[MACRO_NS::ship_model::MAX
                                       int16_t to_zip, int16_t from_zip,
                                       experiment_model& model)
 {
-    features[MACRO_NS::ship_model::SHIPPING_METHOD_TOTAL_AVERAGE] = -1;
-    features[MACRO_NS::ship_model::SHIPPING_METHOD_DAY_AVERAGE] = -1;
-    features[MACRO_NS::ship_model::ZIP_TOTAL_AVERAGE] = -1;
-    features[MACRO_NS::ship_model::ZIP_DAY_AVERAGE] = -1;
     features[MACRO_NS::ship_model::SHIPPING_METHOD_ZIP_TOTAL_AVERAGE] = -1;
     features[MACRO_NS::ship_model::SHIPPING_METHOD_ZIP_DAY_AVERAGE] = -1;
-    /* Read shipment method historical data. */
-    if (XPLAT_LIKELY(model.shipping_features != NULL))
+    /* Read shipping service and zip historical data. */
+    model.shipping_zip_features.find(
+        shipping_zip_key(shipping_service, from_zip, to_zip), day_of_week,
+        features[MACRO_NS::ship_model::SHIPPING_METHOD_ZIP_TOTAL_AVERAGE],
+        features[MACRO_NS::ship_model::SHIPPING_METHOD_ZIP_DAY_AVERAGE]);
+}
+
+/* Number of feature maps an item is looked up in. */
+static const uint32_t feature_map_count = 5;
+
+/** @brief The @a lazy_model_features struct gets the features of an item for
+ *    the tree model. The features of the feature maps are read the first
+ *    time a split compares one of them, one map probe for both of the
+ *    features of the map, and then kept for the rest of the item.
+ */
+struct lazy_model_features
+{
+    lazy_model_features(int32_t* features, experiment_model& model, int64_t day_of_week,
+                        int64_t seller_id, int64_t leaf_category_id,
+                        int32_t shipping_service, int16_t to_zip, int16_t from_zip) :
+        features(features),
+        model(model),
+        day_of_week(day_of_week),
+        seller_id(seller_id),
+        leaf_category_id(leaf_category_id),
+        shipping_service(shipping_service),
+        to_zip(to_zip),
+        from_zip(from_zip),
+        fetched((1u << MACRO_NS::ship_model::SELLER_TOTAL_AVERAGE) - 1),
+        probes(0)
+    {
+    }
+
+    int32_t operator()(int32_t feature)
     {
-        shipping_map::const_iterator it = model.shipping_features->find(shipping_service);
+        if (XPLAT_UNLIKELY((fetched & (1u << feature)) == 0))
+            fetch(feature);
+        return features[feature];
+    }
 
-        if (XPLAT_LIKELY(it != model.shipping_features->end()))
+    /** @brief Reads the feature map of a feature.
+     */
+    void fetch(int32_t feature)
+    {
+        switch (feature)
         {
-            features[MACRO_NS::ship_model::SHIPPING_METHOD_TOTAL_AVERAGE] =
-                it->second.get_total();
-            features[MACRO_NS::ship_model::SHIPPING_METHOD_DAY_AVERAGE] =
-                it->second.get_day(day_of_week);
+        case MACRO_NS::ship_model::SELLER_TOTAL_AVERAGE:
+        case MACRO_NS::ship_model::SELLER_DAY_AVERAGE:
+            set_seller_features(features, day_of_week, seller_id, model);
+            fetch_pair(MACRO_NS::ship_model::SELLER_TOTAL_AVERAGE);
+            break;
+        case MACRO_NS::ship_model::CATEGORY_TOTAL_AVERAGE:
+        case MACRO_NS::ship_model::CATEGORY_DAY_AVERAGE:
+            set_category_features(features, day_of_week, leaf_category_id, model);
+            fetch_pair(MACRO_NS::ship_model::CATEGORY_TOTAL_AVERAGE);
+            break;
+        case MACRO_NS::ship_model::SHIPPING_METHOD_TOTAL_AVERAGE:
+        case MACRO_NS::ship_model::SHIPPING_METHOD_DAY_AVERAGE:
+            set_shipment_features(features, day_of_week, shipping_service, model);
+            fetch_pair(MACRO_NS::ship_model::SHIPPING_METHOD_TOTAL_AVERAGE);
+            break;
+        case MACRO_NS::ship_model::ZIP_TOTAL_AVERAGE:
+        case MACRO_NS::ship_model::ZIP_DAY_AVERAGE:
+            set_zip_features(features, day_of_week, to_zip, from_zip, model);
+            fetch_pair(MACRO_NS::ship_model::ZIP_TOTAL_AVERAGE);
+            break;
+        case MACRO_NS::ship_model::SHIPPING_METHOD_ZIP_TOTAL_AVERAGE:
+        case MACRO_NS::ship_model::SHIPPING_METHOD_ZIP_DAY_AVERAGE:
+            set_shipment_zip_features(features, day_of_week, shipping_service, to_zip,
+                                      from_zip, model);
+            fetch_pair(MACRO_NS::ship_model::SHIPPING_METHOD_ZIP_TOTAL_AVERAGE);
+            break;
+        default:
+            fetched |= 1u << feature;
+            break;
         }
     }
 
-    /* Read zip historical data. */
-    if (XPLAT_LIKELY(model.zip_features != NULL))
+    /** @brief Marks the total feature of a map and the day feature after it
+     *    as read.
+     */
+    void fetch_pair(int32_t total_feature)
+    {
+        fetched |= 3u << total_feature;
+        probes++;
+    }
+
+    int32_t* features;
+    experiment_model& model;
+    int64_t day_of_week;
+    int64_t seller_id;
+    int64_t leaf_category_id;
+    int32_t shipping_service;
+    int16_t to_zip;
+    int16_t from_zip;
+    /* Bit f is set once feature f is in the features array; the features before the map features are set by the caller. */
+    uint32_t fetched;
+    /* Number of feature maps read. */
+    uint32_t probes;
+};
+
+/** @brief Scores an item with a model. The tree model reads the feature maps
+ *    its splits need; the compiled model needs all of them.
+ *
+ *  @param[in,out] features The model feature array, with the features before
+ *    the map features set.
+ *  @param[in] model The model to use.
+ *  @param[in] day_of_week The day of the week.
+ *  @param[in] seller_id The seller id.
+ *  @param[in] leaf_category_id The category id.
+ *  @param[in] shipping_service The shipping service.
+ *  @param[in] to_zip The buyers zip location.
+ *  @param[in] from_zip The item/seller zip location.
+ *  @param[out] probes Receives the number of feature maps read.
+ *  @return Returns the score.
+ */
+static double score_item(int32_t features[MACRO_NS::ship_model::MAX_VALUE],
+                         experiment_model& model, int64_t day_of_week, int64_t seller_id,
+                         int64_t leaf_category_id, int32_t shipping_service,
+                         int16_t to_zip, int16_t from_zip, uint32_t& probes)
+{
+    if (model.trees != NULL)
     {
-        zip_key key(from_zip, to_zip);
+        lazy_model_features lazy(features, model, day_of_week, seller_id, leaf_category_id,
+                                 shipping_service, to_zip, from_zip);
+        double score = model.trees->evaluate_lazy(lazy);
+
+        probes = lazy.probes;
+        return score;
+    }
+    set_seller_features(features, day_of_week, seller_id, model);
+    set_shipment_features(features, day_of_week, shipping_service, model);
+    set_zip_features(features, day_of_week, to_zip, from_zip, model);
+    set_shipment_zip_features(features, day_of_week, shipping_service, to_zip, from_zip, model);
+    set_category_features(features, day_of_week, leaf_category_id, model);
+    probes = feature_map_count;
+    return model.evaluate(features);
+}
 
-        zip_map::const_iterator it = model.zip_features->find(key);
+/** @brief The @a shadow_sample struct holds an item the default model scored,
+ *    with the inputs the shadow model needs to score it again.
+ */
+struct shadow_sample
+{
+    /* Model features; the map features are read again from the shadow model tables. */
+    int32_t features[MACRO_NS::ship_model::MAX_VALUE];
+    int64_t day_of_week;
+    int64_t seller_id;
+    int64_t leaf_category_id;
+    int32_t shipping_service;
+    int16_t to_zip;
+    int16_t from_zip;
+    /* Score and days of the default model, -1 days if it had no result. */
+    double score;
+    int32_t days;
+    /* Days limit set by the sde_model parameter, 0 for the model limit. */
+    std::size_t max_days;
+};
+
+/*
+ * Shadow evaluation: one in shadow_sample_rate items the default model scores
+ * is queued, and a background thread scores it again with the shadow model,
+ * counting how often and how far the two disagree. Items are dropped rather
+ * than delay a request when the queue is full.
+ */
+static boost::scoped_ptr<ebay::common::sample_ring<shadow_sample> > shadow_samples;
+static boost::scoped_ptr<boost::thread> shadow_thread;
+static boost::atomic<bool> shadow_running(false);
+static experiment_model* shadow_model = NULL;
+static uint32_t shadow_sample_rate = 0;
+/* Items left on this thread before the next sample. */
+static __thread uint32_t shadow_countdown;
+
+/** @brief Scores the queued samples with the shadow model, until stopped.
+ */
+static void shadow_evaluate()
+{
+    shadow_sample sample;
 
-        if (XPLAT_LIKELY(it != model.zip_features->end()))
+    while (shadow_running.load(boost::memory_order_acquire))
+    {
+        if (!shadow_samples->try_pop(sample))
         {
-            features[MACRO_NS::ship_model::ZIP_TOTAL_AVERAGE] = it->second.get_total();
-            features[MACRO_NS::ship_model::ZIP_DAY_AVERAGE] =
-                it->second.get_day(day_of_week);
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+            continue;
         }
+
+        uint32_t probes;
+        double score = score_item(sample.features, *shadow_model, sample.day_of_week,
+                                  sample.seller_id, sample.leaf_category_id,
+                                  sample.shipping_service, sample.to_zip, sample.from_zip,
+                                  probes);
+        int32_t days = shadow_model->predicted_days(
+            score, sample.max_days != 0 ? sample.max_days : shadow_model->max_days_predicted);
+
+        shadow_scored_counter.enabled_add_sample(1);
+        if (days != sample.days)
+            shadow_bucket_differs_counter.enabled_add_sample(1);
+        shadow_score_difference_counter.enabled_add_sample(
+            (int64_t) (std::fabs(score - sample.score) * 1000 + 0.5));
     }
+}
 
-    /* Read zip historical data. */
-    if (XPLAT_LIKELY(model.shipping_zip_features != NULL))
+/** @brief Stops the shadow evaluation, dropping the queued samples.
+ */
+static void stop_shadow()
+{
+    if (shadow_thread)
     {
-        shipping_zip_key key(shipping_service, from_zip, to_zip);
+        shadow_running.store(false, boost::memory_order_release);
+        shadow_thread->join();
+        shadow_thread.reset();
+    }
+    shadow_samples.reset();
+    shadow_model = NULL;
+    shadow_sample_rate = 0;
+}
+
+/** @brief Starts the shadow evaluation.
+ *
+ *  @param[in] model The shadow model.
+ *  @param[in] sample_rate One in this many items is scored again.
+ *  @param[in] queue_size The number of samples the queue holds, a power of two.
+ */
+static void start_shadow(experiment_model* model, uint32_t sample_rate, std::size_t queue_size)
+{
+    stop_shadow();
+    shadow_samples.reset(new ebay::common::sample_ring<shadow_sample>(queue_size));
+    shadow_model = model;
+    shadow_sample_rate = std::max(1u, sample_rate);
+    shadow_running.store(true, boost::memory_order_release);
+    shadow_thread.reset(new boost::thread(&shadow_evaluate));
+}
+
+/** @brief Get the first zip of the AU zip range a zip falls in.
+ *
+ *  @param[in] country_id The country of the zip.
+ *  @param[in] zip The zip.
+ *  @return Returns the start of the range, or NULL if the zip is in no range.
+ */
+static const int16_t* find_zip_range(int16_t country_id, int16_t zip)
+{
+    if (XPLAT_LIKELY(zip_ranges_index != NULL))
+        return zip_ranges_index->find(country_id, zip);
+
+    zip_range_map::const_iterator it = zip_ranges->find(zip_range_key(country_id, zip));
+
+    if (it == zip_ranges->end())
+        return NULL;
+    return &it->second;
+}
+
+/** @brief The @a analytical_destination struct holds the buyer side zip work,
+ *    which is the same for every item of a query.
+ */
+struct analytical_destination
+{
+    int32_t to_country_id;
+    int32_t to_zip_big;
+    /* Destination zip in the format the tables use. */
+    int16_t to_zip;
+    /* Start of the zip range of the destination, looked up on first use. */
+    bool range_found;
+    const int16_t* range_to;
+};
 
-        shipping_zip_map::const_iterator it = model.shipping_zip_features->find(key);
+/*
+ * The engine evaluates the macro once per item; the destination of the
+ * previous call on the thread is reused while the buyer stays the same.
+ */
+static __thread uint32_t cached_generation;
+static __thread analytical_destination cached_destination;
 
-        if (XPLAT_LIKELY(it != model.shipping_zip_features->end()))
+/** @brief Gets the destination of a query, reusing the one of the previous
+ *    call on this thread if it had the same buyer.
+ *
+ *  @param[in] to_zip_big The full format of the to zip.
+ *  @param[in] to_country_id The destination country.
+ */
+static analytical_destination& query_destination(int32_t to_zip_big, int32_t to_country_id)
+{
+    analytical_destination& destination = cached_destination;
+    uint32_t generation = tables_generation.load(boost::memory_order_acquire);
+
+    if (XPLAT_UNLIKELY(cached_generation != generation ||
+                       destination.to_country_id != to_country_id ||
+                       destination.to_zip_big != to_zip_big))
+    {
+        destination.to_country_id = to_country_id;
+        destination.to_zip_big = to_zip_big;
+        destination.to_zip = 0;
+        if (XPLAT_LIKELY(to_zip_big != 0))
+            destination.to_zip = translate_to_zip(to_zip_big, to_country_id);
+        destination.range_found = false;
+        destination.range_to = NULL;
+        cached_generation = generation;
+    }
+    return destination;
+}
+
+/** @brief Gets the start of the zip range of a destination.
+ *
+ *  @param[in,out] destination The destination.
+ */
+static const int16_t* find_destination_range(analytical_destination& destination)
+{
+    if (!destination.range_found)
+    {
+        destination.range_to = find_zip_range((int16_t) destination.to_country_id,
+                                              destination.to_zip);
+        destination.range_found = true;
+    }
+    return destination.range_to;
+}
+
+/** @brief The @a analytical_start_date struct holds the model features that
+ *    only depend on the start date of an estimate and on the origin, which
+ *    most items of a query share.
+ */
+struct analytical_start_date
+{
+    MACRO_NS::date_t start_date;
+    int32_t from_country_id;
+    int8_t non_working_days;
+    int64_t day_of_week;
+    int64_t month_of_year;
+    int64_t is_payment_on_holiday;
+    int64_t days_from_nonworking_day;
+};
+
+/*
+ * Like the destination, the date features of the previous item on the
+ * thread are reused while its start date and origin stay the same.
+ */
+static __thread uint32_t cached_start_generation;
+static __thread analytical_start_date cached_start_date;
+
+/** @brief Gets the date features of an estimate, reusing the ones of the
+ *    previous call on this thread if it had the same start date and origin.
+ *
+ *  @param[in] start_date The day the estimate starts from.
+ *  @param[in] from_country_id The item country.
+ *  @param[in] non_working_days The non working days of the shipping service.
+ */
+static const analytical_start_date& query_start_date(MACRO_NS::date_t start_date,
+                                                     int32_t from_country_id,
+                                                     int8_t non_working_days)
+{
+    analytical_start_date& date = cached_start_date;
+    uint32_t generation = tables_generation.load(boost::memory_order_acquire);
+
+    if (XPLAT_UNLIKELY(cached_start_generation != generation ||
+                       date.start_date != start_date ||
+                       date.from_country_id != from_country_id ||
+                       date.non_working_days != non_working_days))
+    {
+        date.start_date = start_date;
+        date.from_country_id = from_country_id;
+        date.non_working_days = non_working_days;
+        date.day_of_week = (start_date + 1) % 7 + 1; /* Sun = 1, Sat = 7. */
+        date.month_of_year = MACRO_NS::time_zone_info::get_month_from_day(start_date);
+        date.is_payment_on_holiday = 0;
+        date.days_from_nonworking_day = 0;
+
+        const MACRO_NS::holiday_info* origin_holidays =
+            MACRO_NS::get_holidays(from_country_id, holiday_info_map.get());
+        const ebay::common::business_calendar* calendar = business_calendars == NULL ? NULL :
+            business_calendars->find(from_country_id, non_working_days, start_date);
+
+        if (XPLAT_LIKELY(origin_holidays != NULL && calendar != NULL))
+        {
+            date.is_payment_on_holiday = calendar->is_holiday(start_date);
+            date.days_from_nonworking_day =
+                std::min<uint32_t>(calendar->days_to_non_working(start_date), 7);
+        }
+        else if (XPLAT_LIKELY(origin_holidays != NULL))
         {
-            features[MACRO_NS::ship_model::SHIPPING_METHOD_ZIP_TOTAL_AVERAGE] =
-                it->second.get_total();
-            features[MACRO_NS::ship_model::SHIPPING_METHOD_ZIP_DAY_AVERAGE] =
-                it->second.get_day(day_of_week);
+            date.is_payment_on_holiday = origin_holidays->is_holiday(start_date);
+
+            MACRO_NS::date_t day = start_date;
+
+            while (!MACRO_NS::holiday_info::is_non_working_day(day,
+                                                               origin_holidays,
+                                                               non_working_days))
+            {
+                day++;
+                date.days_from_nonworking_day++;
+                if (XPLAT_UNLIKELY(date.days_from_nonworking_day >= 7))
+                    break;
+            }
         }
+        cached_start_generation = generation;
     }
+    return date;
 }
 
 /** @brief Set the shipping service and zip map features.
@@ -949,19 +1837,22 @@ static void set_shipment_zip_features(int32_t features[MACRO_NS::ship_model::MAX
  *  @param[in,out] min_days The min delivery estimate.
  *  @param[in,out] max_days The max delivery estimate.
  *  @param[in] shipping_service The shipping service.
- *  @param[in] to_zip The buyers zip location.
- *  @param[in] to_country_id The buyers country.
+ *  @param[in,out] destination The buyers location.
  *  @param[in] from_zip The item/seller zip location.
  *  @param[in] from_country_id The item country.
  *  @param[in] handling_time The seller's stated handling days.
  */
 static void zip_to_zip_model(int32_t& min_days, int32_t& max_days,
-                             int32_t shipping_service, int16_t to_zip,
-                             int32_t to_country_id, int16_t from_zip,
-                             int32_t from_country_id, int32_t handling_time)
+                             int32_t shipping_service, analytical_destination& destination,
+                             int16_t from_zip, int32_t from_country_id,
+                             int32_t handling_time)
 {
+    int16_t to_zip = destination.to_zip;
+    int32_t to_country_id = destination.to_country_id;
+
     /* Calculate the zip->zip AU models. */
-    if (XPLAT_LIKELY(base_services != NULL && zip_ranges != NULL &&
+    if (XPLAT_LIKELY(base_services != NULL &&
+                     (zip_ranges_index != NULL || zip_ranges != NULL) &&
                      zip_estimates != NULL && to_zip != 0 && from_zip != 0 &&
                      shipping_service != 0 && from_country_id == to_country_id &&
                      from_country_id != 0))
@@ -971,16 +1862,12 @@ static void zip_to_zip_model(int32_t& min_days, int32_t& max_days,
 
         if (XPLAT_UNLIKELY(it != base_services->end()))
         {
-            zip_range_key zip_to_key((int16_t) to_country_id, to_zip);
-            zip_range_key zip_from_key((int16_t) from_country_id, from_zip);
-            zip_range_map::const_iterator it_to = zip_ranges->find(zip_to_key);
-            zip_range_map::const_iterator it_from = zip_ranges->find(zip_from_key);
+            const int16_t* range_to = find_destination_range(destination);
+            const int16_t* range_from = find_zip_range((int16_t) from_country_id, from_zip);
 
-            if (XPLAT_LIKELY(it_to != zip_ranges->end() &&
-                             it_from != zip_ranges->end()))
+            if (XPLAT_LIKELY(range_to != NULL && range_from != NULL))
             {
-                shipping_zip_key lookup_key(it->second, it_to->second,
-                                            it_from->second);
+                shipping_zip_key lookup_key(it->second, *range_to, *range_from);
                 zip_estimate_map::const_iterator it_estimate =
                     zip_estimates->find(lookup_key);
 
@@ -1089,8 +1976,7 @@ DECLARE_MACRO(AnalyticalDeliveryEstimate)
         is_analytical_eligible = false;
     if (is_analytical_eligible)
     {
-        if (XPLAT_LIKELY(to_zip_big != 0))
-            to_zip = translate_to_zip(to_zip_big, to_country_id);
+        to_zip = query_destination(to_zip_big, to_country_id).to_zip;
         from_zip = translate_from_zip(from_zip_string, from_country_id);
     }
     if (XPLAT_UNLIKELY(from_zip == -1))
@@ -1104,7 +1990,8 @@ DECLARE_MACRO(AnalyticalDeliveryEstimate)
     }
     if (XPLAT_UNLIKELY(is_analytical_eligible &&
                        to_country_id == ebay::search::macro::country::australia))
-        zip_to_zip_model(min_days, max_days, shipping_service, to_zip, to_country_id,
+        zip_to_zip_model(min_days, max_days, shipping_service,
+                         query_destination(to_zip_big, to_country_id),
                          from_zip, from_country_id, handling_time);
 
     /* Check the EP param to see if we should be using the QA Model. */
@@ -1137,41 +2024,27 @@ DECLARE_MACRO(AnalyticalDeliveryEstimate)
 
             hour_of_day = estimate_start_date->values[des_column_number_start_time] %
                           MACRO_NS::seconds_per_day / MACRO_NS::seconds_per_hour;
-            day_of_week = (start_date + 1) % 7 + 1; /* Sun = 1, Sat = 7. */
-            month_of_year = MACRO_NS::time_zone_info::get_month_from_day(start_date);
-
-            const MACRO_NS::holiday_info* origin_holidays =
-                MACRO_NS::get_holidays(from_country_id, holiday_info_map.get());
 
-            if (XPLAT_LIKELY(origin_holidays != NULL))
-            {
-                is_payment_on_holiday = origin_holidays->is_holiday(start_date);
-                days_from_nonworking_day = 0;
-
-                MACRO_NS::date_t day = start_date;
+            const analytical_start_date& date =
+                query_start_date(start_date, from_country_id, non_working_days);
 
-                while (!MACRO_NS::holiday_info::is_non_working_day(day,
-                                                                   origin_holidays,
-                                                                   non_working_days))
-                {
-                    day++;
-                    days_from_nonworking_day++;
-                    if (XPLAT_UNLIKELY(days_from_nonworking_day >= 7))
-                        break;
-                }
-            }
+            day_of_week = date.day_of_week;
+            month_of_year = date.month_of_year;
+            is_payment_on_holiday = date.is_payment_on_holiday;
+            days_from_nonworking_day = date.days_from_nonworking_day;
         }
 
-        experiment_model* model = &default_model;
+        /* If the sde_model paramater names an experiment model, such as 'b', use it. */
+        experiment_model* model = sde_model.size != 0 && !experiment_models.empty() ?
+            find_experiment_model(sde_model) : NULL;
 
-        /* If the sde_model paramater is set to model 'b', use the test model. */
-        if (XPLAT_UNLIKELY(sde_model.size == 1 && sde_model.data[0] == 'b'))
-        {
-            model = &test_model;
+        if (XPLAT_UNLIKELY(model != NULL))
             test_model_counter.enabled_add_sample(1);
-        }
         else
+        {
+            model = &default_model;
             default_model_counter.enabled_add_sample(1);
+        }
 
         int32_t features[MACRO_NS::ship_model::MAX_VALUE];
 
@@ -1188,36 +2061,69 @@ DECLARE_MACRO(AnalyticalDeliveryEstimate)
             (int32_t) days_from_nonworking_day;
         features[MACRO_NS::ship_model::IS_PAYMENT_ON_HOLIDAY] =
             (int32_t) is_payment_on_holiday;
-        set_seller_features(features, day_of_week, seller_id, *model);
-        set_shipment_zip_features(features, day_of_week, shipping_service, to_zip,
-                                  from_zip, *model);
 
         const QPL_NS::qpl_int64_vect* attr_item_leaf_cats =
             attr_get__LeafCats(QPL_ATTR_CTX);
 
         if (attr_item_leaf_cats != NULL && attr_item_leaf_cats->count > 0)
             leaf_category_id = attr_item_leaf_cats->values[0];
-        set_category_features(features, day_of_week, leaf_category_id, *model);
 
-        double model_score = MACRO_NS::shipping_tree_model::evaluate(features);
+        bool sampled = false;
+        int32_t sampled_features[MACRO_NS::ship_model::MAX_VALUE];
+
+        /* The shadow model gets the features before the map features, as the model did. */
+        if (XPLAT_UNLIKELY(shadow_sample_rate != 0) && model == &default_model &&
+            shadow_countdown-- == 0)
+        {
+            shadow_countdown = shadow_sample_rate - 1;
+            std::memcpy(sampled_features, features, sizeof(sampled_features));
+            sampled = true;
+        }
+
+        uint32_t probes;
+        double model_score = score_item(features, *model, day_of_week, seller_id,
+                                        leaf_category_id, shipping_service, to_zip, from_zip,
+                                        probes);
+
+        feature_probe_counter.enabled_add_sample(probes);
+        if (model->trees != NULL)
+            feature_probe_avoided_counter.enabled_add_sample(feature_map_count - probes);
+
         std::size_t max_model_days = model->max_days_predicted;
+        std::size_t sde_max_days = 0;
 
         if (XPLAT_UNLIKELY(sde_model.size == 2 && sde_model.data[0] == 'D' &&
                            sde_model.data[1] >= '0' && sde_model.data[1] <= '9'))
+        {
             max_model_days = sde_model.data[1] - '0';
+            sde_max_days = max_model_days;
+        }
+
+        int32_t model_days = model->predicted_days(model_score, max_model_days);
 
-        for (std::size_t i = model->min_days_predicted; i <= max_model_days; i++)
+        if (XPLAT_UNLIKELY(sampled))
         {
-            if (i >= model->thresholds.size())
-                break;
+            shadow_sample sample;
+
+            std::memcpy(sample.features, sampled_features, sizeof(sample.features));
+            sample.day_of_week = day_of_week;
+            sample.seller_id = seller_id;
+            sample.leaf_category_id = leaf_category_id;
+            sample.shipping_service = shipping_service;
+            sample.to_zip = to_zip;
+            sample.from_zip = from_zip;
+            sample.score = model_score;
+            sample.days = model_days;
+            sample.max_days = sde_max_days;
+            if (!shadow_samples->try_push(sample))
+                shadow_dropped_counter.enabled_add_sample(1);
+        }
 
-            if (model_score <= model->thresholds[i])
-            {
-                min_days = (int32_t) i;
-                max_days = (int32_t) i;
-                model_result_counter.enabled_add_sample(1);
-                break;
-            }
+        if (model_days >= 0)
+        {
+            min_days = model_days;
+            max_days = model_days;
+            model_result_counter.enabled_add_sample(1);
         }
     }
     QPL_NS::qpl_allocator ator(QPL_APPL_CTX, QPL_ATTR_CTX);
@@ -1235,14 +2141,19 @@ DECLARE_MACRO(AnalyticalDeliveryEstimate)
 /** @brief Resets all of the macro's static pointers */
 static void cleanup()
 {
+    stop_shadow();
     eligibility.reset();
     holiday_info_map.reset();
+    business_calendars.reset();
+    feature_store.reset();
     default_model.clear();
-    test_model.clear();
+    experiment_models.clear();
     zip_ranges.reset();
+    zip_ranges_index.reset();
     base_services.reset();
     zip_estimates.reset();
     category_optouts.clear();
+    tables_generation.fetch_add(1, boost::memory_order_release);
 }
 
 DECLARE_MACRO_INIT(AnalyticalDeliveryEstimate_init)
@@ -1257,6 +2168,9 @@ DECLARE_MACRO_INIT(AnalyticalDeliveryEstimate_init)
         boost::optional<const ebay::common::prop_tree&> opt_AnalyticalDeliveryEstimate =
             cfg_ptree.get_child_optional("AnalyticalDeliveryEstimate");
 
+        /* The shadow model may be reloaded below. */
+        stop_shadow();
+
         if (opt_AnalyticalDeliveryEstimate &&
             opt_AnalyticalDeliveryEstimate->get<bool>("enabled"))
         {
@@ -1276,23 +2190,68 @@ DECLARE_MACRO_INIT(AnalyticalDeliveryEstimate_init)
                 ebay::search::macro::load_map_data<MACRO_NS::holiday_map>(
                     holiday_map_path.c_str(), is_binary));
 
+            /* Days of the week that are not working days, as in the shipping service flags. */
+            std::vector<int8_t> calendar_working_days(default_calendar_working_days,
+                default_calendar_working_days +
+                sizeof(default_calendar_working_days) / sizeof(default_calendar_working_days[0]));
+            boost::optional<std::string> calendar_working_days_str =
+                opt_AnalyticalDeliveryEstimate->get_optional<std::string>("calendar_working_days");
+
+            if (calendar_working_days_str)
+            {
+                std::vector<std::string> flags;
+
+                calendar_working_days.clear();
+                boost::split(flags, *calendar_working_days_str, boost::is_any_of(","));
+                BOOST_FOREACH(std::string flag, flags)
+                {
+                    calendar_working_days.push_back(
+                        (int8_t) boost::lexical_cast<int32_t>(boost::trim_copy(flag)));
+                }
+            }
+            business_calendars.reset(build_business_calendars(*holiday_info_map,
+                                                              calendar_working_days));
+
+            /* Feature tables are shared by the processes of the host when a store is configured. */
+            boost::optional<std::string> feature_store_path =
+                opt_AnalyticalDeliveryEstimate->get_optional<std::string>("feature_store_path");
+
+            if (feature_store_path)
+                feature_store.reset(new ebay::common::shared_table_store(*feature_store_path));
+            else
+                feature_store.reset();
+
             /*
              * Start loading the model features
              */
-            default_model.load(*opt_AnalyticalDeliveryEstimate, "", is_binary);
+            feature_table_registry registry;
+
+            default_model.load(*opt_AnalyticalDeliveryEstimate, "", is_binary, registry);
 
-            std::string zip_ranges_map_path =
-                opt_AnalyticalDeliveryEstimate->get<std::string>("zip_ranges_path");
             std::string base_services_map_path =
                 opt_AnalyticalDeliveryEstimate->get<std::string>("base_services_path");
             std::string zip_estimates_map_path =
                 opt_AnalyticalDeliveryEstimate->get<std::string>("zip_estimates_path");
 
-            zip_ranges.reset(ebay::search::macro::load_map_data<zip_range_map>(
-                zip_ranges_map_path.c_str(), is_binary));
-            base_services.reset(ebay::search::macro::load_map_data<base_service_map>(
+            boost::optional<std::string> zip_ranges_map_path =
+                opt_AnalyticalDeliveryEstimate->get_optional<std::string>("zip_ranges_path");
+            boost::optional<std::string> zip_ranges_index_path =
+                opt_AnalyticalDeliveryEstimate->get_optional<std::string>("zip_ranges_index_path");
+
+            /*
+             * The builder only writes the range index. The per zip map is
+             * still read from older table sets; with neither, zip range
+             * lookups are skipped.
+             */
+            if (zip_ranges_index_path)
+                zip_ranges_index.reset(MACRO_NS::load_serialized_data<zip_range_index>(
+                    zip_ranges_index_path->c_str(), is_binary));
+            else if (zip_ranges_map_path)
+                zip_ranges.reset(load_table_data<zip_range_map>(
+                    zip_ranges_map_path->c_str(), is_binary));
+            base_services.reset(load_table_data<base_service_map>(
                 base_services_map_path.c_str(), is_binary));
-            zip_estimates.reset(ebay::search::macro::load_map_data<zip_estimate_map>(
+            zip_estimates.reset(load_table_data<zip_estimate_map>(
                 zip_estimates_map_path.c_str(), is_binary));
 
             std::string macro_config_path =
@@ -1306,8 +2265,62 @@ DECLARE_MACRO_INIT(AnalyticalDeliveryEstimate_init)
             boost::optional<bool> test_enabled =
                 macro_ptree.get_optional<bool>("test_enabled");
 
+            /* Experiment models as name:prefix pairs; the models share the tables of the same files. */
+            std::vector<std::string> model_names;
+            boost::optional<std::string> experiment_models_str =
+                macro_ptree.get_optional<std::string>("experiment_models");
+
             if (test_enabled && *test_enabled)
-                test_model.load(*opt_AnalyticalDeliveryEstimate, "ep_", is_binary);
+                model_names.push_back("b:ep_");
+            if (experiment_models_str)
+            {
+                std::vector<std::string> names;
+
+                boost::split(names, *experiment_models_str, boost::is_any_of(","));
+                model_names.insert(model_names.end(), names.begin(), names.end());
+            }
+            experiment_models.clear();
+            BOOST_FOREACH(std::string name, model_names)
+            {
+                std::string::size_type colon = name.find(':');
+
+                if (colon == std::string::npos)
+                    throw std::runtime_error("experiment_models: expected name:prefix, got " + name);
+
+                boost::shared_ptr<experiment_model> model(new experiment_model());
+
+                model->load(*opt_AnalyticalDeliveryEstimate,
+                            boost::trim_copy(name.substr(colon + 1)).c_str(), is_binary, registry);
+                experiment_models.push_back(std::make_pair(boost::trim_copy(name.substr(0, colon)),
+                                                           model));
+            }
+
+            /* One in shadow_sample_rate items the default model scores is scored again by the shadow model. */
+            boost::optional<std::string> shadow_model_name =
+                macro_ptree.get_optional<std::string>("shadow_model");
+
+            if (shadow_model_name)
+            {
+                experiment_model* model = NULL;
+
+                for (experiment_model_list::const_iterator it = experiment_models.begin();
+                     it != experiment_models.end(); ++it)
+                {
+                    if (it->first == *shadow_model_name)
+                        model = it->second.get();
+                }
+                if (model == NULL)
+                    throw std::runtime_error("shadow_model: no experiment model " +
+                                             *shadow_model_name);
+
+                boost::optional<uint32_t> shadow_sample_rate_opt =
+                    macro_ptree.get_optional<uint32_t>("shadow_sample_rate");
+                boost::optional<std::size_t> shadow_queue_size =
+                    macro_ptree.get_optional<std::size_t>("shadow_queue_size");
+
+                start_shadow(model, shadow_sample_rate_opt ? *shadow_sample_rate_opt : 100,
+                             shadow_queue_size ? *shadow_queue_size : 4096);
+            }
 
             boost::optional<ebay::common::prop_tree&> category_opt_outs =
                 macro_ptree.get_child_optional("category_opt_outs");
@@ -1333,6 +2346,8 @@ DECLARE_MACRO_INIT(AnalyticalDeliveryEstimate_init)
                 }
             }
         }
+        /* The tables are replaced in place, so the caches of every thread go. */
+        tables_generation.fetch_add(1, boost::memory_order_release);
     }
     catch (...)
     {
@@ -0,0 +1,361 @@
+/** @file common/area_matrix.hpp
+ *  Dense storage for groups of zip to zip rows that form a complete area by
+ *  area matrix, such as the Royal Mail postcode area tables. Such a group is
+ *  stored as one value per cell, indexed through a dictionary that maps every
+ *  area code to its row or column, instead of one hashed row per cell.
+ */
+
+#ifndef EBAY_COMMON_AREA_MATRIX_HPP
+#define EBAY_COMMON_AREA_MATRIX_HPP
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdint.h>
+#include <boost/unordered_map.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/utility.hpp>
+
+namespace ebay { namespace common
+{
+
+/* Area codes above this are not stored densely, their dictionary would be too large. */
+static const int32_t area_max_code = 1 << 16;
+
+/** @brief The @a area_dictionary struct maps the area codes of one set of
+ *    areas to consecutive indexes, through a directly indexed slot table.
+ */
+struct area_dictionary
+{
+    area_dictionary() :
+        slot_offset(0),
+        max_code(0),
+        size(0)
+    {
+    }
+
+    /** @brief Serialization function used by Boost serialization.
+     *
+     *  @param[in,out] ar The Archive to read/write to.
+     *  @param[in] version Not used, but required by the interface.
+     */
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & slot_offset;
+        ar & max_code;
+        ar & size;
+    }
+
+    /* Start of this dictionary's slots, one per code from 0 to max_code. */
+    int32_t slot_offset;
+    int32_t max_code;
+    /* Number of areas. */
+    int32_t size;
+};
+
+/** @brief The @a area_matrix struct holds the entry point of one group into
+ *    an @a area_matrix_index.
+ */
+struct area_matrix
+{
+    area_matrix() :
+        from_areas(-1),
+        to_areas(-1),
+        value_offset(0),
+        from_base(10),
+        to_base(10)
+    {
+    }
+
+    /** @brief Serialization function used by Boost serialization.
+     *
+     *  @param[in,out] ar The Archive to read/write to.
+     *  @param[in] version Not used, but required by the interface.
+     */
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & from_areas;
+        ar & to_areas;
+        ar & value_offset;
+        ar & from_base;
+        ar & to_base;
+    }
+
+    /* Dictionaries of the origin and destination areas. */
+    int32_t from_areas;
+    int32_t to_areas;
+    /* Start of the group's cells, stored row by row by origin area. */
+    int32_t value_offset;
+    int16_t from_base;
+    int16_t to_base;
+};
+
+/** @brief @a area_matrix_index stores groups (e.g. origin country, destination
+ *    country and shipping service) whose rows are exactly every pair of an
+ *    origin area set and a destination area set.
+ *
+ *    For such a group the longest prefix match over its rows is the cell of
+ *    the longest origin prefix that is an area and the longest destination
+ *    prefix that is an area, so a lookup walks the postcodes through the two
+ *    dictionaries and reads one cell. Groups sharing an area set share its
+ *    dictionary.
+ *
+ *    Groups are added with add(); a group that is not a complete matrix is
+ *    refused and has to be stored elsewhere.
+ */
+template <typename K, typename V>
+class area_matrix_index
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef boost::unordered_map<K, area_matrix> group_map;
+    /* One row of a group: origin area, destination area and value. */
+    typedef std::pair<std::pair<int32_t, int32_t>, V> row_type;
+
+    area_matrix_index() :
+        groups(),
+        dictionaries(),
+        slots(),
+        values(),
+        dictionary_ids()
+    {
+    }
+
+    /** @brief Adds a group if its rows form a complete matrix.
+     *
+     *  @param[in] group The group key.
+     *  @param[in] from_base The base origin postcodes of the group match in.
+     *  @param[in] to_base The base destination postcodes of the group match in.
+     *  @param[in] rows The rows of the group, with unique area pairs.
+     *  @return Returns @a false if the rows are not a complete matrix of
+     *    positive area codes, in which case nothing was added.
+     */
+    bool add(const K& group, int16_t from_base, int16_t to_base,
+             const std::vector<row_type>& rows)
+    {
+        std::vector<int32_t> from_codes;
+        std::vector<int32_t> to_codes;
+
+        if (rows.empty() || groups.find(group) != groups.end())
+            return false;
+        for (std::size_t i = 0; i < rows.size(); i++)
+        {
+            from_codes.push_back(rows[i].first.first);
+            to_codes.push_back(rows[i].first.second);
+        }
+        if (!make_areas(from_codes) || !make_areas(to_codes) ||
+            from_codes.size() * to_codes.size() != rows.size())
+            return false;
+
+        area_matrix entry;
+        std::vector<bool> seen(rows.size(), false);
+
+        entry.from_areas = add_dictionary(from_codes);
+        entry.to_areas = add_dictionary(to_codes);
+        entry.value_offset = (int32_t) values.size();
+        entry.from_base = from_base;
+        entry.to_base = to_base;
+
+        values.resize(values.size() + rows.size());
+        for (std::size_t i = 0; i < rows.size(); i++)
+        {
+            std::size_t cell = cell_index(entry, rows[i].first.first, rows[i].first.second);
+
+            /* A repeated pair leaves another cell empty, so it is no matrix. */
+            if (seen[cell])
+            {
+                values.resize(entry.value_offset);
+                return false;
+            }
+            seen[cell] = true;
+            values[entry.value_offset + cell] = rows[i].second;
+        }
+        groups.insert(std::make_pair(group, entry));
+        return true;
+    }
+
+    /** @brief Releases the build state. Groups can not be added afterwards.
+     */
+    void create()
+    {
+        std::map<std::vector<int32_t>, int32_t>().swap(dictionary_ids);
+    }
+
+    /** @brief Finds the entry point of a group.
+     *
+     *  @param[in] group The group key.
+     *  @return Returns the group, or NULL if there is no such group.
+     */
+    const area_matrix* find_group(const K& group) const
+    {
+        typename group_map::const_iterator it = groups.find(group);
+
+        if (it == groups.end())
+            return NULL;
+        return &it->second;
+    }
+
+    /** @brief Finds the value for the longest matching areas within a group.
+     *
+     *  @param[in] group The group, as returned by find_group().
+     *  @param[in] from_zip The origin postcode hash.
+     *  @param[in] to_zip The destination postcode hash.
+     *  @return Returns the value, or NULL if either postcode is in no area.
+     */
+    const V* find(const area_matrix& group, int32_t from_zip, int32_t to_zip) const
+    {
+        int32_t from_slot = find_area(dictionaries[group.from_areas], group.from_base,
+                                      from_zip);
+
+        if (from_slot < 0)
+            return NULL;
+
+        int32_t to_slot = find_area(dictionaries[group.to_areas], group.to_base, to_zip);
+
+        if (to_slot < 0)
+            return NULL;
+        return &values[group.value_offset +
+                       from_slot * dictionaries[group.to_areas].size + to_slot];
+    }
+
+    /** @brief Finds the value for the longest matching areas.
+     *
+     *  @param[in] group The group key.
+     *  @param[in] from_zip The origin postcode hash.
+     *  @param[in] to_zip The destination postcode hash.
+     *  @return Returns the value, or NULL if nothing matches.
+     */
+    const V* find(const K& group, int32_t from_zip, int32_t to_zip) const
+    {
+        const area_matrix* entry = find_group(group);
+
+        if (entry == NULL)
+            return NULL;
+        return find(*entry, from_zip, to_zip);
+    }
+
+    /** @brief Gets the number of groups.
+     */
+    std::size_t size() const
+    {
+        return groups.size();
+    }
+
+    /** @brief Gets the number of cells stored.
+     */
+    std::size_t cell_count() const
+    {
+        return values.size();
+    }
+
+    /** @brief Gets the number of distinct area sets stored.
+     */
+    std::size_t dictionary_count() const
+    {
+        return dictionaries.size();
+    }
+
+    template <typename A>
+    void save(A& ar, const unsigned int version) const
+    {
+        std::vector<std::pair<K, area_matrix> > entries(groups.begin(), groups.end());
+
+        ar & entries;
+        ar & dictionaries;
+        ar & slots;
+        ar & values;
+    }
+
+    template <typename A>
+    void load(A& ar, const unsigned int version)
+    {
+        std::vector<std::pair<K, area_matrix> > entries;
+
+        ar & entries;
+        ar & dictionaries;
+        ar & slots;
+        ar & values;
+        groups.clear();
+        groups.insert(entries.begin(), entries.end());
+    }
+
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+
+private:
+    /** @brief Sorts and dedups area codes, and checks they can be stored.
+     */
+    static bool make_areas(std::vector<int32_t>& codes)
+    {
+        std::sort(codes.begin(), codes.end());
+        codes.erase(std::unique(codes.begin(), codes.end()), codes.end());
+        return codes.front() > 0 && codes.back() < area_max_code && codes.size() < 0x8000;
+    }
+
+    /** @brief Gets the dictionary of a sorted set of area codes, adding it if new.
+     */
+    int32_t add_dictionary(const std::vector<int32_t>& codes)
+    {
+        std::map<std::vector<int32_t>, int32_t>::iterator it = dictionary_ids.find(codes);
+
+        if (it != dictionary_ids.end())
+            return it->second;
+
+        area_dictionary dictionary;
+
+        dictionary.slot_offset = (int32_t) slots.size();
+        dictionary.max_code = codes.back();
+        dictionary.size = (int32_t) codes.size();
+        slots.resize(slots.size() + codes.back() + 1, -1);
+        for (std::size_t i = 0; i < codes.size(); i++)
+            slots[dictionary.slot_offset + codes[i]] = (int16_t) i;
+        dictionaries.push_back(dictionary);
+        dictionary_ids.insert(std::make_pair(codes, (int32_t) dictionaries.size() - 1));
+        return (int32_t) dictionaries.size() - 1;
+    }
+
+    std::size_t cell_index(const area_matrix& entry, int32_t from_code, int32_t to_code) const
+    {
+        const area_dictionary& from = dictionaries[entry.from_areas];
+        const area_dictionary& to = dictionaries[entry.to_areas];
+
+        return slots[from.slot_offset + from_code] * to.size +
+               slots[to.slot_offset + to_code];
+    }
+
+    /** @brief Finds the area of the longest prefix of a postcode.
+     *
+     *  @return Returns the index of the area, or -1 if no prefix is an area.
+     */
+    int32_t find_area(const area_dictionary& dictionary, int32_t base, int32_t zip) const
+    {
+        for (; zip > 0; zip /= base)
+        {
+            if (zip <= dictionary.max_code)
+            {
+                int16_t slot = slots[dictionary.slot_offset + zip];
+
+                if (slot >= 0)
+                    return slot;
+            }
+        }
+        return -1;
+    }
+
+    group_map groups;
+    std::vector<area_dictionary> dictionaries;
+    /* Area index of every code of every dictionary, -1 for codes that are no area. */
+    std::vector<int16_t> slots;
+    /* Cells of every group. */
+    std::vector<V> values;
+    /* Dictionary of each area set, only needed while adding groups. */
+    std::map<std::vector<int32_t>, int32_t> dictionary_ids;
+};
+
+}}
+
+#endif
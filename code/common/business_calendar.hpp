@@ -0,0 +1,193 @@
+/** @file common/business_calendar.hpp
+ *  Precomputed business day calendars. A calendar covers a range of days for
+ *  one set of holidays and one set of weekly non working days, and answers
+ *  whether a day is a holiday, how many days there are until the next non
+ *  working day, and which day comes N business days later, each with one or
+ *  two array loads instead of a walk from day to day.
+ */
+
+#ifndef EBAY_COMMON_BUSINESS_CALENDAR_HPP
+#define EBAY_COMMON_BUSINESS_CALENDAR_HPP
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <boost/unordered_map.hpp>
+
+namespace ebay { namespace common
+{
+
+/* Days past the end of a calendar looked at for its last days, and most days
+ * to the next non working day it tells apart. */
+static const uint32_t business_calendar_lookahead = 255;
+
+/** @brief @a business_calendar holds the business days of a range of days.
+ *    Days are day numbers, such as Julian days.
+ */
+class business_calendar
+{
+public:
+    business_calendar() :
+        first_day(0),
+        day_count(0)
+    {
+    }
+
+    /** @brief Builds a calendar.
+     *
+     *  @param[in] first The first day of the calendar.
+     *  @param[in] count The number of days of the calendar.
+     *  @param[in] is_holiday is_holiday(day) tells whether a day is a holiday.
+     *  @param[in] is_non_working is_non_working(day) tells whether a day is a
+     *    holiday or a weekly non working day. Both are also called for the
+     *    @a business_calendar_lookahead days after the calendar.
+     */
+    template <typename Holiday, typename NonWorking>
+    business_calendar(int64_t first, uint32_t count, const Holiday& is_holiday,
+                      const NonWorking& is_non_working) :
+        first_day(first),
+        day_count(count),
+        holidays((count + 63) / 64, 0),
+        next_non_working(count),
+        working_rank(count + 1)
+    {
+        uint32_t extent = count + business_calendar_lookahead;
+        std::vector<bool> non_working(extent);
+
+        for (uint32_t i = 0; i < extent; i++)
+        {
+            non_working[i] = is_non_working(first + i);
+            if (non_working[i])
+                continue;
+            working_days.push_back(i);
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (is_holiday(first + i))
+                holidays[i >> 6] |= 1ULL << (i & 63);
+        }
+
+        /* Distances are computed back to front, starting past the lookahead. */
+        uint32_t distance = business_calendar_lookahead;
+
+        for (uint32_t i = extent; i-- > 0;)
+        {
+            distance = non_working[i] ? 0 : std::min(distance + 1, business_calendar_lookahead);
+            if (i < count)
+                next_non_working[i] = (uint8_t) distance;
+        }
+        working_rank[0] = 0;
+        for (uint32_t i = 0; i < count; i++)
+            working_rank[i + 1] = working_rank[i] + (non_working[i] ? 0 : 1);
+    }
+
+    /** @brief Checks whether a day is in the calendar.
+     */
+    bool covers(int64_t day) const
+    {
+        return (uint64_t) (day - first_day) < day_count;
+    }
+
+    /** @brief Checks whether a day of the calendar is a holiday.
+     */
+    bool is_holiday(int64_t day) const
+    {
+        uint32_t index = (uint32_t) (day - first_day);
+
+        return (holidays[index >> 6] >> (index & 63)) & 1;
+    }
+
+    /** @brief Gets the number of days from a day of the calendar to the next
+     *    non working day, 0 if the day is not a working day.
+     *
+     *  @return Returns the number of days, at most
+     *    @a business_calendar_lookahead.
+     */
+    uint32_t days_to_non_working(int64_t day) const
+    {
+        return next_non_working[(uint32_t) (day - first_day)];
+    }
+
+    /** @brief Gets the day a number of business days after a day of the
+     *    calendar: the last of the next @a days working days.
+     *
+     *  @param[in] day The day to count from.
+     *  @param[in] days The number of business days, 0 for @a day itself.
+     *  @param[out] result Receives the day.
+     *  @return Returns @a false if the day is past the days the calendar knows.
+     */
+    bool add_business_days(int64_t day, uint32_t days, int64_t& result) const
+    {
+        if (days == 0)
+        {
+            result = day;
+            return true;
+        }
+
+        std::size_t index = working_rank[(uint32_t) (day - first_day) + 1] + days - 1;
+
+        if (index >= working_days.size())
+            return false;
+        result = first_day + working_days[index];
+        return true;
+    }
+
+private:
+    int64_t first_day;
+    uint32_t day_count;
+    /* Bit i is set if day first_day + i is a holiday. */
+    std::vector<uint64_t> holidays;
+    std::vector<uint8_t> next_non_working;
+    /* Number of working days before day first_day + i. */
+    std::vector<uint32_t> working_rank;
+    /* Offsets from first_day of every working day, lookahead included. */
+    std::vector<uint32_t> working_days;
+};
+
+/** @brief @a business_calendar_index holds the calendars of countries, one
+ *    per set of weekly non working days.
+ */
+class business_calendar_index
+{
+public:
+    /** @brief Adds the calendar of a country and a set of weekly non working
+     *    days.
+     */
+    void add(int32_t country_id, int8_t working_days_flags, const business_calendar& calendar)
+    {
+        calendars[key(country_id, working_days_flags)] = calendar;
+    }
+
+    /** @brief Finds the calendar of a day.
+     *
+     *  @return Returns the calendar, or NULL if none covers the day.
+     */
+    const business_calendar* find(int32_t country_id, int8_t working_days_flags,
+                                  int64_t day) const
+    {
+        calendar_map::const_iterator it = calendars.find(key(country_id, working_days_flags));
+
+        if (it == calendars.end() || !it->second.covers(day))
+            return NULL;
+        return &it->second;
+    }
+
+    std::size_t size() const
+    {
+        return calendars.size();
+    }
+
+private:
+    typedef boost::unordered_map<uint64_t, business_calendar> calendar_map;
+
+    static uint64_t key(int32_t country_id, int8_t working_days_flags)
+    {
+        return ((uint64_t) (uint32_t) country_id << 8) | (uint8_t) working_days_flags;
+    }
+
+    calendar_map calendars;
+};
+
+}}
+
+#endif
@@ -0,0 +1,568 @@
+/** @file common/cascade_prefix_index.hpp
+ *  Precompiled form of the z2z fallback cascade. The zip to zip rows, the
+ *  range to range estimates, the origin only rows and the destination only
+ *  rows of every group are folded into one structure at build time, so that a
+ *  lookup walks each postcode down a digit trie once instead of probing a hash
+ *  table for every candidate prefix of every fallback.
+ */
+
+#ifndef EBAY_COMMON_CASCADE_PREFIX_INDEX_HPP
+#define EBAY_COMMON_CASCADE_PREFIX_INDEX_HPP
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdint.h>
+#include <boost/config.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/utility.hpp>
+#include "common/prefix_match_index.hpp"
+#include "common/interval_index.hpp"
+
+namespace ebay { namespace common
+{
+
+/** @brief The @a cascade_group struct holds the entry points of one group
+ *    into the tries and the range pair table of a @a cascade_prefix_index.
+ */
+struct cascade_group
+{
+    cascade_group() :
+        origin(-1),
+        destination(-1),
+        pair_begin(0),
+        pair_end(0),
+        signed_begin(0),
+        signed_end(0),
+        from_country(0),
+        to_country(0),
+        from_base(10),
+        to_base(10)
+    {
+    }
+
+    /** @brief Serialization function used by Boost serialization.
+     *
+     *  @param[in,out] ar The Archive to read/write to.
+     *  @param[in] version Not used, but required by the interface.
+     */
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & origin;
+        ar & destination;
+        ar & pair_begin;
+        ar & pair_end;
+        ar & signed_begin;
+        ar & signed_end;
+        ar & from_country;
+        ar & to_country;
+        ar & from_base;
+        ar & to_base;
+    }
+
+    /*
+     * Root of the origin trie. Nodes link to a destination trie of zip to zip
+     * rows, and hold the origin only row for their prefix.
+     */
+    int32_t origin;
+    /* Root of the trie of destination only rows. */
+    int32_t destination;
+    /* Slice of the range pair table holding this group's estimates. */
+    int32_t pair_begin;
+    int32_t pair_end;
+    /* Slice of the signed row table holding this group's negative postcode rows. */
+    int32_t signed_begin;
+    int32_t signed_end;
+    int16_t from_country;
+    int16_t to_country;
+    int16_t from_base;
+    int16_t to_base;
+};
+
+/** @brief The @a cascade_pair struct is one range to range estimate.
+ */
+template <typename V>
+struct cascade_pair
+{
+    cascade_pair() :
+        from_range(0),
+        to_range(0),
+        value()
+    {
+    }
+
+    cascade_pair(int32_t from_range, int32_t to_range, const V& value) :
+        from_range(from_range),
+        to_range(to_range),
+        value(value)
+    {
+    }
+
+    bool operator<(const cascade_pair& right) const
+    {
+        return from_range < right.from_range ||
+               (from_range == right.from_range && to_range < right.to_range);
+    }
+
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & from_range;
+        ar & to_range;
+        ar & value;
+    }
+
+    int32_t from_range;
+    int32_t to_range;
+    V value;
+};
+
+/** @brief @a cascade_prefix_index answers the z2z fallback cascade for a group
+ *    (e.g. origin country, destination country and shipping service) with the
+ *    same precedence as the query time fallbacks it replaces:
+ *
+ *    - the zip to zip row with the longest origin prefix, then the longest
+ *      destination prefix;
+ *    - the range to range estimate for the longest origin prefix in a range,
+ *      then the longest destination prefix in a range;
+ *    - the origin only row with the longest origin prefix;
+ *    - the destination only row with the longest destination prefix.
+ *
+ *    Zip to zip rows with a negative postcode are not prefixes of digit
+ *    strings: they are kept apart, and matched the way the query time loops
+ *    did, by dividing the postcodes down towards zero.
+ *
+ *    Groups that were never added match nothing, like a group missing from the
+ *    z2z services set. Where a source repeats a key the first row wins.
+ *
+ *    The index is filled with the add_*() functions and made queryable with
+ *    create().
+ */
+template <typename K, typename V>
+class cascade_prefix_index
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef boost::unordered_map<K, cascade_group> group_map;
+
+    cascade_prefix_index() :
+        groups(),
+        trie(),
+        ranges(),
+        pairs(),
+        signed_pairs(),
+        build()
+    {
+    }
+
+    /** @brief Adds a group. Only groups added here are ever matched.
+     *
+     *  @param[in] group The group key.
+     *  @param[in] from_country The origin country of the group.
+     *  @param[in] to_country The destination country of the group.
+     *  @param[in] from_base The base origin postcodes are matched in.
+     *  @param[in] to_base The base destination postcodes are matched in.
+     */
+    void add_group(const K& group, int16_t from_country, int16_t to_country,
+                   int16_t from_base, int16_t to_base)
+    {
+        builder& b = get_builder();
+
+        if (groups.find(group) != groups.end())
+            return;
+
+        cascade_group entry;
+
+        entry.origin = b.trie.add_root();
+        entry.destination = b.trie.add_root();
+        entry.from_country = from_country;
+        entry.to_country = to_country;
+        entry.from_base = from_base;
+        entry.to_base = to_base;
+        groups.insert(std::make_pair(group, entry));
+        b.pairs[group];
+    }
+
+    /** @brief Adds a zip to zip row.
+     *
+     *  @return Returns @a false if the row can never be matched and was skipped.
+     */
+    bool add_zip_pair(const K& group, int32_t from_zip, int32_t to_zip, const V& value)
+    {
+        cascade_group* entry = find_builder_group(group);
+
+        if (entry == NULL)
+            return false;
+
+        builder& b = get_builder();
+
+        if (from_zip < 0 || to_zip < 0)
+        {
+            b.signed_pairs[group].push_back(prefix_signed_row<V>(from_zip, to_zip, value));
+            return true;
+        }
+
+        prefix_key from(from_zip, entry->from_base);
+        prefix_key to(to_zip, entry->to_base);
+
+        if (!from.is_valid || !to.is_valid)
+            return false;
+
+        int32_t from_node = b.trie.insert(entry->origin, from);
+
+        b.trie.set_value(b.trie.insert(b.trie.get_link(from_node), to), value);
+        return true;
+    }
+
+    /** @brief Adds an origin only row.
+     *
+     *  @return Returns @a false if the row can never be matched and was skipped.
+     */
+    bool add_origin(const K& group, int32_t from_zip, const V& value)
+    {
+        cascade_group* entry = find_builder_group(group);
+
+        if (entry == NULL || from_zip <= 0)
+            return false;
+
+        builder& b = get_builder();
+
+        b.trie.set_value(b.trie.insert(entry->origin,
+                                       prefix_key(from_zip, entry->from_base)), value);
+        return true;
+    }
+
+    /** @brief Adds a destination only row.
+     *
+     *  @return Returns @a false if the row can never be matched and was skipped.
+     */
+    bool add_destination(const K& group, int32_t to_zip, const V& value)
+    {
+        cascade_group* entry = find_builder_group(group);
+
+        if (entry == NULL || to_zip <= 0)
+            return false;
+
+        builder& b = get_builder();
+
+        b.trie.set_value(b.trie.insert(entry->destination,
+                                       prefix_key(to_zip, entry->to_base)), value);
+        return true;
+    }
+
+    /** @brief Sets the postcode ranges of every country the range to range
+     *    estimates are keyed by.
+     *
+     *  @param[in] index The ranges, each mapping to its id, e.g. its first
+     *    postcode.
+     */
+    void set_ranges(const interval_index<int32_t>& index)
+    {
+        ranges = index;
+    }
+
+    /** @brief Adds a range to range estimate.
+     *
+     *  @return Returns @a false if the group was never added.
+     */
+    bool add_range_pair(const K& group, int32_t from_range, int32_t to_range,
+                        const V& value)
+    {
+        if (find_builder_group(group) == NULL)
+            return false;
+        get_builder().pairs[group].push_back(cascade_pair<V>(from_range, to_range, value));
+        return true;
+    }
+
+    /** @brief Lays out the added rows and releases the build state.
+     */
+    void create()
+    {
+        if (!build)
+            return;
+
+        std::vector<int32_t> ids = build->trie.flatten(trie);
+
+        pairs.clear();
+        signed_pairs.clear();
+        for (typename group_map::iterator it = groups.begin(); it != groups.end(); ++it)
+        {
+            cascade_group& entry = it->second;
+            std::vector<cascade_pair<V> >& group_pairs = build->pairs[it->first];
+
+            entry.origin = ids[entry.origin];
+            entry.destination = ids[entry.destination];
+
+            /* Keep the first estimate of a repeated pair. */
+            std::stable_sort(group_pairs.begin(), group_pairs.end());
+            entry.pair_begin = (int32_t) pairs.size();
+            for (std::size_t i = 0; i < group_pairs.size(); i++)
+            {
+                if (i == 0 || group_pairs[i - 1] < group_pairs[i])
+                    pairs.push_back(group_pairs[i]);
+            }
+            entry.pair_end = (int32_t) pairs.size();
+            entry.signed_begin = (int32_t) signed_pairs.size();
+            prefix_signed_append(build->signed_pairs[it->first], signed_pairs);
+            entry.signed_end = (int32_t) signed_pairs.size();
+        }
+        build.reset();
+    }
+
+    /** @brief Finds the entry point of a group.
+     *
+     *  @param[in] group The group key.
+     *  @return Returns the group, or NULL if there is no such group.
+     */
+    const cascade_group* find_group(const K& group) const
+    {
+        typename group_map::const_iterator it = groups.find(group);
+
+        if (it == groups.end())
+            return NULL;
+        return &it->second;
+    }
+
+    /** @brief Runs the cascade within a group.
+     *
+     *  @param[in] group The group, as returned by find_group().
+     *  @param[in] from_zip The origin postcode hash.
+     *  @param[in] to_zip The destination postcode hash.
+     *  @return Returns the value, or NULL if nothing matches.
+     */
+    const V* find(const cascade_group& group, int32_t from_zip, int32_t to_zip) const
+    {
+        /* Negative postcodes only ever matched rows with negative postcodes. */
+        if (BOOST_UNLIKELY(from_zip < 0 || to_zip < 0) &&
+            group.signed_begin < group.signed_end)
+        {
+            const V* value = prefix_signed_find(&signed_pairs[group.signed_begin],
+                                                &signed_pairs[0] + group.signed_end,
+                                                from_zip, to_zip, group.from_base,
+                                                group.to_base);
+
+            if (value != NULL)
+                return value;
+        }
+
+        prefix_key from(from_zip, group.from_base);
+        prefix_key to(to_zip, group.to_base);
+        int32_t origin[prefix_max_digits + 1];
+        std::size_t origin_count = trie.collect(group.origin, from, origin);
+
+        /* Zip to zip rows, longest origin prefix first. */
+        for (std::size_t i = origin_count; i > 0; i--)
+        {
+            int32_t link = trie.nodes[origin[i - 1]].link;
+
+            if (link >= 0)
+            {
+                int32_t value = trie.longest_match(link, to);
+
+                if (value >= 0)
+                    return &trie.value(value);
+            }
+        }
+
+        /* Range to range estimates, longest origin prefix first. */
+        if (group.pair_begin < group.pair_end)
+        {
+            const V* value = find_range_pair(group, from_zip, to_zip);
+
+            if (value != NULL)
+                return value;
+        }
+
+        /* Zero is not a prefix of anything, the only rows are for real prefixes. */
+        if (!from.is_zero)
+        {
+            for (std::size_t i = origin_count; i > 0; i--)
+            {
+                int32_t value = trie.nodes[origin[i - 1]].value;
+
+                if (value >= 0)
+                    return &trie.value(value);
+            }
+        }
+        if (!to.is_zero)
+        {
+            int32_t value = trie.longest_match(group.destination, to);
+
+            if (value >= 0)
+                return &trie.value(value);
+        }
+        return NULL;
+    }
+
+    /** @brief Runs the cascade.
+     *
+     *  @param[in] group The group key.
+     *  @param[in] from_zip The origin postcode hash.
+     *  @param[in] to_zip The destination postcode hash.
+     *  @return Returns the value, or NULL if nothing matches.
+     */
+    const V* find(const K& group, int32_t from_zip, int32_t to_zip) const
+    {
+        const cascade_group* entry = find_group(group);
+
+        if (entry == NULL)
+            return NULL;
+        return find(*entry, from_zip, to_zip);
+    }
+
+    /** @brief Gets the number of groups.
+     */
+    std::size_t size() const
+    {
+        return groups.size();
+    }
+
+    /** @brief Gets the number of trie nodes stored.
+     */
+    std::size_t node_count() const
+    {
+        return trie.nodes.size();
+    }
+
+    /** @brief Gets the number of postcode ranges stored.
+     */
+    std::size_t range_count() const
+    {
+        return ranges.size();
+    }
+
+    /** @brief Gets the number of range to range estimates stored.
+     */
+    std::size_t pair_count() const
+    {
+        return pairs.size();
+    }
+
+    template <typename A>
+    void save(A& ar, const unsigned int version) const
+    {
+        std::vector<std::pair<K, cascade_group> > entries(groups.begin(), groups.end());
+
+        ar & entries;
+        ar & trie;
+        ar & ranges;
+        ar & pairs;
+        ar & signed_pairs;
+    }
+
+    template <typename A>
+    void load(A& ar, const unsigned int version)
+    {
+        std::vector<std::pair<K, cascade_group> > entries;
+
+        ar & entries;
+        ar & trie;
+        ar & ranges;
+        ar & pairs;
+        ar & signed_pairs;
+        groups.clear();
+        groups.insert(entries.begin(), entries.end());
+    }
+
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+
+private:
+    /** @brief The @a builder struct holds the state only needed before create().
+     */
+    struct builder
+    {
+        prefix_trie_builder<V> trie;
+        boost::unordered_map<K, std::vector<cascade_pair<V> > > pairs;
+        boost::unordered_map<K, std::vector<prefix_signed_row<V> > > signed_pairs;
+    };
+
+    builder& get_builder()
+    {
+        if (!build)
+            build.reset(new builder());
+        return *build;
+    }
+
+    cascade_group* find_builder_group(const K& group)
+    {
+        typename group_map::iterator it = groups.find(group);
+
+        if (!build || it == groups.end())
+            return NULL;
+        return &it->second;
+    }
+
+    /** @brief Finds the range to range estimate, trying every origin prefix in
+     *    a range, longest first, against every destination prefix in a range,
+     *    longest first. Like the query time loops, prefixes are found by
+     *    dividing the postcodes down to zero.
+     */
+    const V* find_range_pair(const cascade_group& group, int32_t from_zip,
+                             int32_t to_zip) const
+    {
+        int32_t from_ranges[prefix_max_digits + 1];
+        int32_t to_ranges[prefix_max_digits + 1];
+        std::size_t from_count = collect_ranges(group.from_country, group.from_base, from_zip,
+                                                from_ranges);
+        std::size_t to_count = collect_ranges(group.to_country, group.to_base, to_zip, to_ranges);
+        typename std::vector<cascade_pair<V> >::const_iterator begin =
+            pairs.begin() + group.pair_begin;
+        typename std::vector<cascade_pair<V> >::const_iterator end =
+            pairs.begin() + group.pair_end;
+
+        for (std::size_t i = 0; i < from_count; i++)
+        {
+            for (std::size_t j = 0; j < to_count; j++)
+            {
+                cascade_pair<V> probe(from_ranges[i], to_ranges[j], V());
+                typename std::vector<cascade_pair<V> >::const_iterator it =
+                    std::lower_bound(begin, end, probe);
+
+                if (it != end && !(probe < *it))
+                    return &it->value;
+            }
+        }
+        return NULL;
+    }
+
+    /** @brief Gets the ranges of the prefixes of a postcode that are in one,
+     *    longest prefix first.
+     *
+     *  @return Returns the number of ranges found.
+     */
+    std::size_t collect_ranges(int16_t country, int16_t base, int32_t zip,
+                               int32_t found[prefix_max_digits + 1]) const
+    {
+        std::size_t count = 0;
+
+        for (; zip > 0 && count <= prefix_max_digits; zip /= base)
+        {
+            const int32_t* range = ranges.find(country, zip);
+
+            if (range != NULL)
+                found[count++] = *range;
+        }
+        return count;
+    }
+
+    group_map groups;
+    /* Origin, zip to zip and destination only tries of every group. */
+    prefix_trie<V> trie;
+    /* Postcode ranges of every country, mapping to the range ids of the estimates. */
+    interval_index<int32_t> ranges;
+    /* Range to range estimates, sorted within each group's slice. */
+    std::vector<cascade_pair<V> > pairs;
+    /* Zip to zip rows with a negative postcode, sorted within each group's slice. */
+    std::vector<prefix_signed_row<V> > signed_pairs;
+    boost::scoped_ptr<builder> build;
+};
+
+}}
+
+#endif
@@ -0,0 +1,293 @@
+/** @file common/compact_table.hpp
+ *  Static map that does not store its keys. A minimal perfect hash gives
+ *  every key a slot in a dense value array, and a short fingerprint of the
+ *  key, kept per slot, rejects nearly all of the keys that are not in the
+ *  map. The builder writes the table as a file, and the query side maps it,
+ *  reading only the small hash function.
+ *
+ *  Unlike the other table formats, a key that is not in the map is not
+ *  always reported missing: with 16 bit fingerprints about one absent key
+ *  in 2^16 is accepted, and gets the value of another key. On seller
+ *  features, 12 to 22 of 1M absent keys were accepted, about 2e-5, where
+ *  the perfect hash and flat tables return not found for all of them; the
+ *  builder reports the count for every table it writes. That only suits
+ *  feature tables where a wrong value for an unknown key is an acceptable,
+ *  rare error.
+ */
+
+#ifndef EBAY_COMMON_COMPACT_TABLE_HPP
+#define EBAY_COMMON_COMPACT_TABLE_HPP
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "common/flat_table.hpp"
+#include "common/perfect_hash.hpp"
+
+namespace ebay { namespace common
+{
+
+/*
+ * File layout, all offsets from the start of the file and 64 byte aligned:
+ *
+ *   compact_table_header
+ *   the hash function, as written by perfect_hash::write()
+ *   F[size]                            the fingerprints, by slot
+ *   V[size]                            the values, copied byte for byte
+ */
+
+/* "EBCOMPCT" read as a little endian integer. */
+static const uint64_t compact_table_magic = 0x5443504d4f434245ULL;
+/* Bumped whenever the file layout or the fingerprint changes. */
+static const uint32_t compact_table_version = 1;
+
+/** @brief The @a compact_table_header struct starts every compact table file.
+ */
+struct compact_table_header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t value_size;
+    /* Signature of the offsets and sizes of every field of a value. */
+    uint64_t layout;
+    uint64_t fingerprint_size;
+    uint64_t size;
+    uint64_t function_offset;
+    uint64_t fingerprint_offset;
+    uint64_t value_offset;
+    uint64_t file_size;
+};
+
+/** @brief @a compact_table maps keys of type K to values of type V, with
+ *    fingerprints of type F. Per key, it takes the size of V and F and a
+ *    little under 6 bits for the hash function. Like the flat tables, V
+ *    must be a plain struct with a serialize() function.
+ */
+template <typename K, typename V, typename F = uint16_t>
+class compact_table : private boost::noncopyable
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+
+    /** @brief Checks whether a file is in the compact table format.
+     *
+     *  @param[in] path The path of the file.
+     */
+    static bool is_compact_file(const char* path)
+    {
+        std::ifstream ifs(path, std::ios_base::binary);
+        uint64_t magic = 0;
+
+        ifs.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        return ifs && magic == compact_table_magic;
+    }
+
+    /** @brief Builds a table from a range of entries and writes it as a
+     *    compact table file. Where keys repeat the first entry wins.
+     *
+     *  @param[in] path The path of the file.
+     *  @param[in] first The first entry, a std::pair of a key and a V.
+     *  @param[in] last One past the last entry.
+     *  @param[in] threads The number of threads to build with.
+     */
+    template <typename ForwardIterator>
+    static void save(const char* path, ForwardIterator first, ForwardIterator last,
+                     std::size_t threads = 1)
+    {
+        perfect_hash function;
+        std::vector<uint64_t> hashes;
+
+        for (ForwardIterator it = first; it != last; ++it)
+            hashes.push_back(perfect_hash_key(it->first));
+        function.build(hashes, threads);
+
+        std::vector<F> fingerprints(function.size(), 0);
+        std::vector<V> values(function.size(), V());
+        std::vector<bool> filled(function.size(), false);
+        std::size_t i = 0;
+
+        for (ForwardIterator it = first; it != last; ++it, ++i)
+        {
+            uint64_t index = function.index(hashes[i]);
+
+            if (filled[index])
+                continue;
+            filled[index] = true;
+            fingerprints[index] = fingerprint(hashes[i]);
+            values[index] = it->second;
+        }
+
+        std::ostringstream function_data;
+        compact_table_header header;
+
+        function.write(function_data);
+        std::memset(&header, 0, sizeof(header));
+        header.magic = compact_table_magic;
+        header.version = compact_table_version;
+        header.value_size = sizeof(V);
+        header.layout = layout();
+        header.fingerprint_size = sizeof(F);
+        header.size = function.size();
+        header.function_offset = align(sizeof(header));
+        header.fingerprint_offset = align(header.function_offset + function_data.str().size());
+        header.value_offset = align(header.fingerprint_offset + header.size * sizeof(F));
+        header.file_size = header.value_offset + header.size * sizeof(V);
+
+        std::ofstream ofs(path, std::ios_base::binary);
+
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        pad(ofs, sizeof(header), header.function_offset);
+        ofs << function_data.str();
+        pad(ofs, header.function_offset + function_data.str().size(), header.fingerprint_offset);
+        if (header.size != 0)
+            ofs.write(reinterpret_cast<const char*>(&fingerprints[0]), header.size * sizeof(F));
+        pad(ofs, header.fingerprint_offset + header.size * sizeof(F), header.value_offset);
+        for (std::size_t v = 0; v < values.size(); v++)
+            ofs.write(reinterpret_cast<const char*>(&values[v]), sizeof(V));
+        if (!ofs)
+            throw std::runtime_error(std::string("compact table: cannot write ") + path);
+    }
+
+    /** @brief Maps a compact table file.
+     *
+     *  @param[in] path The path of the file.
+     *  @return Returns a new table, owned by the caller.
+     */
+    static compact_table* open(const char* path)
+    {
+        compact_table* table = new compact_table();
+
+        try
+        {
+            table->file.reset(new flat_table_file(path));
+            table->attach(table->file->data(), table->file->size(), path);
+        }
+        catch (...)
+        {
+            delete table;
+            throw;
+        }
+        return table;
+    }
+
+    /** @brief Finds the value of a key.
+     *
+     *  @param[in] key The key.
+     *  @return Returns the value, or NULL if the key is not in the table.
+     *    For a key not in the table, the value of another key is returned
+     *    with a probability of 2^-bits of F.
+     */
+    const V* find(const K& key) const
+    {
+        if (slot_count == 0)
+            return NULL;
+
+        uint64_t hash = perfect_hash_key(key);
+        uint64_t index = function.index(hash);
+
+        return fingerprints[index] == fingerprint(hash) ? &values[index] : NULL;
+    }
+
+    std::size_t size() const
+    {
+        return slot_count;
+    }
+
+    /** @brief Gets the memory taken by the table, in bytes per key.
+     */
+    double bytes_per_key() const
+    {
+        return function.bits_per_key() / 8 + sizeof(F) + sizeof(V);
+    }
+
+private:
+    compact_table() :
+        file(),
+        fingerprints(NULL),
+        values(NULL),
+        slot_count(0)
+    {
+    }
+
+    /** @brief Derives the fingerprint from bits of the hash the perfect hash
+     *    function does not depend on alone.
+     */
+    static F fingerprint(uint64_t hash)
+    {
+        return (F) perfect_hash_mix(hash ^ 0x5851f42d4c957f2dULL);
+    }
+
+    /** @brief Computes the layout signature of V.
+     */
+    static uint64_t layout()
+    {
+        return flat_layout_signature<flat_table_traits<V, void> >();
+    }
+
+    static std::size_t align(std::size_t offset)
+    {
+        return (offset + 63) & ~(std::size_t) 63;
+    }
+
+    static void pad(std::ostream& out, std::size_t from, std::size_t to)
+    {
+        for (; from < to; from++)
+            out.put('\0');
+    }
+
+    /** @brief Validates the header, reads the hash function and points the
+     *    table at its fingerprints and values.
+     */
+    void attach(const char* base, std::size_t length, const char* path)
+    {
+        compact_table_header header;
+
+        if (length < sizeof(header))
+            invalid(path, "file too short");
+        std::memcpy(&header, base, sizeof(header));
+        if (header.magic != compact_table_magic)
+            invalid(path, "not a compact table");
+        if (header.version != compact_table_version)
+            invalid(path, "unsupported version");
+        if (header.value_size != sizeof(V) || header.layout != layout() ||
+            header.fingerprint_size != sizeof(F))
+            invalid(path, "value layout does not match");
+        if (header.function_offset % 64 != 0 || header.fingerprint_offset % 64 != 0 ||
+            header.value_offset % 64 != 0 || header.function_offset > header.fingerprint_offset ||
+            header.size > length ||
+            header.fingerprint_offset + header.size * sizeof(F) > header.value_offset ||
+            header.value_offset + header.size * sizeof(V) > header.file_size ||
+            header.file_size > length)
+            invalid(path, "truncated or corrupt");
+        if (function.read(base + header.function_offset,
+                          header.fingerprint_offset - header.function_offset) == 0 ||
+            function.size() != header.size)
+            invalid(path, "corrupt hash function");
+
+        fingerprints = reinterpret_cast<const F*>(base + header.fingerprint_offset);
+        values = reinterpret_cast<const V*>(base + header.value_offset);
+        slot_count = header.size;
+    }
+
+    static void invalid(const char* path, const char* what)
+    {
+        throw std::runtime_error(std::string("compact table ") + path + ": " + what);
+    }
+
+    boost::scoped_ptr<flat_table_file> file;
+    perfect_hash function;
+    const F* fingerprints;
+    const V* values;
+    std::size_t slot_count;
+};
+
+}}
+
+#endif
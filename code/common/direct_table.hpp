@@ -0,0 +1,304 @@
+/** @file common/direct_table.hpp
+ *  Read only tables over small, dense integer key spaces, such as shipping
+ *  service ids. Values are stored in an array indexed by the key, and a
+ *  bitmap tells which keys are present, so a lookup is a subtraction, a bit
+ *  test and one load, with no hashing and no probing.
+ */
+
+#ifndef EBAY_COMMON_DIRECT_TABLE_HPP
+#define EBAY_COMMON_DIRECT_TABLE_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "common/flat_table.hpp"
+
+namespace ebay { namespace common
+{
+
+/*
+ * File layout, all offsets from the start of the file and 64 byte aligned:
+ *
+ *   direct_table_header
+ *   uint64_t[(span + 63) / 64]         presence bitmap, bit i for key first_key + i
+ *   V[span]                            the values, copied byte for byte
+ */
+
+/* "EBDIRECT" read as a little endian integer. */
+static const uint64_t direct_table_magic = 0x5443455249444245ULL;
+/* Bumped whenever the file layout changes. */
+static const uint32_t direct_table_version = 1;
+/* Largest key span a direct table is built for. */
+static const uint64_t direct_table_max_span = 1 << 20;
+/* Key spans up to this size are always dense enough. */
+static const uint64_t direct_table_small_span = 4096;
+/* Otherwise, at least one key in this many must be present. */
+static const uint64_t direct_table_max_spread = 4;
+
+/** @brief The @a direct_table_header struct starts every direct table file.
+ */
+struct direct_table_header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t value_size;
+    /* Signature of the offsets and sizes of every field of a value. */
+    uint64_t layout;
+    int64_t first_key;
+    uint64_t span;
+    uint64_t size;
+    uint64_t bitmap_offset;
+    uint64_t value_offset;
+    uint64_t file_size;
+};
+
+/** @brief @a direct_table maps integer keys to values of type V. Like the
+ *    flat tables, V must be a plain struct with a serialize() function.
+ */
+template <typename V>
+class direct_table : private boost::noncopyable
+{
+public:
+    typedef int64_t key_type;
+    typedef V mapped_type;
+
+    /** @brief Checks whether a file is in the direct table format.
+     *
+     *  @param[in] path The path of the file.
+     */
+    static bool is_direct_file(const char* path)
+    {
+        std::ifstream ifs(path, std::ios_base::binary);
+        uint64_t magic = 0;
+
+        ifs.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        return ifs && magic == direct_table_magic;
+    }
+
+    /** @brief Checks whether the keys of a range of entries are dense enough
+     *    for a direct table.
+     *
+     *  @param[in] first The first entry, a std::pair of an integer key and a V.
+     *  @param[in] last One past the last entry.
+     */
+    template <typename ForwardIterator>
+    static bool is_dense(ForwardIterator first, ForwardIterator last)
+    {
+        int64_t low;
+        int64_t high;
+        uint64_t count = 0;
+
+        if (!key_range(first, last, low, high))
+            return false;
+        for (; first != last; ++first)
+            count++;
+
+        uint64_t span = (uint64_t) (high - low) + 1;
+
+        return span <= direct_table_max_span &&
+               (span <= direct_table_small_span || span <= count * direct_table_max_spread);
+    }
+
+    /** @brief Writes a range of entries as a direct table file. Where keys
+     *    repeat the first entry wins.
+     *
+     *  @param[in] path The path of the file.
+     *  @param[in] first The first entry, a std::pair of an integer key and a V.
+     *  @param[in] last One past the last entry.
+     */
+    template <typename ForwardIterator>
+    static void save(const char* path, ForwardIterator first, ForwardIterator last)
+    {
+        direct_table_header header;
+        int64_t low = 0;
+        int64_t high = -1;
+
+        key_range(first, last, low, high);
+        std::memset(&header, 0, sizeof(header));
+        header.magic = direct_table_magic;
+        header.version = direct_table_version;
+        header.value_size = sizeof(V);
+        header.layout = layout();
+        header.first_key = low;
+        header.span = (uint64_t) (high - low + 1);
+        if (header.span > direct_table_max_span)
+            throw std::runtime_error(std::string("direct table: key span too large for ") + path);
+        header.bitmap_offset = align(sizeof(header));
+        header.value_offset = align(header.bitmap_offset + bitmap_words(header.span) * 8);
+        header.file_size = header.value_offset + header.span * sizeof(V);
+
+        std::vector<uint64_t> buffer((header.file_size + 7) / 8, 0);
+        char* base = reinterpret_cast<char*>(&buffer[0]);
+        uint64_t* bitmap = reinterpret_cast<uint64_t*>(base + header.bitmap_offset);
+        V* values = reinterpret_cast<V*>(base + header.value_offset);
+
+        for (; first != last; ++first)
+        {
+            uint64_t index = (uint64_t) ((int64_t) first->first - low);
+
+            if (bitmap[index >> 6] & (1ULL << (index & 63)))
+                continue;
+            bitmap[index >> 6] |= 1ULL << (index & 63);
+            std::memcpy(static_cast<void*>(&values[index]), &first->second, sizeof(V));
+            header.size++;
+        }
+        std::memcpy(base, &header, sizeof(header));
+
+        std::ofstream ofs(path, std::ios_base::binary);
+
+        ofs.write(base, header.file_size);
+        if (!ofs)
+            throw std::runtime_error(std::string("direct table: cannot write ") + path);
+    }
+
+    /** @brief Maps a direct table file.
+     *
+     *  @param[in] path The path of the file.
+     *  @return Returns a new table, owned by the caller.
+     */
+    static direct_table* open(const char* path)
+    {
+        direct_table* table = new direct_table();
+
+        try
+        {
+            table->file.reset(new flat_table_file(path));
+            table->attach(table->file->data(), table->file->size(), path);
+        }
+        catch (...)
+        {
+            delete table;
+            throw;
+        }
+        return table;
+    }
+
+    /** @brief Finds the value of a key.
+     *
+     *  @param[in] key The key to look for.
+     *  @return Returns the value, or NULL if the key is not in the table.
+     */
+    const V* find(int64_t key) const
+    {
+        uint64_t index = (uint64_t) (key - first_key);
+
+        if (index >= span || (bitmap[index >> 6] & (1ULL << (index & 63))) == 0)
+            return NULL;
+        return values + index;
+    }
+
+    /** @brief Prefetches the presence bit and the value of a key.
+     */
+    void prefetch(int64_t key) const
+    {
+        uint64_t index = (uint64_t) (key - first_key);
+
+        if (index < span)
+        {
+            __builtin_prefetch(bitmap + (index >> 6));
+            __builtin_prefetch(values + index);
+        }
+    }
+
+    std::size_t size() const
+    {
+        return entry_count;
+    }
+
+private:
+    direct_table() :
+        file(),
+        bitmap(NULL),
+        values(NULL),
+        first_key(0),
+        span(0),
+        entry_count(0)
+    {
+    }
+
+    /** @brief Gets the smallest and the largest key of a range of entries.
+     *
+     *  @return Returns @a false if the range is empty.
+     */
+    template <typename ForwardIterator>
+    static bool key_range(ForwardIterator first, ForwardIterator last, int64_t& low, int64_t& high)
+    {
+        if (first == last)
+            return false;
+        low = high = (int64_t) first->first;
+        for (++first; first != last; ++first)
+        {
+            low = std::min(low, (int64_t) first->first);
+            high = std::max(high, (int64_t) first->first);
+        }
+        return true;
+    }
+
+    /** @brief Computes the layout signature of V.
+     */
+    static uint64_t layout()
+    {
+        return flat_layout_signature<flat_table_traits<V, void> >();
+    }
+
+    static std::size_t align(std::size_t offset)
+    {
+        return (offset + 63) & ~(std::size_t) 63;
+    }
+
+    static std::size_t bitmap_words(uint64_t span)
+    {
+        return (span + 63) / 64;
+    }
+
+    /** @brief Validates the header and points the table at its regions.
+     */
+    void attach(const char* base, std::size_t length, const char* path)
+    {
+        direct_table_header header;
+
+        if (length < sizeof(header))
+            invalid(path, "file too short");
+        std::memcpy(&header, base, sizeof(header));
+        if (header.magic != direct_table_magic)
+            invalid(path, "not a direct table");
+        if (header.version != direct_table_version)
+            invalid(path, "unsupported version");
+        if (header.value_size != sizeof(V) || header.layout != layout())
+            invalid(path, "value layout does not match");
+        if (header.span > direct_table_max_span || header.size > header.span ||
+            header.bitmap_offset % 64 != 0 || header.value_offset % 64 != 0 ||
+            header.bitmap_offset + bitmap_words(header.span) * 8 > header.value_offset ||
+            header.value_offset + header.span * sizeof(V) > header.file_size ||
+            header.file_size > length)
+            invalid(path, "truncated or corrupt");
+
+        bitmap = reinterpret_cast<const uint64_t*>(base + header.bitmap_offset);
+        values = reinterpret_cast<const V*>(base + header.value_offset);
+        first_key = header.first_key;
+        span = header.span;
+        entry_count = header.size;
+    }
+
+    static void invalid(const char* path, const char* what)
+    {
+        throw std::runtime_error(std::string("direct table ") + path + ": " + what);
+    }
+
+    boost::scoped_ptr<flat_table_file> file;
+    const uint64_t* bitmap;
+    const V* values;
+    int64_t first_key;
+    uint64_t span;
+    std::size_t entry_count;
+};
+
+}}
+
+#endif
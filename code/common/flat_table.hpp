@@ -0,0 +1,753 @@
+/** @file common/flat_table.hpp
+ *  Read only hash table stored in a flat, position independent file format.
+ *  Tables are written once by the table builders and memory mapped by the
+ *  macros, which query them in place: loading does no deserialization and no
+ *  allocation, and every process on a host shares the same page cache copy.
+ */
+
+#ifndef EBAY_COMMON_FLAT_TABLE_HPP
+#define EBAY_COMMON_FLAT_TABLE_HPP
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/type_traits/is_arithmetic.hpp>
+#include <boost/mpl/bool.hpp>
+#include <boost/serialization/nvp.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace ebay { namespace common
+{
+
+/*
+ * File layout, all offsets from the start of the file and 64 byte aligned:
+ *
+ *   flat_table_header
+ *   uint8_t[bucket_count]              control bytes, in groups of 16
+ *   uint32_t[bucket_count]             entry index of every full bucket
+ *   value_type[size]                   the entries, copied byte for byte
+ *
+ * The index is open addressing over groups of 16 buckets. A control byte is
+ * either empty or holds seven bits of the key hash, so a lookup compares the
+ * whole group with one SIMD compare and only touches the entries whose bits
+ * match. Probing moves on to the next group until one has an empty bucket.
+ *
+ * Entries are stored in the native representation of the machine that built
+ * the table, so builder and server must share the architecture. The layout
+ * signature in the header catches any difference in the key or value structs.
+ */
+
+/* "EBFLATTB" read as a little endian integer. */
+static const uint64_t flat_table_magic = 0x4254544c41464245ULL;
+/* Bumped whenever the file layout or the key hash changes. */
+static const uint32_t flat_table_version = 2;
+/* Number of buckets matched at once. */
+static const std::size_t flat_table_group_width = 16;
+/* Control byte of an empty bucket; full buckets hold a value below it. */
+static const uint8_t flat_table_empty = 0x80;
+
+/** @brief The @a flat_table_header struct starts every flat table file.
+ */
+struct flat_table_header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    /* Signature of the offsets and sizes of every field of an entry. */
+    uint64_t layout;
+    uint64_t size;
+    uint64_t bucket_count;
+    uint64_t control_offset;
+    uint64_t slot_offset;
+    uint64_t entry_offset;
+    uint64_t file_size;
+};
+
+/** @brief Compares a byte against a group of control bytes.
+ *
+ *  @param[in] group The first of @a flat_table_group_width control bytes.
+ *  @param[in] byte The byte to look for.
+ *  @return Returns a mask with bit i set if control byte i equals @a byte.
+ */
+inline uint32_t flat_table_match(const uint8_t* group, uint8_t byte)
+{
+#ifdef __SSE2__
+    __m128i controls = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(controls,
+                                                       _mm_set1_epi8((char) byte)));
+#else
+    uint32_t mask = 0;
+
+    for (std::size_t i = 0; i < flat_table_group_width; i++)
+    {
+        if (group[i] == byte)
+            mask |= (uint32_t) 1 << i;
+    }
+    return mask;
+#endif
+}
+
+/** @brief Mixes a value into a 64 bit hash.
+ */
+inline uint64_t flat_table_mix(uint64_t hash, uint64_t value)
+{
+    hash = (hash ^ value) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 29);
+}
+
+/** @brief The @a flat_hash_archive class hashes a key through its Boost
+ *    serialize() function.
+ *
+ *    The hash only depends on the values and the order of the serialized
+ *    fields, which the builders and the macros already have to agree on to
+ *    read each other's archives. It is independent of padding and of the
+ *    hash_value() functions, which are free to differ between them.
+ */
+class flat_hash_archive
+{
+public:
+    typedef boost::mpl::true_ is_saving;
+    typedef boost::mpl::false_ is_loading;
+
+    flat_hash_archive() :
+        hash(0x2545f4914f6cdd1dULL)
+    {
+    }
+
+    template <typename T>
+    flat_hash_archive& operator&(const T& t)
+    {
+        add(t, boost::is_arithmetic<T>());
+        return *this;
+    }
+
+    template <typename T>
+    flat_hash_archive& operator<<(const T& t)
+    {
+        return *this & t;
+    }
+
+    template <typename T>
+    flat_hash_archive& operator&(const boost::serialization::nvp<T>& t)
+    {
+        return *this & t.const_value();
+    }
+
+    /** @brief Gets the hash of everything added so far.
+     */
+    uint64_t value() const
+    {
+        uint64_t h = hash;
+
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        return h ^ (h >> 33);
+    }
+
+private:
+    template <typename T>
+    void add(const T& t, boost::mpl::true_)
+    {
+        hash = flat_table_mix(hash, (uint64_t) (int64_t) t);
+    }
+
+    template <typename T>
+    void add(const T& t, boost::mpl::false_)
+    {
+        const_cast<T&>(t).serialize(*this, 0);
+    }
+
+    uint64_t hash;
+};
+
+/** @brief The @a flat_layout_archive class computes the signature of the
+ *    memory layout of a struct through its Boost serialize() function.
+ */
+class flat_layout_archive
+{
+public:
+    typedef boost::mpl::true_ is_saving;
+    typedef boost::mpl::false_ is_loading;
+
+    /** @brief Constructs a @a flat_layout_archive object.
+     *
+     *  @param[in] base The address of the struct being walked.
+     *  @param[in] size The size of the struct being walked.
+     */
+    flat_layout_archive(const void* base, std::size_t size) :
+        base(static_cast<const char*>(base)),
+        hash(flat_table_mix(0, size))
+    {
+    }
+
+    template <typename T>
+    flat_layout_archive& operator&(const T& t)
+    {
+        add(t, boost::is_arithmetic<T>());
+        return *this;
+    }
+
+    template <typename T>
+    flat_layout_archive& operator<<(const T& t)
+    {
+        return *this & t;
+    }
+
+    template <typename T>
+    flat_layout_archive& operator&(const boost::serialization::nvp<T>& t)
+    {
+        return *this & t.const_value();
+    }
+
+    uint64_t value() const
+    {
+        return hash;
+    }
+
+private:
+    template <typename T>
+    void add(const T& t, boost::mpl::true_)
+    {
+        hash = flat_table_mix(hash, (uint64_t) (reinterpret_cast<const char*>(&t) - base));
+        hash = flat_table_mix(hash, sizeof(T));
+    }
+
+    template <typename T>
+    void add(const T& t, boost::mpl::false_)
+    {
+        const_cast<T&>(t).serialize(*this, 0);
+    }
+
+    const char* base;
+    uint64_t hash;
+};
+
+/** @brief Entry policy of a @a flat_table mapping keys to values.
+ */
+template <typename K, typename V>
+struct flat_table_traits
+{
+    typedef std::pair<K, V> value_type;
+
+    static const K& key(const value_type& value)
+    {
+        return value.first;
+    }
+
+    template <typename A>
+    static void walk(A& ar, const value_type& value)
+    {
+        ar & value.first;
+        ar & value.second;
+    }
+};
+
+/** @brief Entry policy of a @a flat_table holding keys only.
+ */
+template <typename K>
+struct flat_table_traits<K, void>
+{
+    typedef K value_type;
+
+    static const K& key(const value_type& value)
+    {
+        return value;
+    }
+
+    template <typename A>
+    static void walk(A& ar, const value_type& value)
+    {
+        ar & value;
+    }
+};
+
+/** @brief Computes the layout signature of the entries of a table, walking
+ *    a value initialised entry with the walk() function of its policy.
+ */
+template <typename Traits>
+uint64_t flat_layout_signature()
+{
+    typename Traits::value_type probe = typename Traits::value_type();
+    flat_layout_archive ar(&probe, sizeof(probe));
+
+    Traits::walk(ar, probe);
+    return ar.value();
+}
+
+/** @brief The @a flat_table_file class holds a read only memory mapping of a
+ *    whole file.
+ */
+class flat_table_file : private boost::noncopyable
+{
+public:
+    /** @brief Maps a file.
+     *
+     *  @param[in] path The path of the file.
+     */
+    explicit flat_table_file(const char* path) :
+        address(MAP_FAILED),
+        length(0)
+    {
+        int fd = ::open(path, O_RDONLY);
+        struct stat st;
+
+        if (fd < 0)
+            fail("cannot open", path);
+        if (::fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            fail("cannot map empty or unreadable", path);
+        }
+        length = st.st_size;
+        address = ::mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED)
+            fail("cannot map", path);
+        ::madvise(address, length, MADV_WILLNEED);
+    }
+
+    ~flat_table_file()
+    {
+        if (address != MAP_FAILED)
+            ::munmap(address, length);
+    }
+
+    const char* data() const
+    {
+        return static_cast<const char*>(address);
+    }
+
+    std::size_t size() const
+    {
+        return length;
+    }
+
+private:
+    static void fail(const char* what, const char* path)
+    {
+        throw std::runtime_error(std::string("flat table: ") + what + " " + path +
+                                 ": " + std::strerror(errno));
+    }
+
+    void* address;
+    std::size_t length;
+};
+
+/** @brief @a flat_table is a read only hash table over the flat file format.
+ *
+ *    A table either maps a flat file, or owns an in memory copy of the same
+ *    bytes when it is converted from a Boost unordered container. Lookups are
+ *    the same in both cases, and return pointers into the entries, which play
+ *    the part of const iterators.
+ *
+ *    @a flat_table<K, V> maps keys to values, @a flat_table<K> holds keys only.
+ *    Keys and values must be plain structs: they are copied byte for byte, and
+ *    their serialize() functions are used for the key hash and the layout
+ *    signature.
+ */
+template <typename K, typename V = void>
+class flat_table : private boost::noncopyable
+{
+public:
+    typedef flat_table_traits<K, V> traits;
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef typename traits::value_type value_type;
+    typedef const value_type* const_iterator;
+    typedef const_iterator iterator;
+
+    /** @brief Checks whether a file is in the flat table format.
+     *
+     *  @param[in] path The path of the file.
+     */
+    static bool is_flat_file(const char* path)
+    {
+        std::ifstream ifs(path, std::ios_base::binary);
+        uint64_t magic = 0;
+
+        ifs.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        return ifs && magic == flat_table_magic;
+    }
+
+    /** @brief Maps a flat table file.
+     *
+     *  @param[in] path The path of the file.
+     *  @return Returns a new table, owned by the caller.
+     */
+    static flat_table* open(const char* path)
+    {
+        return open(path, 0);
+    }
+
+    /** @brief Maps a flat table that follows a header of another format in
+     *    a file.
+     *
+     *  @param[in] path The path of the file.
+     *  @param[in] offset Where the table starts, a multiple of 64.
+     *  @return Returns a new table, owned by the caller.
+     */
+    static flat_table* open(const char* path, std::size_t offset)
+    {
+        flat_table* table = new flat_table();
+
+        try
+        {
+            table->file.reset(new flat_table_file(path));
+            if (offset % 64 != 0 || offset > table->file->size())
+                invalid(path, "bad table offset");
+            table->attach(table->file->data() + offset, table->file->size() - offset, path);
+        }
+        catch (...)
+        {
+            delete table;
+            throw;
+        }
+        return table;
+    }
+
+    /** @brief Creates an in memory table from a range of entries. Where keys
+     *    repeat the first entry wins, as with insert() on a Boost map.
+     *
+     *  @return Returns a new table, owned by the caller.
+     */
+    template <typename InputIterator>
+    static flat_table* create(InputIterator first, InputIterator last)
+    {
+        flat_table* table = new flat_table();
+
+        build(first, last, table->owned);
+        table->attach(reinterpret_cast<const char*>(&table->owned[0]),
+                      table->owned.size() * sizeof(uint64_t), "(memory)");
+        return table;
+    }
+
+    /** @brief Creates an in memory table from a Boost map or set.
+     */
+    template <typename C>
+    static flat_table* create(const C& container)
+    {
+        return create(container.begin(), container.end());
+    }
+
+    /** @brief Writes a range of entries as a flat table file.
+     *
+     *  @param[in] path The path of the file.
+     */
+    template <typename InputIterator>
+    static void save(const char* path, InputIterator first, InputIterator last)
+    {
+        std::ofstream ofs(path, std::ios_base::binary);
+
+        save(ofs, first, last);
+        if (!ofs)
+            throw std::runtime_error(std::string("flat table: cannot write ") + path);
+    }
+
+    /** @brief Writes a range of entries as a flat table to a stream.
+     */
+    template <typename InputIterator>
+    static void save(std::ostream& os, InputIterator first, InputIterator last)
+    {
+        std::vector<uint64_t> buffer;
+
+        build(first, last, buffer);
+
+        const flat_table_header* header =
+            reinterpret_cast<const flat_table_header*>(&buffer[0]);
+
+        os.write(reinterpret_cast<const char*>(&buffer[0]), header->file_size);
+    }
+
+    /** @brief Writes a Boost map or set as a flat table file.
+     */
+    template <typename C>
+    static void save(const char* path, const C& container)
+    {
+        save(path, container.begin(), container.end());
+    }
+
+    /** @brief Finds the entry for a key.
+     *
+     *  @param[in] key The key to look for.
+     *  @return Returns the entry, or end() if the key is not in the table.
+     */
+    const_iterator find(const K& key) const
+    {
+        return find(key, hash_key(key));
+    }
+
+    /** @brief Finds the entry for a key whose hash is already known.
+     *
+     *  @param[in] key The key to look for.
+     *  @param[in] hash The hash of the key, as returned by prefetch().
+     *  @return Returns the entry, or end() if the key is not in the table.
+     */
+    const_iterator find(const K& key, uint64_t hash) const
+    {
+        uint8_t tag = control_tag(hash);
+
+        for (std::size_t group = hash & group_mask; ; group = (group + 1) & group_mask)
+        {
+            std::size_t first = group * flat_table_group_width;
+            const uint8_t* control = controls + first;
+
+            for (uint32_t match = flat_table_match(control, tag); match != 0;
+                 match &= match - 1)
+            {
+                const value_type* entry = entries + slots[first + __builtin_ctz(match)];
+
+                if (traits::key(*entry) == key)
+                    return entry;
+            }
+            if (flat_table_match(control, flat_table_empty) != 0)
+                return end();
+        }
+    }
+
+    /** @brief Hashes a key and prefetches the index group its lookup starts
+     *    at. The first step of a lookup split into stages, so that the cache
+     *    misses of several lookups overlap.
+     *
+     *  @param[in] key The key that will be looked up.
+     *  @return Returns the hash of the key.
+     */
+    uint64_t prefetch(const K& key) const
+    {
+        uint64_t hash = hash_key(key);
+        std::size_t first = (hash & group_mask) * flat_table_group_width;
+
+        __builtin_prefetch(controls + first);
+        __builtin_prefetch(slots + first);
+        return hash;
+    }
+
+    /** @brief Prefetches the first entry that may hold a key, once its index
+     *    group is in cache. The second step of a staged lookup.
+     *
+     *  @param[in] hash The hash returned by prefetch().
+     */
+    void prefetch_entry(uint64_t hash) const
+    {
+        std::size_t first = (hash & group_mask) * flat_table_group_width;
+        uint32_t match = flat_table_match(controls + first, control_tag(hash));
+
+        if (match != 0)
+            __builtin_prefetch(entries + slots[first + __builtin_ctz(match)]);
+    }
+
+    std::size_t count(const K& key) const
+    {
+        return find(key) != end();
+    }
+
+    const_iterator begin() const
+    {
+        return entries;
+    }
+
+    const_iterator end() const
+    {
+        return entries + entry_count;
+    }
+
+    std::size_t size() const
+    {
+        return entry_count;
+    }
+
+    bool empty() const
+    {
+        return entry_count == 0;
+    }
+
+    std::size_t bucket_count() const
+    {
+        return (group_mask + 1) * flat_table_group_width;
+    }
+
+    /** @brief Hashes a key, the same way in the builders and the macros.
+     */
+    static uint64_t hash_key(const K& key)
+    {
+        flat_hash_archive ar;
+
+        ar & key;
+        return ar.value();
+    }
+
+    /** @brief Computes the layout signature of value_type.
+     */
+    static uint64_t layout()
+    {
+        return flat_layout_signature<traits>();
+    }
+
+private:
+    flat_table() :
+        file(),
+        owned(),
+        controls(NULL),
+        slots(NULL),
+        entries(NULL),
+        entry_count(0),
+        group_mask(0)
+    {
+    }
+
+    /** @brief Gets the control byte of a full bucket, seven bits of the hash
+     *    that are not used to pick the group.
+     */
+    static uint8_t control_tag(uint64_t hash)
+    {
+        return (uint8_t) (hash >> 57);
+    }
+
+    static std::size_t align(std::size_t offset)
+    {
+        return (offset + 63) & ~(std::size_t) 63;
+    }
+
+    template <typename InputIterator>
+    static void build(InputIterator first, InputIterator last,
+                      std::vector<uint64_t>& buffer)
+    {
+        std::size_t count = std::distance(first, last);
+        std::size_t group_count = 1;
+
+        /* Keep the load factor at or below seven eighths. */
+        while (group_count * flat_table_group_width * 7 < count * 8 ||
+               group_count * flat_table_group_width <= count)
+            group_count *= 2;
+
+        std::size_t bucket_count = group_count * flat_table_group_width;
+        flat_table_header header;
+
+        std::memset(&header, 0, sizeof(header));
+        header.magic = flat_table_magic;
+        header.version = flat_table_version;
+        header.entry_size = sizeof(value_type);
+        header.layout = layout();
+        header.bucket_count = bucket_count;
+        header.control_offset = align(sizeof(flat_table_header));
+        header.slot_offset = align(header.control_offset + bucket_count);
+        header.entry_offset = align(header.slot_offset + bucket_count * sizeof(uint32_t));
+        header.file_size = header.entry_offset + count * sizeof(value_type);
+        buffer.assign((header.file_size + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+
+        char* base = reinterpret_cast<char*>(&buffer[0]);
+        uint8_t* controls = reinterpret_cast<uint8_t*>(base + header.control_offset);
+        uint32_t* slots = reinterpret_cast<uint32_t*>(base + header.slot_offset);
+        value_type* entries = reinterpret_cast<value_type*>(base + header.entry_offset);
+        std::size_t group_mask = group_count - 1;
+
+        std::memset(controls, flat_table_empty, bucket_count);
+        for (; first != last; ++first)
+        {
+            value_type entry(*first);
+            uint64_t hash = hash_key(traits::key(entry));
+            uint8_t tag = control_tag(hash);
+            bool repeated = false;
+            std::size_t group = hash & group_mask;
+
+            /* A repeated key can only sit in the groups probed before the first gap. */
+            for (; ; group = (group + 1) & group_mask)
+            {
+                std::size_t first_bucket = group * flat_table_group_width;
+
+                for (uint32_t match = flat_table_match(controls + first_bucket, tag);
+                     match != 0 && !repeated; match &= match - 1)
+                {
+                    const value_type& other =
+                        entries[slots[first_bucket + __builtin_ctz(match)]];
+
+                    repeated = traits::key(other) == traits::key(entry);
+                }
+                if (repeated ||
+                    flat_table_match(controls + first_bucket, flat_table_empty) != 0)
+                    break;
+            }
+            if (repeated)
+                continue;
+
+            std::size_t bucket = group * flat_table_group_width +
+                __builtin_ctz(flat_table_match(controls + group * flat_table_group_width,
+                                               flat_table_empty));
+
+            std::memcpy(static_cast<void*>(&entries[header.size]), &entry, sizeof(entry));
+            controls[bucket] = tag;
+            slots[bucket] = (uint32_t) header.size++;
+        }
+        std::memcpy(base, &header, sizeof(header));
+    }
+
+    /** @brief Validates the header and points the table at its regions.
+     */
+    void attach(const char* base, std::size_t length, const char* path)
+    {
+        flat_table_header header;
+
+        if (length < sizeof(header))
+            invalid(path, "file too short");
+        std::memcpy(&header, base, sizeof(header));
+        if (header.magic != flat_table_magic)
+            invalid(path, "not a flat table");
+        if (header.version != flat_table_version)
+            invalid(path, "unsupported version");
+        if (header.entry_size != sizeof(value_type) || header.layout != layout())
+            invalid(path, "entry layout does not match");
+        if (header.bucket_count < flat_table_group_width ||
+            (header.bucket_count & (header.bucket_count - 1)) != 0 ||
+            header.size >= header.bucket_count)
+            invalid(path, "bad bucket count");
+        if (header.control_offset % 64 != 0 || header.slot_offset % 64 != 0 ||
+            header.entry_offset % 64 != 0 ||
+            header.control_offset + header.bucket_count > header.slot_offset ||
+            header.slot_offset + header.bucket_count * sizeof(uint32_t) >
+                header.entry_offset ||
+            header.entry_offset + header.size * sizeof(value_type) > header.file_size ||
+            header.file_size > length)
+            invalid(path, "truncated or corrupt");
+
+        controls = reinterpret_cast<const uint8_t*>(base + header.control_offset);
+        slots = reinterpret_cast<const uint32_t*>(base + header.slot_offset);
+        entries = reinterpret_cast<const value_type*>(base + header.entry_offset);
+        entry_count = header.size;
+        group_mask = header.bucket_count / flat_table_group_width - 1;
+    }
+
+    static void invalid(const char* path, const char* what)
+    {
+        throw std::runtime_error(std::string("flat table ") + path + ": " + what);
+    }
+
+    /* The mapped file, or NULL for an in memory table. */
+    boost::scoped_ptr<flat_table_file> file;
+    /* The bytes of an in memory table, as 64 bit words to keep them aligned. */
+    std::vector<uint64_t> owned;
+    const uint8_t* controls;
+    const uint32_t* slots;
+    const value_type* entries;
+    std::size_t entry_count;
+    std::size_t group_mask;
+};
+
+}}
+
+#endif
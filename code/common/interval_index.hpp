@@ -0,0 +1,236 @@
+/** @file common/interval_index.hpp
+ *  Sorted interval index mapping (country, postcode) to the value of the
+ *  postcode range containing it. Ranges are stored once instead of once per
+ *  postcode, and searched with a branchless walk over an Eytzinger layout.
+ */
+
+#ifndef EBAY_COMMON_INTERVAL_INDEX_HPP
+#define EBAY_COMMON_INTERVAL_INDEX_HPP
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdint.h>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/utility.hpp>
+
+namespace ebay { namespace common
+{
+
+/** @brief @a interval_index maps every postcode of a set of disjoint
+ *    [begin, end] ranges, per country, to a value.
+ *
+ *    Ranges are added with insert() and laid out with create(). Where ranges
+ *    overlap the range inserted first wins, the same as inserting every
+ *    postcode of every range into an unordered_map.
+ *
+ *    Range starts are stored in Eytzinger (breadth first) order, so the first
+ *    levels of every search share the same few cache lines, and the search
+ *    loop has no data dependent branches.
+ */
+template <typename V>
+class interval_index
+{
+public:
+    typedef V mapped_type;
+
+    interval_index() :
+        starts(1, 0),
+        ends(1, 0),
+        values(1, V()),
+        pending()
+    {
+    }
+
+    /** @brief Adds a range. Only valid before create().
+     *
+     *  @param[in] country_id The country id.
+     *  @param[in] begin The first postcode of the range.
+     *  @param[in] end The last postcode of the range.
+     *  @param[in] value The value every postcode in the range maps to.
+     */
+    void insert(int16_t country_id, int32_t begin, int32_t end, const V& value)
+    {
+        if (begin > end)
+            return;
+        pending.push_back(range(make_key(country_id, begin),
+                                make_key(country_id, end), value));
+    }
+
+    /** @brief Resolves overlaps between the inserted ranges and lays them out
+     *    for searching.
+     */
+    void create()
+    {
+        typedef std::map<int64_t, std::pair<int64_t, V> > covered_map;
+        covered_map covered;
+
+        for (std::size_t i = 0; i < pending.size(); i++)
+        {
+            int64_t begin = pending[i].begin;
+            int64_t end = pending[i].end;
+            typename covered_map::iterator it = covered.upper_bound(begin);
+
+            /* Skip past an earlier range that already covers the start. */
+            if (it != covered.begin())
+            {
+                typename covered_map::iterator prev = it;
+
+                --prev;
+                if (prev->second.first >= begin)
+                    begin = prev->second.first + 1;
+            }
+            /* Fill the gaps between earlier ranges. */
+            while (begin <= end)
+            {
+                it = covered.lower_bound(begin);
+
+                int64_t gap_end = (it == covered.end() || it->first > end) ?
+                    end : it->first - 1;
+
+                if (gap_end >= begin)
+                    covered.insert(std::make_pair(begin,
+                        std::make_pair(gap_end, pending[i].value)));
+                if (it == covered.end() || it->first > end)
+                    break;
+                begin = it->second.first + 1;
+            }
+        }
+        pending.clear();
+
+        /* Merge neighbours that map to the same value. */
+        std::vector<range> sorted;
+
+        for (typename covered_map::const_iterator it = covered.begin();
+             it != covered.end(); ++it)
+        {
+            if (!sorted.empty() && sorted.back().end + 1 == it->first &&
+                sorted.back().value == it->second.second)
+                sorted.back().end = it->second.first;
+            else
+                sorted.push_back(range(it->first, it->second.first, it->second.second));
+        }
+
+        starts.assign(sorted.size() + 1, 0);
+        ends.assign(sorted.size() + 1, 0);
+        values.assign(sorted.size() + 1, V());
+
+        std::size_t next = 0;
+
+        layout(sorted, next, 1);
+    }
+
+    /** @brief Finds the value of the range containing a postcode.
+     *
+     *  @param[in] country_id The country id.
+     *  @param[in] zip The postcode.
+     *  @return Returns the value, or NULL if no range contains the postcode.
+     */
+    const V* find(int16_t country_id, int32_t zip) const
+    {
+        int64_t key = make_key(country_id, zip);
+        std::size_t count = starts.size() - 1;
+        std::size_t k = 1;
+        std::size_t found = 0;
+
+        /*
+         * Walk down the implicit tree, remembering the last node we went right
+         * of. That is the largest start not greater than the key.
+         */
+        while (k <= count)
+        {
+            __builtin_prefetch(&starts[0] + std::min(k * 8, count));
+            std::size_t right = starts[k] <= key;
+
+            found = right ? k : found;
+            k = 2 * k + right;
+        }
+        if (found == 0 || key > ends[found])
+            return NULL;
+        return &values[found];
+    }
+
+    /** @brief Gets the number of ranges stored.
+     */
+    std::size_t size() const
+    {
+        return starts.size() - 1;
+    }
+
+    /** @brief Gets a stored range. Ranges come in no particular order.
+     *
+     *  @param[in] i The range, from 0 to size() - 1.
+     *  @param[out] country_id Receives the country id.
+     *  @param[out] begin Receives the first postcode of the range.
+     *  @param[out] end Receives the last postcode of the range.
+     *  @return Returns the value of the range.
+     */
+    const V& get_range(std::size_t i, int16_t& country_id, int32_t& begin, int32_t& end) const
+    {
+        country_id = (int16_t) ((starts[i + 1] + ((int64_t) 1 << 31)) >> 32);
+        begin = (int32_t) (starts[i + 1] - make_key(country_id, 0));
+        end = (int32_t) (ends[i + 1] - make_key(country_id, 0));
+        return values[i + 1];
+    }
+
+    /** @brief Serialization function used by Boost serialization.
+     *
+     *  @param[in,out] ar The Archive to read/write to.
+     *  @param[in] version Not used, but required by the interface.
+     */
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & starts;
+        ar & ends;
+        ar & values;
+    }
+
+private:
+    struct range
+    {
+        range(int64_t begin, int64_t end, const V& value) :
+            begin(begin),
+            end(end),
+            value(value)
+        {
+        }
+
+        int64_t begin;
+        int64_t end;
+        V value;
+    };
+
+    /** @brief Orders (country, postcode) pairs by country, then postcode.
+     */
+    static int64_t make_key(int16_t country_id, int32_t zip)
+    {
+        return (int64_t) country_id * ((int64_t) 1 << 32) + zip;
+    }
+
+    /** @brief Copies sorted ranges into Eytzinger order with an in-order walk.
+     */
+    void layout(const std::vector<range>& sorted, std::size_t& next, std::size_t k)
+    {
+        if (k >= starts.size())
+            return;
+        layout(sorted, next, 2 * k);
+        starts[k] = sorted[next].begin;
+        ends[k] = sorted[next].end;
+        values[k] = sorted[next].value;
+        next++;
+        layout(sorted, next, 2 * k + 1);
+    }
+
+    /* Range starts, ends and values in Eytzinger order, slot 0 unused. */
+    std::vector<int64_t> starts;
+    std::vector<int64_t> ends;
+    std::vector<V> values;
+    /* Ranges inserted but not yet laid out. */
+    std::vector<range> pending;
+};
+
+}}
+
+#endif
@@ -0,0 +1,627 @@
+/** @file common/perfect_hash.hpp
+ *  Minimal perfect hashing for large, static key sets such as the seller
+ *  feature table. Keys are split into shards by their hash, and the shards
+ *  are built independently on a pool of threads, so building takes time and
+ *  temporary memory in proportion to the largest shard rather than to the
+ *  whole table.
+ */
+
+#ifndef EBAY_COMMON_PERFECT_HASH_HPP
+#define EBAY_COMMON_PERFECT_HASH_HPP
+
+#include <vector>
+#include <ostream>
+#include <cstring>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+#include <boost/config.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/utility.hpp>
+#include "common/flat_table.hpp"
+
+namespace ebay { namespace common
+{
+
+/* Keys per shard the builder aims for; a shard is built by one thread. */
+static const std::size_t perfect_hash_shard_keys = 1 << 15;
+/* Average number of keys sharing a pilot. */
+static const std::size_t perfect_hash_bucket_keys = 3;
+/* Seeds tried per shard before the build gives up. */
+static const uint32_t perfect_hash_max_seeds = 64;
+
+/** @brief Mixes a 64 bit value, the finalizer of MurmurHash3.
+ */
+inline uint64_t perfect_hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+/** @brief Maps 32 random bits to [0, range) without a division.
+ */
+inline uint32_t perfect_hash_range(uint32_t bits, uint32_t range)
+{
+    return (uint32_t) (((uint64_t) bits * range) >> 32);
+}
+
+/** @brief Hashes a key through its serialize() function, like the flat
+ *    tables do.
+ */
+template <typename K>
+inline uint64_t perfect_hash_key(const K& key)
+{
+    flat_hash_archive ar;
+
+    ar & key;
+    return ar.value();
+}
+
+/** @brief Runs f(begin, end) over [0, count), split across threads.
+ */
+template <typename F>
+void perfect_hash_parallel(std::size_t count, std::size_t threads, F f)
+{
+    boost::thread_group workers;
+    std::size_t chunk = (count + threads - 1) / std::max<std::size_t>(threads, 1);
+
+    if (chunk == 0)
+        return;
+    for (std::size_t begin = chunk; begin < count; begin += chunk)
+        workers.create_thread(boost::bind<void>(f, begin, std::min(count, begin + chunk)));
+    f(0, std::min(count, chunk));
+    workers.join_all();
+}
+
+/* Words perfect_hash::write() stores a shard entry as. */
+static const std::size_t perfect_hash_shard_words = 7;
+
+/** @brief The @a perfect_hash_shard struct locates one shard of a
+ *    @a perfect_hash.
+ */
+struct perfect_hash_shard
+{
+    perfect_hash_shard() :
+        offset(0),
+        size(0),
+        table_size(0),
+        bucket_offset(0),
+        bucket_count(0),
+        remap_offset(0),
+        seed(0)
+    {
+    }
+
+    /** @brief Serialization function used by Boost serialization.
+     *
+     *  @param[in,out] ar The Archive to read/write to.
+     *  @param[in] version Not used, but required by the interface.
+     */
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & offset;
+        ar & size;
+        ar & table_size;
+        ar & bucket_offset;
+        ar & bucket_count;
+        ar & remap_offset;
+        ar & seed;
+    }
+
+    /* Index of the first key of the shard. */
+    uint64_t offset;
+    uint32_t size;
+    /* Positions the pilots place keys at; the ones past size are remapped. */
+    uint32_t table_size;
+    uint64_t bucket_offset;
+    uint32_t bucket_count;
+    uint64_t remap_offset;
+    uint32_t seed;
+};
+
+/** @brief @a perfect_hash maps a static set of 64 bit key hashes one to one
+ *    onto [0, size()).
+ *
+ *    Every hash picks a shard from the shard directory, then one of the
+ *    shard's buckets, and the 16 bit pilot stored for the bucket moves its
+ *    keys to free positions of the shard. Pilots are searched bucket by
+ *    bucket, largest buckets first. The shard has slightly more positions
+ *    than keys so that the last buckets still find free ones, and the few
+ *    keys placed past the end are remapped to the positions left free.
+ *
+ *    A lookup reads the shard entry and a pilot, and, rarely, the remap
+ *    table. Hashes that were not in the set map to an arbitrary index.
+ */
+class perfect_hash
+{
+public:
+    perfect_hash() :
+        count(0)
+    {
+    }
+
+    /** @brief Builds the function over a set of hashes. Repeated hashes are
+     *    counted once.
+     *
+     *  @param[in] hashes The hashes.
+     *  @param[in] threads The number of shards built at once.
+     */
+    void build(const std::vector<uint64_t>& hashes, std::size_t threads)
+    {
+        std::size_t shard_count = hashes.size() / perfect_hash_shard_keys + 1;
+        std::vector<uint64_t> offsets(shard_count + 1, 0);
+        std::vector<uint64_t> sharded(hashes.size());
+
+        /* Counting sort of the hashes by shard. */
+        for (std::size_t i = 0; i < hashes.size(); i++)
+            offsets[shard_of(hashes[i], shard_count) + 1]++;
+        for (std::size_t i = 0; i < shard_count; i++)
+            offsets[i + 1] += offsets[i];
+        {
+            std::vector<uint64_t> next(offsets.begin(), offsets.end() - 1);
+
+            for (std::size_t i = 0; i < hashes.size(); i++)
+                sharded[next[shard_of(hashes[i], shard_count)]++] = hashes[i];
+        }
+
+        std::vector<shard_build> builds(shard_count);
+        boost::atomic<std::size_t> next_shard(0);
+        boost::atomic<bool> failed(false);
+        boost::thread_group workers;
+
+        for (std::size_t i = 0; i < shard_count; i++)
+        {
+            builds[i].hashes = &sharded[offsets[i]];
+            builds[i].size = offsets[i + 1] - offsets[i];
+        }
+        for (std::size_t i = 1; i < std::max<std::size_t>(threads, 1); i++)
+            workers.create_thread(boost::bind(&perfect_hash::build_shards, &builds,
+                                              &next_shard, &failed));
+        build_shards(&builds, &next_shard, &failed);
+        workers.join_all();
+        if (failed)
+            throw std::runtime_error("perfect hash: no pilots found for a shard");
+
+        shards.assign(shard_count, perfect_hash_shard());
+        pilots.clear();
+        remap.clear();
+        count = 0;
+        for (std::size_t i = 0; i < shard_count; i++)
+        {
+            perfect_hash_shard& shard = shards[i];
+
+            shard.offset = count;
+            shard.size = builds[i].size;
+            shard.table_size = builds[i].table_size;
+            shard.bucket_offset = pilots.size();
+            shard.bucket_count = builds[i].pilots.size();
+            shard.remap_offset = remap.size();
+            shard.seed = builds[i].seed;
+            pilots.insert(pilots.end(), builds[i].pilots.begin(), builds[i].pilots.end());
+            remap.insert(remap.end(), builds[i].remap.begin(), builds[i].remap.end());
+            count += shard.size;
+            std::vector<uint16_t>().swap(builds[i].pilots);
+            std::vector<uint32_t>().swap(builds[i].remap);
+        }
+    }
+
+    /** @brief Gets the index of a hash of the set.
+     */
+    uint64_t index(uint64_t hash) const
+    {
+        const perfect_hash_shard& shard = shards[shard_of(hash, shards.size())];
+        uint64_t key = seeded(hash, shard.seed);
+        uint16_t pilot = pilots[shard.bucket_offset + bucket_of(key, shard.bucket_count)];
+        uint32_t position = position_of(key, pilot, shard.table_size);
+
+        if (BOOST_UNLIKELY(position >= shard.size))
+            position = remap[shard.remap_offset + position - shard.size];
+        return shard.offset + position;
+    }
+
+    /** @brief Gets the number of distinct hashes.
+     */
+    uint64_t size() const
+    {
+        return count;
+    }
+
+    /** @brief Gets the size of the function, in bits per hash.
+     */
+    double bits_per_key() const
+    {
+        std::size_t bytes = shards.size() * sizeof(perfect_hash_shard) +
+                            pilots.size() * sizeof(uint16_t) + remap.size() * sizeof(uint32_t);
+
+        return count == 0 ? 0 : 8.0 * bytes / count;
+    }
+
+    /** @brief Writes the function as raw words, for the table files that are
+     *    mapped rather than deserialized.
+     *
+     *  @param[out] out The stream to write to.
+     */
+    void write(std::ostream& out) const
+    {
+        uint64_t counts[4] = { count, shards.size(), pilots.size(), remap.size() };
+
+        out.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+        for (std::size_t i = 0; i < shards.size(); i++)
+        {
+            uint64_t fields[perfect_hash_shard_words] = {
+                shards[i].offset, shards[i].size, shards[i].table_size, shards[i].bucket_offset,
+                shards[i].bucket_count, shards[i].remap_offset, shards[i].seed };
+
+            out.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+        }
+        if (!pilots.empty())
+            out.write(reinterpret_cast<const char*>(&pilots[0]), pilots.size() * sizeof(uint16_t));
+        if (!remap.empty())
+            out.write(reinterpret_cast<const char*>(&remap[0]), remap.size() * sizeof(uint32_t));
+    }
+
+    /** @brief Reads a function written by write().
+     *
+     *  @param[in] data The first byte written.
+     *  @param[in] length The number of bytes available from data.
+     *  @return Returns the number of bytes read, or 0 if they do not hold a
+     *    whole function.
+     */
+    std::size_t read(const char* data, std::size_t length)
+    {
+        uint64_t counts[4];
+
+        if (length < sizeof(counts))
+            return 0;
+        std::memcpy(counts, data, sizeof(counts));
+        if (counts[1] > length || counts[2] > length || counts[3] > length)
+            return 0;
+
+        std::size_t total = sizeof(counts) + counts[1] * perfect_hash_shard_words * 8 +
+                            counts[2] * sizeof(uint16_t) + counts[3] * sizeof(uint32_t);
+
+        if (total > length)
+            return 0;
+        data += sizeof(counts);
+        count = counts[0];
+        shards.assign(counts[1], perfect_hash_shard());
+        for (std::size_t i = 0; i < shards.size(); i++, data += perfect_hash_shard_words * 8)
+        {
+            uint64_t fields[perfect_hash_shard_words];
+
+            std::memcpy(fields, data, sizeof(fields));
+            shards[i].offset = fields[0];
+            shards[i].size = (uint32_t) fields[1];
+            shards[i].table_size = (uint32_t) fields[2];
+            shards[i].bucket_offset = fields[3];
+            shards[i].bucket_count = (uint32_t) fields[4];
+            shards[i].remap_offset = fields[5];
+            shards[i].seed = (uint32_t) fields[6];
+        }
+        pilots.assign(counts[2], 0);
+        if (!pilots.empty())
+            std::memcpy(&pilots[0], data, pilots.size() * sizeof(uint16_t));
+        data += pilots.size() * sizeof(uint16_t);
+        remap.assign(counts[3], 0);
+        if (!remap.empty())
+            std::memcpy(&remap[0], data, remap.size() * sizeof(uint32_t));
+
+        /* Every shard has to stay within the pilots and the remap table. */
+        uint64_t offset = 0;
+
+        for (std::size_t i = 0; i < shards.size(); i++)
+        {
+            const perfect_hash_shard& shard = shards[i];
+
+            if (shard.offset != offset || shard.table_size < shard.size ||
+                shard.bucket_count == 0 || shard.bucket_offset + shard.bucket_count > pilots.size() ||
+                shard.remap_offset + (shard.table_size - shard.size) > remap.size())
+                return 0;
+            offset += shard.size;
+        }
+        return shards.empty() || offset != count ? 0 : total;
+    }
+
+    /** @brief Serialization function used by Boost serialization.
+     *
+     *  @param[in,out] ar The Archive to read/write to.
+     *  @param[in] version Not used, but required by the interface.
+     */
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & count;
+        ar & shards;
+        ar & pilots;
+        ar & remap;
+    }
+
+private:
+    /** @brief The @a shard_build struct holds one shard while it is built.
+     */
+    struct shard_build
+    {
+        shard_build() :
+            hashes(NULL),
+            size(0),
+            table_size(0),
+            seed(0)
+        {
+        }
+
+        uint64_t* hashes;
+        std::size_t size;
+        uint32_t table_size;
+        uint32_t seed;
+        std::vector<uint16_t> pilots;
+        std::vector<uint32_t> remap;
+    };
+
+    static std::size_t shard_of(uint64_t hash, std::size_t shard_count)
+    {
+        return perfect_hash_range((uint32_t) (hash >> 32), (uint32_t) shard_count);
+    }
+
+    static uint64_t seeded(uint64_t hash, uint32_t seed)
+    {
+        return perfect_hash_mix(hash ^ ((uint64_t) seed * 0x9e3779b97f4a7c15ULL));
+    }
+
+    static uint32_t bucket_of(uint64_t key, uint32_t bucket_count)
+    {
+        return perfect_hash_range((uint32_t) (key >> 32), bucket_count);
+    }
+
+    static uint32_t position_of(uint64_t key, uint16_t pilot, uint32_t table_size)
+    {
+        return perfect_hash_range(
+            (uint32_t) perfect_hash_mix(key ^ ((uint64_t) (pilot + 1) * 0xc2b2ae3d27d4eb4fULL)),
+            table_size);
+    }
+
+    static void build_shards(std::vector<shard_build>* builds,
+                             boost::atomic<std::size_t>* next_shard, boost::atomic<bool>* failed)
+    {
+        for (std::size_t i = (*next_shard)++; i < builds->size() && !*failed; i = (*next_shard)++)
+        {
+            if (!build_shard((*builds)[i]))
+                *failed = true;
+        }
+    }
+
+    /** @brief Searches the pilots of a shard, trying new seeds until every
+     *    bucket finds one.
+     */
+    static bool build_shard(shard_build& build)
+    {
+        /* Repeated hashes would always collide; keep one of each. */
+        std::sort(build.hashes, build.hashes + build.size);
+        build.size = std::unique(build.hashes, build.hashes + build.size) - build.hashes;
+        build.table_size = (uint32_t) (build.size + build.size / 64 + 1);
+
+        for (uint32_t seed = 0; seed < perfect_hash_max_seeds; seed++)
+        {
+            build.seed = seed;
+            if (try_seed(build))
+                return true;
+        }
+        return false;
+    }
+
+    static bool try_seed(shard_build& build)
+    {
+        uint32_t bucket_count = (uint32_t) (build.size / perfect_hash_bucket_keys + 1);
+        std::vector<uint64_t> keys(build.size);
+        std::vector<uint32_t> starts(bucket_count + 1, 0);
+        std::vector<uint32_t> order(bucket_count);
+        std::vector<bool> taken(build.table_size, false);
+        std::vector<uint32_t> positions;
+
+        /* Group the keys by bucket, then order the buckets largest first. */
+        for (std::size_t i = 0; i < build.size; i++)
+            starts[bucket_of(seeded(build.hashes[i], build.seed), bucket_count) + 1]++;
+        for (uint32_t b = 0; b < bucket_count; b++)
+            starts[b + 1] += starts[b];
+        {
+            std::vector<uint32_t> next(starts.begin(), starts.end() - 1);
+
+            for (std::size_t i = 0; i < build.size; i++)
+            {
+                uint64_t key = seeded(build.hashes[i], build.seed);
+
+                keys[next[bucket_of(key, bucket_count)]++] = key;
+            }
+        }
+        for (uint32_t b = 0; b < bucket_count; b++)
+            order[b] = b;
+        std::stable_sort(order.begin(), order.end(), larger_bucket(starts));
+
+        build.pilots.assign(bucket_count, 0);
+        for (uint32_t i = 0; i < bucket_count; i++)
+        {
+            uint32_t b = order[i];
+            uint32_t pilot = 0;
+
+            if (starts[b] == starts[b + 1])
+                break;
+            for (; pilot <= 0xffff; pilot++)
+            {
+                positions.clear();
+                for (uint32_t k = starts[b]; k < starts[b + 1]; k++)
+                {
+                    uint32_t position = position_of(keys[k], (uint16_t) pilot, build.table_size);
+
+                    if (taken[position] ||
+                        std::find(positions.begin(), positions.end(), position) != positions.end())
+                        break;
+                    positions.push_back(position);
+                }
+                if (positions.size() == starts[b + 1] - starts[b])
+                    break;
+            }
+            if (pilot > 0xffff)
+                return false;
+            build.pilots[b] = (uint16_t) pilot;
+            for (std::size_t k = 0; k < positions.size(); k++)
+                taken[positions[k]] = true;
+        }
+
+        /* Move the keys placed past the end to the positions left free. */
+        uint32_t free_position = 0;
+
+        build.remap.assign(build.table_size - build.size, 0);
+        for (uint32_t position = (uint32_t) build.size; position < build.table_size; position++)
+        {
+            if (!taken[position])
+                continue;
+            while (taken[free_position])
+                free_position++;
+            build.remap[position - build.size] = free_position++;
+        }
+        return true;
+    }
+
+    /** @brief Orders buckets by decreasing number of keys.
+     */
+    struct larger_bucket
+    {
+        explicit larger_bucket(const std::vector<uint32_t>& starts) :
+            starts(starts)
+        {
+        }
+
+        bool operator()(uint32_t a, uint32_t b) const
+        {
+            return starts[a + 1] - starts[a] > starts[b + 1] - starts[b];
+        }
+
+        const std::vector<uint32_t>& starts;
+    };
+
+    uint64_t count;
+    std::vector<perfect_hash_shard> shards;
+    std::vector<uint16_t> pilots;
+    std::vector<uint32_t> remap;
+};
+
+/** @brief @a perfect_hash_table is a static map stored in the order of a
+ *    @a perfect_hash over its keys, so that a lookup is one function
+ *    evaluation and one key comparison.
+ */
+template <typename K, typename V>
+class perfect_hash_table
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<K, V> value_type;
+    typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+    /** @brief Builds the table.
+     *
+     *  @param[in] values The entries. When a key is repeated, the first
+     *    entry is kept.
+     *  @param[in] threads The number of threads to build with.
+     */
+    void create(const std::vector<value_type>& values, std::size_t threads)
+    {
+        std::vector<uint64_t> hashes(values.size());
+        std::vector<uint64_t> indexes(values.size());
+
+        perfect_hash_parallel(values.size(), threads,
+                              boost::bind(&perfect_hash_table::hash_range, &values, &hashes,
+                                          _1, _2));
+        function.build(hashes, threads);
+        perfect_hash_parallel(values.size(), threads,
+                              boost::bind(&perfect_hash_table::index_range, &function, &hashes,
+                                          &indexes, _1, _2));
+
+        std::vector<bool> filled(function.size(), false);
+
+        entries.assign(function.size(), value_type());
+        for (std::size_t i = 0; i < values.size(); i++)
+        {
+            if (!filled[indexes[i]])
+            {
+                filled[indexes[i]] = true;
+                entries[indexes[i]] = values[i];
+            }
+            else if (!(entries[indexes[i]].first == values[i].first))
+                throw std::runtime_error("perfect hash table: two keys have the same hash");
+        }
+    }
+
+    const_iterator find(const K& key) const
+    {
+        if (entries.empty())
+            return entries.end();
+
+        const_iterator it = entries.begin() + function.index(perfect_hash_key(key));
+
+        return it->first == key ? it : entries.end();
+    }
+
+    const_iterator begin() const
+    {
+        return entries.begin();
+    }
+
+    const_iterator end() const
+    {
+        return entries.end();
+    }
+
+    std::size_t size() const
+    {
+        return entries.size();
+    }
+
+    /** @brief Gets the size of the hash function, in bits per key.
+     */
+    double bits_per_key() const
+    {
+        return function.bits_per_key();
+    }
+
+    /** @brief Serialization function used by Boost serialization.
+     *
+     *  @param[in,out] ar The Archive to read/write to.
+     *  @param[in] version Not used, but required by the interface.
+     */
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & function;
+        ar & entries;
+    }
+
+private:
+    static void hash_range(const std::vector<value_type>* values, std::vector<uint64_t>* hashes,
+                           std::size_t begin, std::size_t end)
+    {
+        for (std::size_t i = begin; i < end; i++)
+            (*hashes)[i] = perfect_hash_key((*values)[i].first);
+    }
+
+    static void index_range(const perfect_hash* function, const std::vector<uint64_t>* hashes,
+                            std::vector<uint64_t>* indexes, std::size_t begin, std::size_t end)
+    {
+        for (std::size_t i = begin; i < end; i++)
+            (*indexes)[i] = function->index((*hashes)[i]);
+    }
+
+    perfect_hash function;
+    std::vector<value_type> entries;
+};
+
+}}
+
+#endif
@@ -0,0 +1,759 @@
+/** @file common/prefix_match_index.hpp
+ *  Longest prefix match index over numeric postcode hashes. Postcodes are
+ *  matched by prefix the same way the delivery estimate macros strip digits
+ *  with integer division, but the lookup walks a compact digit trie instead of
+ *  probing a hash table once per candidate prefix.
+ */
+
+#ifndef EBAY_COMMON_PREFIX_MATCH_INDEX_HPP
+#define EBAY_COMMON_PREFIX_MATCH_INDEX_HPP
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <stdint.h>
+#include <boost/config.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/utility.hpp>
+
+namespace ebay { namespace common
+{
+
+/* Largest number of digits a non-negative int32_t has in base 10 or above. */
+static const std::size_t prefix_max_digits = 10;
+/* Largest base supported by the trie, one child bit per digit. */
+static const int32_t prefix_max_base = 64;
+
+/** @brief The @a prefix_key struct holds the digits of a postcode hash, most
+ *    significant first, in the base used for prefix matching. A prefix of the
+ *    digit string is exactly one of the values the macros used to get by
+ *    repeatedly dividing the postcode by the base.
+ */
+struct prefix_key
+{
+    /** @brief Constructs an empty @a prefix_key that matches nothing.
+     */
+    prefix_key() :
+        count(0),
+        is_zero(false),
+        is_valid(false)
+    {
+    }
+
+    /** @brief Constructs a @a prefix_key object.
+     *
+     *  @param[in] zip The postcode hash.
+     *  @param[in] base The base used for prefix matching.
+     */
+    prefix_key(int32_t zip, int32_t base) :
+        count(0),
+        is_zero(zip == 0),
+        is_valid(zip >= 0 && base > 1 && base <= prefix_max_base)
+    {
+        if (!is_valid)
+            return;
+
+        uint8_t reversed[prefix_max_digits];
+
+        while (zip > 0)
+        {
+            reversed[count++] = (uint8_t) (zip % base);
+            zip /= base;
+        }
+        for (std::size_t i = 0; i < count; i++)
+            digits[i] = reversed[count - i - 1];
+    }
+
+    uint8_t digits[prefix_max_digits];
+    std::size_t count;
+    /* Zero is the empty digit string, it only ever matches itself. */
+    bool is_zero;
+    /* Negative postcodes are never stored, so they never match. */
+    bool is_valid;
+};
+
+/** @brief The @a prefix_trie_node struct is one node of a flattened digit trie.
+ *    The children of a node are stored contiguously and sorted by digit, so a
+ *    child is found with one popcount over the child mask.
+ */
+struct prefix_trie_node
+{
+    prefix_trie_node() :
+        child_mask(0),
+        first_child(-1),
+        value(-1),
+        link(-1),
+        reserved(0)
+    {
+    }
+
+    /** @brief Gets the index of the child for a digit.
+     *
+     *  @param[in] digit The next digit of the key.
+     *  @return Returns the child node index, or -1 if there is none.
+     */
+    int32_t child(uint8_t digit) const
+    {
+        uint64_t bit = (uint64_t) 1 << digit;
+
+        if (!(child_mask & bit))
+            return -1;
+        return first_child + __builtin_popcountll(child_mask & (bit - 1));
+    }
+
+    /** @brief Serialization function used by Boost serialization.
+     *
+     *  @param[in,out] ar The Archive to read/write to.
+     *  @param[in] version Not used, but required by the interface.
+     */
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & child_mask;
+        ar & first_child;
+        ar & value;
+        ar & link;
+    }
+
+    /* Bit d is set if the node has a child for digit d. */
+    uint64_t child_mask;
+    int32_t first_child;
+    /* Index into the value array, or -1 if no key ends at this node. */
+    int32_t value;
+    /* Root of a second trie hanging off this node, or -1. */
+    int32_t link;
+    int32_t reserved;
+};
+
+/** @brief @a prefix_trie holds any number of flattened digit tries sharing one
+ *    node array and one value array. A node can link to the root of another
+ *    trie, which is how the two dimensional origin/destination index is built.
+ */
+template <typename V>
+class prefix_trie
+{
+public:
+    /** @brief Walks the trie along a key and collects the nodes on the path.
+     *
+     *  @param[in] root The root of the trie to walk.
+     *  @param[in] key The key to walk along.
+     *  @param[out] path Receives node indexes, shortest prefix first.
+     *  @return Returns the number of nodes written to @a path.
+     */
+    std::size_t collect(int32_t root, const prefix_key& key,
+                        int32_t path[prefix_max_digits + 1]) const
+    {
+        std::size_t count = 0;
+
+        if (root < 0 || !key.is_valid)
+            return 0;
+        if (key.is_zero)
+        {
+            path[count++] = root;
+            return count;
+        }
+
+        int32_t node = root;
+
+        for (std::size_t i = 0; i < key.count; i++)
+        {
+            node = nodes[node].child(key.digits[i]);
+            if (node < 0)
+                break;
+            path[count++] = node;
+        }
+        return count;
+    }
+
+    /** @brief Gets the value stored for the longest prefix of a key.
+     *
+     *  @param[in] root The root of the trie to walk.
+     *  @param[in] key The key to match.
+     *  @return Returns the value index, or -1 if no prefix is stored.
+     */
+    int32_t longest_match(int32_t root, const prefix_key& key) const
+    {
+        int32_t path[prefix_max_digits + 1];
+        std::size_t count = collect(root, key, path);
+
+        while (count > 0)
+        {
+            int32_t value = nodes[path[--count]].value;
+
+            if (value >= 0)
+                return value;
+        }
+        return -1;
+    }
+
+    /** @brief Gets the value stored for the longest origin prefix, then the
+     *    longest destination prefix under it. This is the same precedence as
+     *    the nested division loops it replaces.
+     *
+     *  @param[in] root The root of the origin trie.
+     *  @param[in] from The origin key.
+     *  @param[in] to The destination key.
+     *  @return Returns the value index, or -1 if no pair of prefixes is stored.
+     */
+    int32_t longest_match(int32_t root, const prefix_key& from,
+                          const prefix_key& to) const
+    {
+        int32_t path[prefix_max_digits + 1];
+        std::size_t count = collect(root, from, path);
+
+        while (count > 0)
+        {
+            int32_t link = nodes[path[--count]].link;
+
+            if (link >= 0)
+            {
+                int32_t value = longest_match(link, to);
+
+                if (value >= 0)
+                    return value;
+            }
+        }
+        return -1;
+    }
+
+    /** @brief Gets a stored value.
+     *
+     *  @param[in] index A value index returned by longest_match().
+     */
+    const V& value(int32_t index) const
+    {
+        return values[index];
+    }
+
+    /** @brief Serialization function used by Boost serialization.
+     *
+     *  @param[in,out] ar The Archive to read/write to.
+     *  @param[in] version Not used, but required by the interface.
+     */
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & nodes;
+        ar & values;
+    }
+
+    std::vector<prefix_trie_node> nodes;
+    std::vector<V> values;
+};
+
+/** @brief @a prefix_trie_builder accumulates keys into pointer based tries and
+ *    then lays them out breadth first into a @a prefix_trie, so that every
+ *    node's children end up next to each other.
+ */
+template <typename V>
+class prefix_trie_builder
+{
+public:
+    /** @brief Adds a new, empty trie.
+     *
+     *  @return Returns the builder id of the new root.
+     */
+    int32_t add_root()
+    {
+        roots.push_back(add_node());
+        return roots.back();
+    }
+
+    /** @brief Finds or creates the node for a key.
+     *
+     *  @param[in] root The builder id of the root to insert under.
+     *  @param[in] key The key to insert.
+     *  @return Returns the builder id of the node for @a key.
+     */
+    int32_t insert(int32_t root, const prefix_key& key)
+    {
+        int32_t node = root;
+
+        for (std::size_t i = 0; i < key.count; i++)
+        {
+            std::map<uint8_t, int32_t>::iterator it =
+                nodes[node].children.find(key.digits[i]);
+
+            if (it == nodes[node].children.end())
+            {
+                int32_t child = add_node();
+
+                nodes[node].children[key.digits[i]] = child;
+                node = child;
+            }
+            else
+                node = it->second;
+        }
+        return node;
+    }
+
+    /** @brief Sets the value of a node, unless it already has one. The first
+     *    value wins, the same as inserting duplicates into an unordered_map.
+     *
+     *  @param[in] node The builder id of the node.
+     *  @param[in] value The value to store.
+     */
+    void set_value(int32_t node, const V& value)
+    {
+        if (nodes[node].value >= 0)
+            return;
+        nodes[node].value = (int32_t) values.size();
+        values.push_back(value);
+    }
+
+    /** @brief Gets the linked trie root of a node, creating it if needed.
+     *
+     *  @param[in] node The builder id of the node.
+     *  @return Returns the builder id of the linked root.
+     */
+    int32_t get_link(int32_t node)
+    {
+        if (nodes[node].link < 0)
+        {
+            int32_t link = add_root();
+
+            nodes[node].link = link;
+        }
+        return nodes[node].link;
+    }
+
+    /** @brief Lays out all the tries into @a trie.
+     *
+     *  @param[out] trie The flattened tries.
+     *  @return Returns the flattened id of every builder id.
+     */
+    std::vector<int32_t> flatten(prefix_trie<V>& trie) const
+    {
+        std::vector<int32_t> ids(nodes.size(), -1);
+        std::deque<int32_t> pending;
+
+        trie.nodes.clear();
+        trie.nodes.reserve(nodes.size());
+        trie.values = values;
+        for (std::size_t i = 0; i < roots.size(); i++)
+        {
+            ids[roots[i]] = (int32_t) trie.nodes.size();
+            trie.nodes.push_back(prefix_trie_node());
+            pending.push_back(roots[i]);
+        }
+        while (!pending.empty())
+        {
+            int32_t node = pending.front();
+            prefix_trie_node& flat = trie.nodes[ids[node]];
+
+            pending.pop_front();
+            flat.value = nodes[node].value;
+            if (!nodes[node].children.empty())
+                flat.first_child = (int32_t) trie.nodes.size();
+            for (std::map<uint8_t, int32_t>::const_iterator it =
+                     nodes[node].children.begin();
+                 it != nodes[node].children.end(); ++it)
+            {
+                trie.nodes[ids[node]].child_mask |= (uint64_t) 1 << it->first;
+                ids[it->second] = (int32_t) trie.nodes.size();
+                trie.nodes.push_back(prefix_trie_node());
+                pending.push_back(it->second);
+            }
+        }
+        /* Links point at roots, which all have ids by now. */
+        for (std::size_t i = 0; i < nodes.size(); i++)
+        {
+            if (nodes[i].link >= 0)
+                trie.nodes[ids[i]].link = ids[nodes[i].link];
+        }
+        return ids;
+    }
+
+private:
+    struct build_node
+    {
+        build_node() :
+            children(),
+            value(-1),
+            link(-1)
+        {
+        }
+
+        std::map<uint8_t, int32_t> children;
+        int32_t value;
+        int32_t link;
+    };
+
+    int32_t add_node()
+    {
+        nodes.push_back(build_node());
+        return (int32_t) nodes.size() - 1;
+    }
+
+    std::vector<build_node> nodes;
+    std::vector<int32_t> roots;
+    std::vector<V> values;
+};
+
+/** @brief The @a prefix_signed_row struct is one row with a negative postcode.
+ *    Negative postcodes are not digit strings, so these rows are kept sorted
+ *    apart from the tries.
+ */
+template <typename V>
+struct prefix_signed_row
+{
+    prefix_signed_row() :
+        from_zip(0),
+        to_zip(0),
+        value()
+    {
+    }
+
+    prefix_signed_row(int32_t from_zip, int32_t to_zip, const V& value) :
+        from_zip(from_zip),
+        to_zip(to_zip),
+        value(value)
+    {
+    }
+
+    bool operator<(const prefix_signed_row& right) const
+    {
+        return from_zip < right.from_zip ||
+               (from_zip == right.from_zip && to_zip < right.to_zip);
+    }
+
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & from_zip;
+        ar & to_zip;
+        ar & value;
+    }
+
+    int32_t from_zip;
+    int32_t to_zip;
+    V value;
+};
+
+/** @brief Sorts the signed rows of a group into a table, keeping the first
+ *    of a repeated pair of postcodes.
+ *
+ *  @param[in,out] rows The rows of the group, sorted on return.
+ *  @param[in,out] table The table to append to.
+ */
+template <typename V>
+void prefix_signed_append(std::vector<prefix_signed_row<V> >& rows,
+                          std::vector<prefix_signed_row<V> >& table)
+{
+    std::stable_sort(rows.begin(), rows.end());
+    for (std::size_t i = 0; i < rows.size(); i++)
+    {
+        if (i == 0 || rows[i - 1] < rows[i])
+            table.push_back(rows[i]);
+    }
+}
+
+/** @brief Finds the signed row for a pair of postcodes the way the query time
+ *    loops did: dividing the origin, then the destination postcode down until
+ *    it reaches zero.
+ *
+ *  @param[in] begin The first row of the sorted slice of a group.
+ *  @param[in] end The end of the slice.
+ *  @param[in] from_zip The origin postcode hash.
+ *  @param[in] to_zip The destination postcode hash.
+ *  @param[in] from_base The base origin postcodes are matched in.
+ *  @param[in] to_base The base destination postcodes are matched in.
+ *  @return Returns the value, or NULL if no row matches.
+ */
+template <typename V>
+const V* prefix_signed_find(const prefix_signed_row<V>* begin, const prefix_signed_row<V>* end,
+                            int32_t from_zip, int32_t to_zip, int32_t from_base, int32_t to_base)
+{
+    for (int32_t temp_from_zip = from_zip; ; temp_from_zip /= from_base)
+    {
+        for (int32_t temp_to_zip = to_zip; ; temp_to_zip /= to_base)
+        {
+            prefix_signed_row<V> probe(temp_from_zip, temp_to_zip, V());
+            const prefix_signed_row<V>* it = std::lower_bound(begin, end, probe);
+
+            if (it != end && !(probe < *it))
+                return &it->value;
+            if (temp_to_zip / to_base == 0)
+                break;
+        }
+        if (temp_from_zip / from_base == 0)
+            break;
+    }
+    return NULL;
+}
+
+/** @brief The @a prefix_group struct holds the per group entry point into the
+ *    tries of a @a prefix_match_index.
+ */
+struct prefix_group
+{
+    prefix_group() :
+        root(-1),
+        signed_begin(0),
+        signed_end(0),
+        from_base(10),
+        to_base(10)
+    {
+    }
+
+    prefix_group(int32_t root, int16_t from_base, int16_t to_base) :
+        root(root),
+        signed_begin(0),
+        signed_end(0),
+        from_base(from_base),
+        to_base(to_base)
+    {
+    }
+
+    /** @brief Serialization function used by Boost serialization.
+     *
+     *  @param[in,out] ar The Archive to read/write to.
+     *  @param[in] version Not used, but required by the interface.
+     */
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        ar & root;
+        ar & signed_begin;
+        ar & signed_end;
+        ar & from_base;
+        ar & to_base;
+    }
+
+    /* Root of the origin trie for this group. */
+    int32_t root;
+    /* Slice of the signed row table holding this group's negative postcode rows. */
+    int32_t signed_begin;
+    int32_t signed_end;
+    /* Base the origin postcodes are matched in. */
+    int16_t from_base;
+    /* Base the destination postcodes are matched in. */
+    int16_t to_base;
+};
+
+/** @brief @a prefix_match_index is a two dimensional longest prefix match
+ *    index. Rows are grouped by a key (e.g. origin country, destination country
+ *    and shipping service), and within a group matched by longest origin prefix
+ *    first, then longest destination prefix. A lookup is one hash probe for the
+ *    group followed by two bounded trie walks. Rows with a negative postcode
+ *    are matched the way the query time loops did, from a sorted table.
+ *
+ *    The index is filled with insert() and made queryable with create().
+ */
+template <typename K, typename V>
+class prefix_match_index
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef boost::unordered_map<K, prefix_group> group_map;
+
+    prefix_match_index() :
+        groups(),
+        trie(),
+        signed_rows(),
+        builder(),
+        signed_build(),
+        delegated()
+    {
+    }
+
+    /** @brief Adds a row to the index. Only valid before create().
+     *
+     *  @param[in] group The group key.
+     *  @param[in] from_base The base origin postcodes of the group match in.
+     *  @param[in] to_base The base destination postcodes of the group match in.
+     *  @param[in] from_zip The origin postcode hash.
+     *  @param[in] to_zip The destination postcode hash.
+     *  @param[in] value The value for the row.
+     *  @return Returns @a false if the row can never be matched and was skipped.
+     */
+    bool insert(const K& group, int16_t from_base, int16_t to_base,
+                int32_t from_zip, int32_t to_zip, const V& value)
+    {
+        if (!builder)
+            builder.reset(new prefix_trie_builder<V>());
+
+        typename group_map::iterator it = groups.find(group);
+
+        if (it == groups.end())
+        {
+            it = groups.insert(std::make_pair(group,
+                prefix_group(builder->add_root(), from_base, to_base))).first;
+        }
+
+        if (from_zip < 0 || to_zip < 0)
+        {
+            signed_build[group].push_back(prefix_signed_row<V>(from_zip, to_zip, value));
+            return true;
+        }
+
+        prefix_key from(from_zip, it->second.from_base);
+        prefix_key to(to_zip, it->second.to_base);
+
+        if (!from.is_valid || !to.is_valid)
+            return false;
+
+        int32_t from_node = builder->insert(it->second.root, from);
+        int32_t to_node = builder->insert(builder->get_link(from_node), to);
+
+        builder->set_value(to_node, value);
+        return true;
+    }
+
+    /** @brief Records a group whose rows are kept by another table instead,
+     *    so that the index is not used without that table.
+     *
+     *  @param[in] group The group key.
+     */
+    void delegate(const K& group)
+    {
+        delegated.push_back(group);
+    }
+
+    /** @brief Gets the groups whose rows are kept by another table.
+     */
+    const std::vector<K>& delegated_groups() const
+    {
+        return delegated;
+    }
+
+    /** @brief Lays out the inserted rows and releases the build state.
+     */
+    void create()
+    {
+        if (!builder)
+            return;
+
+        std::vector<int32_t> ids = builder->flatten(trie);
+
+        signed_rows.clear();
+        for (typename group_map::iterator it = groups.begin(); it != groups.end(); ++it)
+        {
+            it->second.root = ids[it->second.root];
+            it->second.signed_begin = (int32_t) signed_rows.size();
+            prefix_signed_append(signed_build[it->first], signed_rows);
+            it->second.signed_end = (int32_t) signed_rows.size();
+        }
+        builder.reset();
+        signed_build.clear();
+    }
+
+    /** @brief Finds the entry point of a group.
+     *
+     *  @param[in] group The group key.
+     *  @return Returns the group, or NULL if there is no such group.
+     */
+    const prefix_group* find_group(const K& group) const
+    {
+        typename group_map::const_iterator it = groups.find(group);
+
+        if (it == groups.end())
+            return NULL;
+        return &it->second;
+    }
+
+    /** @brief Finds the value for the longest matching prefixes within a group.
+     *
+     *  @param[in] group The group, as returned by find_group().
+     *  @param[in] from_zip The origin postcode hash.
+     *  @param[in] to_zip The destination postcode hash.
+     *  @return Returns the value, or NULL if nothing matches.
+     */
+    const V* find(const prefix_group& group, int32_t from_zip, int32_t to_zip) const
+    {
+        /* Negative postcodes only ever matched rows with negative postcodes. */
+        if (BOOST_UNLIKELY(from_zip < 0 || to_zip < 0))
+        {
+            if (group.signed_begin == group.signed_end)
+                return NULL;
+            return prefix_signed_find(&signed_rows[group.signed_begin],
+                                      &signed_rows[0] + group.signed_end,
+                                      from_zip, to_zip, group.from_base, group.to_base);
+        }
+
+        int32_t value = trie.longest_match(group.root,
+                                           prefix_key(from_zip, group.from_base),
+                                           prefix_key(to_zip, group.to_base));
+
+        if (value < 0)
+            return NULL;
+        return &trie.value(value);
+    }
+
+    /** @brief Finds the value for the longest matching prefixes.
+     *
+     *  @param[in] group The group key.
+     *  @param[in] from_zip The origin postcode hash.
+     *  @param[in] to_zip The destination postcode hash.
+     *  @return Returns the value, or NULL if nothing matches.
+     */
+    const V* find(const K& group, int32_t from_zip, int32_t to_zip) const
+    {
+        const prefix_group* entry = find_group(group);
+
+        if (entry == NULL)
+            return NULL;
+        return find(*entry, from_zip, to_zip);
+    }
+
+    /** @brief Gets the number of distinct rows stored.
+     */
+    std::size_t size() const
+    {
+        return trie.values.size() + signed_rows.size();
+    }
+
+    /** @brief Gets the number of trie nodes stored.
+     */
+    std::size_t node_count() const
+    {
+        return trie.nodes.size();
+    }
+
+    template <typename A>
+    void save(A& ar, const unsigned int version) const
+    {
+        std::vector<std::pair<K, prefix_group> > entries(groups.begin(), groups.end());
+
+        ar & entries;
+        ar & trie;
+        ar & signed_rows;
+        ar & delegated;
+    }
+
+    template <typename A>
+    void load(A& ar, const unsigned int version)
+    {
+        std::vector<std::pair<K, prefix_group> > entries;
+
+        ar & entries;
+        ar & trie;
+        ar & signed_rows;
+        ar & delegated;
+        groups.clear();
+        groups.insert(entries.begin(), entries.end());
+    }
+
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+
+private:
+    group_map groups;
+    prefix_trie<V> trie;
+    /* Rows with a negative postcode, sorted within each group's slice. */
+    std::vector<prefix_signed_row<V> > signed_rows;
+    boost::scoped_ptr<prefix_trie_builder<V> > builder;
+    boost::unordered_map<K, std::vector<prefix_signed_row<V> > > signed_build;
+    /* Groups kept by another table, such as dense matrices. */
+    std::vector<K> delegated;
+};
+
+}}
+
+#endif
@@ -0,0 +1,359 @@
+/** @file common/quantized_table.hpp
+ *  Flat tables whose values are rows of small integer columns, stored as one
+ *  byte per column. Every column has its own scale, chosen by the builder
+ *  from the range of the column, so columns with different ranges, such as
+ *  a total and per day values, each keep as much precision as they can. A
+ *  column whose values span at most 256 integers is stored exactly.
+ *
+ *  The columns are stored one after the other rather than row by row, and
+ *  the keys in a flat table of their own, so a lookup that reads a total
+ *  and one day reads the key and one byte from each of those two columns,
+ *  and the columns of the other days stay out of the cache.
+ */
+
+#ifndef EBAY_COMMON_QUANTIZED_TABLE_HPP
+#define EBAY_COMMON_QUANTIZED_TABLE_HPP
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "common/flat_table.hpp"
+
+namespace ebay { namespace common
+{
+
+/* "EBQUANT8" read as a little endian integer. */
+static const uint64_t quantized_table_magic = 0x38544e4155514245ULL;
+/* Bumped whenever the header, the layout or the quantization changes. */
+static const uint32_t quantized_table_version = 2;
+/* Most columns a row can have. */
+static const std::size_t quantized_table_max_columns = 14;
+
+/** @brief The @a quantized_column struct holds the scale of a column: the
+ *    stored byte q stands for base + q * step.
+ */
+struct quantized_column
+{
+    int32_t base;
+    int32_t step;
+};
+
+/*
+ * File layout, all offsets from the start of the file and 64 byte aligned:
+ *
+ *   quantized_table_header
+ *   flat_table<K>                      the keys; a key's entry index is its row
+ *   uint8_t[column_count][row_count]   the stored bytes, column by column
+ */
+
+/** @brief The @a quantized_table_header struct starts every quantized table
+ *    file.
+ */
+struct quantized_table_header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t column_count;
+    quantized_column columns[quantized_table_max_columns];
+    uint64_t row_count;
+    /* Distance between two columns, the row count rounded up to 64. */
+    uint64_t column_stride;
+    uint64_t column_offset;
+    uint64_t file_size;
+};
+
+/** @brief The @a quantized_row struct holds the stored bytes of a row while
+ *    the table is built.
+ */
+template <std::size_t N>
+struct quantized_row
+{
+    quantized_row() :
+        data()
+    {
+    }
+
+    /** @brief Serialization function used by Boost serialization.
+     *
+     *  @param[in,out] ar The Archive to read/write to.
+     *  @param[in] version Not used, but required by the interface.
+     */
+    template <typename A>
+    void serialize(A& ar, const unsigned int version)
+    {
+        for (std::size_t i = 0; i < N; i++)
+            ar & data[i];
+    }
+
+    uint8_t data[N];
+};
+
+/** @brief The @a quantized_error struct describes how far the stored values
+ *    of a column are from the values the table was built from.
+ */
+struct quantized_error
+{
+    quantized_error() :
+        step(1),
+        max_error(0),
+        total_error(0),
+        exact(0),
+        count(0)
+    {
+    }
+
+    double mean_error() const
+    {
+        return count == 0 ? 0 : (double) total_error / count;
+    }
+
+    int32_t step;
+    int32_t max_error;
+    uint64_t total_error;
+    uint64_t exact;
+    uint64_t count;
+};
+
+/** @brief @a quantized_table maps keys of type K to rows of N columns.
+ */
+template <typename K, std::size_t N>
+class quantized_table : private boost::noncopyable
+{
+public:
+    typedef quantized_row<N> row_type;
+    typedef flat_table<K> key_table;
+
+    /* Returned by row() for a key that is not in the table. */
+    static const std::size_t npos = ~(std::size_t) 0;
+
+    /** @brief Checks whether a file is in the quantized table format.
+     *
+     *  @param[in] path The path of the file.
+     */
+    static bool is_quantized_file(const char* path)
+    {
+        std::ifstream ifs(path, std::ios_base::binary);
+        uint64_t magic = 0;
+
+        ifs.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        return ifs && magic == quantized_table_magic;
+    }
+
+    /** @brief Maps a quantized table file.
+     *
+     *  @param[in] path The path of the file.
+     *  @return Returns a new table, owned by the caller.
+     */
+    static quantized_table* open(const char* path)
+    {
+        std::ifstream ifs(path, std::ios_base::binary);
+        quantized_table* table = new quantized_table();
+
+        try
+        {
+            ifs.read(reinterpret_cast<char*>(&table->header), sizeof(table->header));
+            if (!ifs || table->header.magic != quantized_table_magic)
+                invalid(path, "not a quantized table");
+            if (table->header.version != quantized_table_version)
+                invalid(path, "unsupported version");
+            if (table->header.column_count != N)
+                invalid(path, "column count does not match");
+            table->keys.reset(key_table::open(path, table_offset()));
+            table->file.reset(new flat_table_file(path));
+
+            const quantized_table_header& header = table->header;
+
+            if (header.row_count != table->keys->size() || header.column_stride < header.row_count ||
+                header.column_stride % 64 != 0 || header.column_offset % 64 != 0 ||
+                header.column_offset + N * header.column_stride > header.file_size ||
+                header.file_size > table->file->size())
+                invalid(path, "truncated or corrupt");
+            table->columns =
+                reinterpret_cast<const uint8_t*>(table->file->data() + header.column_offset);
+        }
+        catch (...)
+        {
+            delete table;
+            throw;
+        }
+        return table;
+    }
+
+    /** @brief Quantizes a range of entries and writes them as a quantized
+     *    table file.
+     *
+     *  @param[in] path The path of the file.
+     *  @param[in] first The first entry, a std::pair of a key and a value
+     *    holding its columns in a data[N] array.
+     *  @param[in] last One past the last entry.
+     *  @param[out] errors Receives the quantization error of every column.
+     */
+    template <typename InputIterator>
+    static void save(const char* path, InputIterator first, InputIterator last,
+                     quantized_error errors[N])
+    {
+        quantized_table_header header;
+        int32_t low[N];
+        int32_t high[N];
+
+        std::memset(&header, 0, sizeof(header));
+        header.magic = quantized_table_magic;
+        header.version = quantized_table_version;
+        header.column_count = N;
+        for (std::size_t c = 0; c < N; c++)
+        {
+            low[c] = std::numeric_limits<int32_t>::max();
+            high[c] = std::numeric_limits<int32_t>::min();
+        }
+        for (InputIterator it = first; it != last; ++it)
+        {
+            for (std::size_t c = 0; c < N; c++)
+            {
+                low[c] = std::min(low[c], (int32_t) it->second.data[c]);
+                high[c] = std::max(high[c], (int32_t) it->second.data[c]);
+            }
+        }
+        for (std::size_t c = 0; c < N; c++)
+        {
+            header.columns[c].base = low[c] <= high[c] ? low[c] : 0;
+            /* The smallest step that spans the column with 256 values. */
+            header.columns[c].step = low[c] < high[c] ? (high[c] - low[c] + 254) / 255 : 1;
+            errors[c] = quantized_error();
+            errors[c].step = header.columns[c].step;
+        }
+
+        std::vector<std::pair<K, row_type> > rows;
+        std::vector<K> row_keys;
+
+        for (InputIterator it = first; it != last; ++it)
+        {
+            row_type row;
+
+            for (std::size_t c = 0; c < N; c++)
+            {
+                int32_t value = it->second.data[c];
+                const quantized_column& column = header.columns[c];
+                int32_t error;
+
+                row.data[c] = (uint8_t) ((value - column.base + column.step / 2) / column.step);
+                error = std::abs(column.base + row.data[c] * column.step - value);
+                errors[c].max_error = std::max(errors[c].max_error, error);
+                errors[c].total_error += error;
+                errors[c].exact += error == 0;
+                errors[c].count++;
+            }
+            rows.push_back(std::make_pair(it->first, row));
+            row_keys.push_back(it->first);
+        }
+
+        /*
+         * The key table numbers the keys in the order they are first seen,
+         * so the rows are written in that order, the first of repeated keys
+         * winning, as in the other tables.
+         */
+        boost::scoped_ptr<key_table> keys(key_table::create(row_keys.begin(), row_keys.end()));
+        std::ostringstream key_data;
+        std::vector<uint8_t> column_data;
+
+        key_table::save(key_data, row_keys.begin(), row_keys.end());
+        header.row_count = keys->size();
+        header.column_stride = (header.row_count + 63) & ~(uint64_t) 63;
+        header.column_offset = align(table_offset() + key_data.str().size());
+        header.file_size = header.column_offset + N * header.column_stride;
+        column_data.assign(N * header.column_stride, 0);
+
+        std::vector<bool> filled(header.row_count, false);
+
+        for (std::size_t i = 0; i < rows.size(); i++)
+        {
+            std::size_t r = keys->find(rows[i].first) - keys->begin();
+
+            if (filled[r])
+                continue;
+            filled[r] = true;
+            for (std::size_t c = 0; c < N; c++)
+                column_data[c * header.column_stride + r] = rows[i].second.data[c];
+        }
+
+        std::ofstream ofs(path, std::ios_base::binary);
+
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (std::size_t i = sizeof(header); i < table_offset(); i++)
+            ofs.put('\0');
+        ofs << key_data.str();
+        for (std::size_t i = table_offset() + key_data.str().size(); i < header.column_offset; i++)
+            ofs.put('\0');
+        if (!column_data.empty())
+            ofs.write(reinterpret_cast<const char*>(&column_data[0]), column_data.size());
+        if (!ofs)
+            throw std::runtime_error(std::string("quantized table: cannot write ") + path);
+    }
+
+    /** @brief Finds the row of a key.
+     *
+     *  @param[in] key The key to look for.
+     *  @return Returns the row, or npos if the key is not in the table.
+     */
+    std::size_t row(const K& key) const
+    {
+        typename key_table::const_iterator it = keys->find(key);
+
+        return it != keys->end() ? (std::size_t) (it - keys->begin()) : npos;
+    }
+
+    /** @brief Gets the value of a column of a row.
+     */
+    int32_t value(std::size_t row, std::size_t column) const
+    {
+        return header.columns[column].base +
+               columns[column * header.column_stride + row] * header.columns[column].step;
+    }
+
+    std::size_t size() const
+    {
+        return keys->size();
+    }
+
+private:
+    quantized_table() :
+        columns(NULL)
+    {
+        std::memset(&header, 0, sizeof(header));
+    }
+
+    static std::size_t table_offset()
+    {
+        return align(sizeof(quantized_table_header));
+    }
+
+    static std::size_t align(std::size_t offset)
+    {
+        return (offset + 63) & ~(std::size_t) 63;
+    }
+
+    static void invalid(const char* path, const char* what)
+    {
+        throw std::runtime_error(std::string("quantized table ") + path + ": " + what);
+    }
+
+    quantized_table_header header;
+    boost::scoped_ptr<key_table> keys;
+    /* A second mapping of the file, for the columns after the key table. */
+    boost::scoped_ptr<flat_table_file> file;
+    const uint8_t* columns;
+};
+
+template <typename K, std::size_t N>
+const std::size_t quantized_table<K, N>::npos;
+
+}}
+
+#endif
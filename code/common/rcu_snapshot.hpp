@@ -0,0 +1,158 @@
+/** @file common/rcu_snapshot.hpp
+ *  Read-copy-update holder for an immutable snapshot of data, such as a set
+ *  of lookup tables. Readers take the current snapshot without a lock, a
+ *  single writer publishes a replacement and frees the old one once every
+ *  reader that could still see it has finished.
+ */
+
+#ifndef EBAY_COMMON_RCU_SNAPSHOT_HPP
+#define EBAY_COMMON_RCU_SNAPSHOT_HPP
+
+#include <sched.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace ebay { namespace common
+{
+
+/** @brief @a rcu_snapshot publishes snapshots of type T to concurrent readers.
+ *
+ *    Readers register in one of two reader counts, picked by the current
+ *    parity, and each count is striped across cache lines by CPU so that
+ *    readers on different CPUs do not contend. A reader costs one atomic
+ *    increment and one atomic decrement on a mostly CPU local line.
+ *
+ *    publish() swaps the snapshot pointer, then flips the parity twice,
+ *    each time waiting for the readers of the parity it left to drain. New
+ *    readers never enter the parity being waited for, so the wait always
+ *    ends, and after both flips no reader can still hold the old snapshot.
+ *
+ *    Only one thread may publish at a time; readers are unrestricted.
+ */
+template <typename T>
+class rcu_snapshot : private boost::noncopyable
+{
+public:
+    /** @brief The @a reader class pins the current snapshot for its lifetime.
+     */
+    class reader : private boost::noncopyable
+    {
+    public:
+        explicit reader(const rcu_snapshot& owner) :
+            count(owner.enter()),
+            snapshot(owner.current.load(boost::memory_order_seq_cst))
+        {
+        }
+
+        ~reader()
+        {
+            count->fetch_sub(1, boost::memory_order_release);
+        }
+
+        /** @brief Gets the pinned snapshot, NULL if none is published.
+         */
+        const T* get() const
+        {
+            return snapshot;
+        }
+
+    private:
+        boost::atomic<intptr_t>* count;
+        const T* snapshot;
+    };
+
+    rcu_snapshot() :
+        current(NULL),
+        parity(0)
+    {
+        for (std::size_t p = 0; p < 2; p++)
+            for (std::size_t i = 0; i < stripes; i++)
+                counts[p][i].count.store(0);
+    }
+
+    ~rcu_snapshot()
+    {
+        delete current.load();
+    }
+
+    /** @brief Replaces the snapshot, and frees the old one when no reader can
+     *    see it anymore. Blocks until then.
+     *
+     *  @param[in] next The new snapshot, owned by this object. May be NULL.
+     */
+    void publish(T* next)
+    {
+        T* old = current.exchange(next, boost::memory_order_seq_cst);
+
+        synchronize();
+        delete old;
+    }
+
+    /** @brief Gets the snapshot without pinning it. Only safe on the thread
+     *    that publishes.
+     */
+    const T* unsafe_get() const
+    {
+        return current.load(boost::memory_order_relaxed);
+    }
+
+private:
+    /* Number of reader count stripes, per parity. */
+    static const std::size_t stripes = 64;
+
+    /** @brief A reader count on its own cache line.
+     */
+    struct stripe
+    {
+        boost::atomic<intptr_t> count;
+        char padding[64 - sizeof(boost::atomic<intptr_t>)];
+    };
+
+    /** @brief Registers a reader in the current parity.
+     *
+     *  @return Returns the count the reader must decrement when done.
+     */
+    boost::atomic<intptr_t>* enter() const
+    {
+        int cpu = ::sched_getcpu();
+        std::size_t p = parity.load(boost::memory_order_seq_cst);
+        boost::atomic<intptr_t>* count =
+            &counts[p][(cpu < 0 ? 0 : cpu) % stripes].count;
+
+        count->fetch_add(1, boost::memory_order_seq_cst);
+        return count;
+    }
+
+    /** @brief Waits until every reader that started before the call is done.
+     */
+    void synchronize()
+    {
+        for (int flip = 0; flip < 2; flip++)
+        {
+            std::size_t p = parity.load(boost::memory_order_relaxed);
+
+            parity.store(p ^ 1, boost::memory_order_seq_cst);
+            while (active(p) != 0)
+                ::usleep(1000);
+        }
+    }
+
+    intptr_t active(std::size_t p) const
+    {
+        intptr_t total = 0;
+
+        for (std::size_t i = 0; i < stripes; i++)
+            total += counts[p][i].count.load(boost::memory_order_seq_cst);
+        return total;
+    }
+
+    boost::atomic<T*> current;
+    boost::atomic<std::size_t> parity;
+    mutable stripe counts[2][stripes];
+};
+
+}}
+
+#endif
@@ -0,0 +1,368 @@
+/** @file common/record_reader.hpp
+ *  Reader for the text exports the table builders convert: one record per
+ *  line, fields separated by spaces, tabs or commas. The file is memory
+ *  mapped and parsed in place, fields are never copied, and a malformed line
+ *  is reported with its line number and skipped instead of being stored.
+ */
+
+#ifndef EBAY_COMMON_RECORD_READER_HPP
+#define EBAY_COMMON_RECORD_READER_HPP
+
+#include <string>
+#include <limits>
+#include <cstring>
+#include <iostream>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/noncopyable.hpp>
+
+namespace ebay { namespace common
+{
+
+/* Malformed records reported per file; the rest are only counted. */
+static const std::size_t record_reader_max_reports = 20;
+
+/** @brief The @a record_field struct points at one field of a record, in
+ *    the mapped file. It is only valid as long as its reader.
+ */
+struct record_field
+{
+    record_field() :
+        data(NULL),
+        size(0)
+    {
+    }
+
+    std::string str() const
+    {
+        return std::string(data, size);
+    }
+
+    const char* data;
+    std::size_t size;
+};
+
+/** @brief Parses a decimal integer, with an optional sign, that must fill
+ *    the whole range.
+ *
+ *  @param[in] begin The first character.
+ *  @param[in] end One past the last character.
+ *  @param[out] value Receives the integer.
+ *  @return Returns @a false if the range is no integer or does not fit in T.
+ */
+template <typename T>
+inline bool parse_integer(const char* begin, const char* end, T& value)
+{
+    uint64_t limit = (uint64_t) std::numeric_limits<T>::max();
+    bool negative = false;
+    uint64_t result = 0;
+
+    if (begin != end && (*begin == '-' || *begin == '+'))
+    {
+        negative = *begin++ == '-';
+        if (negative && !std::numeric_limits<T>::is_signed)
+            return false;
+        if (negative)
+            limit++;
+    }
+    if (begin == end)
+        return false;
+    for (; begin != end; ++begin)
+    {
+        unsigned int digit = (unsigned char) *begin - '0';
+
+        if (digit > 9 || result > (limit - digit) / 10)
+            return false;
+        result = result * 10 + digit;
+    }
+    value = (T) (negative ? 0 - result : result);
+    return true;
+}
+
+/** @brief @a record_reader reads a text file record by record. Fields are
+ *    extracted with operator>>, like from a stream; an extraction that fails
+ *    puts the record in a failed state, and valid() tells whether the record
+ *    was read whole.
+ *
+ *    A typical loop:
+ *
+ *      while (reader.next())
+ *      {
+ *          reader >> a >> b;
+ *          if (!reader.valid())
+ *              continue;
+ *          ...
+ *      }
+ */
+class record_reader : private boost::noncopyable
+{
+public:
+    /** @brief Maps a file.
+     *
+     *  @param[in] path The path of the file.
+     *  @param[in] comment Lines starting with this character are skipped,
+     *    0 for none.
+     */
+    explicit record_reader(const char* path, char comment = '\0') :
+        path(path),
+        comment(comment),
+        fd(-1),
+        mapped(NULL),
+        size(0),
+        begin(NULL),
+        end(NULL),
+        next_line(NULL),
+        record_begin(NULL),
+        record_end(NULL),
+        cursor(NULL),
+        line_number(0),
+        failed(false),
+        first_field(true),
+        malformed(0)
+    {
+        struct stat info;
+
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return;
+        if (::fstat(fd, &info) != 0)
+        {
+            close();
+            return;
+        }
+        size = info.st_size;
+        if (size > 0)
+        {
+            mapped = ::mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED)
+            {
+                mapped = NULL;
+                close();
+                return;
+            }
+            ::madvise(mapped, size, MADV_SEQUENTIAL);
+            begin = static_cast<const char*>(mapped);
+        }
+        end = begin + size;
+        next_line = begin;
+    }
+
+    ~record_reader()
+    {
+        close();
+    }
+
+    /** @brief Checks whether the file could be opened.
+     */
+    bool is_open() const
+    {
+        return fd >= 0;
+    }
+
+    /** @brief Moves to the next record, skipping blank and comment lines.
+     *
+     *  @return Returns @a false at the end of the file.
+     */
+    bool next()
+    {
+        while (next_line != end)
+        {
+            /* memchr is vectorized, so finding the line end scans 16 or more bytes at a time. */
+            const char* newline = static_cast<const char*>(
+                std::memchr(next_line, '\n', end - next_line));
+
+            record_begin = next_line;
+            record_end = newline != NULL ? newline : end;
+            next_line = newline != NULL ? newline + 1 : end;
+            cursor = record_begin;
+            line_number++;
+            failed = false;
+            first_field = true;
+            skip_blanks();
+            if (cursor != record_end && (comment == '\0' || *cursor != comment))
+                return true;
+        }
+        cursor = record_begin = record_end = end;
+        return false;
+    }
+
+    /** @brief Extracts the next field.
+     *
+     *  @param[out] field Receives the field.
+     */
+    record_reader& operator>>(record_field& field)
+    {
+        if (failed)
+            return *this;
+        skip_separator();
+        scan_field(field);
+        return *this;
+    }
+
+    record_reader& operator>>(int16_t& value)
+    {
+        return extract(value);
+    }
+
+    record_reader& operator>>(int32_t& value)
+    {
+        return extract(value);
+    }
+
+    record_reader& operator>>(int64_t& value)
+    {
+        return extract(value);
+    }
+
+    /** @brief Checks the record was read whole: every extraction succeeded
+     *    and no field is left. Reports it as malformed otherwise.
+     */
+    bool valid()
+    {
+        skip_blanks();
+        if (!failed && cursor == record_end)
+            return true;
+        return reject("malformed record");
+    }
+
+    /** @brief Reports the current record as malformed, for a field that was
+     *    extracted but cannot be used.
+     *
+     *  @param[in] reason What is wrong with the record.
+     *  @return Returns @a false.
+     */
+    bool reject(const char* reason)
+    {
+        if (malformed < record_reader_max_reports)
+            std::cerr << path << ":" << line_number << ": " << reason << ": "
+                      << std::string(record_begin, record_end) << "\n";
+        else if (malformed == record_reader_max_reports)
+            std::cerr << path << ": more malformed records not shown\n";
+        malformed++;
+        failed = true;
+        return false;
+    }
+
+    /** @brief Gets the line number of the current record, starting at 1.
+     */
+    std::size_t line() const
+    {
+        return line_number;
+    }
+
+    /** @brief Gets the number of malformed records seen so far.
+     */
+    std::size_t malformed_count() const
+    {
+        return malformed;
+    }
+
+private:
+    static bool is_separator(char c)
+    {
+        return c == ' ' || c == '\t' || c == ',' || c == '\r';
+    }
+
+    void skip_blanks()
+    {
+        while (cursor != record_end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+            cursor++;
+    }
+
+    /** @brief Skips the blanks and the comma before a field. Only one comma
+     *    separates two fields, and none comes before the first, so that an
+     *    empty field, as in "a,,b" or ",a", fails to extract instead of
+     *    shifting the fields after it.
+     */
+    void skip_separator()
+    {
+        skip_blanks();
+        if (!first_field && cursor != record_end && *cursor == ',')
+        {
+            cursor++;
+            skip_blanks();
+        }
+        first_field = false;
+    }
+
+    /** @brief Reads the field at the cursor, which fails if it is empty.
+     */
+    void scan_field(record_field& field)
+    {
+        const char* start = cursor;
+
+        while (cursor != record_end && !is_separator(*cursor))
+            cursor++;
+        field.data = start;
+        field.size = cursor - start;
+        failed = field.size == 0;
+    }
+
+    /** @brief Extracts an integer field. The common case, a field of plain
+     *    digits, is parsed while it is scanned.
+     */
+    template <typename T>
+    record_reader& extract(T& value)
+    {
+        if (failed)
+            return *this;
+        skip_separator();
+
+        const char* start = cursor;
+        uint64_t result = 0;
+
+        while (cursor != record_end && (unsigned int) (*cursor - '0') <= 9 &&
+               cursor - start < std::numeric_limits<uint64_t>::digits10)
+            result = result * 10 + (*cursor++ - '0');
+        if (cursor != start && (cursor == record_end || is_separator(*cursor)) &&
+            result <= (uint64_t) std::numeric_limits<T>::max())
+        {
+            value = (T) result;
+            return *this;
+        }
+
+        record_field field;
+
+        cursor = start;
+        scan_field(field);
+        if (!failed && !parse_integer(field.data, field.data + field.size, value))
+            failed = true;
+        return *this;
+    }
+
+    void close()
+    {
+        if (mapped != NULL)
+            ::munmap(mapped, size);
+        if (fd >= 0)
+            ::close(fd);
+        mapped = NULL;
+        fd = -1;
+    }
+
+    std::string path;
+    char comment;
+    int fd;
+    void* mapped;
+    std::size_t size;
+    const char* begin;
+    const char* end;
+    const char* next_line;
+    /* The current record, and its next character. */
+    const char* record_begin;
+    const char* record_end;
+    const char* cursor;
+    std::size_t line_number;
+    /* Whether an extraction from the current record failed. */
+    bool failed;
+    /* Whether no field of the current record was extracted yet. */
+    bool first_field;
+    std::size_t malformed;
+};
+
+}}
+
+#endif
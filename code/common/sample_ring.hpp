@@ -0,0 +1,138 @@
+/** @file common/sample_ring.hpp
+ *  Bounded lock free queue for handing samples from request threads to a
+ *  background thread. Pushing never blocks and never allocates: when the
+ *  queue is full the sample is dropped, so a slow consumer costs samples,
+ *  not request latency.
+ */
+
+#ifndef EBAY_COMMON_SAMPLE_RING_HPP
+#define EBAY_COMMON_SAMPLE_RING_HPP
+
+#include <vector>
+#include <stdexcept>
+#include <stdint.h>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace ebay { namespace common
+{
+
+/** @brief @a sample_ring is a bounded queue of T for any number of producers
+ *    and consumers. Every cell carries a sequence number, telling whether it
+ *    is free for the producer of a position or filled for its consumer, so
+ *    producers and consumers only contend on their own position counters.
+ */
+template <typename T>
+class sample_ring : private boost::noncopyable
+{
+public:
+    /** @brief Constructs an empty ring.
+     *
+     *  @param[in] capacity The number of samples, a power of two.
+     */
+    explicit sample_ring(std::size_t capacity) :
+        cells(capacity),
+        mask(capacity - 1),
+        push_position(0),
+        pop_position(0)
+    {
+        if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+            throw std::invalid_argument("sample ring: capacity must be a power of two");
+        for (std::size_t i = 0; i < capacity; i++)
+            cells[i].sequence.store(i, boost::memory_order_relaxed);
+    }
+
+    /** @brief Adds a sample, unless the ring is full.
+     *
+     *  @return Returns @a false if the sample was dropped.
+     */
+    bool try_push(const T& sample)
+    {
+        std::size_t position = push_position.load(boost::memory_order_relaxed);
+
+        for (;;)
+        {
+            cell& c = cells[position & mask];
+            std::size_t sequence = c.sequence.load(boost::memory_order_acquire);
+            intptr_t lag = (intptr_t) sequence - (intptr_t) position;
+
+            if (lag == 0)
+            {
+                if (push_position.compare_exchange_weak(position, position + 1,
+                                                        boost::memory_order_relaxed))
+                {
+                    c.sample = sample;
+                    c.sequence.store(position + 1, boost::memory_order_release);
+                    return true;
+                }
+            }
+            else if (lag < 0)
+                return false;
+            else
+                position = push_position.load(boost::memory_order_relaxed);
+        }
+    }
+
+    /** @brief Removes the oldest sample, if any.
+     *
+     *  @param[out] sample Receives the sample.
+     *  @return Returns @a false if the ring is empty.
+     */
+    bool try_pop(T& sample)
+    {
+        std::size_t position = pop_position.load(boost::memory_order_relaxed);
+
+        for (;;)
+        {
+            cell& c = cells[position & mask];
+            std::size_t sequence = c.sequence.load(boost::memory_order_acquire);
+            intptr_t lag = (intptr_t) sequence - (intptr_t) (position + 1);
+
+            if (lag == 0)
+            {
+                if (pop_position.compare_exchange_weak(position, position + 1,
+                                                       boost::memory_order_relaxed))
+                {
+                    sample = c.sample;
+                    c.sequence.store(position + mask + 1, boost::memory_order_release);
+                    return true;
+                }
+            }
+            else if (lag < 0)
+                return false;
+            else
+                position = pop_position.load(boost::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct cell
+    {
+        cell() :
+            sequence(0),
+            sample()
+        {
+        }
+
+        cell(const cell& other) :
+            sequence(other.sequence.load(boost::memory_order_relaxed)),
+            sample(other.sample)
+        {
+        }
+
+        boost::atomic<std::size_t> sequence;
+        T sample;
+    };
+
+    std::vector<cell> cells;
+    std::size_t mask;
+    /* Kept on separate cache lines, as producers and consumers run on different threads. */
+    char padding_before[64];
+    boost::atomic<std::size_t> push_position;
+    char padding_between[64];
+    boost::atomic<std::size_t> pop_position;
+};
+
+}}
+
+#endif
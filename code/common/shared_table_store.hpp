@@ -0,0 +1,278 @@
+/** @file common/shared_table_store.hpp
+ *  A per host store of table files, in a directory such as /dev/shm, shared
+ *  by every process of the host. The first process that needs a table built
+ *  from a source file writes it to the store, and every process, that one
+ *  included, maps it read only, so the host keeps one copy of the table in
+ *  memory instead of one per process.
+ *
+ *  Every table file is named after its source file, a key computed from the
+ *  canonical path of the source file and the format of the table, and a
+ *  version computed from the identity of the source file, so a new source
+ *  file or format gets a new table file, and sources of the same name in
+ *  different directories, or tables of different formats built from one
+ *  source, never replace each other. Processes hold a shared
+ *  lock on the table files they use, which counts their references: a table
+ *  file that nobody holds is removed once a newer version is written.
+ */
+
+#ifndef EBAY_COMMON_SHARED_TABLE_STORE_HPP
+#define EBAY_COMMON_SHARED_TABLE_STORE_HPP
+
+#include <string>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <stdexcept>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <boost/noncopyable.hpp>
+#include "common/flat_table.hpp"
+
+namespace ebay { namespace common
+{
+
+/** @brief The @a shared_table_segment class holds a reference to a table
+ *    file of the store, for as long as the table is in use.
+ */
+class shared_table_segment : private boost::noncopyable
+{
+public:
+    /** @brief Takes a reference to a table file.
+     *
+     *  @param[in] path The path of the table file.
+     *  @param[in] fd A descriptor of the table file, owned from now on.
+     */
+    shared_table_segment(const std::string& path, int fd) :
+        file_path(path),
+        fd(fd)
+    {
+        if (::flock(fd, LOCK_SH) != 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("shared table store: cannot lock " + path + ": " +
+                                     std::strerror(errno));
+        }
+    }
+
+    /** @brief Releases the reference. The file stays mapped by the tables
+     *    opened from it until they are released too.
+     */
+    ~shared_table_segment()
+    {
+        ::close(fd);
+    }
+
+    const char* path() const
+    {
+        return file_path.c_str();
+    }
+
+private:
+    std::string file_path;
+    int fd;
+};
+
+/** @brief @a shared_table_store builds and finds the table files of a
+ *    store directory.
+ */
+class shared_table_store : private boost::noncopyable
+{
+public:
+    /** @brief Opens a store.
+     *
+     *  @param[in] directory The directory of the store; it is created if
+     *    it does not exist.
+     */
+    explicit shared_table_store(const std::string& directory) :
+        directory(directory)
+    {
+        if (::mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+            fail("cannot create", directory);
+    }
+
+    /** @brief Gets the table file built from a source file, building it if
+     *    no process has yet. Processes attaching the same table wait for the
+     *    one building it.
+     *
+     *  @param[in] source The path of the source file.
+     *  @param[in] format A signature of the format of the table file.
+     *  @param[in] build build(path) writes the table file to path.
+     *  @return Returns a reference to the table file, owned by the caller.
+     */
+    template <typename Build>
+    shared_table_segment* attach(const char* source, uint64_t format, const Build& build) const
+    {
+        std::string name = base_name(source) + "." + table_key(source, format);
+        std::string prefix = directory + "/" + name + ".";
+        std::string path = prefix + version(source, format) + ".table";
+        std::string lock_path = directory + "/" + name + ".lock";
+        int lock_fd = ::open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+
+        if (lock_fd < 0)
+            fail("cannot open", lock_path);
+        /* Held while the table file is built, and until the reference is taken. */
+        if (::flock(lock_fd, LOCK_EX) != 0)
+        {
+            ::close(lock_fd);
+            fail("cannot lock", lock_path);
+        }
+
+        shared_table_segment* segment = NULL;
+
+        try
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+
+            if (fd < 0)
+            {
+                std::ostringstream temporary;
+
+                temporary << path << ".tmp" << ::getpid();
+                build(temporary.str().c_str());
+                if (::rename(temporary.str().c_str(), path.c_str()) != 0)
+                {
+                    ::unlink(temporary.str().c_str());
+                    fail("cannot rename", temporary.str());
+                }
+                fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0)
+                    fail("cannot open", path);
+            }
+            segment = new shared_table_segment(path, fd);
+            remove_unused(name + ".", path);
+        }
+        catch (...)
+        {
+            delete segment;
+            ::close(lock_fd);
+            throw;
+        }
+        ::close(lock_fd);
+        return segment;
+    }
+
+private:
+    static std::string base_name(const char* source)
+    {
+        const char* slash = std::strrchr(source, '/');
+
+        return slash != NULL ? slash + 1 : source;
+    }
+
+    /** @brief Computes the key of a table from the canonical path of its
+     *    source file and the format of the table.
+     */
+    static std::string table_key(const char* source, uint64_t format)
+    {
+        char* canonical = ::realpath(source, NULL);
+        char text[17];
+
+        if (canonical == NULL)
+            fail("cannot resolve", source);
+
+        uint64_t hash = flat_table_mix(0x9e3779b97f4a7c15ULL, format);
+        std::size_t i = 0;
+        std::size_t length = std::strlen(canonical);
+
+        for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+        {
+            uint64_t word;
+
+            std::memcpy(&word, canonical + i, sizeof(word));
+            hash = flat_table_mix(hash, word);
+        }
+        for (; i < length; i++)
+            hash = flat_table_mix(hash, (uint8_t) canonical[i]);
+        std::free(canonical);
+        std::snprintf(text, sizeof(text), "%016llx", (unsigned long long) hash);
+        return text;
+    }
+
+    /** @brief Computes the version of a table file from the identity of its
+     *    source file and the format of the table.
+     */
+    static std::string version(const char* source, uint64_t format)
+    {
+        struct stat st;
+        char text[17];
+
+        if (::stat(source, &st) != 0)
+            fail("cannot read", source);
+
+        uint64_t hash = flat_table_mix(0x2545f4914f6cdd1dULL, format);
+
+        hash = flat_table_mix(hash, flat_table_version);
+        hash = flat_table_mix(hash, (uint64_t) st.st_dev);
+        hash = flat_table_mix(hash, (uint64_t) st.st_ino);
+        hash = flat_table_mix(hash, (uint64_t) st.st_size);
+        hash = flat_table_mix(hash, (uint64_t) st.st_mtim.tv_sec);
+        hash = flat_table_mix(hash, (uint64_t) st.st_mtim.tv_nsec);
+        std::snprintf(text, sizeof(text), "%016llx", (unsigned long long) hash);
+        return text;
+    }
+
+    /** @brief Removes the other versions of a table file that no process
+     *    holds. Called with the lock of the table held, so that no process
+     *    takes a reference meanwhile.
+     */
+    void remove_unused(const std::string& prefix, const std::string& current) const
+    {
+        DIR* dir = ::opendir(directory.c_str());
+        struct dirent* entry;
+
+        if (dir == NULL)
+            return;
+        while ((entry = ::readdir(dir)) != NULL)
+        {
+            std::string path = directory + "/" + entry->d_name;
+
+            if (path == current || !is_version(entry->d_name, prefix))
+                continue;
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+
+            if (fd < 0)
+                continue;
+            if (::flock(fd, LOCK_EX | LOCK_NB) == 0)
+                ::unlink(path.c_str());
+            ::close(fd);
+        }
+        ::closedir(dir);
+    }
+
+    /** @brief Checks whether a file name is a version of a table file, or a
+     *    table file left behind by a process that stopped while building it.
+     */
+    static bool is_version(const char* name, const std::string& prefix)
+    {
+        if (std::strncmp(name, prefix.c_str(), prefix.size()) != 0)
+            return false;
+        name += prefix.size();
+        for (std::size_t i = 0; i < 16; i++)
+        {
+            if (!std::isxdigit((unsigned char) name[i]))
+                return false;
+        }
+        return std::strncmp(name + 16, ".table", 6) == 0 &&
+               (name[22] == '\0' || std::strncmp(name + 22, ".tmp", 4) == 0);
+    }
+
+    static void fail(const char* what, const std::string& path)
+    {
+        throw std::runtime_error(std::string("shared table store: ") + what + " " + path +
+                                 ": " + std::strerror(errno));
+    }
+
+    std::string directory;
+};
+
+}}
+
+#endif
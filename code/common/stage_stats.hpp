@@ -0,0 +1,175 @@
+/** @file common/stage_stats.hpp
+ *  Counters describing one stage of a lookup cascade: how often it answers,
+ *  how many table probes it makes, and, for a sample of the calls, how many
+ *  cycles it takes. Everything is exported through counters_stats, so the
+ *  stages can be compared on production traffic.
+ */
+
+#ifndef EBAY_COMMON_STAGE_STATS_HPP
+#define EBAY_COMMON_STAGE_STATS_HPP
+
+#include <string>
+#include <cstdio>
+#include <stdint.h>
+#include <time.h>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "xplat/counters_stats.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace ebay { namespace common
+{
+
+/* Probe count buckets: 0, 1, 2, 3-4, 5-8, 9-16 and more. */
+static const std::size_t stage_probe_buckets = 7;
+/* Cycle count buckets: below 2^6, then one per power of two up to 2^20 and more. */
+static const std::size_t stage_cycle_buckets = 16;
+static const std::size_t stage_cycle_first_log2 = 6;
+
+/** @brief Reads a cheap, monotonic timestamp: the time stamp counter where
+ *    there is one, nanoseconds otherwise.
+ */
+inline uint64_t read_timestamp()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+#endif
+}
+
+/** @brief Decides whether the calling thread times this call. Every
+ *    @a period th call of each thread is timed.
+ *
+ *  @param[in] period The sampling period, a power of two.
+ */
+inline bool sample_timing(uint32_t period)
+{
+    static __thread uint32_t calls;
+
+    return (calls++ & (period - 1)) == 0;
+}
+
+/** @brief Gets the index of the highest set bit, -1 for 0.
+ */
+inline int floor_log2(uint64_t value)
+{
+    return value == 0 ? -1 : 63 - __builtin_clzll(value);
+}
+
+/** @brief @a stage_stats holds the counters of one stage, named
+ *    <prefix>.hit, <prefix>.miss, <prefix>.probes_<n> and <prefix>.cycles_<n>.
+ */
+class stage_stats : private boost::noncopyable
+{
+public:
+    typedef ebay::xplat::counters_stats::counter_registration counter;
+
+    /** @brief Registers the counters of a stage.
+     *
+     *  @param[in] prefix The name all of the stage's counters start with.
+     */
+    explicit stage_stats(const std::string& prefix)
+    {
+        static const char* const probe_names[stage_probe_buckets] =
+            { "0", "1", "2", "4", "8", "16", "more" };
+
+        register_counter(hit, hit_name, prefix + ".hit");
+        register_counter(miss, miss_name, prefix + ".miss");
+        for (std::size_t i = 0; i < stage_probe_buckets; i++)
+            register_counter(probes[i], probe_counter_names[i],
+                             prefix + ".probes_" + probe_names[i]);
+        for (std::size_t i = 0; i < stage_cycle_buckets; i++)
+        {
+            char name[32];
+
+            /* cycles_<n> counts the calls of 2^(n-1) up to 2^n cycles. */
+            if (i + 1 < stage_cycle_buckets)
+                std::snprintf(name, sizeof(name), ".cycles_%u",
+                              (unsigned) (stage_cycle_first_log2 + i));
+            else
+                std::snprintf(name, sizeof(name), ".cycles_more");
+            register_counter(cycles[i], cycle_counter_names[i], prefix + name);
+        }
+    }
+
+    /** @brief Records one call of the stage.
+     *
+     *  @param[in] found Whether the stage answered.
+     *  @param[in] probe_count The number of table probes it made.
+     */
+    void record(bool found, uint32_t probe_count)
+    {
+        std::size_t bucket = probe_count == 0 ? 0 : floor_log2(probe_count - 1) + 2;
+
+        (found ? hit : miss)->enabled_add_sample(1);
+        probes[bucket < stage_probe_buckets ? bucket : stage_probe_buckets - 1]->
+            enabled_add_sample(1);
+    }
+
+    /** @brief Records the duration of a sampled call of the stage.
+     *
+     *  @param[in] elapsed The difference of two read_timestamp() values.
+     */
+    void record_time(uint64_t elapsed)
+    {
+        int bucket = floor_log2(elapsed) + 1 - (int) stage_cycle_first_log2;
+
+        if (bucket < 0)
+            bucket = 0;
+        if (bucket >= (int) stage_cycle_buckets)
+            bucket = (int) stage_cycle_buckets - 1;
+        cycles[bucket]->enabled_add_sample(1);
+    }
+
+private:
+    /** @brief Registers a counter; the name is kept for as long as the counter.
+     */
+    static void register_counter(boost::scoped_ptr<counter>& target, std::string& name,
+                                 const std::string& value)
+    {
+        name = value;
+        target.reset(new counter(name.c_str(), &ebay::xplat::counters_add_merger, true));
+    }
+
+    std::string hit_name;
+    std::string miss_name;
+    std::string probe_counter_names[stage_probe_buckets];
+    std::string cycle_counter_names[stage_cycle_buckets];
+    boost::scoped_ptr<counter> hit;
+    boost::scoped_ptr<counter> miss;
+    boost::scoped_ptr<counter> probes[stage_probe_buckets];
+    boost::scoped_ptr<counter> cycles[stage_cycle_buckets];
+};
+
+/** @brief @a stage_timer times one call of a stage when the call is sampled,
+ *    and does nothing otherwise.
+ */
+class stage_timer : private boost::noncopyable
+{
+public:
+    stage_timer(stage_stats& stats, bool sampled) :
+        stats(stats),
+        start(sampled ? read_timestamp() : 0)
+    {
+    }
+
+    ~stage_timer()
+    {
+        if (start != 0)
+            stats.record_time(read_timestamp() - start);
+    }
+
+private:
+    stage_stats& stats;
+    uint64_t start;
+};
+
+}}
+
+#endif
@@ -0,0 +1,462 @@
+/** @file common/tree_ensemble.hpp
+ *  Inference for boosted tree ensembles over integer features. A model is
+ *  read from the text dump of XGBoost, then its trees are flattened into
+ *  arrays of nodes, each tree breadth first, so that the top levels of all
+ *  the trees stay in cache. Evaluating a tree is a loop that selects the
+ *  next node with an index computed from the comparison, without a branch.
+ *  Batches of items are walked through each tree together, eight at a time
+ *  with AVX2 gathers and compares when the processor supports them.
+ */
+
+#ifndef EBAY_COMMON_TREE_ENSEMBLE_HPP
+#define EBAY_COMMON_TREE_ENSEMBLE_HPP
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cmath>
+#include <limits>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+/* The AVX2 path is compiled for x86 whatever the target, and chosen at run time. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EBAY_TREE_ENSEMBLE_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace ebay { namespace common
+{
+
+/** @brief The @a tree_ensemble_node struct holds one node of a tree, as
+ *    read from a model file.
+ */
+struct tree_ensemble_node
+{
+    tree_ensemble_node() :
+        id(-1),
+        feature(-1),
+        threshold(0),
+        yes(-1),
+        no(-1),
+        value(0)
+    {
+    }
+
+    bool is_leaf() const
+    {
+        return feature < 0;
+    }
+
+    /* Id of the node in its tree. */
+    int32_t id;
+    /* Feature compared by a split, -1 for a leaf. */
+    int32_t feature;
+    /* A split goes to yes when the feature is below the threshold. */
+    double threshold;
+    int32_t yes;
+    int32_t no;
+    /* Value of a leaf. */
+    double value;
+};
+
+/* The nodes of every tree of a model, in file order. */
+typedef std::vector<std::vector<tree_ensemble_node> > tree_ensemble_trees;
+
+/** @brief Reads the trees of an XGBoost text dump, made with dump_model()
+ *    without a feature map. Features are named f<index>; lines look like
+ *
+ *      base_score=0.5
+ *      booster[0]:
+ *      0:[f3<12.5] yes=1,no=2,missing=1
+ *          1:leaf=0.25
+ *          2:leaf=-0.125
+ *
+ *    XGBoost does not dump the base score of the model, so it is added as
+ *    a line before the first booster. The macro and the table builder both
+ *    take it from there; without the line it is 0.
+ *
+ *  @param[in] path The path of the dump.
+ *  @param[in] feature_count The number of features; indexes must be below it.
+ *  @param[out] base_score Receives the base score, if not NULL.
+ *  @return Returns the trees.
+ */
+inline tree_ensemble_trees read_tree_ensemble(const char* path, int32_t feature_count,
+                                              double* base_score = NULL)
+{
+    std::ifstream ifs(path);
+    std::string line;
+    std::size_t line_number = 0;
+    tree_ensemble_trees trees;
+    double score = 0;
+
+    if (!ifs)
+        throw std::runtime_error(std::string("tree model: cannot read ") + path);
+    while (std::getline(ifs, line))
+    {
+        std::ostringstream where;
+        std::size_t start = line.find_first_not_of(" \t");
+        tree_ensemble_node node;
+        char* end = NULL;
+
+        line_number++;
+        where << "tree model " << path << ":" << line_number << ": ";
+        if (start == std::string::npos)
+            continue;
+        if (line.compare(start, 11, "base_score=") == 0)
+        {
+            const char* text = line.c_str() + start + 11;
+
+            if (!trees.empty())
+                throw std::runtime_error(where.str() + "base score after the first booster");
+            score = std::strtod(text, &end);
+            if (end == text)
+                throw std::runtime_error(where.str() + "bad base score");
+            continue;
+        }
+        if (line.compare(start, 8, "booster[") == 0)
+        {
+            trees.push_back(std::vector<tree_ensemble_node>());
+            continue;
+        }
+        if (trees.empty())
+            throw std::runtime_error(where.str() + "node outside of a booster");
+
+        const char* text = line.c_str() + start;
+
+        node.id = (int32_t) std::strtol(text, &end, 10);
+        if (end == text || *end != ':' || node.id < 0)
+            throw std::runtime_error(where.str() + "bad node id");
+        text = end + 1;
+        if (std::strncmp(text, "leaf=", 5) == 0)
+        {
+            node.value = std::strtod(text + 5, &end);
+            if (end == text + 5)
+                throw std::runtime_error(where.str() + "bad leaf value");
+        }
+        else
+        {
+            if (std::strncmp(text, "[f", 2) != 0)
+                throw std::runtime_error(where.str() + "expected a split on f<index>");
+            node.feature = (int32_t) std::strtol(text + 2, &end, 10);
+            if (end == text + 2 || *end != '<' || node.feature < 0 ||
+                node.feature >= feature_count)
+                throw std::runtime_error(where.str() + "bad split feature");
+            text = end + 1;
+            node.threshold = std::strtod(text, &end);
+            if (end == text || std::strncmp(end, "] yes=", 6) != 0)
+                throw std::runtime_error(where.str() + "bad split threshold");
+            text = end + 6;
+            node.yes = (int32_t) std::strtol(text, &end, 10);
+            if (end == text || std::strncmp(end, ",no=", 4) != 0)
+                throw std::runtime_error(where.str() + "bad yes branch");
+            text = end + 4;
+            node.no = (int32_t) std::strtol(text, &end, 10);
+            if (end == text)
+                throw std::runtime_error(where.str() + "bad no branch");
+        }
+        trees.back().push_back(node);
+    }
+    if (base_score != NULL)
+        *base_score = score;
+    return trees;
+}
+
+/** @brief Gets the smallest integer t such that, for integer features,
+ *    x < threshold is x < t.
+ */
+inline int32_t tree_ensemble_threshold(double threshold)
+{
+    double rounded = std::ceil(threshold);
+
+    if (rounded <= std::numeric_limits<int32_t>::min())
+        return std::numeric_limits<int32_t>::min();
+    if (rounded >= std::numeric_limits<int32_t>::max())
+        return std::numeric_limits<int32_t>::max();
+    return (int32_t) rounded;
+}
+
+/** @brief @a tree_ensemble evaluates the sum of the leaves an integer
+ *    feature vector reaches in every tree of a model.
+ *
+ *    Splits are stored as integer thresholds: for integer features, x < t
+ *    holds exactly when x < ceil(t). Internal nodes are kept in parallel
+ *    arrays, and the two children of a node side by side, the one for
+ *    x < t first. A child index below zero is the complement of a leaf
+ *    index. Features are never missing, so the missing branches of the
+ *    dump are not used.
+ */
+class tree_ensemble : private boost::noncopyable
+{
+public:
+    /** @brief Builds the ensemble from the trees of a model.
+     *
+     *  @param[in] trees The trees.
+     *  @param[in] base_score The score added to the sum of the leaves.
+     */
+    tree_ensemble(const tree_ensemble_trees& trees, double base_score) :
+        base_score(base_score),
+        depth(0)
+    {
+        for (std::size_t t = 0; t < trees.size(); t++)
+            add_tree(trees[t], t);
+    }
+
+    /** @brief Scores a feature vector.
+     *
+     *  @param[in] features The features, indexed like the f<index> names of
+     *    the model.
+     */
+    double evaluate(const int32_t features[]) const
+    {
+        double score = base_score;
+
+        for (std::size_t t = 0; t < roots.size(); t++)
+        {
+            int32_t node = roots[t];
+
+            while (node >= 0)
+                node = children[2 * node + (features[split_features[node]] >= thresholds[node])];
+            score += leaves[~node];
+        }
+        return score;
+    }
+
+    /** @brief Scores an item whose features are computed on demand, so that
+     *    features no split on its paths compares are never computed.
+     *
+     *  @param[in,out] features A function object; features(f) gets feature
+     *    f, and is called every time a split compares it.
+     */
+    template <typename Features>
+    double evaluate_lazy(Features& features) const
+    {
+        double score = base_score;
+
+        for (std::size_t t = 0; t < roots.size(); t++)
+        {
+            int32_t node = roots[t];
+
+            while (node >= 0)
+                node = children[2 * node + (features(split_features[node]) >= thresholds[node])];
+            score += leaves[~node];
+        }
+        return score;
+    }
+
+    /** @brief Scores a batch of feature vectors, stored column by column.
+     *    Every score is summed in the same order as by evaluate(), so both
+     *    give the same results.
+     *
+     *  @param[in] features The features, feature f of item i at
+     *    features[f * stride + i].
+     *  @param[in] stride The distance between two columns, at least count.
+     *  @param[in] count The number of items.
+     *  @param[out] scores Receives one score per item.
+     */
+    void evaluate_batch(const int32_t features[], std::size_t stride, std::size_t count,
+                        double scores[]) const
+    {
+        std::size_t i = 0;
+
+#ifdef EBAY_TREE_ENSEMBLE_AVX2
+        if (has_avx2())
+        {
+            for (; i + 8 <= count; i += 8)
+                evaluate_lanes(features + i, stride, scores + i);
+        }
+#endif
+        /* The remaining items go through each tree one after the other. */
+        for (std::size_t j = i; j < count; j++)
+            scores[j] = base_score;
+        for (std::size_t t = 0; t < roots.size(); t++)
+        {
+            for (std::size_t j = i; j < count; j++)
+            {
+                int32_t node = roots[t];
+
+                while (node >= 0)
+                    node = children[2 * node +
+                                    (features[split_features[node] * stride + j] >= thresholds[node])];
+                scores[j] += leaves[~node];
+            }
+        }
+    }
+
+    std::size_t tree_count() const
+    {
+        return roots.size();
+    }
+
+    std::size_t node_count() const
+    {
+        return split_features.size() + leaves.size();
+    }
+
+    /** @brief Gets the memory taken by the node arrays, in bytes.
+     */
+    std::size_t memory_size() const
+    {
+        return (roots.size() + split_features.size() + thresholds.size() + children.size()) *
+               sizeof(int32_t) + leaves.size() * sizeof(double);
+    }
+
+    /** @brief Gets the largest number of splits on a path from a root to a leaf.
+     */
+    std::size_t max_depth() const
+    {
+        return depth;
+    }
+
+private:
+    /** @brief Flattens a tree, breadth first, checking that every node is
+     *    defined once and reached once from the root.
+     */
+    void add_tree(const std::vector<tree_ensemble_node>& nodes, std::size_t tree)
+    {
+        std::map<int32_t, const tree_ensemble_node*> by_id;
+        /* Ids of the nodes to place, with their depths and the child slot pointing at them. */
+        std::deque<int32_t> pending;
+        std::deque<std::size_t> depths;
+        std::deque<int32_t*> slots;
+        std::size_t placed = 0;
+        int32_t root = 0;
+
+        for (std::size_t i = 0; i < nodes.size(); i++)
+        {
+            if (!by_id.insert(std::make_pair(nodes[i].id, &nodes[i])).second)
+                invalid(tree, "node defined twice");
+        }
+        if (by_id.find(0) == by_id.end())
+            invalid(tree, "no root node");
+        /* The children of a node are placed after it, so their slots are only resized below. */
+        children.reserve(children.size() + 2 * nodes.size());
+        pending.push_back(0);
+        depths.push_back(0);
+        slots.push_back(&root);
+        while (!pending.empty())
+        {
+            std::map<int32_t, const tree_ensemble_node*>::const_iterator it =
+                by_id.find(pending.front());
+
+            if (it == by_id.end())
+                invalid(tree, "branch to an undefined node");
+            if (++placed > nodes.size())
+                invalid(tree, "node reached twice");
+
+            const tree_ensemble_node& node = *it->second;
+
+            if (node.is_leaf())
+            {
+                *slots.front() = ~(int32_t) leaves.size();
+                leaves.push_back(node.value);
+            }
+            else
+            {
+                int32_t index = (int32_t) split_features.size();
+
+                *slots.front() = index;
+                split_features.push_back(node.feature);
+                thresholds.push_back(tree_ensemble_threshold(node.threshold));
+                children.push_back(0);
+                children.push_back(0);
+                pending.push_back(node.yes);
+                pending.push_back(node.no);
+                depths.push_back(depths.front() + 1);
+                depths.push_back(depths.front() + 1);
+                slots.push_back(&children[2 * index]);
+                slots.push_back(&children[2 * index + 1]);
+                depth = std::max(depth, depths.front() + 1);
+            }
+            pending.pop_front();
+            depths.pop_front();
+            slots.pop_front();
+        }
+        if (placed != nodes.size())
+            invalid(tree, "node not reached from the root");
+        roots.push_back(root);
+    }
+
+#ifdef EBAY_TREE_ENSEMBLE_AVX2
+    static bool has_avx2()
+    {
+        static const bool supported = __builtin_cpu_supports("avx2");
+
+        return supported;
+    }
+
+    /** @brief Scores eight items, one per lane. A lane that has reached a
+     *    leaf keeps its node while the others go on down the tree.
+     */
+    __attribute__((target("avx2")))
+    void evaluate_lanes(const int32_t features[], std::size_t stride, double scores[]) const
+    {
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i columns = _mm256_set1_epi32((int32_t) stride);
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i none = _mm256_set1_epi32(-1);
+        const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        __m256d low = _mm256_set1_pd(base_score);
+        __m256d high = _mm256_set1_pd(base_score);
+
+        for (std::size_t t = 0; t < roots.size(); t++)
+        {
+            __m256i node = _mm256_set1_epi32(roots[t]);
+            __m256i split = _mm256_cmpgt_epi32(node, none);
+
+            while (!_mm256_testz_si256(split, split))
+            {
+                /* Lanes at a leaf read the first node, and keep their own. */
+                __m256i index = _mm256_and_si256(node, split);
+                __m256i feature = _mm256_i32gather_epi32(&split_features[0], index, 4);
+                __m256i value = _mm256_i32gather_epi32(
+                    features, _mm256_add_epi32(_mm256_mullo_epi32(feature, columns), lanes), 4);
+                __m256i threshold = _mm256_i32gather_epi32(&thresholds[0], index, 4);
+                /* 1 where value >= threshold, the second child. */
+                __m256i side = _mm256_andnot_si256(_mm256_cmpgt_epi32(threshold, value), one);
+                __m256i child = _mm256_i32gather_epi32(
+                    &children[0], _mm256_add_epi32(_mm256_add_epi32(index, index), side), 4);
+
+                node = _mm256_blendv_epi8(node, child, split);
+                split = _mm256_cmpgt_epi32(node, none);
+            }
+
+            __m256i leaf = _mm256_xor_si256(node, none);
+
+            low = _mm256_add_pd(low, _mm256_mask_i32gather_pd(
+                _mm256_setzero_pd(), &leaves[0], _mm256_castsi256_si128(leaf), all, 8));
+            high = _mm256_add_pd(high, _mm256_mask_i32gather_pd(
+                _mm256_setzero_pd(), &leaves[0], _mm256_extracti128_si256(leaf, 1), all, 8));
+        }
+        _mm256_storeu_pd(scores, low);
+        _mm256_storeu_pd(scores + 4, high);
+    }
+#endif
+
+    static void invalid(std::size_t tree, const char* what)
+    {
+        std::ostringstream message;
+
+        message << "tree model: booster[" << tree << "]: " << what;
+        throw std::runtime_error(message.str());
+    }
+
+    double base_score;
+    std::size_t depth;
+    /* First node of every tree. */
+    std::vector<int32_t> roots;
+    std::vector<int32_t> split_features;
+    std::vector<int32_t> thresholds;
+    std::vector<int32_t> children;
+    std::vector<double> leaves;
+};
+
+}}
+
+#endif
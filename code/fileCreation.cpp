@@ -1,4 +1,4 @@
-//g++ -Wall -O2 -c filecreationtool.cpp; g++ -O2 filecreationtool.o -o filecreationtool -lboost_serialization; ./filecreationtool
+//g++ -Wall -O2 -c filecreationtool.cpp; g++ -O2 filecreationtool.o -o filecreationtool -lboost_serialization -lboost_thread -ldl; ./filecreationtool
 
 /*
 SQL Query for Generic Services:
@@ -57,8 +57,18 @@ FROM SHIPPING_DELIVERY_EST_LKP
 #include <set>
 #include <vector>
 #include <fstream>
+#include <sstream>
 #include <iostream>
 #include <bitset>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <stdexcept>
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
 #include <boost/optional.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
@@ -70,6 +80,8 @@ FROM SHIPPING_DELIVERY_EST_LKP
 #include <boost/serialization/utility.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/unordered_set.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/type_traits/is_integral.hpp>
 #include <boost/date_time/gregorian/gregorian.hpp>
 #include <boost/date_time/gregorian/greg_calendar.hpp>
 #include <boost/date_time/posix_time/ptime.hpp>
@@ -78,7 +90,22 @@ FROM SHIPPING_DELIVERY_EST_LKP
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/assign/list_of.hpp>
-#include "perfect_hash_map.hpp"
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "common/prefix_match_index.hpp"
+#include "common/interval_index.hpp"
+#include "common/flat_table.hpp"
+#include "common/perfect_hash.hpp"
+#include "common/quantized_table.hpp"
+#include "common/direct_table.hpp"
+#include "common/compact_table.hpp"
+#include "common/tree_ensemble.hpp"
+#include "common/cascade_prefix_index.hpp"
+#include "common/area_matrix.hpp"
+#include "common/record_reader.hpp"
 
 
 
@@ -95,6 +122,170 @@ const boost::unordered_map<Key, Type, Hash, Compare, Allocator>& t)
 	boost::unordered_map<Key, Type, Hash, Compare, Allocator> >(ar, t);
 }
 
+/** @brief 
+* This function will write an object with a serialize() member, such as a
+* lookup index, to a binary archive and a text archive next to it.
+*/
+template <class Type>
+inline void save_object_archive(const char* output, const Type& t)
+{
+    std::ofstream ofs(output, std::ios_base::binary);
+    boost::archive::binary_oarchive oarc(ofs);
+    std::string out_text = output;
+    out_text += ".txt";
+    std::ofstream ofs_text(out_text.c_str());
+    boost::archive::text_oarchive oarc_text(ofs_text);
+    oarc << t;
+    oarc_text << t;
+}
+
+/** @brief 
+* This function will read an object written by save_object_archive().
+* Returns false if there is no such file.
+*/
+template <class Type>
+inline bool load_object_archive(const char* input, Type& t)
+{
+    std::ifstream ifs(input, std::ios_base::binary);
+    if (!ifs)
+        return false;
+    boost::archive::binary_iarchive iarc(ifs);
+    iarc >> t;
+    return true;
+}
+
+/** @brief Gets the key of a map entry or of a set entry.
+*/
+template <class Key, class Type>
+inline const Key& table_key(const std::pair<const Key, Type>& entry)
+{
+    return entry.first;
+}
+
+template <class Key>
+inline const Key& table_key(const Key& entry)
+{
+    return entry;
+}
+
+inline double elapsed_ns(const timespec& start, const timespec& stop)
+{
+    return (stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_nsec - start.tv_nsec);
+}
+
+/*
+* Whether the builder times the tables it writes: only when BUILD_BENCHMARK is set to
+* a nonzero value, as timing every table slows down the build
+*/
+inline bool build_benchmarks()
+{
+    const char* benchmark_env = std::getenv("BUILD_BENCHMARK");
+
+    return benchmark_env != NULL && std::atoi(benchmark_env) != 0;
+}
+
+/** @brief 
+* This function will time a lookup of every key of a table, in random order,
+* in the Boost container the builder filled and in the flat table written
+* from it, and print the cost per lookup of both. The order is the same on
+* every run, so that runs can be compared.
+*/
+template <class Table, class Container>
+inline void benchmark_flat_table(const char* output, const Table& table, const Container& t)
+{
+    typedef typename Table::key_type key_type;
+    std::vector<key_type> keys;
+    std::size_t found = 0;
+    unsigned int seed = 1;
+    timespec start;
+    timespec middle;
+    timespec stop;
+
+    for (typename Container::const_iterator it = t.begin(); it != t.end(); ++it)
+        keys.push_back(table_key(*it));
+    if (keys.empty())
+        return;
+    for (std::size_t i = keys.size() - 1; i > 0; i--)
+        std::swap(keys[i], keys[rand_r(&seed) % (i + 1)]);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (std::size_t i = 0; i < keys.size(); i++)
+        found += t.find(keys[i]) != t.end();
+    clock_gettime(CLOCK_MONOTONIC, &middle);
+    for (std::size_t i = 0; i < keys.size(); i++)
+        found += table.find(keys[i]) != table.end();
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    std::cout << output << ": " << keys.size() << " keys, "
+              << elapsed_ns(start, middle) / keys.size() << " ns per boost lookup, "
+              << elapsed_ns(middle, stop) / keys.size() << " ns per flat lookup"
+              << (found == 2 * keys.size() ? "" : ", LOOKUPS FAILED") << "\n";
+}
+
+/** @brief 
+* These functions will write a table in the flat format, which the macros
+* memory map and query in place, next to its archive with a .flat suffix,
+* then read it back and, with BUILD_BENCHMARK set, benchmark it against the
+* Boost container.
+*/
+template <class Key, class Type, class Hash, class Compare, class Allocator>
+inline void save_flat_table(
+    const char* output,
+    const boost::unordered_map<Key, Type, Hash, Compare, Allocator>& t)
+{
+    std::string out_flat = output;
+    out_flat += ".flat";
+    ebay::common::flat_table<Key, Type>::save(out_flat.c_str(), t);
+    if (!build_benchmarks())
+        return;
+    boost::scoped_ptr<ebay::common::flat_table<Key, Type> > table(
+        ebay::common::flat_table<Key, Type>::open(out_flat.c_str()));
+    benchmark_flat_table(out_flat.c_str(), *table, t);
+}
+
+template <class Key, class Hash, class Compare, class Allocator>
+inline void save_flat_table(
+    const char* output,
+    const boost::unordered_set<Key, Hash, Compare, Allocator>& t)
+{
+    std::string out_flat = output;
+    out_flat += ".flat";
+    ebay::common::flat_table<Key>::save(out_flat.c_str(), t);
+    if (!build_benchmarks())
+        return;
+    boost::scoped_ptr<ebay::common::flat_table<Key> > table(
+        ebay::common::flat_table<Key>::open(out_flat.c_str()));
+    benchmark_flat_table(out_flat.c_str(), *table, t);
+}
+
+/** @brief 
+* This function will write a map with small integer keys as a direct table, when its keys are
+* dense enough
+*/
+template <class Key, class Type, class Hash, class Compare, class Allocator>
+inline void save_direct_table(
+    const char* output,
+    const boost::unordered_map<Key, Type, Hash, Compare, Allocator>& t)
+{
+    std::string out_direct = output;
+    out_direct += ".direct";
+    if (!ebay::common::direct_table<Type>::is_dense(t.begin(), t.end()))
+    {
+        std::cout << "Keys too sparse for a direct table: " << output << "\n";
+        return;
+    }
+    ebay::common::direct_table<Type>::save(out_direct.c_str(), t.begin(), t.end());
+    std::cout << "Created direct table " << out_direct << "\n";
+}
+
+template <class Key, class Type>
+inline void save_flat_table(const char* output, const std::vector<std::pair<Key, Type> >& t)
+{
+    std::string out_flat = output;
+    out_flat += ".flat";
+    ebay::common::flat_table<Key, Type>::save(out_flat.c_str(), t.begin(), t.end());
+}
+
 /** @brief 
 * This function will serialize a boost::unordered_set
 */
@@ -266,6 +457,15 @@ struct holiday_info
 
 struct cbt_key
 {
+	/** @brief Constructs an empty cbt_key, as the flat table layout probe needs.
+	*/
+	cbt_key() :
+	shipping_service_id(0),
+	origin_country_id(0),
+	dest_country_id(0)
+	{
+	}
+
 	/** @brief Default Constructor for cbt_key
 	*
 	*  @param[in] service The shipping service id.
@@ -421,71 +621,6 @@ std::size_t hash_value(const shipping_zip_key& key)
 }
 
 
-/** @brief The @a zip_range_key struct holds the lookup key for the zip_range
-*    analytical map. It has a country id and a zip3 or zip.
-*/
-
-struct zip_range_key
-{
-	/** @brief Constructs a @a zip_range_key object.
-	*    This is the default constructor.
-	*/
-	zip_range_key() :
-	country_id(0),
-	zip(0)
-	{
-	}
-
-	/** @brief Constructs a @a zip_range_key object.
-	*
-	*  @param[in] country The country id.
-	*  @param[in] zipcode The zip or post code.
-	*/
-	zip_range_key(int32_t country, int16_t zipcode) :
-	country_id(country),
-	zip(zipcode)
-	{
-	}
-
-	/** @brief Equality operator, required for use as a unordered_map key.
-	*
-	*  @param[in] right The object to compare to for equality.
-	*/
-	bool operator==(const zip_range_key& right) const
-	{
-		return country_id == right.country_id &&
-		zip == right.zip;
-	}
-
-	/** @brief Serialization function used by Boost serialization.
-	*
-	*  @param[in] ar The Archive to read/write to.
-	*  @param[in] version Not used, but required by the interface.
-	*/
-	template<typename A>
-	void serialize(A& ar, const unsigned int version)
-	{
-		ar & country_id;
-		ar & zip;
-	}
-
-	int16_t country_id;
-	int16_t zip;
-};
-
-/** @brief Define a hash_value function for zip_range_key. This is required for us
-*    to use it as a key to a boost::unordered_map.
-*
-*  @param[in] key The instance of zip_range_key to hash.
-*/
-std::size_t hash_value(const zip_range_key& key)
-{
-	std::size_t hash = 0;
-	boost::hash_combine(hash, key.country_id);
-	boost::hash_combine(hash, key.zip);
-	return hash;
-}
-
 /** @brief The @a service_country_key struct holds the lookup key for the
 *    service_country_range analytical map. It has a country id and service id.
 */
@@ -674,69 +809,6 @@ std::size_t hash_value(const exclusion_zip_key& key)
     return hash;
 }
 
-/** @brief The @a zip_range_key struct holds the lookup key for the z2z_range_map
- *    map. It has a country id and zip.
- */
-struct z2z_range_key
-{
-    /** @brief Constructs a @a zip_range_key object.
-     *    This is the default constructor.
-     */
-    z2z_range_key() :
-        country_id(0),
-        zip(0)
-    {
-    }
-
-    /** @brief Constructs a @a z2z_range_key object.
-     *
-     *  @param[in] country_id The country id.
-     *  @param[in] zip The zip or post code.
-     */
-    z2z_range_key(int16_t country_id, int32_t zip) :
-        country_id(country_id),
-        zip(zip)
-    {
-    }
-
-    /** @brief Equality operator, required for use as a unordered_map key.
-     *
-     *  @param[in] right The object to compare to for equality.
-     */
-    bool operator==(const z2z_range_key& right) const
-    {
-        return country_id == right.country_id && zip == right.zip;
-    }
-
-    /** @brief Serialization function used by Boost serialization.
-     *
-     *  @param[in] ar The Archive to read/write to.
-     *  @param[in] version Not used, but required by the interface.
-     */
-    template <typename A>
-    void serialize(A& ar, const unsigned int version)
-    {
-        ar & country_id;
-        ar & zip;
-    }
-
-    int16_t country_id;
-    int32_t zip;
-};
-
-/** @brief Define a hash_value function for z2z_range_key. This is required for us
- *    to use it as a key to a boost::unordered_map.
- *
- *  @param[in] key The instance of z2z_range_key to hash.
- */
-std::size_t hash_value(const z2z_range_key& key)
-{
-    std::size_t hash = 0;
-    boost::hash_combine(hash, key.country_id);
-    boost::hash_combine(hash, key.zip);
-    return hash;
-}
-
 /** @brief The @a z2z_services_key struct holds the lookup key for z2z_services_map.
  *    It has from country id, to country id and shipping service.
  */
@@ -977,8 +1049,8 @@ typedef boost::unordered_map<int32_t, holiday_info> holiday_map;
 typedef boost::unordered_map<int32_t, shipping_service_info> ssi_map;
 /* Map <Service ID, Origin, Destination> to Shipping Service Info. */
 typedef boost::unordered_map<cbt_key, shipping_service_info > cbt_map;
-/* Map Zip to Zip Range */
-typedef boost::unordered_map<zip_range_key, int16_t> zip_range_map;
+/* Map Country, Zip to the first Zip of its Zip Range, one entry per range. */
+typedef ebay::common::interval_index<int16_t> zip_range_index;
 /* Map Service, Country to Base Service. */
 typedef boost::unordered_map<service_country_key, int32_t> base_service_map;
 /* Map Zip to Delivery Estimate */
@@ -987,35 +1059,33 @@ typedef boost::unordered_map<shipping_zip_key, shipping_service_est> zip_estimat
 typedef boost::unordered_map<exclusion_zip_key, shipping_service_est> exc_map;
 /* Map <Country ID, Postal Code, Shipping Service Id> to Exclusion Zones info */
 typedef boost::unordered_map<z2z_default_key, shipping_service_est> z2z_default_map;
-/* Map Country Id, Postal code to all Postal codes in that range. */
-typedef boost::unordered_map<z2z_range_key, int32_t> z2z_range_map;
+/* Map Country Id, Postal code to the first Postal code of its range, one entry per range. */
+typedef ebay::common::interval_index<int32_t> z2z_range_index;
 /* Map From Country Id, To Country ID, From Zip, Shipping Service Id to Shipping Service Info. */
 typedef boost::unordered_map<z2z_tozipnull_key, shipping_service_est> z2z_tozipnull_map;
 /* Map From Country Id, To Country ID, From Zip, To Zip, Shipping Service Id to Shipping Service Info. */
 typedef boost::unordered_map<z2z_default_key, shipping_service_est> z2z_estimate_map;
 /* Set with From Country Id, To Country ID, Shipping Service Id as Key. */
 typedef boost::unordered_set<z2z_services_key> z2z_services_set;
+/* Longest prefix match index for z2z default data, grouped by From Country Id, To Country ID, Shipping Service Id. */
+typedef ebay::common::prefix_match_index<z2z_services_key, shipping_service_est> z2z_default_index;
+/* Dense area by area matrices of z2z default data, grouped by From Country Id, To Country ID, Shipping Service Id. */
+typedef ebay::common::area_matrix_index<z2z_services_key, shipping_service_est> z2z_default_matrix;
+/* Precompiled z2z cascade of the default, range, tozipnull and exclusion data, grouped by From Country Id, To Country ID, Shipping Service Id. */
+typedef ebay::common::cascade_prefix_index<z2z_services_key, shipping_service_est> z2z_cascade_index;
 static const int32_t UK_ZIP_BASE = 36;
 static const int32_t UK_ZIP_VAR = 55;
+static const int16_t UK_COUNTRY_ID = 3;
+/* Smallest z2z default group worth storing as a dense matrix. */
+static const std::size_t MIN_MATRIX_ROWS = 256;
+static const int32_t DEFAULT_ZIP_BASE = 10;
 
-bool is_number(const std::string& str)
-{
-	std::string::const_iterator it = str.begin();
-	while (it != str.end() && std::isdigit(*it)) ++it;
-	return !str.empty() && it == str.end();
-}
-
-int32_t power(int32_t base, int32_t pow)
+/** @brief Gets the base postcodes of a country are prefix matched in.
+*  UK postcodes are hashed in base 36, everything else is numeric.
+*/
+int16_t zip_base(int16_t country_id)
 {
-	int32_t result = 1;
-	while (pow)
-	{
-		if (pow & 1)
-		result *= base;
-		pow >>= 1;
-		base *= base;
-	}
-	return result;
+	return country_id == UK_COUNTRY_ID ? UK_ZIP_BASE : DEFAULT_ZIP_BASE;
 }
 
 std :: string convert_hash_to_zip(int32_t zip)
@@ -1037,26 +1107,33 @@ std :: string convert_hash_to_zip(int32_t zip)
 	return zip_code;
 }
 
-int32_t convert_zip_to_hash(const std :: string& zip)
+/** @brief Hashes a postcode field: numeric postcodes are their value, others
+*  are read as base 36 digits.
+*
+*  @param[in] zip The postcode field.
+*  @param[out] zip_hash Receives the hash.
+*  @return Returns false for a numeric postcode too large for an int32_t, a
+*  record the readers report and skip.
+*/
+bool convert_zip_to_hash(const ebay::common::record_field& zip, int32_t& zip_hash)
 {
-	int32_t zip_hash = 0;
-	if (is_number(zip))
-	{
-		zip_hash = boost::lexical_cast<int32_t>(zip);
-		return zip_hash;
-	}
-	
-	int32_t counter = static_cast<int32_t>(zip.length());
-	std::string::const_iterator it;	
-	
-	for(it = zip.begin(); it != zip.end(); it++)
+	const char* begin = zip.data;
+	const char* end = zip.data + zip.size;
+	const char* it = begin;
+
+	zip_hash = 0;
+	while (it != end && std::isdigit(*it)) ++it;
+	if (it == end)
+		return ebay::common::parse_integer(begin, end, zip_hash);
+
+	for(it = begin; it != end; it++)
 	{
 		if(std :: isdigit(*it))
-		zip_hash +=  ((int32_t)(*it) - '0') * power(UK_ZIP_BASE, --counter); 
+		zip_hash = zip_hash * UK_ZIP_BASE + ((int32_t)(*it) - '0');
 		else
-		zip_hash += ((int32_t)(*it) - UK_ZIP_VAR) * power(UK_ZIP_BASE, --counter);	  	    
+		zip_hash = zip_hash * UK_ZIP_BASE + ((int32_t)(*it) - UK_ZIP_VAR);
 	}
-	return zip_hash;
+	return true;
 }
 
 /** @brief
@@ -1065,19 +1142,21 @@ int32_t convert_zip_to_hash(const std :: string& zip)
 */
 static void z2z_services_create_map_data(const char* input,const char* output)
 {
-    std::ifstream ifs(input);
+    ebay::common::record_reader reader(input);
 
-    if (!ifs)
-        return;
+    if (!reader.is_open())
+        throw std::runtime_error(std::string("Cannot read ") + input);
 
     int16_t from_country_id;
     int16_t to_country_id;
     int32_t shipping_service;
     z2z_services_set* bset = new z2z_services_set();
 
-    while (!ifs.fail() && !ifs.eof())
+    while (reader.next())
     {
-        ifs >> from_country_id >> to_country_id >> shipping_service;
+        reader >> from_country_id >> to_country_id >> shipping_service;
+        if (!reader.valid())
+            continue;
         z2z_services_key key(from_country_id, to_country_id, shipping_service);
         bset->insert(key);
     }
@@ -1090,20 +1169,100 @@ static void z2z_services_create_map_data(const char* input,const char* output)
     boost::archive::text_oarchive oarc_text(ofs_text);
     serialize_set(oarc,*bset);
     serialize_set(oarc_text,*bset);
+    save_flat_table(output,*bset);
     delete bset;
     bset=NULL;
 }
 
+/** @brief Looks a z2z default row up the way the macro did without the index:
+*  every origin prefix, longest first, against every destination prefix.
+*/
+static const shipping_service_est* z2z_default_reference(const z2z_default_map& map,
+    const z2z_default_key& query)
+{
+    int32_t from_base = zip_base(query.from_country_id);
+    int32_t to_base = zip_base(query.to_country_id);
+
+    for (int32_t temp_from_zip = query.from_zip_hash; ; temp_from_zip /= from_base)
+    {
+        for (int32_t temp_to_zip = query.to_zip_hash; ; temp_to_zip /= to_base)
+        {
+            z2z_default_map::const_iterator it = map.find(z2z_default_key(
+                query.from_country_id, query.to_country_id, temp_from_zip, temp_to_zip,
+                query.shipping_service_id));
+
+            if (it != map.end())
+                return &it->second;
+            if (temp_to_zip / to_base == 0)
+                break;
+        }
+        if (temp_from_zip / from_base == 0)
+            break;
+    }
+    return NULL;
+}
+
+/** @brief Compares the default index and matrices against the map on every
+*  row, and on every row with its postcodes negated and shortened. Prints and
+*  returns the number of queries that disagree.
+*/
+static std::size_t z2z_default_check(const z2z_default_map& map, const z2z_default_index& index,
+                                     const z2z_default_matrix& matrix)
+{
+    std::size_t queries = 0;
+    std::size_t mismatches = 0;
+
+    for (z2z_default_map::const_iterator row = map.begin(); row != map.end(); ++row)
+    {
+        const z2z_default_key& key = row->first;
+        z2z_services_key group(key.from_country_id, key.to_country_id, key.shipping_service_id);
+        int32_t from_zips[3] = { key.from_zip_hash, -key.from_zip_hash,
+                                 key.from_zip_hash / zip_base(key.from_country_id) };
+        int32_t to_zips[3] = { key.to_zip_hash, -key.to_zip_hash,
+                               key.to_zip_hash / zip_base(key.to_country_id) };
+
+        for (std::size_t f = 0; f < 3; f++)
+        {
+            for (std::size_t t = 0; t < 3; t++)
+            {
+                z2z_default_key query(key.from_country_id, key.to_country_id, from_zips[f],
+                                      to_zips[t], key.shipping_service_id);
+                const shipping_service_est* expected = z2z_default_reference(map, query);
+                const ebay::common::area_matrix* dense = matrix.find_group(group);
+                const shipping_service_est* actual = dense != NULL ?
+                    matrix.find(*dense, query.from_zip_hash, query.to_zip_hash) :
+                    index.find(group, query.from_zip_hash, query.to_zip_hash);
+
+                queries++;
+                if ((expected == NULL) != (actual == NULL) ||
+                    (expected != NULL && (expected->min_hours != actual->min_hours ||
+                                          expected->max_hours != actual->max_hours)))
+                {
+                    if (mismatches < 10)
+                        std::cout << "z2z default mismatch: " << query.from_country_id << " "
+                                  << query.to_country_id << " " << query.from_zip_hash << " "
+                                  << query.to_zip_hash << " " << query.shipping_service_id
+                                  << "\n";
+                    mismatches++;
+                }
+            }
+        }
+    }
+    std::cout << "z2z default check: " << queries << " queries, " << mismatches
+              << " mismatches\n";
+    return mismatches;
+}
+
 /** @brief
 * Function to convert human readable file to Boost Serialization archive
 * useful for unit testing 
 */
-static void z2zdefault_create_map_data(const char* input,const char* output)
+static void z2zdefault_create_map_data(const char* input,const char* output,const char* index_output,const char* matrix_output)
 {
-    std::ifstream ifs(input);
+    ebay::common::record_reader reader(input);
 
-    if (!ifs)
-        return;
+    if (!reader.is_open())
+        throw std::runtime_error(std::string("Cannot read ") + input);
 
     int16_t from_country_id;
     int16_t to_country_id;
@@ -1112,19 +1271,71 @@ static void z2zdefault_create_map_data(const char* input,const char* output)
     int16_t max_hours;    
     int32_t from_zip_hash;
     int32_t to_zip_hash;
-    std :: string from_zip;
-    std :: string to_zip;
+    ebay::common::record_field from_zip;
+    ebay::common::record_field to_zip;
+    std::size_t skipped = 0;
+    std::size_t dense = 0;
     z2z_default_map* bmap = new z2z_default_map();
+    z2z_default_index* bindex = new z2z_default_index();
+    z2z_default_matrix* bmatrix = new z2z_default_matrix();
+    boost::unordered_map<z2z_services_key, std::vector<z2z_default_matrix::row_type> > groups;
 
-    while (!ifs.fail() && !ifs.eof())
+    while (reader.next())
     {
-        ifs >> from_country_id >> to_country_id >> from_zip >> to_zip >> shipping_service >> min_hours >> max_hours;
-        from_zip_hash = convert_zip_to_hash(from_zip);
-        to_zip_hash = convert_zip_to_hash(to_zip);
+        reader >> from_country_id >> to_country_id >> from_zip >> to_zip >> shipping_service >> min_hours >> max_hours;
+        if (!reader.valid())
+            continue;
+        if (!convert_zip_to_hash(from_zip, from_zip_hash) ||
+            !convert_zip_to_hash(to_zip, to_zip_hash))
+        {
+            reader.reject("postcode out of range");
+            continue;
+        }
         z2z_default_key key(from_country_id, to_country_id, from_zip_hash, to_zip_hash,shipping_service);
         shipping_service_est val(min_hours,max_hours);
         bmap->insert(std::pair<z2z_default_key, shipping_service_est>(key,val));
     }
+
+    /*
+     * Groups that are a complete area by area matrix, like the Royal Mail
+     * tables, go to the dense matrices, everything else to the prefix index.
+     */
+    for (z2z_default_map::const_iterator it = bmap->begin(); it != bmap->end(); ++it)
+    {
+        z2z_services_key group(it->first.from_country_id, it->first.to_country_id,
+                               it->first.shipping_service_id);
+
+        groups[group].push_back(z2z_default_matrix::row_type(
+            std::make_pair(it->first.from_zip_hash, it->first.to_zip_hash), it->second));
+    }
+    for (boost::unordered_map<z2z_services_key, std::vector<z2z_default_matrix::row_type> >::const_iterator
+             it = groups.begin(); it != groups.end(); ++it)
+    {
+        const z2z_services_key& group = it->first;
+        const std::vector<z2z_default_matrix::row_type>& rows = it->second;
+
+        if (rows.size() >= MIN_MATRIX_ROWS &&
+            bmatrix->add(group, zip_base(group.from_country_id), zip_base(group.to_country_id), rows))
+        {
+            bindex->delegate(group);
+            dense += rows.size();
+            continue;
+        }
+        for (std::size_t i = 0; i < rows.size(); i++)
+        {
+            if (!bindex->insert(group, zip_base(group.from_country_id),
+                                zip_base(group.to_country_id), rows[i].first.first,
+                                rows[i].first.second, rows[i].second))
+                skipped++;
+        }
+    }
+    bindex->create();
+    bmatrix->create();
+    std::cout << "z2z default index: " << bindex->size() << " rows, "
+              << bindex->node_count() << " nodes, " << skipped << " rows skipped, "
+              << bindex->delegated_groups().size() << " groups in the matrices\n";
+    std::cout << "z2z default matrix: " << bmatrix->size() << " groups, " << dense
+              << " rows, " << bmatrix->dictionary_count() << " area sets\n";
     
     std::ofstream ofs(output, std::ios_base::binary);
     boost::archive::binary_oarchive oarc(ofs);
@@ -1134,8 +1345,23 @@ static void z2zdefault_create_map_data(const char* input,const char* output)
     boost::archive::text_oarchive oarc_text(ofs_text);
     save_archive(oarc,*bmap);
     save_archive(oarc_text,*bmap);
+    save_flat_table(output,*bmap);
+
+    std::size_t mismatches = z2z_default_check(*bmap, *bindex, *bmatrix);
+
+    if (mismatches == 0)
+    {
+        save_object_archive(index_output, *bindex);
+        save_object_archive(matrix_output, *bmatrix);
+    }
     delete bmap;
     bmap=NULL;
+    delete bindex;
+    bindex=NULL;
+    delete bmatrix;
+    bmatrix=NULL;
+    if (mismatches != 0)
+        throw std::runtime_error(std::string("z2z default index not written: ") + index_output);
 }
 
 /** @brief
@@ -1144,10 +1370,10 @@ static void z2zdefault_create_map_data(const char* input,const char* output)
 */
 static void z2ztozipnull_create_map_data(const char* input,const char* output)
 {
-    std::ifstream ifs(input);
+    ebay::common::record_reader reader(input);
 
-    if (!ifs)
-        return;
+    if (!reader.is_open())
+        throw std::runtime_error(std::string("Cannot read ") + input);
 
     int16_t from_country_id;
     int16_t to_country_id;
@@ -1155,13 +1381,19 @@ static void z2ztozipnull_create_map_data(const char* input,const char* output)
     int16_t min_hours;
     int16_t max_hours;    
     int32_t from_zip_hash;
-    std :: string from_zip;
+    ebay::common::record_field from_zip;
     z2z_tozipnull_map* bmap = new z2z_tozipnull_map();
 
-    while (!ifs.fail() && !ifs.eof())
+    while (reader.next())
     {
-        ifs >> from_country_id >> to_country_id >> from_zip >> shipping_service >> min_hours >> max_hours;
-        from_zip_hash = convert_zip_to_hash(from_zip);
+        reader >> from_country_id >> to_country_id >> from_zip >> shipping_service >> min_hours >> max_hours;
+        if (!reader.valid())
+            continue;
+        if (!convert_zip_to_hash(from_zip, from_zip_hash))
+        {
+            reader.reject("postcode out of range");
+            continue;
+        }
         z2z_tozipnull_key key(from_country_id, to_country_id, from_zip_hash,shipping_service);
         shipping_service_est val(min_hours,max_hours);
         bmap->insert(std::pair<z2z_tozipnull_key, shipping_service_est>(key,val));
@@ -1175,6 +1407,7 @@ static void z2ztozipnull_create_map_data(const char* input,const char* output)
     boost::archive::text_oarchive oarc_text(ofs_text);
     save_archive(oarc,*bmap);
     save_archive(oarc_text,*bmap);
+    save_flat_table(output,*bmap);
     delete bmap;
     bmap=NULL;
 }
@@ -1183,39 +1416,33 @@ static void z2ztozipnull_create_map_data(const char* input,const char* output)
 * Function to convert human readable file to Boost Serialization archive
 * useful for unit testing 
 */
-static void z2zranges_create_map_data(const char* input,const char* output)
+static void z2zranges_create_map_data(const char* input,const char* index_output)
 {
-    std::ifstream ifs(input);
+    ebay::common::record_reader reader(input);
 
-    if (!ifs)
-        return;
+    if (!reader.is_open())
+        throw std::runtime_error(std::string("Cannot read ") + input);
 
     int16_t country;
     int32_t zip_begin;
     int32_t zip_end;
-    z2z_range_map* bmap = new z2z_range_map();
+    z2z_range_index* bindex = new z2z_range_index();
+    std::size_t rows = 0;
 
-    while (!ifs.fail() && !ifs.eof())
+    while (reader.next())
     {
-        ifs >> country >> zip_begin >> zip_end ;
-        for(int32_t i = zip_begin; i<= zip_end; i++)
-        {
-            z2z_range_key temp(country,i);
-            bmap->insert(std::pair<z2z_range_key, int32_t>(temp,zip_begin));
-        }
+        reader >> country >> zip_begin >> zip_end ;
+        if (!reader.valid())
+            continue;
+        bindex->insert(country, zip_begin, zip_end, zip_begin);
+        rows++;
     }
-
-    std::ofstream ofs(output, std::ios_base::binary);
-    boost::archive::binary_oarchive oarc(ofs);
-    std::string out_text = output;
-    out_text += ".txt";
-    std::ofstream ofs_text(out_text.c_str());
-    boost::archive::text_oarchive oarc_text(ofs_text);
-
-    save_archive(oarc,*bmap);
-    save_archive(oarc_text,*bmap);
-    delete bmap;
-    bmap=NULL;
+    bindex->create();
+    std::cout << "z2z range index: " << bindex->size() << " ranges from "
+              << rows << " rows\n";
+    save_object_archive(index_output, *bindex);
+    delete bindex;
+    bindex=NULL;
 }
 
 /** @brief
@@ -1224,10 +1451,10 @@ static void z2zranges_create_map_data(const char* input,const char* output)
 */
 static void z2z_create_map_data(const char* input,const char* output)
 {
-    std::ifstream ifs(input);
+    ebay::common::record_reader reader(input);
 
-    if (!ifs)
-        return;
+    if (!reader.is_open())
+        throw std::runtime_error(std::string("Cannot read ") + input);
 
     int16_t from_country_id;
     int16_t to_country_id;
@@ -1238,9 +1465,11 @@ static void z2z_create_map_data(const char* input,const char* output)
     int32_t to_zip;
     z2z_estimate_map* bmap = new z2z_estimate_map();
 
-    while (!ifs.fail() && !ifs.eof())
+    while (reader.next())
     {
-        ifs >> from_country_id >> to_country_id >> from_zip >> to_zip >> shipping_service >> min_hours >> max_hours;
+        reader >> from_country_id >> to_country_id >> from_zip >> to_zip >> shipping_service >> min_hours >> max_hours;
+        if (!reader.valid())
+            continue;
         z2z_default_key key(from_country_id, to_country_id, from_zip, to_zip,shipping_service);
         shipping_service_est val(min_hours,max_hours);
         bmap->insert(std::pair<z2z_default_key, shipping_service_est>(key,val));
@@ -1254,6 +1483,7 @@ static void z2z_create_map_data(const char* input,const char* output)
     boost::archive::text_oarchive oarc_text(ofs_text);
     save_archive(oarc,*bmap);
     save_archive(oarc_text,*bmap);
+    save_flat_table(output,*bmap);
     delete bmap;
     bmap=NULL;
 }
@@ -1264,23 +1494,29 @@ static void z2z_create_map_data(const char* input,const char* output)
 */
 static void exc_create_map_data(const char* input,const char* output)
 {
-    std::ifstream ifs(input);
+    ebay::common::record_reader reader(input);
 
-    if (!ifs)
-        return;
+    if (!reader.is_open())
+        throw std::runtime_error(std::string("Cannot read ") + input);
 
     int16_t country;
     int32_t shipping_service;
     int16_t min_hours;
     int16_t max_hours;    
     int32_t zip_code_hash;
-    std :: string zip;
+    ebay::common::record_field zip;
     exc_map* bmap = new exc_map();
 
-    while (!ifs.fail() && !ifs.eof())
+    while (reader.next())
     {
-        ifs >> country >> shipping_service >> zip >> min_hours >> max_hours;
-        zip_code_hash = convert_zip_to_hash(zip);
+        reader >> country >> shipping_service >> zip >> min_hours >> max_hours;
+        if (!reader.valid())
+            continue;
+        if (!convert_zip_to_hash(zip, zip_code_hash))
+        {
+            reader.reject("postcode out of range");
+            continue;
+        }
         exclusion_zip_key temp(shipping_service,country,zip_code_hash);
         shipping_service_est temp2(min_hours,max_hours);
         bmap->insert(std::pair<exclusion_zip_key, shipping_service_est>(temp,temp2));
@@ -1295,46 +1531,448 @@ static void exc_create_map_data(const char* input,const char* output)
 
     save_archive(oarc,*bmap);
     save_archive(oarc_text,*bmap);
+    save_flat_table(output,*bmap);
     delete bmap;
     bmap=NULL;
 }
 
 
-/** @brief
-* Function to convert human readable file to Boost Serialization archive
-* useful for unit testing 
+/** @brief The @a z2z_cascade_tables struct holds the flat z2z tables written
+*  by the builders above, read back the way the macro maps them.
 */
-static void ze_create_map_data(const char* input,const char* output)
+struct z2z_cascade_tables
 {
-	std::ifstream ifs(input);
+    boost::scoped_ptr<ebay::common::flat_table<z2z_services_key> > services;
+    boost::scoped_ptr<ebay::common::flat_table<z2z_default_key, shipping_service_est> > defaults;
+    boost::scoped_ptr<z2z_range_index> ranges;
+    boost::scoped_ptr<ebay::common::flat_table<z2z_default_key, shipping_service_est> > estimates;
+    boost::scoped_ptr<ebay::common::flat_table<z2z_tozipnull_key, shipping_service_est> > tozipnull;
+    boost::scoped_ptr<ebay::common::flat_table<exclusion_zip_key, shipping_service_est> > exclusions;
+    /* Dense matrices the macro tries before the cascade index, if written. */
+    boost::scoped_ptr<z2z_default_matrix> matrix;
+};
 
-	if (!ifs)
-	return;
+/** @brief Opens the flat table written next to an archive, if there is one.
+*/
+template <class Table>
+static Table* open_flat_table(const char* output)
+{
+    std::string out_flat = output;
+    out_flat += ".flat";
+    if (!Table::is_flat_file(out_flat.c_str()))
+        return NULL;
+    return Table::open(out_flat.c_str());
+}
 
-	int32_t shipping_service;
-	int16_t min_hours;
-	int16_t max_hours;
-	int16_t origin_zip;
-	int16_t dest_zip;
-	zip_estimate_map* bmap = new zip_estimate_map();
+/** @brief Runs the z2z fallback cascade the way the macro does without the
+*  precompiled index: zip to zip rows, range to range estimates, tozipnull rows,
+*  then exclusion zones, each by longest prefix.
+*/
+static const shipping_service_est* z2z_cascade_reference(const z2z_cascade_tables& tables,
+    int16_t from_country_id, int16_t to_country_id, int32_t from_zip, int32_t to_zip,
+    int32_t shipping_service)
+{
+    int32_t from_base = zip_base(from_country_id);
+    int32_t to_base = zip_base(to_country_id);
 
-	while (!ifs.fail() && !ifs.eof())
-	{
-		ifs >> shipping_service >> origin_zip >> dest_zip >> min_hours >> max_hours;
-		shipping_zip_key temp(shipping_service,origin_zip,dest_zip);
-		shipping_service_est temp2(min_hours,max_hours);
-		bmap->insert(std::pair<shipping_zip_key, shipping_service_est>(temp,temp2));
-	}
+    if (tables.services->find(z2z_services_key(from_country_id, to_country_id,
+                                               shipping_service)) == tables.services->end())
+        return NULL;
 
-	std::ofstream ofs(output, std::ios_base::binary);
-	boost::archive::binary_oarchive oarc(ofs);
-	std::string out_text = output;
-	out_text += ".txt";
+    if (tables.defaults)
+    {
+        for (int32_t temp_from_zip = from_zip; ; temp_from_zip /= from_base)
+        {
+            for (int32_t temp_to_zip = to_zip; ; temp_to_zip /= to_base)
+            {
+                z2z_default_key key(from_country_id, to_country_id, temp_from_zip,
+                                    temp_to_zip, shipping_service);
+                ebay::common::flat_table<z2z_default_key, shipping_service_est>::const_iterator
+                    it = tables.defaults->find(key);
+
+                if (it != tables.defaults->end())
+                    return &it->second;
+                if (temp_to_zip / to_base == 0)
+                    break;
+            }
+            if (temp_from_zip / from_base == 0)
+                break;
+        }
+    }
+    if (tables.ranges && tables.estimates)
+    {
+        for (int32_t temp_from_zip = from_zip; temp_from_zip > 0; temp_from_zip /= from_base)
+        {
+            const int32_t* range_from = tables.ranges->find(from_country_id, temp_from_zip);
+
+            if (range_from == NULL)
+                continue;
+            for (int32_t temp_to_zip = to_zip; temp_to_zip > 0; temp_to_zip /= to_base)
+            {
+                const int32_t* range_to = tables.ranges->find(to_country_id, temp_to_zip);
+
+                if (range_to == NULL)
+                    continue;
+
+                z2z_default_key key(from_country_id, to_country_id, *range_from,
+                                    *range_to, shipping_service);
+                ebay::common::flat_table<z2z_default_key, shipping_service_est>::const_iterator
+                    it = tables.estimates->find(key);
+
+                if (it != tables.estimates->end() && it->second.max_hours >= 0)
+                    return &it->second;
+            }
+        }
+    }
+    if (tables.tozipnull)
+    {
+        for (int32_t temp_from_zip = from_zip; temp_from_zip > 0; temp_from_zip /= from_base)
+        {
+            z2z_tozipnull_key key(from_country_id, to_country_id, temp_from_zip,
+                                  shipping_service);
+            ebay::common::flat_table<z2z_tozipnull_key, shipping_service_est>::const_iterator
+                it = tables.tozipnull->find(key);
+
+            if (it != tables.tozipnull->end())
+                return &it->second;
+        }
+    }
+    if (tables.exclusions)
+    {
+        for (int32_t temp_to_zip = to_zip; temp_to_zip > 0; temp_to_zip /= to_base)
+        {
+            exclusion_zip_key key(shipping_service, to_country_id, temp_to_zip);
+            ebay::common::flat_table<exclusion_zip_key, shipping_service_est>::const_iterator
+                it = tables.exclusions->find(key);
+
+            if (it != tables.exclusions->end())
+                return &it->second;
+        }
+    }
+    return NULL;
+}
+
+/** @brief Picks a query postcode from the postcodes seen for a group: one of
+*  them as is, one level shorter, or one random digit longer.
+*/
+static int32_t z2z_cascade_sample(const std::vector<int32_t>& zips, int32_t base,
+                                  unsigned int& seed)
+{
+    int32_t zip = zips[rand_r(&seed) % zips.size()];
+
+    switch (rand_r(&seed) % 3)
+    {
+    case 0:
+        return zip / base;
+    case 1:
+        if (zip < 0x7fffffff / base - base)
+            return zip * base + rand_r(&seed) % base;
+    }
+    return zip;
+}
+
+/** @brief Looks a query up the way the macro does with the cascade index:
+*  groups missing from the services set match nothing, the others try the
+*  dense matrices first, then the index.
+*/
+static const shipping_service_est* z2z_cascade_lookup(const z2z_cascade_tables& tables,
+    const z2z_cascade_index& index, const z2z_services_key& key, int32_t from_zip,
+    int32_t to_zip)
+{
+    const ebay::common::cascade_group* group = index.find_group(key);
+    const shipping_service_est* hit = NULL;
+
+    if (group == NULL)
+        return NULL;
+    if (tables.matrix)
+        hit = tables.matrix->find(key, from_zip, to_zip);
+    if (hit == NULL)
+        hit = index.find(*group, from_zip, to_zip);
+    return hit;
+}
+
+/** @brief Compares the precompiled index against the query time cascade on
+*  every zip to zip row and on random postcodes around the rows of every
+*  group. Prints and returns the number of queries that disagree.
+*/
+static std::size_t z2z_cascade_check(const z2z_cascade_tables& tables,
+                                     const z2z_cascade_index& index)
+{
+    typedef boost::unordered_map<z2z_services_key, std::vector<int32_t> > zip_samples;
+    static const std::size_t samples_per_country = 256;
+    static const std::size_t queries_per_group = 512;
+    zip_samples from_zips;
+    zip_samples to_zips;
+    std::map<int16_t, std::vector<int32_t> > range_zips;
+    std::map<std::pair<int32_t, int16_t>, std::vector<int32_t> > exclusion_zips;
+    std::vector<z2z_default_key> queries;
+    std::size_t mismatches = 0;
+    /* A seed of its own, the same queries whatever else the builder runs. */
+    unsigned int seed = 1;
+
+    if (tables.defaults)
+    {
+        for (ebay::common::flat_table<z2z_default_key, shipping_service_est>::const_iterator
+                 it = tables.defaults->begin(); it != tables.defaults->end(); ++it)
+        {
+            const z2z_default_key& key = it->first;
+            z2z_services_key group(key.from_country_id, key.to_country_id,
+                                   key.shipping_service_id);
+
+            from_zips[group].push_back(key.from_zip_hash);
+            to_zips[group].push_back(key.to_zip_hash);
+            queries.push_back(key);
+        }
+    }
+    if (tables.tozipnull)
+    {
+        for (ebay::common::flat_table<z2z_tozipnull_key, shipping_service_est>::const_iterator
+                 it = tables.tozipnull->begin(); it != tables.tozipnull->end(); ++it)
+        {
+            const z2z_tozipnull_key& key = it->first;
+
+            from_zips[z2z_services_key(key.from_country_id, key.to_country_id,
+                                       key.shipping_service_id)].push_back(key.from_zip_hash);
+        }
+    }
+    if (tables.ranges)
+    {
+        /* The ends and the middle of every range. */
+        for (std::size_t i = 0; i < tables.ranges->size(); i++)
+        {
+            int16_t country_id;
+            int32_t begin;
+            int32_t end;
+
+            tables.ranges->get_range(i, country_id, begin, end);
+
+            std::vector<int32_t>& zips = range_zips[country_id];
+
+            if (zips.size() < samples_per_country)
+            {
+                zips.push_back(begin);
+                zips.push_back(begin + (end - begin) / 2);
+                zips.push_back(end);
+            }
+        }
+    }
+    if (tables.exclusions)
+    {
+        for (ebay::common::flat_table<exclusion_zip_key, shipping_service_est>::const_iterator
+                 it = tables.exclusions->begin(); it != tables.exclusions->end(); ++it)
+        {
+            exclusion_zips[std::make_pair(it->first.shipping_service_id,
+                                          it->first.country_id)].push_back(it->first.zip_code_hash);
+        }
+    }
+    for (ebay::common::flat_table<z2z_services_key>::const_iterator
+             it = tables.services->begin(); it != tables.services->end(); ++it)
+    {
+        const z2z_services_key& group = *it;
+        std::vector<int32_t>& from = from_zips[group];
+        std::vector<int32_t>& to = to_zips[group];
+        std::vector<int32_t>& from_ranges = range_zips[group.from_country_id];
+        std::vector<int32_t>& to_ranges = range_zips[group.to_country_id];
+
+        from.insert(from.end(), from_ranges.begin(), from_ranges.end());
+        to.insert(to.end(), to_ranges.begin(), to_ranges.end());
+        std::vector<int32_t>& exclusions = exclusion_zips[
+            std::make_pair(group.shipping_service_id, group.to_country_id)];
+
+        to.insert(to.end(), exclusions.begin(), exclusions.end());
+        from.push_back(0);
+        to.push_back(0);
+        from.push_back(1 + rand_r(&seed) % 100000);
+        to.push_back(1 + rand_r(&seed) % 100000);
+        /* Negative postcodes only match negative rows, by the query time loops. */
+        from.push_back(-from[rand_r(&seed) % from.size()]);
+        to.push_back(-to[rand_r(&seed) % to.size()]);
+
+        for (std::size_t i = 0; i < queries_per_group; i++)
+        {
+            queries.push_back(z2z_default_key(group.from_country_id, group.to_country_id,
+                z2z_cascade_sample(from, zip_base(group.from_country_id), seed),
+                z2z_cascade_sample(to, zip_base(group.to_country_id), seed),
+                group.shipping_service_id));
+        }
+    }
+
+    for (std::size_t i = 0; i < queries.size(); i++)
+    {
+        const z2z_default_key& query = queries[i];
+        const shipping_service_est* expected = z2z_cascade_reference(tables,
+            query.from_country_id, query.to_country_id, query.from_zip_hash,
+            query.to_zip_hash, query.shipping_service_id);
+        const shipping_service_est* actual = z2z_cascade_lookup(tables, index,
+            z2z_services_key(query.from_country_id, query.to_country_id,
+                             query.shipping_service_id),
+            query.from_zip_hash, query.to_zip_hash);
+
+        if ((expected == NULL) != (actual == NULL) ||
+            (expected != NULL && (expected->min_hours != actual->min_hours ||
+                                  expected->max_hours != actual->max_hours)))
+        {
+            if (mismatches < 10)
+                std::cout << "z2z cascade mismatch: " << query.from_country_id << " "
+                          << query.to_country_id << " " << query.from_zip_hash << " "
+                          << query.to_zip_hash << " " << query.shipping_service_id << "\n";
+            mismatches++;
+        }
+    }
+    std::cout << "z2z cascade check: " << queries.size() << " queries, "
+              << mismatches << " mismatches\n";
+    return mismatches;
+}
+
+/** @brief
+* Resolve stage of the z2z data. Folds the default, range, tozipnull and
+* exclusion tables written above into one precompiled cascade, checks it
+* answers exactly like the query time fallbacks, and writes it only if it does.
+*/
+static void z2z_resolve_create_map_data(const char* services, const char* defaults,
+    const char* matrix, const char* ranges, const char* estimates, const char* tozipnull,
+    const char* exclusions, const char* output)
+{
+    z2z_cascade_tables tables;
+
+    tables.services.reset(open_flat_table<ebay::common::flat_table<z2z_services_key> >(services));
+    if (!tables.services)
+        throw std::runtime_error(std::string("Cannot read ") + services);
+    tables.defaults.reset(open_flat_table<
+        ebay::common::flat_table<z2z_default_key, shipping_service_est> >(defaults));
+    tables.ranges.reset(new z2z_range_index());
+    if (!load_object_archive(ranges, *tables.ranges))
+        tables.ranges.reset();
+    tables.estimates.reset(open_flat_table<
+        ebay::common::flat_table<z2z_default_key, shipping_service_est> >(estimates));
+    tables.tozipnull.reset(open_flat_table<
+        ebay::common::flat_table<z2z_tozipnull_key, shipping_service_est> >(tozipnull));
+    tables.exclusions.reset(open_flat_table<
+        ebay::common::flat_table<exclusion_zip_key, shipping_service_est> >(exclusions));
+    tables.matrix.reset(new z2z_default_matrix());
+    if (!load_object_archive(matrix, *tables.matrix))
+        tables.matrix.reset();
+
+    z2z_cascade_index* bindex = new z2z_cascade_index();
+    boost::unordered_multimap<exclusion_zip_key, z2z_services_key> exclusion_groups;
+
+    for (ebay::common::flat_table<z2z_services_key>::const_iterator
+             it = tables.services->begin(); it != tables.services->end(); ++it)
+    {
+        bindex->add_group(*it, it->from_country_id, it->to_country_id,
+                          zip_base(it->from_country_id), zip_base(it->to_country_id));
+        exclusion_groups.insert(std::make_pair(
+            exclusion_zip_key(it->shipping_service_id, it->to_country_id, 0), *it));
+    }
+    if (tables.defaults)
+    {
+        for (ebay::common::flat_table<z2z_default_key, shipping_service_est>::const_iterator
+                 it = tables.defaults->begin(); it != tables.defaults->end(); ++it)
+        {
+            const z2z_default_key& key = it->first;
+
+            bindex->add_zip_pair(z2z_services_key(key.from_country_id, key.to_country_id,
+                                                  key.shipping_service_id),
+                                 key.from_zip_hash, key.to_zip_hash, it->second);
+        }
+    }
+    if (tables.ranges && tables.estimates)
+    {
+        bindex->set_ranges(*tables.ranges);
+        for (ebay::common::flat_table<z2z_default_key, shipping_service_est>::const_iterator
+                 it = tables.estimates->begin(); it != tables.estimates->end(); ++it)
+        {
+            const z2z_default_key& key = it->first;
+
+            /* Estimates without a max are skipped by the macro too. */
+            if (it->second.max_hours >= 0)
+                bindex->add_range_pair(z2z_services_key(key.from_country_id,
+                                                        key.to_country_id,
+                                                        key.shipping_service_id),
+                                       key.from_zip_hash, key.to_zip_hash, it->second);
+        }
+    }
+    if (tables.tozipnull)
+    {
+        for (ebay::common::flat_table<z2z_tozipnull_key, shipping_service_est>::const_iterator
+                 it = tables.tozipnull->begin(); it != tables.tozipnull->end(); ++it)
+        {
+            const z2z_tozipnull_key& key = it->first;
+
+            bindex->add_origin(z2z_services_key(key.from_country_id, key.to_country_id,
+                                                key.shipping_service_id),
+                               key.from_zip_hash, it->second);
+        }
+    }
+    if (tables.exclusions)
+    {
+        /* Exclusion zones apply to every origin country of the service. */
+        for (ebay::common::flat_table<exclusion_zip_key, shipping_service_est>::const_iterator
+                 it = tables.exclusions->begin(); it != tables.exclusions->end(); ++it)
+        {
+            const exclusion_zip_key& key = it->first;
+            std::pair<boost::unordered_multimap<exclusion_zip_key, z2z_services_key>::iterator,
+                      boost::unordered_multimap<exclusion_zip_key, z2z_services_key>::iterator>
+                groups = exclusion_groups.equal_range(
+                    exclusion_zip_key(key.shipping_service_id, key.country_id, 0));
+
+            for (; groups.first != groups.second; ++groups.first)
+                bindex->add_destination(groups.first->second, key.zip_code_hash, it->second);
+        }
+    }
+    bindex->create();
+    std::cout << "z2z cascade index: " << bindex->size() << " groups, "
+              << bindex->node_count() << " nodes, " << bindex->range_count()
+              << " ranges, " << bindex->pair_count() << " range pairs\n";
+
+    std::size_t mismatches = z2z_cascade_check(tables, *bindex);
+
+    if (mismatches == 0)
+        save_object_archive(output, *bindex);
+    delete bindex;
+    bindex=NULL;
+    if (mismatches != 0)
+        throw std::runtime_error(std::string("z2z cascade index not written: ") + output);
+}
+
+/** @brief
+* Function to convert human readable file to Boost Serialization archive
+* useful for unit testing 
+*/
+static void ze_create_map_data(const char* input,const char* output)
+{
+	ebay::common::record_reader reader(input);
+
+	if (!reader.is_open())
+		throw std::runtime_error(std::string("Cannot read ") + input);
+
+	int32_t shipping_service;
+	int16_t min_hours;
+	int16_t max_hours;
+	int16_t origin_zip;
+	int16_t dest_zip;
+	zip_estimate_map* bmap = new zip_estimate_map();
+
+	while (reader.next())
+	{
+		reader >> shipping_service >> origin_zip >> dest_zip >> min_hours >> max_hours;
+		if (!reader.valid())
+			continue;
+		shipping_zip_key temp(shipping_service,origin_zip,dest_zip);
+		shipping_service_est temp2(min_hours,max_hours);
+		bmap->insert(std::pair<shipping_zip_key, shipping_service_est>(temp,temp2));
+	}
+
+	std::ofstream ofs(output, std::ios_base::binary);
+	boost::archive::binary_oarchive oarc(ofs);
+	std::string out_text = output;
+	out_text += ".txt";
 	std::ofstream ofs_text(out_text.c_str());
 	boost::archive::text_oarchive oarc_text(ofs_text);
 
 	save_archive(oarc,*bmap);
 	save_archive(oarc_text,*bmap);
+	save_flat_table(output,*bmap);
 	delete bmap;
 	bmap=NULL;
 }
@@ -1344,19 +1982,21 @@ static void ze_create_map_data(const char* input,const char* output)
 */
 static void sb_create_map_data(const char* input,const char* output)
 {
-	std::ifstream ifs(input);
+	ebay::common::record_reader reader(input);
 
-	if (!ifs)
-	return;
+	if (!reader.is_open())
+		throw std::runtime_error(std::string("Cannot read ") + input);
 
 	int16_t country;
 	int32_t service;
 	int32_t base_service;
 	base_service_map* bmap = new base_service_map();
 
-	while (!ifs.fail() && !ifs.eof())
+	while (reader.next())
 	{
-		ifs >> country >> service >> base_service ;
+		reader >> country >> service >> base_service ;
+		if (!reader.valid())
+			continue;
 		service_country_key temp(country,service);
 		bmap->insert(std::pair<service_country_key, int32_t>(temp,base_service));
 	}
@@ -1370,6 +2010,7 @@ static void sb_create_map_data(const char* input,const char* output)
 
 	save_archive(oarc,*bmap);
 	save_archive(oarc_text,*bmap);
+	save_flat_table(output,*bmap);
 	delete bmap;
 	bmap=NULL;
 }
@@ -1378,40 +2019,38 @@ static void sb_create_map_data(const char* input,const char* output)
 * Function to convert human readable file to Boost Serialization archive
 * useful for uni ttesting 
 */
-static void zr_create_map_data(const char* input,const char* output, std::set<int16_t> excluded)
+static void zr_create_map_data(const char* input,const char* index_output, std::set<int16_t> excluded)
 {
-	std::ifstream ifs(input);
+	ebay::common::record_reader reader(input);
 
-	if (!ifs)
-	return;
+	if (!reader.is_open())
+		throw std::runtime_error(std::string("Cannot read ") + input);
 
 	int16_t country;
 	int16_t zip_begin;
 	int16_t zip_end;
-	zip_range_map* bmap = new zip_range_map();
+	zip_range_index* bindex = new zip_range_index();
 
-	while (!ifs.fail() && !ifs.eof())
+	while (reader.next())
 	{
-		ifs >> country >> zip_begin >> zip_end ;
-		for(int16_t i = zip_begin; i<= zip_end; i++)
+		reader >> country >> zip_begin >> zip_end ;
+		if (!reader.valid())
+			continue;
+		/* Split the range around the excluded postcodes. */
+		int32_t piece_begin = zip_begin;
+		std::set<int16_t>::const_iterator it = excluded.lower_bound(zip_begin);
+		for(; it != excluded.end() && *it <= zip_end; ++it)
 		{
-			if(excluded.count(i)>0) continue;
-			zip_range_key temp(country,i);
-			bmap->insert(std::pair<zip_range_key, int16_t>(temp,zip_begin));
+			bindex->insert(country, piece_begin, *it - 1, zip_begin);
+			piece_begin = *it + 1;
 		}
+		bindex->insert(country, piece_begin, zip_end, zip_begin);
 	}
-
-	std::ofstream ofs(output, std::ios_base::binary);
-	boost::archive::binary_oarchive oarc(ofs);
-	std::string out_text = output;
-	out_text += ".txt";
-	std::ofstream ofs_text(out_text.c_str());
-	boost::archive::text_oarchive oarc_text(ofs_text);
-
-	save_archive(oarc,*bmap);
-	save_archive(oarc_text,*bmap);
-	delete bmap;
-	bmap=NULL;
+	bindex->create();
+	std::cout << "zip range index: " << bindex->size() << " ranges\n";
+	save_object_archive(index_output, *bindex);
+	delete bindex;
+	bindex=NULL;
 }
 
 /** @brief
@@ -1420,10 +2059,10 @@ static void zr_create_map_data(const char* input,const char* output, std::set<in
 */
 static void ssi_create_map_data(const char* input,const char* output)
 {
-	std::ifstream ifs(input);
+	ebay::common::record_reader reader(input);
 
-	if (!ifs)
-	return;
+	if (!reader.is_open())
+		throw std::runtime_error(std::string("Cannot read ") + input);
 
 	int32_t shipping_service;
 	int16_t min_hours;
@@ -1431,9 +2070,11 @@ static void ssi_create_map_data(const char* input,const char* output)
 	int16_t working_days;
 	ssi_map* bmap = new ssi_map();
 
-	while (!ifs.fail() && !ifs.eof())
+	while (reader.next())
 	{
-		ifs >> shipping_service >> min_hours >> max_hours >> working_days;
+		reader >> shipping_service >> min_hours >> max_hours >> working_days;
+		if (!reader.valid())
+			continue;
 		shipping_service_info temp(min_hours,max_hours,(int8_t)working_days);
 		bmap->insert(std::pair<int32_t, shipping_service_info>(shipping_service,temp));
 	}
@@ -1447,6 +2088,8 @@ static void ssi_create_map_data(const char* input,const char* output)
 
 	save_archive(oarc,*bmap);
 	save_archive(oarc_text,*bmap);
+	save_flat_table(output,*bmap);
+	save_direct_table(output,*bmap);
 	delete bmap;
 	bmap=NULL;
 }
@@ -1459,25 +2102,27 @@ typedef boost::unordered_multimap<int32_t,int32_t> gentype;
 */
 static void cbt_create_map_data(const char* input, const char* generics,const char* output)
 {
-	std::ifstream gens(generics);
+	ebay::common::record_reader gens(generics);
 
-	if (!gens)
-	return;
+	if (!gens.is_open())
+		throw std::runtime_error(std::string("Cannot read ") + generics);
 
 	gentype gen;
 	int32_t key;
 	int32_t value;
 
-	while (!gens.fail() && !gens.eof())
+	while (gens.next())
 	{
 		gens >> key >> value;
+		if (!gens.valid())
+			continue;
 		gen.insert(gentype::value_type(key,value));
 	}
 
-	std::ifstream ifs(input);
+	ebay::common::record_reader reader(input);
 
-	if (!ifs)
-	return;
+	if (!reader.is_open())
+		throw std::runtime_error(std::string("Cannot read ") + input);
 	int32_t shipping_service;
 	int32_t origin_country;
 	int32_t dest_country;
@@ -1485,9 +2130,11 @@ static void cbt_create_map_data(const char* input, const char* generics,const ch
 	int16_t max_hours;
 	cbt_map* bmap = new cbt_map();
 
-	while (!ifs.fail() && !ifs.eof())
+	while (reader.next())
 	{
-		ifs >> shipping_service >> origin_country >> dest_country >> min_hours >> max_hours;
+		reader >> shipping_service >> origin_country >> dest_country >> min_hours >> max_hours;
+		if (!reader.valid())
+			continue;
 		shipping_service_info temp(min_hours,max_hours,(int8_t)0);
 		cbt_key key(shipping_service,origin_country,dest_country);
 		bmap->insert(std::pair<cbt_key, shipping_service_info>(key,temp));
@@ -1511,6 +2158,7 @@ static void cbt_create_map_data(const char* input, const char* generics,const ch
 
 	save_archive(oarc,*bmap);
 	save_archive(oarc_text,*bmap);
+	save_flat_table(output,*bmap);
 	delete bmap;
 	bmap=NULL;
 }
@@ -1521,10 +2169,10 @@ static void cbt_create_map_data(const char* input, const char* generics,const ch
 */
 static void holiday_create_map_data(const char* input,const char* output)
 {
-	std::ifstream ifs(input);
+	ebay::common::record_reader reader(input, '#');
 
-	if (!ifs)
-	return;
+	if (!reader.is_open())
+		throw std::runtime_error(std::string("Cannot read ") + input);
 	
 	/*
 	* Get today's date, subtract 365 days, this will be our start day.
@@ -1540,15 +2188,11 @@ static void holiday_create_map_data(const char* input,const char* output)
 	int16_t year;
 	holiday_map* bmap = new holiday_map();
 	holiday_info current(start_date);
-	char comments[256];
-	
-	while (!ifs.fail() && !ifs.eof() && ifs.peek() == '#')
+	while (reader.next())
 	{
-		ifs.getline(comments, 256);
-	}
-	while (!ifs.fail() && !ifs.eof())
-	{
-		ifs >> list_id >> month >> day >> year;
+		reader >> list_id >> month >> day >> year;
+		if (!reader.valid())
+			continue;
 		if (list_id != previous_list_id)
 		{
 			if (previous_list_id!=-1)
@@ -1622,7 +2266,7 @@ struct analytical_info
 
 /** @brief operator >> overload for reading shipping_zip_key
 */
-std::istream &operator>>(std::istream &in, shipping_zip_key &s)
+ebay::common::record_reader &operator>>(ebay::common::record_reader &in, shipping_zip_key &s)
 {
 	in >> s.shipping_service_id >> s.origin_zip >> s.dest_zip;
 	return in;
@@ -1702,7 +2346,7 @@ struct zip_key
 
 /** @brief operator >> overload for reading zip_key
 */
-std::istream &operator>>(std::istream &in, zip_key &z)
+ebay::common::record_reader &operator>>(ebay::common::record_reader &in, zip_key &z)
 {
 	in >> z.origin_zip >> z.dest_zip;
 	return in;
@@ -1783,14 +2427,116 @@ std::ostream &operator<<(std::ostream &in, shipping_zip_key &s)
 
 
 
-typedef ebay::common::perfect_hash_map<int64_t, analytical_info, int64_hasher> seller_map;
+typedef ebay::common::perfect_hash_table<int64_t, analytical_info> seller_map;
 typedef boost::unordered_map<int64_t, analytical_info> category_map;
 typedef boost::unordered_map<int32_t, analytical_info> shipping_map;
-typedef ebay::common::perfect_hash_map<shipping_zip_key, analytical_info> shipping_zip_map;
-typedef ebay::common::perfect_hash_map<zip_key, analytical_info> zip_map;
+typedef ebay::common::perfect_hash_table<shipping_zip_key, analytical_info> shipping_zip_map;
+typedef ebay::common::perfect_hash_table<zip_key, analytical_info> zip_map;
 
 typedef uint16_t hash_t;
 
+/*
+* Number of threads the builder uses: one per core, or BUILD_THREADS
+*/
+static std::size_t build_threads()
+{
+	std::size_t threads = std::max(1u, boost::thread::hardware_concurrency());
+	const char* threads_env = std::getenv("BUILD_THREADS");
+
+	if (threads_env != NULL && std::atoi(threads_env) > 0)
+		threads = std::atoi(threads_env);
+	return threads;
+}
+
+/*
+* Writes the 8 bit quantized table of a feature file next to its archive, and reports how far
+* the quantized values are from the input, column by column
+*/
+template <typename Key, typename InputIterator>
+static void save_quantized_table(const char* output, InputIterator first, InputIterator last)
+{
+	std::string out_quantized = output;
+	out_quantized += ".quantized";
+	ebay::common::quantized_error errors[analytical_info_data_size];
+	std::ostringstream report;
+
+	ebay::common::quantized_table<Key, analytical_info_data_size>::save(
+		out_quantized.c_str(), first, last, errors);
+	report << "Quantized " << out_quantized << ", column: step, max error, mean error, exact\n";
+	for (int i = 0; i < analytical_info_data_size; ++i)
+	{
+		report << "  " << (i == 0 ? "total" : "day ") << (i == 0 ? "" : std::string(1, '0' + i))
+			<< ": " << errors[i].step << ", " << errors[i].max_error << ", "
+			<< errors[i].mean_error() << ", "
+			<< (errors[i].count == 0 ? 100.0 : 100.0 * errors[i].exact / errors[i].count) << "%\n";
+	}
+	std::cout << report.str();
+}
+
+/*
+* Counts the integer keys past the largest key of a compact table the table accepts anyway,
+* out of a million
+*/
+template <typename Table, typename Key>
+static std::size_t compact_false_hits(const Table& table,
+	const std::vector<std::pair<Key, analytical_info> >& entries, boost::true_type)
+{
+	Key largest = entries[0].first;
+	std::size_t hits = 0;
+
+	for (std::size_t i = 1; i < entries.size(); i++)
+		largest = std::max(largest, entries[i].first);
+	for (int64_t i = 1; i <= 1000000; i++)
+		hits += table.find((Key) (largest + i)) != NULL;
+	return hits;
+}
+
+template <typename Table, typename Key>
+static std::size_t compact_false_hits(const Table& table,
+	const std::vector<std::pair<Key, analytical_info> >& entries, boost::false_type)
+{
+	return 0;
+}
+
+/*
+* Writes the compact table of a feature file next to its archive, maps it back and checks every
+* key finds its value. For integer keys it also reports how many absent keys the fingerprints let
+* through, each of which gets the features of another key.
+*/
+template <typename Key>
+static void save_compact_table(const char* output,
+	const std::vector<std::pair<Key, analytical_info> >& entries)
+{
+	typedef ebay::common::compact_table<Key, analytical_info> compact_map;
+	std::string out_compact = output;
+	out_compact += ".compact";
+
+	/* One thread: the build schedule already runs a table on every core. */
+	compact_map::save(out_compact.c_str(), entries.begin(), entries.end(), 1);
+
+	boost::scoped_ptr<compact_map> table(compact_map::open(out_compact.c_str()));
+	boost::unordered_set<Key> seen;
+
+	for (std::size_t i = 0; i < entries.size(); i++)
+	{
+		const analytical_info* info = table->find(entries[i].first);
+
+		if (!seen.insert(entries[i].first).second)
+			continue;
+		if (info == NULL || std::memcmp(info, &entries[i].second, sizeof(analytical_info)) != 0)
+			throw std::runtime_error("compact table does not match its input: " + out_compact);
+	}
+	std::ostringstream report;
+
+	report << "Created compact table " << out_compact << ", " << table->bytes_per_key()
+		<< " bytes per key";
+	if (boost::is_integral<Key>::value && !entries.empty())
+		report << ", " << compact_false_hits(*table, entries, boost::is_integral<Key>())
+			<< " false hits per 1M absent keys";
+	report << "\n";
+	std::cout << report.str();
+}
+
 /*
 * Function to convert human readable sellers data historical file to Boost Serialization archive
 * useful for unittesting 
@@ -1800,44 +2546,39 @@ static void features_create_perfect_data(const char* input,const char* output)
 {
 	std::vector<typename M::value_type> vector;
 	
-	std::ifstream ifs(input);
+	ebay::common::record_reader reader(input);
 
-	if (!ifs)
-	{
-		std::cout << "File Not Found: " << input << "\n";
-		return;
-	}
+	if (!reader.is_open())
+		throw std::runtime_error(std::string("Cannot read ") + input);
 	std::cout << "Processing File: " << input << "\n";
 	
 	typename M::key_type input_id;
 	typename M::mapped_type historical_features;
 	
-	ifs >> input_id;
 	std::size_t count = 0;
-	while (!ifs.fail() && !ifs.eof())
+	while (reader.next())
 	{
+		reader >> input_id;
 		for(int i=0; i<analytical_info_data_size; ++i)
 		{
-			ifs >> historical_features.data[i];
+			reader >> historical_features.data[i];
 		}
+		if (!reader.valid())
+			continue;
 		typename M::value_type temp(input_id, historical_features);
 		vector.push_back(temp);
 		count++;
-		ifs >> input_id;
 	}
 
 	std::cout << "Done reading: " << input << "\n";
 	
-	M* map = new M();
-	if(map->create(vector,1.5,0.0005))
-	{
-		std::cout << "Created hash map with "<<map->get_bucket_count()<<" buckets: " << input << "\n";
-	}
-	else
-	{
-		std::cout << "Failed to Create PHM!!! " << input << "\n";
-	}
-	
+	boost::scoped_ptr<M> map(new M());
+
+	/* One thread: the build schedule already runs a table on every core. */
+	map->create(vector, 1);
+	std::cout << "Created perfect hash of " << map->size() << " keys, "
+		<< map->bits_per_key() << " bits per key: " << input << "\n";
+
 	std::ofstream ofs(output, std::ios_base::binary);
 	boost::archive::binary_oarchive oarc(ofs);
 	std::string out_text = output;
@@ -1847,8 +2588,9 @@ static void features_create_perfect_data(const char* input,const char* output)
 
 	oarc & *map;
 	oarc_text & *map;
-	delete map;
-	map=NULL;
+	save_flat_table(output,vector);
+	save_quantized_table<typename M::key_type>(output, vector.begin(), vector.end());
+	save_compact_table(output, vector);
 }
 
 /*
@@ -1858,31 +2600,28 @@ static void features_create_perfect_data(const char* input,const char* output)
 template <typename T, typename M>
 static void features_create_map_data(const char* input,const char* output)
 {
-	M* map = new M();
-	
-	std::ifstream ifs(input);
+	ebay::common::record_reader reader(input);
 
-	if (!ifs)
-	{
-		std::cout << "File Not Found: " << input << "\n";
-		return;
-	}
+	if (!reader.is_open())
+		throw std::runtime_error(std::string("Cannot read ") + input);
 	std::cout << "Processing File: " << input << "\n";
 	
+	M* map = new M();
 	T input_id;
 	analytical_info historical_features;
 	
-	ifs >> input_id;
 	int32_t count = 0;
-	while (!ifs.fail() && !ifs.eof())
+	while (reader.next())
 	{
+		reader >> input_id;
 		for(int i=0; i<analytical_info_data_size; ++i)
 		{
-			ifs >> historical_features.data[i];
+			reader >> historical_features.data[i];
 		}
+		if (!reader.valid())
+			continue;
 		map->insert(std::pair<T, analytical_info>(input_id, historical_features));
 		count++;
-		ifs >> input_id;
 	}
 	
 	std::ofstream ofs(output, std::ios_base::binary);
@@ -1894,32 +2633,819 @@ static void features_create_map_data(const char* input,const char* output)
 
 	save_archive(oarc,*map);
 	save_archive(oarc_text,*map);
+	save_flat_table(output,*map);
+	save_direct_table(output,*map);
+	save_quantized_table<T>(output, map->begin(), map->end());
 	delete map;
 	map=NULL;
 }
 
-int main()
+/* Number of features of the delivery time model, ship_model::MAX_VALUE in the macros. */
+static const int32_t tree_model_feature_count = 19;
+
+/** @brief The @a pointer_tree_node struct is a node of the plain tree layout the
+*    flattened tree ensemble is checked and timed against: nodes allocated one by one
+*    and linked by pointers, compared as they are written in the model.
+*/
+struct pointer_tree_node
+{
+	int32_t feature;
+	double threshold;
+	double value;
+	pointer_tree_node* yes;
+	pointer_tree_node* no;
+};
+
+static pointer_tree_node* pointer_tree_build(const std::vector<ebay::common::tree_ensemble_node>& nodes,
+	int32_t id, std::vector<pointer_tree_node*>& allocated)
 {
+	for (std::size_t i = 0; i < nodes.size(); i++)
+	{
+		if (nodes[i].id != id)
+			continue;
+
+		pointer_tree_node* node = new pointer_tree_node();
+
+		allocated.push_back(node);
+		node->feature = nodes[i].feature;
+		node->threshold = nodes[i].threshold;
+		node->value = nodes[i].value;
+		node->yes = nodes[i].is_leaf() ? NULL : pointer_tree_build(nodes, nodes[i].yes, allocated);
+		node->no = nodes[i].is_leaf() ? NULL : pointer_tree_build(nodes, nodes[i].no, allocated);
+		return node;
+	}
+	throw std::runtime_error("tree model: branch to an undefined node");
+}
 
-	ssi_create_map_data("shipping_services.txt","nde_shipping_service_info.dat");
-	cbt_create_map_data("shipping_services_cbt.txt","generic_services.txt","nde_cbt_info.dat");
-	holiday_create_map_data("holidays.txt","nde_shipping_service_holiday.dat");
+static double pointer_tree_evaluate(const std::vector<pointer_tree_node*>& roots, double base_score,
+	const int32_t* features)
+{
+	double score = base_score;
 
+	for (std::size_t t = 0; t < roots.size(); t++)
+	{
+		const pointer_tree_node* node = roots[t];
+
+		while (node->feature >= 0)
+			node = features[node->feature] < node->threshold ? node->yes : node->no;
+		score += node->value;
+	}
+	return score;
+}
+
+/*
+* Draws feature vectors to check and time a tree model with, one after the other. Half of the
+* features sit next to a threshold of their own, where rounding matters
+*/
+static std::vector<int32_t> tree_model_samples(const ebay::common::tree_ensemble_trees& trees,
+	std::size_t sample_count)
+{
+	std::vector<std::vector<double> > splits(tree_model_feature_count);
+
+	for (std::size_t t = 0; t < trees.size(); t++)
+	{
+		for (std::size_t i = 0; i < trees[t].size(); i++)
+		{
+			if (!trees[t][i].is_leaf())
+				splits[trees[t][i].feature].push_back(trees[t][i].threshold);
+		}
+	}
+
+	std::vector<int32_t> samples(sample_count * tree_model_feature_count);
+	unsigned int seed = 1;
+
+	for (std::size_t i = 0; i < samples.size(); i++)
+	{
+		const std::vector<double>& feature_splits = splits[i % tree_model_feature_count];
+
+		if (feature_splits.empty())
+			samples[i] = rand_r(&seed) % 100;
+		else if (rand_r(&seed) % 2 == 0)
+			samples[i] = (int32_t) std::floor(feature_splits[rand_r(&seed) % feature_splits.size()]) +
+				rand_r(&seed) % 3 - 1;
+		else
+			samples[i] = (int32_t) feature_splits[rand_r(&seed) % feature_splits.size()] +
+				rand_r(&seed) % 201 - 100;
+	}
+	return samples;
+}
+
+/*
+* Function to check the flattened tree ensemble the analytical macro scores items with against
+* plain pointer trees, on feature vectors around the split thresholds of the model, and to time both,
+* one item at a time and in batches
+*/
+static void tree_model_check(const char* input)
+{
+	static const std::size_t sample_count = 100000;
+
+	std::ifstream probe(input);
+	if (!probe)
+		throw std::runtime_error(std::string("Cannot read ") + input);
+	probe.close();
+
+	double base_score = 0;
+	ebay::common::tree_ensemble_trees trees =
+		ebay::common::read_tree_ensemble(input, tree_model_feature_count, &base_score);
+	ebay::common::tree_ensemble ensemble(trees, base_score);
+	std::vector<pointer_tree_node*> allocated;
+	std::vector<pointer_tree_node*> roots;
+	std::vector<int32_t> samples = tree_model_samples(trees, sample_count);
+
+	for (std::size_t t = 0; t < trees.size(); t++)
+		roots.push_back(pointer_tree_build(trees[t], 0, allocated));
+
+	/* The same samples column by column, for the batch evaluation. */
+	std::vector<int32_t> columns(samples.size());
+	std::vector<double> batch_scores(sample_count);
+
+	for (std::size_t i = 0; i < sample_count; i++)
+	{
+		for (int32_t f = 0; f < tree_model_feature_count; f++)
+			columns[f * sample_count + i] = samples[i * tree_model_feature_count + f];
+	}
+
+	std::size_t mismatches = 0;
+	std::size_t batch_mismatches = 0;
+	double flattened_sum = 0;
+	double pointer_sum = 0;
+	timespec start;
+	timespec middle;
+	timespec stop;
+	timespec batch_start;
+	timespec batch_stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &batch_start);
+	ensemble.evaluate_batch(&columns[0], sample_count, sample_count, &batch_scores[0]);
+	clock_gettime(CLOCK_MONOTONIC, &batch_stop);
+	for (std::size_t i = 0; i < sample_count; i++)
+	{
+		const int32_t* features = &samples[i * tree_model_feature_count];
+		double score = ensemble.evaluate(features);
+
+		if (score != pointer_tree_evaluate(roots, base_score, features))
+			mismatches++;
+		if (score != batch_scores[i])
+			batch_mismatches++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (std::size_t i = 0; i < sample_count; i++)
+		flattened_sum += ensemble.evaluate(&samples[i * tree_model_feature_count]);
+	clock_gettime(CLOCK_MONOTONIC, &middle);
+	for (std::size_t i = 0; i < sample_count; i++)
+		pointer_sum += pointer_tree_evaluate(roots, base_score, &samples[i * tree_model_feature_count]);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	for (std::size_t i = 0; i < allocated.size(); i++)
+		delete allocated[i];
+
+	std::cout << input << ": " << ensemble.tree_count() << " trees, " << ensemble.node_count()
+		<< " nodes, depth " << ensemble.max_depth() << ", "
+		<< elapsed_ns(start, middle) / sample_count << " ns per flattened evaluation, "
+		<< elapsed_ns(middle, stop) / sample_count << " ns per pointer tree evaluation, "
+		<< elapsed_ns(batch_start, batch_stop) / sample_count << " ns per batch evaluation"
+		<< (flattened_sum == pointer_sum ? "" : ", sums differ") << "\n";
+	if (mismatches != 0 || batch_mismatches != 0)
+	{
+		std::ostringstream message;
+
+		message << mismatches << " of " << sample_count << " scores differ from the pointer trees, "
+			<< batch_mismatches << " from the batch evaluation";
+		throw std::runtime_error(message.str());
+	}
+}
+
+/*
+* Model features read from the historical feature maps, a total followed by the day of week
+* value, as ordered in ship_model in the macros
+*/
+static const int32_t tree_model_seller_feature = 9;
+static const int32_t tree_model_category_feature = 11;
+static const int32_t tree_model_shipping_method_feature = 13;
+static const int32_t tree_model_zip_feature = 15;
+static const int32_t tree_model_shipping_method_zip_feature = 17;
+
+/*
+* Function to compare the scores of the tree model on the features of a feature file with the
+* scores on the same features read back from its 8 bit quantized table, and to time a lookup of
+* the total and one day in the flat table and in the quantized columns
+*/
+template <typename Key>
+static void quantized_score_table(const ebay::common::tree_ensemble& ensemble,
+	const std::vector<int32_t>& samples, const char* input, const char* output,
+	int32_t total_feature)
+{
+	typedef ebay::common::quantized_table<Key, analytical_info_data_size> quantized_map;
+	typedef ebay::common::flat_table<Key, analytical_info> full_map;
+	std::vector<std::pair<Key, analytical_info> > entries;
+	ebay::common::record_reader reader(input);
+
+	if (!reader.is_open())
+		throw std::runtime_error(std::string("Cannot read ") + input);
+
+	Key key;
+	analytical_info info;
+
+	while (reader.next())
+	{
+		reader >> key;
+		for (int i = 0; i < analytical_info_data_size; ++i)
+			reader >> info.data[i];
+		if (reader.valid())
+			entries.push_back(std::make_pair(key, info));
+	}
+	if (entries.empty())
+		return;
+
+	std::string quantized_path = std::string(output) + ".quantized";
+	std::string flat_path = std::string(output) + ".flat";
+	boost::scoped_ptr<quantized_map> quantized(quantized_map::open(quantized_path.c_str()));
+	boost::scoped_ptr<full_map> full(full_map::open(flat_path.c_str()));
+	std::size_t sample_count = samples.size() / tree_model_feature_count;
+	std::vector<int32_t> features(tree_model_feature_count);
+	std::vector<std::size_t> picks(sample_count);
+	unsigned int seed = 1;
+	double max_change = 0;
+	double total_change = 0;
+	std::size_t unchanged = 0;
+	int64_t full_sum = 0;
+	int64_t quantized_sum = 0;
+	timespec start;
+	timespec middle;
+	timespec stop;
+
+	for (std::size_t i = 0; i < sample_count; i++)
+		picks[i] = rand_r(&seed) % entries.size();
+	for (std::size_t i = 0; i < sample_count; i++)
+	{
+		const std::pair<Key, analytical_info>& entry = entries[picks[i]];
+		std::size_t day = 1 + i % 7;
+		std::size_t row = quantized->row(entry.first);
+
+		if (row == quantized_map::npos)
+			throw std::runtime_error("Key missing from " + quantized_path);
+		std::copy(&samples[i * tree_model_feature_count],
+			&samples[(i + 1) * tree_model_feature_count], features.begin());
+		features[total_feature] = entry.second.data[0];
+		features[total_feature + 1] = entry.second.data[day];
+
+		double score = ensemble.evaluate(&features[0]);
+
+		features[total_feature] = quantized->value(row, 0);
+		features[total_feature + 1] = quantized->value(row, day);
+
+		double change = std::abs(ensemble.evaluate(&features[0]) - score);
+
+		max_change = std::max(max_change, change);
+		total_change += change;
+		unchanged += change == 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (std::size_t i = 0; i < sample_count; i++)
+	{
+		typename full_map::const_iterator it = full->find(entries[picks[i]].first);
+
+		full_sum += it->second.data[0] + it->second.data[1 + i % 7];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &middle);
+	for (std::size_t i = 0; i < sample_count; i++)
+	{
+		std::size_t row = quantized->row(entries[picks[i]].first);
+
+		quantized_sum += quantized->value(row, 0) + quantized->value(row, 1 + i % 7);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	std::ostringstream report;
+
+	report << "Model scores on " << quantized_path << ": " << sample_count << " items, "
+		<< 100.0 * unchanged / sample_count << "% unchanged, max change " << max_change
+		<< ", mean change " << total_change / sample_count << "; "
+		<< elapsed_ns(start, middle) / sample_count << " ns per flat table lookup, "
+		<< elapsed_ns(middle, stop) / sample_count << " ns per quantized lookup, "
+		<< full_sum - quantized_sum << " summed difference\n";
+	std::cout << report.str();
+}
+
+/*
+* Function to report how much the 8 bit quantized feature tables change the scores of the tree
+* model, table by table, on the feature vectors of the tree model check
+*/
+static void quantized_score_check(const char* model)
+{
+	static const std::size_t sample_count = 100000;
+
+	std::ifstream probe(model);
+	if (!probe)
+		throw std::runtime_error(std::string("Cannot read ") + model);
+	probe.close();
+
+	double base_score = 0;
+	ebay::common::tree_ensemble_trees trees =
+		ebay::common::read_tree_ensemble(model, tree_model_feature_count, &base_score);
+	ebay::common::tree_ensemble ensemble(trees, base_score);
+	std::vector<int32_t> samples = tree_model_samples(trees, sample_count);
+
+	quantized_score_table<int64_t>(ensemble, samples, "seller_history.txt",
+		"seller_history.dat", tree_model_seller_feature);
+	quantized_score_table<int64_t>(ensemble, samples, "category_history.txt",
+		"category_history.dat", tree_model_category_feature);
+	quantized_score_table<int32_t>(ensemble, samples, "shipment_history.txt",
+		"shipment_history.dat", tree_model_shipping_method_feature);
+	quantized_score_table<zip_key>(ensemble, samples, "zip_history.txt",
+		"zip_history.dat", tree_model_zip_feature);
+	quantized_score_table<shipping_zip_key>(ensemble, samples, "shipment_zip_history.txt",
+		"shipment_zip_history.dat", tree_model_shipping_method_zip_feature);
+}
+
+/* Items per window of the batch lookup, as in NativeDeliveryEstimate. */
+static const std::size_t batch_lookup_window = 16;
+
+/*
+* Function to check the staged lookups of the batched NativeDeliveryEstimate against one lookup per
+* item, on the shipping service and cbt flat tables: both must find the same entries. Reports the
+* cost per item of each
+*/
+static void batch_lookup_check(const char* services, const char* cbt)
+{
+	typedef ebay::common::flat_table<int32_t, shipping_service_info> service_table;
+	typedef ebay::common::flat_table<cbt_key, shipping_service_info> cbt_table;
+	static const std::size_t sample_count = 1000000;
+
+	boost::scoped_ptr<service_table> service_info(open_flat_table<service_table>(services));
+	boost::scoped_ptr<cbt_table> cbt_info(open_flat_table<cbt_table>(cbt));
+
+	if (!service_info || !cbt_info)
+		throw std::runtime_error(std::string("Cannot read ") + services + ".flat or " + cbt + ".flat");
+
+	std::vector<cbt_key> keys;
+	unsigned int seed = 1;
+
+	for (cbt_table::const_iterator it = cbt_info->begin(); it != cbt_info->end(); ++it)
+		keys.push_back(it->first);
+	if (keys.empty())
+		throw std::runtime_error(std::string("No entries in ") + cbt + ".flat");
+
+	/* One item in eight ships to a country the tables do not have. */
+	std::vector<cbt_key> items(sample_count);
+	for (std::size_t i = 0; i < sample_count; i++)
+	{
+		items[i] = keys[rand_r(&seed) % keys.size()];
+		if (rand_r(&seed) % 8 == 0)
+			items[i].dest_country_id = (int16_t) (-1 - (int) (rand_r(&seed) % 64));
+	}
+
+	std::vector<service_table::const_iterator> single_services(sample_count);
+	std::vector<cbt_table::const_iterator> single_cbt(sample_count);
+	std::vector<service_table::const_iterator> batch_services(sample_count);
+	std::vector<cbt_table::const_iterator> batch_cbt(sample_count);
+	uint64_t service_hash[batch_lookup_window];
+	uint64_t cbt_hash[batch_lookup_window];
+	timespec start;
+	timespec middle;
+	timespec stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (std::size_t i = 0; i < sample_count; i++)
+	{
+		single_services[i] = service_info->find(items[i].shipping_service_id);
+		single_cbt[i] = cbt_info->find(items[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &middle);
+	for (std::size_t first = 0; first < sample_count; first += batch_lookup_window)
+	{
+		std::size_t count = std::min(sample_count - first, batch_lookup_window);
+
+		for (std::size_t i = 0; i < count; i++)
+		{
+			service_hash[i] = service_info->prefetch(items[first + i].shipping_service_id);
+			cbt_hash[i] = cbt_info->prefetch(items[first + i]);
+		}
+		for (std::size_t i = 0; i < count; i++)
+		{
+			service_info->prefetch_entry(service_hash[i]);
+			cbt_info->prefetch_entry(cbt_hash[i]);
+		}
+		for (std::size_t i = 0; i < count; i++)
+		{
+			batch_services[first + i] =
+				service_info->find(items[first + i].shipping_service_id, service_hash[i]);
+			batch_cbt[first + i] = cbt_info->find(items[first + i], cbt_hash[i]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	std::size_t mismatches = 0;
+	std::size_t found = 0;
+
+	for (std::size_t i = 0; i < sample_count; i++)
+	{
+		mismatches += single_services[i] != batch_services[i] || single_cbt[i] != batch_cbt[i];
+		found += single_cbt[i] != cbt_info->end();
+	}
+
+	std::ostringstream report;
+
+	report << "Batch lookups: " << sample_count << " items, " << found << " cbt entries found, "
+		<< mismatches << " mismatches; "
+		<< elapsed_ns(start, middle) / sample_count << " ns per item one at a time, "
+		<< elapsed_ns(middle, stop) / sample_count << " ns per item in windows of "
+		<< batch_lookup_window << "\n";
+	std::cout << report.str();
+	if (mismatches != 0)
+		throw std::runtime_error("batch lookups differ from single lookups");
+}
+
+/*
+* Writes the branches of a tree node and of its children, as nested ifs
+*/
+static void write_tree_node(std::ostream& out, const std::vector<ebay::common::tree_ensemble_node>& nodes,
+	const std::map<int32_t, std::size_t>& by_id, int32_t id, std::size_t depth)
+{
+	std::map<int32_t, std::size_t>::const_iterator it = by_id.find(id);
+	std::string indent(4 * depth, ' ');
+
+	if (it == by_id.end() || depth > 256)
+		throw std::runtime_error("tree model: branch to an undefined node");
+
+	const ebay::common::tree_ensemble_node& node = nodes[it->second];
+
+	if (node.is_leaf())
+	{
+		out << indent << "net_response += " << node.value << ";\n";
+		return;
+	}
+	/* Features are integers, so the threshold is the integer the tree ensemble compares with. */
+	out << indent << "if (features[" << node.feature << "] < "
+		<< ebay::common::tree_ensemble_threshold(node.threshold) << ") {\n";
+	write_tree_node(out, nodes, by_id, node.yes, depth + 1);
+	out << indent << "} else {\n";
+	write_tree_node(out, nodes, by_id, node.no, depth + 1);
+	out << indent << "}\n";
+}
+
+/*
+* Writes a tree model as the source of shipping_tree_model::evaluate, laid out like
+* shipping_analytical_modelB.cpp, with every split and leaf as a constant in a branch
+*/
+static void write_tree_model_source(const ebay::common::tree_ensemble_trees& trees, double base_score,
+	const char* input, const char* output)
+{
+	std::ofstream out(output);
+
+	/* Enough digits for every leaf to read back as the same double. */
+	out.precision(17);
+	out << "/** @file macro/source/" << output << "\n"
+		<< " *  This file contains the boosted tree model for predicting shipment time,\n"
+		<< " *  generated by the table builder from " << input << "\n"
+		<< " */\n\n"
+		<< "#include \"macro/shipping_analytical_model.hpp\"\n\n"
+		<< "namespace ebay  { namespace search  { namespace macro\n{\n\n"
+		<< "double shipping_tree_model::evaluate(const int32_t features[]) {\n"
+		<< "    /* Return value. */\n"
+		<< "    double net_response = " << base_score << ";\n\n";
+	for (std::size_t t = 0; t < trees.size(); t++)
+	{
+		std::map<int32_t, std::size_t> by_id;
+
+		for (std::size_t i = 0; i < trees[t].size(); i++)
+			by_id[trees[t][i].id] = i;
+		out << "    /* booster[" << t << "] */\n";
+		write_tree_node(out, trees[t], by_id, 0, 1);
+	}
+	out << "\n    return net_response;\n}\n\n}}}\n";
+	if (!out)
+		throw std::runtime_error(std::string("Cannot write ") + output);
+}
+
+/*
+* Function to generate the C++ source of a tree model. When TREE_MODEL_CXX holds a compile command,
+* such as "g++ -O2 -I<include path>", the source is also built as a shared object, checked against the
+* tree ensemble the macro loads at run time and timed, with the size of each
+*/
+static void tree_model_source(const char* input, const char* output)
+{
+	static const std::size_t sample_count = 100000;
+
+	std::ifstream probe(input);
+	if (!probe)
+		throw std::runtime_error(std::string("Cannot read ") + input);
+	probe.close();
+
+	double base_score = 0;
+	ebay::common::tree_ensemble_trees trees =
+		ebay::common::read_tree_ensemble(input, tree_model_feature_count, &base_score);
+
+	write_tree_model_source(trees, base_score, input, output);
+
+	struct stat source_stat;
+	stat(output, &source_stat);
+	std::cout << "Generated " << output << ", " << source_stat.st_size << " bytes of source\n";
+
+	const char* compiler = std::getenv("TREE_MODEL_CXX");
+	if (compiler == NULL)
+		return;
+
+	std::string library = std::string(output) + ".so";
+	std::string command = std::string(compiler) + " -shared -fPIC -o " + library + " " + output;
+
+	if (std::system(command.c_str()) != 0)
+		throw std::runtime_error("Cannot compile " + std::string(output) + ": " + command);
+
+	typedef double (*evaluate_function)(const int32_t*);
+	std::string path = "./" + library;
+	void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+
+	if (handle == NULL)
+		throw std::runtime_error(std::string("Cannot load ") + library + ": " + dlerror());
+
+	/* shipping_tree_model::evaluate(const int32_t[]) */
+	evaluate_function generated = (evaluate_function)
+		dlsym(handle, "_ZN4ebay6search5macro19shipping_tree_model8evaluateEPKi");
+
+	if (generated == NULL)
+	{
+		dlclose(handle);
+		throw std::runtime_error("No shipping_tree_model::evaluate in " + library);
+	}
+
+	ebay::common::tree_ensemble ensemble(trees, base_score);
+	std::vector<int32_t> samples = tree_model_samples(trees, sample_count);
+	std::size_t mismatches = 0;
+	double generated_sum = 0;
+	double flattened_sum = 0;
+	timespec start;
+	timespec middle;
+	timespec stop;
+
+	for (std::size_t i = 0; i < sample_count; i++)
+	{
+		const int32_t* features = &samples[i * tree_model_feature_count];
+
+		if (generated(features) != ensemble.evaluate(features))
+			mismatches++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (std::size_t i = 0; i < sample_count; i++)
+		generated_sum += generated(&samples[i * tree_model_feature_count]);
+	clock_gettime(CLOCK_MONOTONIC, &middle);
+	for (std::size_t i = 0; i < sample_count; i++)
+		flattened_sum += ensemble.evaluate(&samples[i * tree_model_feature_count]);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	dlclose(handle);
+
+	struct stat library_stat;
+	stat(library.c_str(), &library_stat);
+	std::cout << library << ": " << library_stat.st_size << " bytes, "
+		<< elapsed_ns(start, middle) / sample_count << " ns per evaluation; tree ensemble: "
+		<< ensemble.memory_size() << " bytes, "
+		<< elapsed_ns(middle, stop) / sample_count << " ns per evaluation"
+		<< (generated_sum == flattened_sum ? "" : ", sums differ") << "\n";
+	if (mismatches != 0)
+	{
+		std::ostringstream message;
+
+		message << mismatches << " of " << sample_count << " scores of " << library
+			<< " differ from the tree ensemble";
+		throw std::runtime_error(message.str());
+	}
+}
+
+/** @brief The @a build_task struct describes one step of the table build.
+*/
+struct build_task
+{
+    build_task(const std::string& name, const boost::function<void ()>& run) :
+        name(name),
+        run(run)
+    {
+    }
+
+    /** @brief Adds a task whose output this one reads.
+    */
+    build_task& after(const std::string& task)
+    {
+        dependencies.push_back(task);
+        return *this;
+    }
+
+    std::string name;
+    boost::function<void ()> run;
+    /* Names of the tasks that have to finish first. */
+    std::vector<std::string> dependencies;
+};
+
+/** @brief The @a build_schedule class runs build tasks on a pool of threads,
+*  each as soon as the tasks it depends on are done. A task that fails, or
+*  depends on one that did, marks its dependents as skipped.
+*/
+class build_schedule
+{
+public:
+    explicit build_schedule(const std::vector<build_task>& tasks) :
+        tasks(tasks),
+        pending(tasks.size(), 0),
+        failed(tasks.size(), false),
+        dependents(tasks.size()),
+        done(0),
+        failures(0)
+    {
+        std::map<std::string, std::size_t> ids;
+
+        for (std::size_t i = 0; i < tasks.size(); i++)
+            ids[tasks[i].name] = i;
+        for (std::size_t i = 0; i < tasks.size(); i++)
+        {
+            for (std::size_t j = 0; j < tasks[i].dependencies.size(); j++)
+            {
+                std::map<std::string, std::size_t>::const_iterator it =
+                    ids.find(tasks[i].dependencies[j]);
+
+                if (it == ids.end() || it->second >= i)
+                    throw std::runtime_error("build task " + tasks[i].name +
+                        " must come after " + tasks[i].dependencies[j]);
+                dependents[it->second].push_back(i);
+                pending[i]++;
+            }
+            if (pending[i] == 0)
+                ready.push_back(i);
+        }
+    }
+
+    /** @brief Runs every task.
+    *
+    *  @param[in] threads The number of tasks run at once.
+    *  @return Returns the number of tasks that failed or were skipped.
+    */
+    std::size_t run(std::size_t threads)
+    {
+        boost::thread_group workers;
+        timespec start;
+        timespec stop;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (std::size_t i = 0; i < threads; i++)
+            workers.create_thread(boost::bind(&build_schedule::work, this));
+        workers.join_all();
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        std::cout << "Built " << tasks.size() - failures << " of " << tasks.size()
+                  << " tables on " << threads << " threads in "
+                  << elapsed_ns(start, stop) / 1e6 << " ms\n";
+        return failures;
+    }
+
+private:
+    void work()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+
+        while (true)
+        {
+            while (ready.empty() && done < tasks.size())
+                changed.wait(lock);
+            if (done == tasks.size())
+                return;
+
+            std::size_t id = ready.front();
+            bool ok = false;
+            std::string error;
+            timespec start;
+            timespec stop;
+
+            ready.pop_front();
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if (!failed[id])
+            {
+                lock.unlock();
+                try
+                {
+                    tasks[id].run();
+                    ok = true;
+                }
+                catch (const std::exception& e)
+                {
+                    error = e.what();
+                }
+                catch (...)
+                {
+                    error = "unknown error";
+                }
+                lock.lock();
+            }
+            clock_gettime(CLOCK_MONOTONIC, &stop);
+
+            if (ok)
+                std::cout << "Task " << tasks[id].name << ": "
+                          << elapsed_ns(start, stop) / 1e6 << " ms\n";
+            else if (failed[id])
+                std::cout << "Task " << tasks[id].name << ": skipped\n";
+            else
+                std::cout << "Task " << tasks[id].name << ": FAILED, " << error << "\n";
+            if (!ok)
+                failures++;
+            for (std::size_t i = 0; i < dependents[id].size(); i++)
+            {
+                std::size_t next = dependents[id][i];
+
+                if (!ok)
+                    failed[next] = true;
+                if (--pending[next] == 0)
+                    ready.push_back(next);
+            }
+            done++;
+            changed.notify_all();
+        }
+    }
+
+    const std::vector<build_task>& tasks;
+    /* Number of unfinished dependencies of every task. */
+    std::vector<std::size_t> pending;
+    /* Tasks a dependency of which failed. */
+    std::vector<bool> failed;
+    std::vector<std::vector<std::size_t> > dependents;
+    /* Tasks whose dependencies are all done, in the order they became ready. */
+    std::deque<std::size_t> ready;
+    std::size_t done;
+    std::size_t failures;
+    boost::mutex mutex;
+    boost::condition_variable changed;
+};
+
+int main()
+{
 	std::set<int16_t> excluded_zips = boost::assign::list_of(2898)(2899)(6798)(6799)(7151);
-	zr_create_map_data("zip_ranges.txt","ade_zip_ranges.dat",excluded_zips);
-	sb_create_map_data("base_services.txt","ade_base_services.dat");
-	ze_create_map_data("zip_estimates.txt","ade_zip_estimates.dat");
-	exc_create_map_data("exc_zones", "exc_zones.dat");
-    z2zdefault_create_map_data("z2z_default", "z2z_default.dat");
-    z2zranges_create_map_data("z2z_ranges", "z2z_ranges.dat");
-    z2ztozipnull_create_map_data("z2z_tozipnull", "z2z_tozipnull.dat");
-    z2z_create_map_data("z2z_ranges_data", "z2z_ranges_data.dat");
-    z2z_services_create_map_data("z2z_services", "z2z_services.dat");
-	
-	features_create_map_data<int64_t, category_map>("category_history.txt","category_history.dat");
-	features_create_map_data<int32_t, shipping_map>("shipment_history.txt","shipment_history.dat");
+	std::vector<build_task> tasks;
+
+	/*
+	* Every builder reads its own input and writes its own tables, except for
+	* the z2z resolve stage, which reads the other z2z tables back.
+	*/
+	tasks.push_back(build_task("ssi", boost::bind(&ssi_create_map_data,
+		"shipping_services.txt", "nde_shipping_service_info.dat")));
+	tasks.push_back(build_task("cbt", boost::bind(&cbt_create_map_data,
+		"shipping_services_cbt.txt", "generic_services.txt", "nde_cbt_info.dat")));
+	tasks.push_back(build_task("holiday", boost::bind(&holiday_create_map_data,
+		"holidays.txt", "nde_shipping_service_holiday.dat")));
+	tasks.push_back(build_task("zip_ranges", boost::bind(&zr_create_map_data,
+		"zip_ranges.txt", "ade_zip_ranges_index.dat", excluded_zips)));
+	tasks.push_back(build_task("base_services", boost::bind(&sb_create_map_data,
+		"base_services.txt", "ade_base_services.dat")));
+	tasks.push_back(build_task("zip_estimates", boost::bind(&ze_create_map_data,
+		"zip_estimates.txt", "ade_zip_estimates.dat")));
+	tasks.push_back(build_task("exc_zones", boost::bind(&exc_create_map_data,
+		"exc_zones", "exc_zones.dat")));
+	tasks.push_back(build_task("z2z_default", boost::bind(&z2zdefault_create_map_data,
+		"z2z_default", "z2z_default.dat", "z2z_default_index.dat", "z2z_default_matrix.dat")));
+	tasks.push_back(build_task("z2z_ranges", boost::bind(&z2zranges_create_map_data,
+		"z2z_ranges", "z2z_ranges_index.dat")));
+	tasks.push_back(build_task("z2z_tozipnull", boost::bind(&z2ztozipnull_create_map_data,
+		"z2z_tozipnull", "z2z_tozipnull.dat")));
+	tasks.push_back(build_task("z2z_ranges_data", boost::bind(&z2z_create_map_data,
+		"z2z_ranges_data", "z2z_ranges_data.dat")));
+	tasks.push_back(build_task("z2z_services", boost::bind(&z2z_services_create_map_data,
+		"z2z_services", "z2z_services.dat")));
+	tasks.push_back(build_task("z2z_resolve", boost::bind(&z2z_resolve_create_map_data,
+		"z2z_services.dat", "z2z_default.dat", "z2z_default_matrix.dat", "z2z_ranges_index.dat",
+		"z2z_ranges_data.dat",
+		"z2z_tozipnull.dat", "exc_zones.dat", "z2z_cascade_index.dat")));
+	tasks.back().after("z2z_services").after("z2z_default").after("z2z_ranges")
+		.after("z2z_ranges_data").after("z2z_tozipnull").after("exc_zones");
+
+	tasks.push_back(build_task("category_history", boost::bind(
+		&features_create_map_data<int64_t, category_map>,
+		"category_history.txt", "category_history.dat")));
+	tasks.push_back(build_task("shipment_history", boost::bind(
+		&features_create_map_data<int32_t, shipping_map>,
+		"shipment_history.txt", "shipment_history.dat")));
+	tasks.push_back(build_task("zip_history", boost::bind(
+		&features_create_perfect_data<zip_map>,
+		"zip_history.txt", "zip_history.dat")));
+	tasks.push_back(build_task("seller_history", boost::bind(
+		&features_create_perfect_data<seller_map>,
+		"seller_history.txt", "seller_history.dat")));
+	tasks.push_back(build_task("shipment_zip_history", boost::bind(
+		&features_create_perfect_data<shipping_zip_map>,
+		"shipment_zip_history.txt", "shipment_zip_history.dat")));
 
-	features_create_perfect_data<zip_map>("zip_history.txt","zip_history.dat");
-	features_create_perfect_data<seller_map>("seller_history.txt","seller_history.dat");
-	features_create_perfect_data<shipping_zip_map>("shipment_zip_history.txt","shipment_zip_history.dat");
-}
\ No newline at end of file
+	/*
+	* The tree model checks time the scoring and read the tables built
+	* above, so they run one at a time once every table is built, not next
+	* to the builders.
+	*/
+	std::vector<build_task> checks;
+
+	checks.push_back(build_task("tree_model", boost::bind(&tree_model_check,
+		"shipping_tree_model.txt")));
+	checks.push_back(build_task("tree_model_source", boost::bind(&tree_model_source,
+		"shipping_tree_model.txt", "shipping_analytical_model_generated.cpp")));
+	checks.push_back(build_task("quantized_scores", boost::bind(&quantized_score_check,
+		"shipping_tree_model.txt")));
+	checks.push_back(build_task("batch_lookups", boost::bind(&batch_lookup_check,
+		"nde_shipping_service_info.dat", "nde_cbt_info.dat")));
+
+	std::size_t failures = build_schedule(tasks).run(build_threads());
+
+	failures += build_schedule(checks).run(1);
+	return failures == 0 ? 0 : 1;
+}
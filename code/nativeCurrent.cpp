@@ -5,10 +5,12 @@
  */
 
 #include <map>
+#include <algorithm>
 #include <vector>
 #include <fstream>
 #include <iostream>
 #include <bitset>
+#include <stdexcept>
 #include <boost/optional.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
@@ -22,12 +24,25 @@
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/atomic.hpp>
+#include <sys/stat.h>
 #include "common/json_parser.hpp"
+#include "common/prefix_match_index.hpp"
+#include "common/interval_index.hpp"
+#include "common/flat_table.hpp"
+#include "common/direct_table.hpp"
+#include "common/rcu_snapshot.hpp"
+#include "common/cascade_prefix_index.hpp"
+#include "common/area_matrix.hpp"
+#include "common/stage_stats.hpp"
 #include "macro/macro_includes.hpp"
 #include "query_plugin/base_types_wrappers.hpp"
 #include "query_plugin/allocator_types.hpp"
 #include "macro/delivery_estimate_utils.hpp"
 #include "xplat/path.hpp"
+#include "xplat/counters_stats.hpp"
+#include "nativeCurrent.hpp"
 
 /** @brief The @a shipping_service_est struct holds data originating from the
  *    POSTALCODE SHIPPING ESTIMATES table in the Production DB
@@ -586,40 +601,104 @@ std::size_t hash_value(const z2z_services_key& key)
 }
 
 /* Map Shipping Service ID to Shipping Service Info. */
-typedef boost::unordered_map<int32_t, shipping_service_info> ssi_map;
+typedef ebay::common::flat_table<int32_t, shipping_service_info> ssi_map;
+/* Array of Shipping Service Info indexed by Shipping Service ID. */
+typedef ebay::common::direct_table<shipping_service_info> ssi_direct_map;
 /* Map <Service ID, Origin, Destination> to Shipping Service Info. */
-typedef boost::unordered_map<cbt_key, shipping_service_info> cbt_map;
+typedef ebay::common::flat_table<cbt_key, shipping_service_info> cbt_map;
 /* Map Country ID, Postal Code, Shipping Service Id to Exclusion Zones info. */
-typedef boost::unordered_map<exclusion_zip_key, shipping_service_est> exc_map;
+typedef ebay::common::flat_table<exclusion_zip_key, shipping_service_est> exc_map;
 /* Map From Country Id, To Country ID, From Zip, To Zip, Shipping Service Id to Shipping Service Info. */
-typedef boost::unordered_map<z2z_default_key, shipping_service_est> z2z_default_map;
+typedef ebay::common::flat_table<z2z_default_key, shipping_service_est> z2z_default_map;
 /* Map Country Id, Postal code to all Postal codes in that range. */
-typedef boost::unordered_map<z2z_range_key, int32_t> z2z_range_map;
+typedef ebay::common::flat_table<z2z_range_key, int32_t> z2z_range_map;
+/* Map Country Id, Postal code to the first Postal code of its range, one entry per range. */
+typedef ebay::common::interval_index<int32_t> z2z_range_index;
 /* Map From Country Id, To Country ID, From Zip, Shipping Service Id to Shipping Service Info. */
-typedef boost::unordered_map<z2z_tozipnull_key, shipping_service_est> z2z_tozipnull_map;
+typedef ebay::common::flat_table<z2z_tozipnull_key, shipping_service_est> z2z_tozipnull_map;
 /* Map From Country Id, To Country ID, From Zip, To Zip, Shipping Service Id to Shipping Service Info. */
-typedef boost::unordered_map<z2z_default_key, shipping_service_est> z2z_estimate_map;
+typedef ebay::common::flat_table<z2z_default_key, shipping_service_est> z2z_estimate_map;
 /* Set with From Country Id, To Country ID, Shipping Service Id as Key. */
-typedef boost::unordered_set<z2z_services_key> z2z_services_set;
-
-/* Static map to hold the shipping service info. */
-static boost::scoped_ptr<ssi_map> service_info_map;
-/* Static map to hold the cbt shipping service info. */
-static boost::scoped_ptr<cbt_map> service_cbt_map;
-/* Static map to hold Exclusion Zones info. */
-static boost::scoped_ptr<exc_map> service_exc_map;
-/* Static map to hold Zip2Zip ranges data info for DE and AU. */
-static boost::scoped_ptr<z2z_range_map> service_z2z_range_map;
-/* Static map to hold Zip2Zip data. */
-static boost::scoped_ptr<z2z_default_map> service_z2z_default_map;
-/* Static map to hold Zip2Zip buyer zip null data for DE. */
-static boost::scoped_ptr<z2z_tozipnull_map> service_z2z_tozipnull_map;
-/* Static map to hold Zip2Zip ranges estimates for DE and AU. */
-static boost::scoped_ptr<z2z_estimate_map> service_z2z_estimate_map;
-/* Static set to hold z2z Model shipping services. */
-static boost::scoped_ptr<z2z_services_set> service_z2z_services_set;
+typedef ebay::common::flat_table<z2z_services_key> z2z_services_set;
+/* Longest prefix match index over z2z default data, grouped by From Country Id, To Country ID, Shipping Service Id. */
+typedef ebay::common::prefix_match_index<z2z_services_key, shipping_service_est> z2z_default_index;
+/* Dense area by area matrices of z2z default data, grouped by From Country Id, To Country ID, Shipping Service Id. */
+typedef ebay::common::area_matrix_index<z2z_services_key, shipping_service_est> z2z_default_matrix;
+/* Precompiled z2z cascade of the default, range, tozipnull and exclusion data, grouped by From Country Id, To Country ID, Shipping Service Id. */
+typedef ebay::common::cascade_prefix_index<z2z_services_key, shipping_service_est> z2z_cascade_index;
+
+/** @brief The @a native_tables struct holds one generation of the tables the
+ *    macro reads. A generation is never modified once published: a reload
+ *    builds a new one and swaps it in whole.
+ */
+struct native_tables
+{
+    native_tables() :
+        z2z_model_flag(false),
+        generation(0)
+    {
+    }
+
+    /* Map to hold the shipping service info. */
+    boost::scoped_ptr<ssi_map> service_info_map;
+    /* Direct table of the shipping service info, preferred over the map when loaded. */
+    boost::scoped_ptr<ssi_direct_map> service_info_direct;
+    /* Map to hold the cbt shipping service info. */
+    boost::scoped_ptr<cbt_map> service_cbt_map;
+    /* Map to hold Exclusion Zones info. */
+    boost::scoped_ptr<exc_map> service_exc_map;
+    /* Map to hold Zip2Zip ranges data info for DE and AU. */
+    boost::scoped_ptr<z2z_range_map> service_z2z_range_map;
+    /* Index to hold Zip2Zip ranges, preferred over the map when loaded. */
+    boost::scoped_ptr<z2z_range_index> service_z2z_range_index;
+    /* Map to hold Zip2Zip data. */
+    boost::scoped_ptr<z2z_default_map> service_z2z_default_map;
+    /* Index to hold Zip2Zip data, preferred over the map when loaded. */
+    boost::scoped_ptr<z2z_default_index> service_z2z_default_index;
+    /* Matrices holding the Zip2Zip groups left out of the index, loaded with it. */
+    boost::scoped_ptr<z2z_default_matrix> service_z2z_default_matrix;
+    /* Map to hold Zip2Zip buyer zip null data for DE. */
+    boost::scoped_ptr<z2z_tozipnull_map> service_z2z_tozipnull_map;
+    /* Map to hold Zip2Zip ranges estimates for DE and AU. */
+    boost::scoped_ptr<z2z_estimate_map> service_z2z_estimate_map;
+    /* Set to hold z2z Model shipping services. */
+    boost::scoped_ptr<z2z_services_set> service_z2z_services_set;
+    /* Index to hold the whole z2z cascade, preferred over all of the above when loaded. */
+    boost::scoped_ptr<z2z_cascade_index> service_z2z_cascade_index;
+    bool z2z_model_flag;
+    /* Number of this generation, never reused; 0 for no tables. */
+    uint64_t generation;
+    /* Files the tables were loaded from, with their modification times. */
+    std::vector<std::pair<std::string, time_t> > sources;
+};
+
+/* The published table generation, read without locks by the macro. */
+static ebay::common::rcu_snapshot<native_tables> current_tables;
+/* Stand in for the tables when the macro is disabled or not initialized. */
+static const native_tables no_tables;
+/* Background thread reloading the tables when their files change. */
+static boost::scoped_ptr<boost::thread> reload_thread;
+static ebay::xplat::counters_stats::counter_registration
+    reload_counter("macro.shipping.fnf.native.tables_reloaded",
+                   &ebay::xplat::counters_add_merger, true);
+static ebay::xplat::counters_stats::counter_registration
+    reload_failed_counter("macro.shipping.fnf.native.tables_reload_failed",
+                          &ebay::xplat::counters_add_merger, true);
+/*
+ * Hit rate, probe counts and sampled latency of every stage of the cascade.
+ * One call in stats_sample_period per thread is timed.
+ */
+static const uint32_t stats_sample_period = 64;
+static ebay::common::stage_stats cascade_stats("macro.shipping.fnf.native.z2z_cascade");
+static ebay::common::stage_stats default_stats("macro.shipping.fnf.native.z2z_default");
+static ebay::common::stage_stats ranges_stats("macro.shipping.fnf.native.z2z_ranges");
+static ebay::common::stage_stats tozipnull_stats("macro.shipping.fnf.native.z2z_tozipnull");
+static ebay::common::stage_stats exclusion_stats("macro.shipping.fnf.native.exclusion");
+static ebay::common::stage_stats ssi_stats("macro.shipping.fnf.native.ssi");
+static ebay::common::stage_stats cbt_stats("macro.shipping.fnf.native.cbt");
+static ebay::common::stage_stats cbt_retry_stats("macro.shipping.fnf.native.cbt_retry");
 static const int32_t uk_zip_base = 36;
-static bool z2z_model_flag;
+
 
 /** @brief Translate the full numeric from_zip into an int.
  *
@@ -645,19 +724,105 @@ static int32_t translate_from_zip_big(const QPL_NS::blob_vect& from_zip_string)
     return from_zip;
 }
 
+/* Most prefixes of a postcode hash: ten digits in base 10, fewer in base 36. */
+static const std::size_t max_zip_prefixes = 10;
+/* Shipping services whose exclusion zone result a destination remembers. */
+static const std::size_t exc_cache_size = 4;
+
+/** @brief The @a destination_context struct holds the destination side of the
+ *    z2z lookups. It only depends on the buyer, so it is computed once per
+ *    query and shared by every item, leaving the items the origin side.
+ */
+struct destination_context
+{
+    int16_t to_country_id;
+    int32_t to_zip;
+    int32_t to_ctry_base;
+    /* Destination prefixes, longest first, as the default lookup walks them. */
+    std::size_t prefix_count;
+    int32_t prefixes[max_zip_prefixes];
+    /* Number of positive prefixes, the only ones ranges and exclusions hold. */
+    std::size_t range_count;
+    /* Start of the z2z range of each positive prefix, NULL if in no range;
+     * only looked up once a query falls back to the ranges. */
+    bool ranges_found;
+    const int32_t* ranges[max_zip_prefixes];
+    /* Exclusion zone results of the last few shipping services. */
+    std::size_t exc_count;
+    int32_t exc_services[exc_cache_size];
+    const shipping_service_est* exc_hits[exc_cache_size];
+};
+
+/** @brief Get the first postcode of the z2z range a postcode falls in.
+ *
+ *  @param[in] tables the table generation to read
+ *  @param[in] country_id the country of the postcode
+ *  @param[in] zip the postcode
+ *  @return Returns the start of the range, or NULL if the postcode is in no range.
+ */
+static const int32_t* find_z2z_range(const native_tables& tables, int16_t country_id,
+                                     int32_t zip)
+{
+    if (XPLAT_LIKELY(tables.service_z2z_range_index != NULL))
+        return tables.service_z2z_range_index->find(country_id, zip);
+    if (XPLAT_UNLIKELY(tables.service_z2z_range_map == NULL))
+        return NULL;
+
+    z2z_range_map::const_iterator it = tables.service_z2z_range_map->find(z2z_range_key(country_id, zip));
+
+    if (it == tables.service_z2z_range_map->end())
+        return NULL;
+    return &it->second;
+}
+
+/** @brief Computes the destination side of the z2z lookups.
+ *
+ *  @param[in] to_country_id the destination country
+ *  @param[in] to_zip the destination postcode
+ *  @param[out] destination receives the destination side
+ */
+static void init_destination(int16_t to_country_id, int32_t to_zip,
+                             destination_context& destination)
+{
+    destination.to_country_id = to_country_id;
+    destination.to_zip = to_zip;
+    destination.to_ctry_base = 10;
+    /*
+     * If to_country is UK, use 36 as the base for longest prefix match
+     * otherwise use 10.
+     */
+    if (XPLAT_UNLIKELY(to_country_id == MACRO_NS::country::united_kingdom))
+        destination.to_ctry_base = uk_zip_base;
+
+    destination.prefix_count = 0;
+    for (int32_t temp_to_zip = to_zip; ; temp_to_zip /= destination.to_ctry_base)
+    {
+        destination.prefixes[destination.prefix_count++] = temp_to_zip;
+        if (temp_to_zip / destination.to_ctry_base == 0)
+            break;
+    }
+
+    destination.range_count = to_zip > 0 ? destination.prefix_count : 0;
+    destination.ranges_found = false;
+    destination.exc_count = 0;
+}
+
 /** @brief Get an estimate from the z2z default map if it exists.
  *
+ *  @param[in] tables the table generation to read
+ *  @param[in] destination the destination side of the query
  *  @param[in] from_country_id the origin country
- *  @param[in] to_country_id the destination country
  *  @param[in] from_zip the origin postcode
- *  @param[in] to_zip the destination postcode
  *  @param[in] shipping_service the shipping service being used
+ *  @param[out] probes receives the number of table probes made
  */
-boost::optional<shipping_service_est> get_z2z_default(int16_t from_country_id,
-       int16_t to_country_id, int32_t from_zip, int32_t to_zip, int32_t shipping_service)
+boost::optional<shipping_service_est> get_z2z_default(const native_tables& tables,
+       const destination_context& destination, int16_t from_country_id, int32_t from_zip,
+       int32_t shipping_service, uint32_t& probes)
 {
+    int16_t to_country_id = destination.to_country_id;
+    int32_t to_zip = destination.to_zip;
     int32_t from_ctry_base = 10;
-    int32_t to_ctry_base = 10;
 
     /*
      * If to_country is UK, use 36 as the base for longest prefix match
@@ -665,31 +830,68 @@ boost::optional<shipping_service_est> get_z2z_default(int16_t from_country_id,
      */
     if (XPLAT_UNLIKELY(from_country_id == MACRO_NS::country::united_kingdom))
         from_ctry_base = uk_zip_base;
-    if (XPLAT_UNLIKELY(to_country_id == MACRO_NS::country::united_kingdom))
-        to_ctry_base = uk_zip_base;
 
     boost::optional<shipping_service_est> est;
+
+    /*
+     * Groups that are complete area matrices are only in the matrices: the
+     * longest prefix match is the cell of the longest matching areas.
+     */
+    if (XPLAT_LIKELY(tables.service_z2z_default_matrix != NULL))
+    {
+        probes++;
+
+        const ebay::common::area_matrix* matrix =
+            tables.service_z2z_default_matrix->find_group(
+                z2z_services_key(from_country_id, to_country_id, shipping_service));
+
+        if (XPLAT_LIKELY(matrix != NULL))
+        {
+            const shipping_service_est* hit =
+                tables.service_z2z_default_matrix->find(*matrix, from_zip, to_zip);
+
+            if (XPLAT_LIKELY(hit != NULL))
+                est = *hit;
+            return est;
+        }
+    }
+
+    /*
+     * The index answers the same longest prefix question with one probe for
+     * the group and a walk down the origin and destination tries.
+     */
+    if (XPLAT_LIKELY(tables.service_z2z_default_index != NULL))
+    {
+        probes++;
+
+        const shipping_service_est* hit = tables.service_z2z_default_index->find(
+            z2z_services_key(from_country_id, to_country_id, shipping_service),
+            from_zip, to_zip);
+
+        if (XPLAT_UNLIKELY(hit != NULL))
+            est = *hit;
+        return est;
+    }
+    if (XPLAT_UNLIKELY(tables.service_z2z_default_map == NULL))
+        return est;
+
     int32_t temp_from_zip = from_zip;
-    int32_t temp_to_zip = to_zip;
 
     while (true)
     {
-        temp_to_zip = to_zip;
-        while (true)
+        for (std::size_t i = 0; i < destination.prefix_count; i++)
         {
             z2z_default_key key(from_country_id, to_country_id, temp_from_zip,
-                                temp_to_zip, shipping_service);
+                                destination.prefixes[i], shipping_service);
             z2z_default_map::const_iterator it;
 
-            it = service_z2z_default_map->find(key);
-            if (XPLAT_UNLIKELY(it != service_z2z_default_map->end()))
+            probes++;
+            it = tables.service_z2z_default_map->find(key);
+            if (XPLAT_UNLIKELY(it != tables.service_z2z_default_map->end()))
             {
                 est = it->second;
                 return est;
             }
-            temp_to_zip /= to_ctry_base;
-            if (temp_to_zip == 0)
-                break;
         }
         temp_from_zip /= from_ctry_base;
         if (temp_from_zip == 0)
@@ -700,59 +902,64 @@ boost::optional<shipping_service_est> get_z2z_default(int16_t from_country_id,
 
 /** @brief Get an estimate from the z2z ranges map if it exists.
  *
+ *  @param[in] tables the table generation to read
+ *  @param[in,out] destination the destination side of the query
  *  @param[in] from_country_id the origin country
- *  @param[in] to_country_ip the destination country
  *  @param[in] from_zip the origin postcode
- *  @param[in] to_zip_big the destination postcode
  *  @param[in] shipping_service the shipping service being used
+ *  @param[out] probes receives the number of table probes made
  */
-boost::optional<shipping_service_est> get_z2z_ranges(int16_t from_country_id, int16_t to_country_id,
-                       int32_t from_zip, int32_t to_zip, int32_t shipping_service)
+boost::optional<shipping_service_est> get_z2z_ranges(const native_tables& tables,
+                       destination_context& destination, int16_t from_country_id,
+                       int32_t from_zip, int32_t shipping_service, uint32_t& probes)
 {
+    if (!destination.ranges_found)
+    {
+        for (std::size_t i = 0; i < destination.range_count; i++)
+            destination.ranges[i] = find_z2z_range(tables, destination.to_country_id,
+                                                   destination.prefixes[i]);
+        destination.ranges_found = true;
+        probes += destination.range_count;
+    }
+
     int32_t from_ctry_base = 10;
-    int32_t to_ctry_base = 10;
     /*
      * If to_country is UK, use 36 as the base for longest prefix match
      * otherwise use 10.
      */
     if (XPLAT_UNLIKELY(from_country_id == MACRO_NS::country::united_kingdom))
         from_ctry_base = uk_zip_base;
-    if (XPLAT_UNLIKELY(to_country_id == MACRO_NS::country::united_kingdom))
-        to_ctry_base = uk_zip_base;
 
     boost::optional<shipping_service_est> est;
-    z2z_range_map::const_iterator it_range;
-    it_range =  service_z2z_range_map->begin();
     int32_t temp_from_zip = from_zip;
-    int32_t temp_to_zip = to_zip;
 
     while (temp_from_zip > 0)
     {
-        temp_to_zip = to_zip;
-        z2z_range_key zip_from_key(from_country_id, temp_from_zip);
-        z2z_range_map::const_iterator it_from = service_z2z_range_map->find(zip_from_key);
-        if (XPLAT_LIKELY(it_from != service_z2z_range_map->end()))
+        const int32_t* range_from = find_z2z_range(tables, from_country_id, temp_from_zip);
+
+        probes++;
+        if (XPLAT_LIKELY(range_from != NULL))
         {
-            while (temp_to_zip > 0)
+            for (std::size_t i = 0; i < destination.range_count; i++)
             {
-                z2z_range_key zip_to_key(to_country_id, temp_to_zip);
-                z2z_range_map::const_iterator it_to = service_z2z_range_map->find(zip_to_key);
+                const int32_t* range_to = destination.ranges[i];
 
-                if (XPLAT_LIKELY(it_to != service_z2z_range_map->end()))
+                if (XPLAT_LIKELY(range_to != NULL))
                 {
-                    z2z_default_key lookup_key(from_country_id, to_country_id, it_from->second,
-                                            it_to->second, shipping_service);
+                    z2z_default_key lookup_key(from_country_id, destination.to_country_id,
+                                            *range_from, *range_to, shipping_service);
                     z2z_estimate_map::const_iterator it_estimate =
-                                 service_z2z_estimate_map->find(lookup_key);
+                                 tables.service_z2z_estimate_map->find(lookup_key);
+
+                    probes++;
 
-                    if (XPLAT_UNLIKELY(it_estimate != service_z2z_estimate_map->end() &&
+                    if (XPLAT_UNLIKELY(it_estimate != tables.service_z2z_estimate_map->end() &&
                                  it_estimate->second.max_hours >= 0))
                     {
                         est = it_estimate->second;
                         return est;
                     }
                 }
-                temp_to_zip /= to_ctry_base;
             }
         }
         temp_from_zip /= from_ctry_base;
@@ -762,13 +969,16 @@ boost::optional<shipping_service_est> get_z2z_ranges(int16_t from_country_id, in
 
 /** @brief Get an estimate from the z2z null map if it exists.
  *
+ *  @param[in] tables the table generation to read
  *  @param[in] from_country_id the origin country
  *  @param[in] to_country_id the destination country
  *  @param[in] from_zip the origin postcode
  *  @param[in] shipping_service the shipping service being used
+ *  @param[out] probes receives the number of table probes made
  */
-boost::optional<shipping_service_est> get_z2z_tozipnull(int16_t from_country_id,
-              int16_t to_country_id, int32_t from_zip, int32_t shipping_service)
+boost::optional<shipping_service_est> get_z2z_tozipnull(const native_tables& tables,
+              int16_t from_country_id, int16_t to_country_id, int32_t from_zip,
+              int32_t shipping_service, uint32_t& probes)
 {
     int32_t from_ctry_base = 10;
 
@@ -787,8 +997,9 @@ boost::optional<shipping_service_est> get_z2z_tozipnull(int16_t from_country_id,
     {
         z2z_tozipnull_key key(from_country_id, to_country_id, temp_from_zip, shipping_service);
 
-        it = service_z2z_tozipnull_map->find(key);
-        if (XPLAT_UNLIKELY(it != service_z2z_tozipnull_map->end()))
+        probes++;
+        it = tables.service_z2z_tozipnull_map->find(key);
+        if (XPLAT_UNLIKELY(it != tables.service_z2z_tozipnull_map->end()))
         {
             est = it->second;
             return est;
@@ -798,73 +1009,159 @@ boost::optional<shipping_service_est> get_z2z_tozipnull(int16_t from_country_id,
     return est;
 }
 
-/** @brief Get an estimate from the exclusion zone map if it exists.
+/** @brief Get an estimate from the exclusion zone map if it exists. The
+ *    result only depends on the destination and the shipping service, so the
+ *    destination remembers it for the next items of the query.
  *
- *  @param[in] to_country_id the destination country
- *  @param[in] to_zip the destination postcode
+ *  @param[in] tables the table generation to read
+ *  @param[in,out] destination the destination side of the query
  *  @param[in] shipping_service the shipping service being used
+ *  @param[out] probes receives the number of table probes made
  */
-boost::optional<shipping_service_est> get_exc_est(int16_t to_country_id, int32_t to_zip,
-                                                  int32_t shipping_service)
+boost::optional<shipping_service_est> get_exc_est(const native_tables& tables,
+                                                  destination_context& destination,
+                                                  int32_t shipping_service, uint32_t& probes)
 {
-    int32_t to_ctry_base = 10;
+    boost::optional<shipping_service_est> est;
+    std::size_t cached = std::min(destination.exc_count, exc_cache_size);
 
-    /*
-     * If to_country is UK, use 36 as the base for longest prefix match
-     * otherwise use 10.
-     */
-    if (XPLAT_UNLIKELY(to_country_id == MACRO_NS::country::united_kingdom))
-        to_ctry_base = uk_zip_base;
+    for (std::size_t i = 0; i < cached; i++)
+    {
+        if (destination.exc_services[i] == shipping_service)
+        {
+            if (destination.exc_hits[i] != NULL)
+                est = *destination.exc_hits[i];
+            return est;
+        }
+    }
 
-    boost::optional<shipping_service_est> est;
-    exc_map::const_iterator it;
-    int32_t temp_to_zip = to_zip;
+    const shipping_service_est* hit = NULL;
 
-    while (temp_to_zip > 0)
+    /* The prefixes go from the full postcode down, so the longest matching prefix wins. */
+    for (std::size_t i = 0; i < destination.range_count; i++)
     {
-        exclusion_zip_key key(shipping_service, to_country_id, temp_to_zip);
+        exclusion_zip_key key(shipping_service, destination.to_country_id,
+                              destination.prefixes[i]);
+        exc_map::const_iterator it = tables.service_exc_map->find(key);
 
-        it = service_exc_map->find(key);
-        if (XPLAT_UNLIKELY(it != service_exc_map->end()))
+        probes++;
+        if (XPLAT_UNLIKELY(it != tables.service_exc_map->end()))
         {
-            est = it->second;
-            return est;
+            hit = &it->second;
+            break;
         }
-        temp_to_zip /= to_ctry_base;
     }
+
+    std::size_t slot = destination.exc_count++ % exc_cache_size;
+
+    destination.exc_services[slot] = shipping_service;
+    destination.exc_hits[slot] = hit;
+    if (hit != NULL)
+        est = *hit;
     return est;
 }
 
 /** @brief Get an estimate from the z2z model .
  *
+ *  @param[in] tables the table generation to read
+ *  @param[in,out] destination the destination side of the query
  *  @param[in] from_country_id the origin country
- *  @param[in] to_country_ip the destination country
  *  @param[in] from_zip the origin postcode
- *  @param[in] to_zip_big the destination postcode
  *  @param[in] shipping_service the shipping service being used
+ *  @param[in] sampled whether the stages of this call are timed
  */
-boost::optional<shipping_service_est> get_z2z_est(int16_t from_country_id, int16_t to_country_id,
-        int32_t from_zip, int32_t to_zip, int32_t shipping_service)
+boost::optional<shipping_service_est> get_z2z_est(const native_tables& tables,
+        destination_context& destination, int16_t from_country_id,
+        int32_t from_zip, int32_t shipping_service, bool sampled)
 {
     z2z_services_set::const_iterator it;
     boost::optional<shipping_service_est> z2z_est;
+    int16_t to_country_id = destination.to_country_id;
+    int32_t to_zip = destination.to_zip;
 
     z2z_services_key key(from_country_id, to_country_id, shipping_service);
-    it = service_z2z_services_set->find(key);
-    if (XPLAT_UNLIKELY(it != service_z2z_services_set->end()))
-    {
-        if (XPLAT_UNLIKELY(!z2z_est && service_z2z_default_map != NULL))
-            z2z_est = get_z2z_default(from_country_id, to_country_id, from_zip,
-                                      to_zip, shipping_service);
-        if (XPLAT_UNLIKELY(!z2z_est && service_z2z_range_map != NULL &&
-                                    service_z2z_estimate_map != NULL))
-            z2z_est = get_z2z_ranges(from_country_id, to_country_id, from_zip,
-                                     to_zip, shipping_service);
-        if (XPLAT_UNLIKELY(!z2z_est && service_z2z_tozipnull_map != NULL))
-            z2z_est = get_z2z_tozipnull(from_country_id, to_country_id,
-                                        from_zip, shipping_service);
-        if (XPLAT_UNLIKELY(!z2z_est && service_exc_map != NULL))
-            z2z_est = get_exc_est(to_country_id, to_zip, shipping_service);
+
+    /*
+     * The cascade index was checked against the fallbacks below when it was
+     * built, and resolves them with one group probe and one trie walk each.
+     */
+    if (XPLAT_LIKELY(tables.service_z2z_cascade_index != NULL))
+    {
+        const shipping_service_est* hit = NULL;
+        uint32_t probes = 1;
+
+        {
+            ebay::common::stage_timer timer(cascade_stats, sampled);
+
+            /* Only the groups of the z2z services set have estimates. */
+            const ebay::common::cascade_group* group =
+                tables.service_z2z_cascade_index->find_group(key);
+
+            if (XPLAT_LIKELY(group != NULL))
+            {
+                /* A matrix hit is the default row the cascade would find first. */
+                if (tables.service_z2z_default_matrix != NULL)
+                {
+                    probes++;
+                    hit = tables.service_z2z_default_matrix->find(key, from_zip, to_zip);
+                }
+                if (hit == NULL)
+                    hit = tables.service_z2z_cascade_index->find(*group, from_zip, to_zip);
+            }
+        }
+        cascade_stats.record(hit != NULL, probes);
+
+        if (XPLAT_UNLIKELY(hit != NULL))
+            z2z_est = *hit;
+        return z2z_est;
+    }
+
+    it = tables.service_z2z_services_set->find(key);
+    if (XPLAT_UNLIKELY(it != tables.service_z2z_services_set->end()))
+    {
+        if (XPLAT_UNLIKELY(!z2z_est && (tables.service_z2z_default_matrix != NULL ||
+                                        tables.service_z2z_default_index != NULL ||
+                                        tables.service_z2z_default_map != NULL)))
+        {
+            uint32_t probes = 0;
+            {
+                ebay::common::stage_timer timer(default_stats, sampled);
+                z2z_est = get_z2z_default(tables, destination, from_country_id, from_zip,
+                                          shipping_service, probes);
+            }
+            default_stats.record(z2z_est.is_initialized(), probes);
+        }
+        if (XPLAT_UNLIKELY(!z2z_est && (tables.service_z2z_range_index != NULL ||
+                                        tables.service_z2z_range_map != NULL) &&
+                                    tables.service_z2z_estimate_map != NULL))
+        {
+            uint32_t probes = 0;
+            {
+                ebay::common::stage_timer timer(ranges_stats, sampled);
+                z2z_est = get_z2z_ranges(tables, destination, from_country_id, from_zip,
+                                         shipping_service, probes);
+            }
+            ranges_stats.record(z2z_est.is_initialized(), probes);
+        }
+        if (XPLAT_UNLIKELY(!z2z_est && tables.service_z2z_tozipnull_map != NULL))
+        {
+            uint32_t probes = 0;
+            {
+                ebay::common::stage_timer timer(tozipnull_stats, sampled);
+                z2z_est = get_z2z_tozipnull(tables, from_country_id, to_country_id,
+                                            from_zip, shipping_service, probes);
+            }
+            tozipnull_stats.record(z2z_est.is_initialized(), probes);
+        }
+        if (XPLAT_UNLIKELY(!z2z_est && tables.service_exc_map != NULL))
+        {
+            uint32_t probes = 0;
+            {
+                ebay::common::stage_timer timer(exclusion_stats, sampled);
+                z2z_est = get_exc_est(tables, destination, shipping_service, probes);
+            }
+            exclusion_stats.record(z2z_est.is_initialized(), probes);
+        }
     }
     return z2z_est;
 }
@@ -885,88 +1182,88 @@ static const std::size_t shipcalc_column_number_error = 0;
 static const std::size_t shipcalc_column_number_mail_class = 2;
 static const int64_t cbt_shipping_service_id = 50000;
 static const std::size_t return_size = 4;
+/* Number of items whose table lookups are interleaved. */
+static const std::size_t batch_window = 16;
 
-DECLARE_MACRO(NativeDeliveryEstimate)
+/** @brief Checks whether an item is estimated from the cbt table.
+ *
+ *  @param[in] query the buyer side inputs
+ *  @param[in] item the item
+ */
+static bool is_cbt_item(const native_delivery_query& query, const native_delivery_item& item)
 {
-    int32_t handling_time = attr_get__handling_time(QPL_ATTR_CTX, 0);
-    int16_t from_country_id = (int16_t) MACRO_NS::convert_country(
-        attr_get__Ctry(QPL_ATTR_CTX, 0));
-    int16_t to_country_id = (int16_t) MACRO_NS::convert_country(
-        attr_get__ToCtry(QPL_ATTR_CTX, 0));
-    const QPL_NS::qpl_blob z2z_model =
-        attr_get__z2z_model(QPL_ATTR_CTX, QPL_NS::qpl_blob());
-    const QPL_NS::qpl_int64_vect* shipping_services_vect =
-        attr_get__shipping_services(QPL_ATTR_CTX);
-    const QPL_NS::qpl_int64_vect* shipping_cost =
-        attr_get__CalculatedShippingCost(QPL_ATTR_CTX);
-    const QPL_NS::blob_vect from_zip_string = attr_get__FromZip(QPL_ATTR_CTX);
-    int32_t to_zip_big = attr_get__ToZip(QPL_ATTR_CTX, 0);
-    int32_t shipping_service = 0;
+    return item.shipping_service >= cbt_shipping_service_id ||
+           item.from_country_id != query.to_country_id;
+}
+
+/** @brief Computes the estimate of one item, once its lookups are prefetched.
+ *
+ *  @param[in] tables the table generation to read
+ *  @param[in] query the buyer side inputs
+ *  @param[in] item the item
+ *  @param[in,out] destination the destination side of the query
+ *  @param[in] is_z2z_model_on whether the z2z model applies to the query
+ *  @param[in] ssi_hash the hash of the shipping service info key
+ *  @param[in] cbt_hash the hash of the cbt key
+ *  @param[out] estimate receives the estimate
+ */
+static void estimate_item(const native_tables& tables, const native_delivery_query& query,
+                          const native_delivery_item& item,
+                          destination_context& destination, bool is_z2z_model_on,
+                          uint64_t ssi_hash, uint64_t cbt_hash,
+                          native_delivery_estimate& estimate)
+{
+    int32_t shipping_service = item.shipping_service;
+    int32_t handling_time = item.handling_time;
+    int16_t from_country_id = item.from_country_id;
+    int16_t to_country_id = query.to_country_id;
     int16_t max_hours = -1;
     int16_t min_hours = -1;
     int8_t working_days = 0x41; /*1000001*/
     bool have_z2z_est = false;
-    bool is_cbt = false;
-
-    if (from_country_id != to_country_id)
-        is_cbt = true;
+    bool sampled = ebay::common::sample_timing(stats_sample_period);
 
-    if (XPLAT_LIKELY(shipping_cost->count > shipcalc_column_number_mail_class &&
-                     shipping_cost->values[shipcalc_column_number_error] == 0))
-        shipping_service = static_cast<int32_t>
-            (shipping_cost->values[shipcalc_column_number_mail_class]);
-    else if (shipping_services_vect != NULL && shipping_services_vect->count > 0)
+    if (XPLAT_LIKELY(from_country_id == to_country_id && is_z2z_model_on))
     {
-        /*
-         * We didn't get a ShipCalc response, so attempt to figure out the
-         * proper shipping service.
-         */
-        for (std::size_t i = 0; i < shipping_services_vect->count; i++)
+        boost::optional<shipping_service_est> z2z_est = get_z2z_est(tables,
+                                        destination, from_country_id,
+                                        item.from_zip, shipping_service, sampled);
+        if (XPLAT_UNLIKELY(z2z_est))
         {
-            if (is_cbt && shipping_services_vect->values[i] >= cbt_shipping_service_id)
-            {
-                shipping_service = (int32_t) shipping_services_vect->values[i];
-                break;
-            }
-            else if (!is_cbt &&
-                     shipping_services_vect->values[i] < cbt_shipping_service_id)
-            {
-                shipping_service = (int32_t) shipping_services_vect->values[i];
-                break;
-            }
+            max_hours = z2z_est->max_hours;
+            min_hours = z2z_est->min_hours;
+            have_z2z_est = true;
         }
     }
 
-    if (XPLAT_LIKELY(!is_cbt && service_z2z_services_set != NULL))
+    if (XPLAT_LIKELY(tables.service_info_direct != NULL && shipping_service != 0 &&
+                     !have_z2z_est))
     {
-        bool is_z2z_model_on = z2z_model_flag;
+        const shipping_service_info* info;
 
-        if (XPLAT_UNLIKELY(z2z_model.size == 1 && std::strncmp(z2z_model.data, "1", 1) == 0))
-            is_z2z_model_on = true;
-        else if (XPLAT_UNLIKELY(z2z_model.size == 1 && std::strncmp(z2z_model.data, "0", 1) == 0))
-            is_z2z_model_on = false;
-        if (XPLAT_LIKELY(is_z2z_model_on))
         {
-            int32_t from_zip_big = 0;
-
-            from_zip_big = translate_from_zip_big(from_zip_string);
-            boost::optional<shipping_service_est> z2z_est = get_z2z_est(from_country_id, to_country_id,
-                                            from_zip_big, to_zip_big, shipping_service);
-            if (XPLAT_UNLIKELY(z2z_est))
-            {
-                max_hours = z2z_est->max_hours;
-                min_hours = z2z_est->min_hours;
-                have_z2z_est = true;
-            }
+            ebay::common::stage_timer timer(ssi_stats, sampled);
+            info = tables.service_info_direct->find(shipping_service);
+        }
+        ssi_stats.record(info != NULL, 1);
+        if (XPLAT_LIKELY(info != NULL))
+        {
+            max_hours = info->max_hours;
+            min_hours = info->min_hours;
+            working_days = info->working_days_flags;
         }
     }
-
-    if (XPLAT_LIKELY(service_info_map != NULL && shipping_service != 0 &&
-                     !have_z2z_est))
+    else if (XPLAT_LIKELY(tables.service_info_map != NULL && shipping_service != 0 &&
+                          !have_z2z_est))
     {
-        ssi_map::const_iterator it = service_info_map->find(shipping_service);
+        ssi_map::const_iterator it;
 
-        if (XPLAT_LIKELY(it != service_info_map->end()))
+        {
+            ebay::common::stage_timer timer(ssi_stats, sampled);
+            it = tables.service_info_map->find(shipping_service, ssi_hash);
+        }
+        ssi_stats.record(it != tables.service_info_map->end(), 1);
+        if (XPLAT_LIKELY(it != tables.service_info_map->end()))
         {
             max_hours = it->second.max_hours;
             min_hours = it->second.min_hours;
@@ -974,22 +1271,27 @@ DECLARE_MACRO(NativeDeliveryEstimate)
         }
     }
 
-    if (XPLAT_UNLIKELY((shipping_service >= cbt_shipping_service_id ||
-                        from_country_id != to_country_id) && !have_z2z_est))
+    if (XPLAT_UNLIKELY(is_cbt_item(query, item) && !have_z2z_est))
     {
-        if (XPLAT_LIKELY(service_cbt_map != NULL))
+        if (XPLAT_LIKELY(tables.service_cbt_map != NULL))
         {
             max_hours = -1;
             min_hours = -1;
 
             cbt_key key(shipping_service, from_country_id, to_country_id);
-            cbt_map::const_iterator it = service_cbt_map->find(key);
+            cbt_map::const_iterator it;
+
+            {
+                ebay::common::stage_timer timer(cbt_stats, sampled);
+                it = tables.service_cbt_map->find(key, cbt_hash);
+            }
+            cbt_stats.record(it != tables.service_cbt_map->end(), 1);
 
             /*
              * With the current CBT service estimates, this is unlikely, but
              * if we add a lot more estimates, we should change this to likely.
              */
-            if (XPLAT_UNLIKELY(it != service_cbt_map->end()))
+            if (XPLAT_UNLIKELY(it != tables.service_cbt_map->end()))
             {
                 max_hours = it->second.max_hours;
                 min_hours = it->second.min_hours;
@@ -999,8 +1301,12 @@ DECLARE_MACRO(NativeDeliveryEstimate)
                 /* Didn't find (from,to), try (to,to). */
                 cbt_key key2(shipping_service, to_country_id, to_country_id);
 
-                it = service_cbt_map->find(key2);
-                if (XPLAT_UNLIKELY(it != service_cbt_map->end()))
+                {
+                    ebay::common::stage_timer timer(cbt_retry_stats, sampled);
+                    it = tables.service_cbt_map->find(key2);
+                }
+                cbt_retry_stats.record(it != tables.service_cbt_map->end(), 1);
+                if (XPLAT_UNLIKELY(it != tables.service_cbt_map->end()))
                 {
                     max_hours = it->second.max_hours;
                     min_hours = it->second.min_hours;
@@ -1009,40 +1315,557 @@ DECLARE_MACRO(NativeDeliveryEstimate)
         }
     }
 
-    int64_t min_days = -1;
-    int64_t max_days = -1;
+    estimate.min_days = -1;
+    estimate.max_days = -1;
+    estimate.working_days = working_days;
 
     if (handling_time == 0)
         handling_time = 1;
     /* Calculate the business days. */
     if (max_hours >= 0 && handling_time > 0)
-        max_days = static_cast<int64_t>(max_hours / 24) + handling_time;
+        estimate.max_days = static_cast<int64_t>(max_hours / 24) + handling_time;
     if (min_hours >= 0 && handling_time > 0)
-        min_days = static_cast<int64_t>(min_hours / 24) + handling_time;
+        estimate.min_days = static_cast<int64_t>(min_hours / 24) + handling_time;
+}
+
+/** @brief Computes the estimates of up to @a batch_window items. The lookups
+ *    are split into stages run across all of the items: hash every key and
+ *    prefetch its index group, then prefetch the entries the groups point at,
+ *    then resolve each item, so that the cache misses of the items overlap
+ *    instead of stalling one after the other.
+ *
+ *  @param[in] tables the table generation to read
+ *  @param[in] query the buyer side inputs
+ *  @param[in,out] destination the destination side of the query
+ *  @param[in] items the items
+ *  @param[in] count the number of items, at most @a batch_window
+ *  @param[out] estimates receives one estimate per item
+ */
+static void estimate_window(const native_tables& tables, const native_delivery_query& query,
+                            destination_context& destination,
+                            const native_delivery_item* items, std::size_t count,
+                            native_delivery_estimate* estimates)
+{
+    uint64_t ssi_hash[batch_window];
+    uint64_t cbt_hash[batch_window];
+    bool is_z2z_model_on = query.z2z_model < 0 ? tables.z2z_model_flag : query.z2z_model != 0;
+
+    /* The z2z tables are walked as tries, their lookups are not staged. */
+    if (tables.service_z2z_cascade_index == NULL && tables.service_z2z_services_set == NULL)
+        is_z2z_model_on = false;
+
+    for (std::size_t i = 0; i < count; i++)
+    {
+        ssi_hash[i] = 0;
+        cbt_hash[i] = 0;
+        if (tables.service_info_direct != NULL && items[i].shipping_service != 0)
+            tables.service_info_direct->prefetch(items[i].shipping_service);
+        else if (tables.service_info_map != NULL && items[i].shipping_service != 0)
+            ssi_hash[i] = tables.service_info_map->prefetch(items[i].shipping_service);
+        if (tables.service_cbt_map != NULL && is_cbt_item(query, items[i]))
+            cbt_hash[i] = tables.service_cbt_map->prefetch(cbt_key(
+                items[i].shipping_service, items[i].from_country_id, query.to_country_id));
+    }
+    for (std::size_t i = 0; i < count; i++)
+    {
+        if (tables.service_info_direct == NULL && tables.service_info_map != NULL &&
+            items[i].shipping_service != 0)
+            tables.service_info_map->prefetch_entry(ssi_hash[i]);
+        if (tables.service_cbt_map != NULL && is_cbt_item(query, items[i]))
+            tables.service_cbt_map->prefetch_entry(cbt_hash[i]);
+    }
+    for (std::size_t i = 0; i < count; i++)
+        estimate_item(tables, query, items[i], destination, is_z2z_model_on,
+                      ssi_hash[i], cbt_hash[i], estimates[i]);
+}
+
+void native_delivery_estimate_batch(const native_delivery_query& query,
+                                    const native_delivery_item* items, std::size_t count,
+                                    native_delivery_estimate* estimates)
+{
+    /* One snapshot for the whole batch, so every item sees the same tables. */
+    ebay::common::rcu_snapshot<native_tables>::reader snapshot(current_tables);
+    const native_tables& tables = snapshot.get() != NULL ? *snapshot.get() : no_tables;
+    destination_context destination;
+
+    init_destination(query.to_country_id, query.to_zip, destination);
+    for (std::size_t i = 0; i < count; i += batch_window)
+        estimate_window(tables, query, destination, items + i,
+                        std::min(count - i, batch_window), estimates + i);
+}
+
+/*
+ * The engine evaluates the macro once per item, but every item of a query
+ * has the same buyer. The destination side is kept per thread and reused
+ * while the buyer and the table generation stay the same.
+ */
+static __thread uint64_t cached_generation;
+static __thread int32_t cached_to_ctry;
+static __thread int32_t cached_to_zip;
+static __thread destination_context cached_destination;
+
+/** @brief Gets the destination side of a query, reusing the one of the
+ *    previous call on this thread if it had the same buyer.
+ *
+ *  @param[in] tables the table generation to read
+ *  @param[in] to_ctry the destination country attribute
+ *  @param[in] to_zip the destination postcode
+ */
+static destination_context& query_destination(const native_tables& tables, int32_t to_ctry,
+                                              int32_t to_zip)
+{
+    if (XPLAT_UNLIKELY(cached_generation != tables.generation || tables.generation == 0 ||
+                       cached_to_ctry != to_ctry || cached_to_zip != to_zip))
+    {
+        init_destination((int16_t) MACRO_NS::convert_country(to_ctry), to_zip,
+                         cached_destination);
+        cached_generation = tables.generation;
+        cached_to_ctry = to_ctry;
+        cached_to_zip = to_zip;
+    }
+    return cached_destination;
+}
+
+DECLARE_MACRO(NativeDeliveryEstimate)
+{
+    /* Pin the current tables, a reload only swaps them in for later calls. */
+    ebay::common::rcu_snapshot<native_tables>::reader snapshot(current_tables);
+    const native_tables& tables = snapshot.get() != NULL ? *snapshot.get() : no_tables;
+    int32_t handling_time = attr_get__handling_time(QPL_ATTR_CTX, 0);
+    int16_t from_country_id = (int16_t) MACRO_NS::convert_country(
+        attr_get__Ctry(QPL_ATTR_CTX, 0));
+    int32_t to_zip_big = attr_get__ToZip(QPL_ATTR_CTX, 0);
+    destination_context& destination = query_destination(tables,
+        attr_get__ToCtry(QPL_ATTR_CTX, 0), to_zip_big);
+    int16_t to_country_id = destination.to_country_id;
+    const QPL_NS::qpl_blob z2z_model =
+        attr_get__z2z_model(QPL_ATTR_CTX, QPL_NS::qpl_blob());
+    const QPL_NS::qpl_int64_vect* shipping_services_vect =
+        attr_get__shipping_services(QPL_ATTR_CTX);
+    const QPL_NS::qpl_int64_vect* shipping_cost =
+        attr_get__CalculatedShippingCost(QPL_ATTR_CTX);
+    const QPL_NS::blob_vect from_zip_string = attr_get__FromZip(QPL_ATTR_CTX);
+    int32_t shipping_service = 0;
+    bool is_cbt = false;
+
+    if (from_country_id != to_country_id)
+        is_cbt = true;
+
+    if (XPLAT_LIKELY(shipping_cost->count > shipcalc_column_number_mail_class &&
+                     shipping_cost->values[shipcalc_column_number_error] == 0))
+        shipping_service = static_cast<int32_t>
+            (shipping_cost->values[shipcalc_column_number_mail_class]);
+    else if (shipping_services_vect != NULL && shipping_services_vect->count > 0)
+    {
+        /*
+         * We didn't get a ShipCalc response, so attempt to figure out the
+         * proper shipping service.
+         */
+        for (std::size_t i = 0; i < shipping_services_vect->count; i++)
+        {
+            if (is_cbt && shipping_services_vect->values[i] >= cbt_shipping_service_id)
+            {
+                shipping_service = (int32_t) shipping_services_vect->values[i];
+                break;
+            }
+            else if (!is_cbt &&
+                     shipping_services_vect->values[i] < cbt_shipping_service_id)
+            {
+                shipping_service = (int32_t) shipping_services_vect->values[i];
+                break;
+            }
+        }
+    }
+
+    native_delivery_query query;
+    native_delivery_item item;
+    native_delivery_estimate estimate;
+
+    query.to_country_id = to_country_id;
+    query.to_zip = to_zip_big;
+    if (XPLAT_UNLIKELY(z2z_model.size == 1 && std::strncmp(z2z_model.data, "1", 1) == 0))
+        query.z2z_model = 1;
+    else if (XPLAT_UNLIKELY(z2z_model.size == 1 && std::strncmp(z2z_model.data, "0", 1) == 0))
+        query.z2z_model = 0;
+    item.shipping_service = shipping_service;
+    item.from_country_id = from_country_id;
+    item.handling_time = handling_time;
+    /* Only the z2z model reads the origin postcode. */
+    if (!is_cbt)
+        item.from_zip = translate_from_zip_big(from_zip_string);
+
+    /* The engine calls the macro once per item, which is a batch of one. */
+    estimate_window(tables, query, destination, &item, 1, &estimate);
 
     QPL_NS::qpl_allocator ator(QPL_APPL_CTX, QPL_ATTR_CTX);
     QPL_NS::qpl_int64_vect* return_vect = (QPL_NS::qpl_int64_vect*)
         ator.alloc(sizeof(QPL_NS::qpl_int64_vect) + return_size * sizeof(int64_t));
 
     return_vect->count = 0;
-    return_vect->values[return_vect->count++] = min_days;
-    return_vect->values[return_vect->count++] = max_days;
+    return_vect->values[return_vect->count++] = estimate.min_days;
+    return_vect->values[return_vect->count++] = estimate.max_days;
     return_vect->values[return_vect->count++] = static_cast<int64_t>(shipping_service);
-    return_vect->values[return_vect->count++] = static_cast<int64_t>(working_days);
+    return_vect->values[return_vect->count++] = static_cast<int64_t>(estimate.working_days);
     QPL_RETVAL->type = QPL_NS::ATTR_TYPE_INT64_VEC;
     QPL_RETVAL->value.int64_vect_v = return_vect;
 }
 
-/** @brief Resets all of the macro's static pointers */
+/** @brief Loads a lookup table. Flat table files are memory mapped and queried
+ *    in place, Boost archives of an unordered_map are read and converted.
+ *
+ *  @param[in] path The path of the table file.
+ *  @param[in] is_binary Do we expect binary or text archives.
+ *  @return Returns the table, owned by the caller.
+ */
+template <typename T>
+static T* load_table_data(const char* path, bool is_binary)
+{
+    typedef boost::unordered_map<typename T::key_type, typename T::mapped_type> archive_map;
+
+    if (T::is_flat_file(path))
+        return T::open(path);
+
+    boost::scoped_ptr<archive_map> map(
+        ebay::search::macro::load_map_data<archive_map>(path, is_binary));
+
+    return map ? T::create(*map) : NULL;
+}
+
+/** @brief Loads a lookup set. Flat table files are memory mapped and queried
+ *    in place, Boost archives of an unordered_set are read and converted.
+ *
+ *  @param[in] path The path of the table file.
+ *  @param[in] is_binary Do we expect binary or text archives.
+ *  @return Returns the table, owned by the caller.
+ */
+template <typename T>
+static T* load_table_set(const char* path, bool is_binary)
+{
+    typedef boost::unordered_set<typename T::key_type> archive_set;
+
+    if (T::is_flat_file(path))
+        return T::open(path);
+
+    boost::scoped_ptr<archive_set> set(
+        ebay::search::macro::load_set_data<archive_set>(path, is_binary));
+
+    return set ? T::create(*set) : NULL;
+}
+
+/** @brief Gets the modification time of a file, 0 if it cannot be read.
+ *
+ *  @param[in] path The path of the file.
+ */
+static time_t file_mtime(const std::string& path)
+{
+    struct stat st;
+
+    if (::stat(path.c_str(), &st) != 0)
+        return 0;
+    return st.st_mtime;
+}
+
+/** @brief Reads a generation of tables from the paths in the macro config.
+ *
+ *  @param[in] config The NativeDeliveryEstimate config.
+ *  @param[out] tables The tables to fill in.
+ */
+static void read_native_tables(const ebay::common::prop_tree& config, native_tables& tables)
+{
+    bool is_binary = true;
+    boost::optional<bool> is_text_archive =
+        config.get_optional<bool>("is_text_archive");
+
+    if (is_text_archive && *is_text_archive)
+        is_binary = false;
+
+    ebay::xplat::path ssi_map_path =
+        config.get<std::string>("shipping_service_info_path");
+    ebay::xplat::path cbt_map_path =
+        config.get<std::string>("shipping_cbt_path");
+    ebay::xplat::path macro_config_path =
+        config.get<std::string>("macro_config_path");
+    boost::optional<std::string> exc_map_path_str =
+        config.get_optional<std::string>("exc_map_path");
+    boost::optional<std::string> z2z_default_map_path_str =
+        config.get_optional<std::string>("z2z_default_map_path");
+    boost::optional<std::string> z2z_default_index_path_str =
+        config.get_optional<std::string>("z2z_default_index_path");
+    boost::optional<std::string> z2z_default_matrix_path_str =
+        config.get_optional<std::string>("z2z_default_matrix_path");
+    boost::optional<std::string> z2z_range_map_path_str =
+        config.get_optional<std::string>("z2z_range_map_path");
+    boost::optional<std::string> z2z_range_index_path_str =
+        config.get_optional<std::string>("z2z_range_index_path");
+    boost::optional<std::string> z2z_tozipnull_map_path_str =
+        config.get_optional<std::string>("z2z_tozipnull_map_path");
+    boost::optional<std::string> z2z_estimate_map_path_str =
+        config.get_optional<std::string>("z2z_estimate_map_path");
+    boost::optional<std::string> z2z_services_set_path_str =
+        config.get_optional<std::string>("z2z_services_set_path");
+    boost::optional<std::string> z2z_cascade_index_path_str =
+        config.get_optional<std::string>("z2z_cascade_index_path");
+
+    /*
+     * Record the modification times before reading, so that a file replaced
+     * while we read it is seen as changed by the next reload check.
+     */
+    tables.sources.push_back(std::make_pair(std::string(ssi_map_path.c_str()),
+                                             file_mtime(ssi_map_path.c_str())));
+    tables.sources.push_back(std::make_pair(std::string(cbt_map_path.c_str()),
+                                             file_mtime(cbt_map_path.c_str())));
+    tables.sources.push_back(std::make_pair(std::string(macro_config_path.c_str()),
+                                             file_mtime(macro_config_path.c_str())));
+
+    boost::optional<std::string> optional_paths[] = {
+        exc_map_path_str, z2z_default_map_path_str, z2z_default_index_path_str,
+        z2z_default_matrix_path_str, z2z_range_map_path_str, z2z_range_index_path_str,
+        z2z_tozipnull_map_path_str, z2z_estimate_map_path_str, z2z_services_set_path_str,
+        z2z_cascade_index_path_str
+    };
+
+    BOOST_FOREACH(const boost::optional<std::string>& path, optional_paths)
+    {
+        if (path)
+            tables.sources.push_back(std::make_pair(*path, file_mtime(*path)));
+    }
+
+    /* Load our index files. */
+    if (ssi_direct_map::is_direct_file(ssi_map_path.c_str()))
+        tables.service_info_direct.reset(ssi_direct_map::open(ssi_map_path.c_str()));
+    else
+        tables.service_info_map.reset(load_table_data<ssi_map>(
+            ssi_map_path.c_str(), is_binary));
+    tables.service_cbt_map.reset(load_table_data<cbt_map>(
+        cbt_map_path.c_str(), is_binary));
+    if (exc_map_path_str)
+    {
+        ebay::xplat::path exc_map_path = exc_map_path_str.get();
+
+        tables.service_exc_map.reset(load_table_data<exc_map>(
+            exc_map_path.c_str(), is_binary));
+    }
+    if (z2z_default_map_path_str)
+    {
+        ebay::xplat::path z2z_default_map_path = z2z_default_map_path_str.get();
+
+        tables.service_z2z_default_map.reset(load_table_data<z2z_default_map>(
+            z2z_default_map_path.c_str(), is_binary));
+    }
+    if (z2z_default_index_path_str)
+    {
+        ebay::xplat::path z2z_default_index_path = z2z_default_index_path_str.get();
+
+        tables.service_z2z_default_index.reset(
+            ebay::search::macro::load_serialized_data<z2z_default_index>(
+                z2z_default_index_path.c_str(), is_binary));
+    }
+    if (z2z_default_matrix_path_str)
+    {
+        ebay::xplat::path z2z_default_matrix_path = z2z_default_matrix_path_str.get();
+
+        tables.service_z2z_default_matrix.reset(
+            ebay::search::macro::load_serialized_data<z2z_default_matrix>(
+                z2z_default_matrix_path.c_str(), is_binary));
+    }
+
+    /* The index leaves the groups that are complete matrices to the matrices. */
+    if (tables.service_z2z_default_index != NULL)
+    {
+        const std::vector<z2z_services_key>& delegated =
+            tables.service_z2z_default_index->delegated_groups();
+
+        for (std::size_t i = 0; i < delegated.size(); i++)
+        {
+            if (tables.service_z2z_default_matrix == NULL ||
+                tables.service_z2z_default_matrix->find_group(delegated[i]) == NULL)
+                throw std::runtime_error("z2z_default_index_path needs the matching "
+                                         "z2z_default_matrix_path");
+        }
+    }
+    if (z2z_range_map_path_str)
+    {
+        ebay::xplat::path z2z_range_map_path = z2z_range_map_path_str.get();
+
+        tables.service_z2z_range_map.reset(load_table_data<z2z_range_map>(
+            z2z_range_map_path.c_str(), is_binary));
+    }
+    if (z2z_range_index_path_str)
+    {
+        ebay::xplat::path z2z_range_index_path = z2z_range_index_path_str.get();
+
+        tables.service_z2z_range_index.reset(
+            ebay::search::macro::load_serialized_data<z2z_range_index>(
+                z2z_range_index_path.c_str(), is_binary));
+    }
+    if (z2z_tozipnull_map_path_str)
+    {
+        ebay::xplat::path z2z_tozipnull_map_path = z2z_tozipnull_map_path_str.get();
+
+        tables.service_z2z_tozipnull_map.reset(load_table_data<z2z_tozipnull_map>(
+            z2z_tozipnull_map_path.c_str(), is_binary));
+    }
+    if (z2z_estimate_map_path_str)
+    {
+        ebay::xplat::path z2z_estimate_map_path = z2z_estimate_map_path_str.get();
+
+        tables.service_z2z_estimate_map.reset(load_table_data<z2z_estimate_map>(
+            z2z_estimate_map_path.c_str(), is_binary));
+    }
+    if (z2z_services_set_path_str)
+    {
+        ebay::xplat::path z2z_services_set_path = z2z_services_set_path_str.get();
+
+        tables.service_z2z_services_set.reset(load_table_set<z2z_services_set>(
+            z2z_services_set_path.c_str(), is_binary));
+    }
+    if (z2z_cascade_index_path_str)
+    {
+        ebay::xplat::path z2z_cascade_index_path = z2z_cascade_index_path_str.get();
+
+        tables.service_z2z_cascade_index.reset(
+            ebay::search::macro::load_serialized_data<z2z_cascade_index>(
+                z2z_cascade_index_path.c_str(), is_binary));
+    }
+
+    /* Load everything from the index package json. */
+    ebay::common::prop_tree macro_ptree;
+
+    ebay::common::json_parser::read_json(macro_config_path.c_str(), macro_ptree);
+    boost::optional<ebay::common::prop_tree&>
+        opt_z2z_model = macro_ptree.get_child_optional("z2z_model");
+
+    if (opt_z2z_model)
+        tables.z2z_model_flag = opt_z2z_model->get_optional<bool>("enabled");
+}
+
+/** @brief Loads a generation of tables from the paths in the macro config.
+ *
+ *  @param[in] config The NativeDeliveryEstimate config.
+ *  @return Returns the tables, owned by the caller.
+ */
+static native_tables* load_native_tables(const ebay::common::prop_tree& config)
+{
+    static boost::atomic<uint64_t> generations(0);
+    native_tables* tables = new native_tables();
+
+    tables->generation = ++generations;
+
+    try
+    {
+        read_native_tables(config, *tables);
+    }
+    catch (...)
+    {
+        delete tables;
+        throw;
+    }
+    return tables;
+}
+
+/** @brief Checks whether any file of a table generation changed on disk.
+ *
+ *  @param[in] tables The tables to check.
+ */
+static bool tables_changed(const native_tables& tables)
+{
+    typedef std::pair<std::string, time_t> source;
+
+    BOOST_FOREACH(const source& file, tables.sources)
+    {
+        if (file_mtime(file.first) != file.second)
+            return true;
+    }
+    return false;
+}
+
+/** @brief Gets the modification times the files of a table generation have
+ *    on disk now.
+ *
+ *  @param[in] tables The tables to check.
+ *  @param[out] files Receives the files with their modification times.
+ */
+static void current_sources(const native_tables& tables,
+                            std::vector<std::pair<std::string, time_t> >& files)
+{
+    typedef std::pair<std::string, time_t> source;
+
+    files.clear();
+    BOOST_FOREACH(const source& file, tables.sources)
+        files.push_back(std::make_pair(file.first, file_mtime(file.first)));
+}
+
+/** @brief Polls the table files and publishes a new generation when they
+ *    change. Runs on the reload thread until interrupted.
+ *
+ *    Tables must be replaced by renaming new files over the old ones, so that
+ *    a generation still in use keeps its mapping of the old files. A reload
+ *    that fails keeps the current generation, and is retried once the files
+ *    change again.
+ *
+ *  @param[in] config The NativeDeliveryEstimate config.
+ *  @param[in] interval Seconds between polls.
+ */
+static void reload_tables(ebay::common::prop_tree config, int32_t interval)
+{
+    /* Files as they were when the last reload failed. */
+    std::vector<std::pair<std::string, time_t> > failed_sources;
+    std::vector<std::pair<std::string, time_t> > sources;
+
+    while (true)
+    {
+        boost::this_thread::sleep(boost::posix_time::seconds(interval));
+
+        /* Only the reload thread publishes, so it can read without pinning. */
+        const native_tables* tables = current_tables.unsafe_get();
+
+        if (tables == NULL || !tables_changed(*tables))
+            continue;
+        current_sources(*tables, sources);
+        if (sources == failed_sources)
+            continue;
+
+        native_tables* next = NULL;
+
+        try
+        {
+            next = load_native_tables(config);
+        }
+        catch (...)
+        {
+            failed_sources.swap(sources);
+            reload_failed_counter.enabled_add_sample(1);
+            continue;
+        }
+        failed_sources.clear();
+        /* Readers never wait; publish() waits for the last of them instead. */
+        boost::this_thread::disable_interruption no_interruption;
+
+        current_tables.publish(next);
+        reload_counter.enabled_add_sample(1);
+    }
+}
+
+/** @brief Stops the reload thread and releases the tables. */
 static void cleanup()
 {
-    service_info_map.reset();
-    service_cbt_map.reset();
-    service_exc_map.reset();
-    service_z2z_default_map.reset();
-    service_z2z_range_map.reset();
-    service_z2z_tozipnull_map.reset();
-    service_z2z_estimate_map.reset();
+    if (reload_thread)
+    {
+        reload_thread->interrupt();
+        reload_thread->join();
+        reload_thread.reset();
+    }
+    current_tables.publish(NULL);
+}
+
+void native_delivery_estimate_init(const ebay::common::prop_tree& config)
+{
+    current_tables.publish(load_native_tables(config));
+}
+
+void native_delivery_estimate_cleanup()
+{
+    cleanup();
 }
 
 DECLARE_MACRO_INIT(NativeDeliveryEstimate_init)
@@ -1060,90 +1883,15 @@ DECLARE_MACRO_INIT(NativeDeliveryEstimate_init)
         if (opt_NativeDeliveryEstimate &&
             opt_NativeDeliveryEstimate->get<bool>("enabled"))
         {
-            bool is_binary = true;
-            boost::optional<bool> is_text_archive =
-                opt_NativeDeliveryEstimate->get_optional<bool>("is_text_archive");
-
-            if (is_text_archive && *is_text_archive)
-                is_binary = false;
-
-            ebay::xplat::path ssi_map_path =
-                opt_NativeDeliveryEstimate->get<std::string>(
-                "shipping_service_info_path");
-            ebay::xplat::path cbt_map_path =
-                opt_NativeDeliveryEstimate->get<std::string>("shipping_cbt_path");
-            ebay::xplat::path macro_config_path =
-                opt_NativeDeliveryEstimate->get<std::string>("macro_config_path");
-            boost::optional<std::string> exc_map_path_str =
-                opt_NativeDeliveryEstimate->get_optional<std::string>("exc_map_path");
-            boost::optional<std::string> z2z_default_map_path_str =
-                opt_NativeDeliveryEstimate->get_optional<std::string>("z2z_default_map_path");
-            boost::optional<std::string> z2z_range_map_path_str =
-                opt_NativeDeliveryEstimate->get_optional<std::string>("z2z_range_map_path");
-            boost::optional<std::string> z2z_tozipnull_map_path_str =
-                opt_NativeDeliveryEstimate->get_optional<std::string>("z2z_tozipnull_map_path");
-            boost::optional<std::string> z2z_estimate_map_path_str =
-                opt_NativeDeliveryEstimate->get_optional<std::string>("z2z_estimate_map_path");
-            boost::optional<std::string> z2z_services_set_path_str =
-                opt_NativeDeliveryEstimate->get_optional<std::string>("z2z_services_set_path");
-
-            /* Load our index files. */
-            service_info_map.reset(ebay::search::macro::load_map_data<ssi_map>(
-                ssi_map_path.c_str(), is_binary));
-            service_cbt_map.reset(ebay::search::macro::load_map_data<cbt_map>(
-                cbt_map_path.c_str(), is_binary));
-            if (exc_map_path_str)
-            {
-                ebay::xplat::path exc_map_path = exc_map_path_str.get();
-
-                service_exc_map.reset(ebay::search::macro::load_map_data<exc_map>(
-                    exc_map_path.c_str(), is_binary));
-            }
-            if (z2z_default_map_path_str)
-            {
-                ebay::xplat::path z2z_default_map_path = z2z_default_map_path_str.get();
-
-                service_z2z_default_map.reset(ebay::search::macro::load_map_data<z2z_default_map>(
-                    z2z_default_map_path.c_str(), is_binary));
-            }
-            if (z2z_range_map_path_str)
-            {
-                ebay::xplat::path z2z_range_map_path = z2z_range_map_path_str.get();
-
-                service_z2z_range_map.reset(ebay::search::macro::load_map_data<z2z_range_map>(
-                    z2z_range_map_path.c_str(), is_binary));
-            }
-            if (z2z_tozipnull_map_path_str)
-            {
-                ebay::xplat::path z2z_tozipnull_map_path = z2z_tozipnull_map_path_str.get();
-
-                service_z2z_tozipnull_map.reset(ebay::search::macro::load_map_data<z2z_tozipnull_map>(
-                    z2z_tozipnull_map_path.c_str(), is_binary));
-            }
-            if (z2z_estimate_map_path_str)
-            {
-                ebay::xplat::path z2z_estimate_map_path = z2z_estimate_map_path_str.get();
-
-                service_z2z_estimate_map.reset(ebay::search::macro::load_map_data<z2z_estimate_map>(
-                    z2z_estimate_map_path.c_str(), is_binary));
-            }
-            if (z2z_services_set_path_str)
-            {
-                ebay::xplat::path z2z_services_set_path = z2z_services_set_path_str.get();
-
-                service_z2z_services_set.reset(ebay::search::macro::load_set_data<z2z_services_set>(
-                              z2z_services_set_path.c_str(), is_binary));
-            }
-
-            /* Load everything from the index package json. */
-            ebay::common::prop_tree macro_ptree;
+            current_tables.publish(load_native_tables(*opt_NativeDeliveryEstimate));
 
-            ebay::common::json_parser::read_json(macro_config_path.c_str(), macro_ptree);
-            boost::optional<ebay::common::prop_tree&>
-                opt_z2z_model = macro_ptree.get_child_optional("z2z_model");
+            /* Hot reload is off unless a poll interval is configured. */
+            boost::optional<int32_t> reload_interval =
+                opt_NativeDeliveryEstimate->get_optional<int32_t>("reload_interval_seconds");
 
-            if (opt_z2z_model)
-                z2z_model_flag = opt_z2z_model->get_optional<bool>("enabled");
+            if (reload_interval && *reload_interval > 0)
+                reload_thread.reset(new boost::thread(reload_tables,
+                    *opt_NativeDeliveryEstimate, *reload_interval));
         }
     }
     catch (...)
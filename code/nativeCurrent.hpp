@@ -0,0 +1,98 @@
+/** @file macro/source/macro_NativeDeliveryEstimate.hpp
+ *  Plain C++ interface to the NativeDeliveryEstimate tables, for evaluating
+ *  many items against one buyer location at once, and for offline use
+ *  outside of the macro engine.
+ */
+
+#ifndef EBAY_MACRO_NATIVE_DELIVERY_ESTIMATE_HPP
+#define EBAY_MACRO_NATIVE_DELIVERY_ESTIMATE_HPP
+
+#include <cstddef>
+#include <stdint.h>
+#include "common/prop_tree.hpp"
+
+/** @brief The @a native_delivery_query struct holds the buyer side inputs
+ *    shared by every item of a batch.
+ */
+struct native_delivery_query
+{
+    native_delivery_query() :
+        to_country_id(0),
+        to_zip(0),
+        z2z_model(-1)
+    {
+    }
+
+    /* Destination country, as an id of the tables. */
+    int16_t to_country_id;
+    /* Destination postcode hash. */
+    int32_t to_zip;
+    /* 1 or 0 to force the z2z model on or off, -1 to use the configured default. */
+    int8_t z2z_model;
+};
+
+/** @brief The @a native_delivery_item struct holds the inputs of one item.
+ */
+struct native_delivery_item
+{
+    native_delivery_item() :
+        shipping_service(0),
+        from_zip(0),
+        from_country_id(0),
+        handling_time(0)
+    {
+    }
+
+    /* Shipping service id, 0 if none could be determined. */
+    int32_t shipping_service;
+    /* Numeric origin postcode. */
+    int32_t from_zip;
+    /* Origin country, as an id of the tables. */
+    int16_t from_country_id;
+    /* Handling time in days, 0 is counted as 1. */
+    int32_t handling_time;
+};
+
+/** @brief The @a native_delivery_estimate struct holds the estimate of one item.
+ */
+struct native_delivery_estimate
+{
+    native_delivery_estimate() :
+        min_days(-1),
+        max_days(-1),
+        working_days(0)
+    {
+    }
+
+    /* Delivery estimate in days, -1 if there is none. */
+    int64_t min_days;
+    int64_t max_days;
+    /* Working days of the shipping service, one bit per day. */
+    int8_t working_days;
+};
+
+/** @brief Loads the tables, replacing any loaded before. For offline use; in
+ *    the macro engine the macro initialization loads them.
+ *
+ *  @param[in] config The NativeDeliveryEstimate config.
+ */
+void native_delivery_estimate_init(const ebay::common::prop_tree& config);
+
+/** @brief Releases the tables.
+ */
+void native_delivery_estimate_cleanup();
+
+/** @brief Computes the delivery estimates of a batch of items shipping to the
+ *    same buyer. Gives the same estimates as evaluating the macro once per
+ *    item, but overlaps the table lookups of neighbouring items.
+ *
+ *  @param[in] query The buyer side inputs.
+ *  @param[in] items The items.
+ *  @param[in] count The number of items.
+ *  @param[out] estimates Receives one estimate per item.
+ */
+void native_delivery_estimate_batch(const native_delivery_query& query,
+                                    const native_delivery_item* items, std::size_t count,
+                                    native_delivery_estimate* estimates);
+
+#endif